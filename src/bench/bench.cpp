@@ -0,0 +1,452 @@
+//
+//  bench.cpp
+//  express
+//
+//  Created by Adam Roberts on 10/14/12.
+//  Copyright 2012 Adam Roberts. All rights reserved.
+//
+
+#include <boost/filesystem.hpp>
+#include <boost/function.hpp>
+#include <boost/bind.hpp>
+#include <boost/program_options.hpp>
+#include <boost/thread.hpp>
+#include <algorithm>
+#include <iostream>
+#include <stdio.h>
+#include "main.h"
+#include "simulator.h"
+#include "biascorrection.h"
+#include "fragments.h"
+#include "lengthdistribution.h"
+#include "library.h"
+#include "mapparser.h"
+#include "markovmodel.h"
+#include "mismatchmodel.h"
+#include "targets.h"
+#include "threadsafety.h"
+
+using namespace std;
+namespace po = boost::program_options;
+namespace fs = boost::filesystem;
+
+// The following are defined in main.cpp, which is built without its main
+// function for the benchmarks.
+extern double ff_param;
+extern size_t frag_batch_size;
+extern double expr_alpha;
+extern double fld_alpha;
+extern double bias_alpha;
+extern double mm_alpha;
+extern size_t bias_model_order;
+extern size_t def_fl_max;
+extern size_t def_fl_mean;
+extern size_t def_fl_stddev;
+extern size_t def_fl_kernel_n;
+extern double def_fl_kernel_p;
+void process_fragment(Fragment* frag_p, vector<size_t>& locks,
+                      AuxAccumulator* aux);
+
+/**
+ * A benchmark function runs its workload once and returns the number of items
+ * (fragments, hits, positions, ...) processed.
+ */
+typedef boost::function<size_t ()> BenchFunc;
+
+/**
+ * The number of batches passed through the queue by the frag_queue benchmark.
+ */
+const size_t QUEUE_BENCH_BATCHES = 200000;
+
+/**
+ * A global double that benchmarks accumulate results in so that they are not
+ * optimized away.
+ */
+volatile double bench_sink = 0;
+
+/**
+ * The Workload struct holds the simulated input files and a library whose
+ * parameter tables and parsed fragments are shared by the benchmarks.
+ *  @author    Adam Roberts
+ *  @date      2012
+ *  @copyright Artistic License 2.0
+ **/
+struct Workload {
+  /**
+   * The parameters the input files were simulated with.
+   */
+  SimParams params;
+  /**
+   * The paths to the simulated MultiFASTA, SAM and BAM files.
+   */
+  string fasta_file;
+  string sam_file;
+  string bam_file;
+  /**
+   * The library of the simulated alignments, with default parameter tables.
+   */
+  Librarian libs;
+  /**
+   * The parsed batches of fragments, held until the Workload is destroyed.
+   */
+  vector<FragBatch*> batches;
+  /**
+   * The queues between the parser thread and the benchmarks.
+   */
+  ParseThreadSafety pts;
+  /**
+   * The thread parsing the SAM file.
+   */
+  boost::scoped_ptr<boost::thread> parse;
+  /**
+   * The number and (logged) mass of the next fragment to be processed.
+   */
+  size_t n;
+  double mass_n;
+
+  /**
+   * Workload constructor simulates the input files in the given directory and
+   * loads the targets and fragments.
+   * @param source_fasta the path to the MultiFASTA file of source targets.
+   * @param work_dir the directory to write the simulated files to.
+   * @param sim_params the parameters of the workload.
+   */
+  Workload(const string& source_fasta, const string& work_dir,
+           const SimParams& sim_params)
+      : params(sim_params), libs(1), pts(0, frag_batch_size), n(1),
+        mass_n(0) {
+    string prefix = work_dir + "/synth";
+    simulate_workload(source_fasta, prefix, params);
+    fasta_file = prefix + ".fa";
+    sam_file = prefix + ".sam";
+    bam_file = prefix + ".bam";
+
+    Library& lib = libs[0];
+    lib.in_file_name = sam_file;
+    lib.map_parser.reset(new MapParser(&lib, false));
+    lib.fld.reset(new LengthDistribution(fld_alpha, def_fl_max, def_fl_mean,
+                                         def_fl_stddev, def_fl_kernel_n,
+                                         def_fl_kernel_p));
+    lib.mismatch_table.reset(new MismatchTable(mm_alpha));
+    lib.bias_table.reset(new BiasBoss(bias_model_order, bias_alpha));
+    lib.targ_table.reset(new TargetTable(fasta_file, "", false, false,
+                                         expr_alpha, NULL, &libs));
+    // Measure the error model as it is used after burn-in.
+    lib.mismatch_table->activate();
+
+    parse.reset(new boost::thread(&MapParser::threaded_parse,
+                                  lib.map_parser.get(), &pts, 0, 0));
+    while (FragBatch* batch = pts.proc_in.pop()) {
+      batches.push_back(batch);
+    }
+  }
+  /**
+   * Workload destructor returns the fragments to the parser thread and joins
+   * it.
+   */
+  ~Workload() {
+    foreach (FragBatch* batch, batches) {
+      pts.proc_out.push(batch);
+    }
+    parse->join();
+  }
+};
+
+/**
+ * This benchmark processes every parsed fragment once, as in the serial
+ * dispatch path of the online EM.
+ */
+size_t bench_process_fragment(Workload* w) {
+  vector<size_t> locks;
+  size_t num_frags = 0;
+  foreach (FragBatch* batch, w->batches) {
+    foreach (Fragment* frag, *batch) {
+      frag->mass(w->mass_n);
+      frag->lib_mass(w->mass_n);
+      process_fragment(frag, locks, NULL);
+      w->n++;
+      w->mass_n += ff_param*log((double)w->n-1) - log(pow(w->n,ff_param) - 1);
+      num_frags++;
+    }
+  }
+  return num_frags;
+}
+
+/**
+ * This benchmark computes the error model likelihood of every parsed hit.
+ */
+size_t bench_mismatch_likelihood(Workload* w) {
+  const MismatchTable& mismatch_table = *w->libs[0].mismatch_table;
+  size_t num_hits = 0;
+  double sum = 0;
+  foreach (FragBatch* batch, w->batches) {
+    foreach (Fragment* frag, *batch) {
+      foreach (const FragHit* hit, frag->hits()) {
+        sum += mismatch_table.log_likelihood(*hit);
+        num_hits++;
+      }
+    }
+  }
+  bench_sink += sum;
+  return num_hits;
+}
+
+/**
+ * This benchmark computes the bias model probability of the window starting at
+ * every position of both strands of every target.
+ */
+size_t bench_markov_seq_prob(Workload* w, const MarkovModel* model) {
+  TargetTable& targ_table = *w->libs[0].targ_table;
+  size_t num_pos = 0;
+  double sum = 0;
+  for (TargID id = 0; id < targ_table.size(); ++id) {
+    const Target& targ = *targ_table.get_targ(id);
+    for (size_t strand = 0; strand < 2; ++strand) {
+      const Sequence& seq = targ.seq(strand);
+      for (size_t i = 0; i < seq.length(); ++i) {
+        sum += model->seq_prob(seq, (int)i);
+      }
+      num_pos += seq.length();
+    }
+  }
+  bench_sink += sum;
+  return num_pos;
+}
+
+/**
+ * This benchmark parses all fragments of the simulated SAM or BAM file.
+ */
+size_t bench_parse(Workload* w, bool bam) {
+  FragPool pool;
+  boost::scoped_ptr<Parser> parser;
+  if (bam) {
+    BamTools::BamReader* reader = new BamTools::BamReader();
+    if (!reader->Open(w->bam_file)) {
+      logger.severe("Unable to open BAM file '%s'.", w->bam_file.c_str());
+    }
+    parser.reset(new BAMParser(reader, w->bam_file, &pool));
+  } else {
+    parser.reset(new SAMParser(w->sam_file, &pool));
+  }
+  Library& lib = w->libs[0];
+  size_t num_frags = 0;
+  bool fragments_remain = true;
+  while (fragments_remain) {
+    Fragment* frag = pool.fragment(&lib);
+    fragments_remain = parser->next_fragment(*frag);
+    num_frags += frag->num_hits() > 0;
+    pool.release(frag);
+  }
+  return num_frags;
+}
+
+/**
+ * A helper function that pops batches from a queue until the stop signal.
+ */
+void queue_consumer(ThreadSafeFragQueue* queue, size_t* num_popped) {
+  while (queue->pop()) {
+    (*num_popped)++;
+  }
+}
+
+/**
+ * This benchmark passes batches from a producer to a consumer thread through
+ * a bounded ThreadSafeFragQueue.
+ */
+size_t bench_frag_queue() {
+  ThreadSafeFragQueue queue(64);
+  FragBatch batch;
+  size_t num_popped = 0;
+  boost::thread consumer(queue_consumer, &queue, &num_popped);
+  for (size_t i = 0; i < QUEUE_BENCH_BATCHES; ++i) {
+    queue.push(&batch);
+  }
+  queue.push(NULL);
+  consumer.join();
+  assert(num_popped == QUEUE_BENCH_BATCHES);
+  return num_popped;
+}
+
+/**
+ * The BenchResult struct stores the timings of the runs of a benchmark.
+ */
+struct BenchResult {
+  string name;
+  size_t items;
+  vector<double> ns_per_item;
+};
+
+/**
+ * This function runs a benchmark once to warm up and then the given number of
+ * times, timing each run.
+ * @param name the name of the benchmark.
+ * @param func the benchmark function.
+ * @param repeats the number of timed runs.
+ * @return The timings of the runs.
+ */
+BenchResult run_bench(const string& name, BenchFunc func, size_t repeats) {
+  BenchResult res;
+  res.name = name;
+  res.items = func();
+  for (size_t r = 0; r < repeats; ++r) {
+    pt::ptime start = pt::microsec_clock::universal_time();
+    size_t items = func();
+    double ns = (pt::microsec_clock::universal_time() - start)
+                .total_microseconds()*1000.0;
+    res.ns_per_item.push_back(ns/max(items, (size_t)1));
+  }
+  sort(res.ns_per_item.begin(), res.ns_per_item.end());
+  return res;
+}
+
+/**
+ * This function writes the result of a benchmark along with the workload
+ * parameters as a single line, either as a JSON object or as tab-separated
+ * values.
+ * @param out the stream to write to.
+ * @param res the result of the benchmark.
+ * @param params the parameters of the workload.
+ * @param json a bool that is true iff the line is written as JSON.
+ */
+void output_result(ostream& out, const BenchResult& res,
+                   const SimParams& params, bool json) {
+  const vector<double>& t = res.ns_per_item;
+  double median = t[t.size()/2];
+  char buff[2000];
+  if (json) {
+    sprintf(buff, "{\"benchmark\": \"%s\", \"version\": \"%s\", "
+            "\"items\": %d, \"repeats\": %d, \"min_ns_per_item\": %.3f, "
+            "\"median_ns_per_item\": %.3f, \"max_ns_per_item\": %.3f, "
+            "\"items_per_sec\": %.1f, \"num_targets\": %d, "
+            "\"num_frags\": %d, \"multi_rate\": %g, \"indel_rate\": %g, "
+            "\"paired_frac\": %g, \"seed\": %u}",
+            res.name.c_str(), PACKAGE_VERSION, (int)res.items, (int)t.size(),
+            t.front(), median, t.back(), 1e9/median, (int)params.num_targets,
+            (int)params.num_frags, params.multi_rate, params.indel_rate,
+            params.paired_frac, params.seed);
+  } else {
+    sprintf(buff, "%s\t%s\t%d\t%d\t%.3f\t%.3f\t%.3f\t%.1f\t%d\t%d\t%g\t%g\t%g"
+            "\t%u", res.name.c_str(), PACKAGE_VERSION, (int)res.items,
+            (int)t.size(), t.front(), median, t.back(), 1e9/median,
+            (int)params.num_targets, (int)params.num_frags, params.multi_rate,
+            params.indel_rate, params.paired_frac, params.seed);
+  }
+  out << buff << endl;
+}
+
+int main(int argc, char** argv) {
+  SimParams params;
+  string source_fasta = string(SAMPLE_DATA_DIR) + "/transcripts.fasta";
+  string work_dir = "express_bench_work";
+  string filter = "";
+  string format = "json";
+  size_t repeats = 5;
+
+  po::options_description options("express_bench Options");
+  options.add_options()
+  ("help,h", "produce help message")
+  ("source-fasta",
+   po::value<string>(&source_fasta)->default_value(source_fasta),
+   "MultiFASTA file the synthetic targets are derived from")
+  ("work-dir,o", po::value<string>(&work_dir)->default_value(work_dir),
+   "directory to write the synthetic workload to")
+  ("num-targets",
+   po::value<size_t>(&params.num_targets)->default_value(params.num_targets),
+   "number of synthetic targets")
+  ("num-frags",
+   po::value<size_t>(&params.num_frags)->default_value(params.num_frags),
+   "number of simulated fragments")
+  ("multi-rate",
+   po::value<double>(&params.multi_rate)->default_value(params.multi_rate),
+   "fraction of fragments with additional alignments")
+  ("indel-rate",
+   po::value<double>(&params.indel_rate)->default_value(params.indel_rate),
+   "fraction of reads with an insertion or deletion")
+  ("paired-frac",
+   po::value<double>(&params.paired_frac)->default_value(params.paired_frac),
+   "fraction of fragments that are paired-end")
+  ("error-rate",
+   po::value<double>(&params.error_rate)->default_value(params.error_rate),
+   "per-base sequencing error rate")
+  ("read-len",
+   po::value<size_t>(&params.read_len)->default_value(params.read_len),
+   "read length")
+  ("seed", po::value<unsigned int>(&params.seed)->default_value(params.seed),
+   "seed of the workload generator")
+  ("repeats,r", po::value<size_t>(&repeats)->default_value(repeats),
+   "number of timed runs of each benchmark")
+  ("filter", po::value<string>(&filter)->default_value(filter),
+   "only run benchmarks whose names contain this string")
+  ("format", po::value<string>(&format)->default_value(format),
+   "output format (json or tsv)")
+  ("simulate-only", "write the synthetic workload and exit")
+  ;
+
+  po::variables_map vm;
+  try {
+    po::store(po::parse_command_line(argc, argv, options), vm);
+  } catch (po::error& e) {
+    logger.info("Command-Line Argument Error: %s.", e.what());
+    return 1;
+  }
+  po::notify(vm);
+  if (vm.count("help") || repeats == 0 || params.num_targets == 0 ||
+      (format != "json" && format != "tsv")) {
+    cerr << "express_bench v" << PACKAGE_VERSION << endl
+         << "-----------------------------\n"
+         << "Usage: express_bench [options]\n\n"
+         << "Runs microbenchmarks of the eXpress hot paths on a synthetic "
+         << "workload and\nwrites one line of results per benchmark to "
+         << "stdout.\n\n" << options;
+    return 1;
+  }
+
+  try {
+    fs::create_directories(work_dir);
+  } catch (fs::filesystem_error& e) {
+    logger.info(e.what());
+  }
+  if (!fs::exists(work_dir)) {
+    logger.severe("Cannot create directory %s.", work_dir.c_str());
+  }
+  if (vm.count("simulate-only")) {
+    simulate_workload(source_fasta, work_dir + "/synth", params);
+    return 0;
+  }
+
+  // Always generate the same random numbers for each run.
+  srand(params.seed);
+  Workload workload(source_fasta, work_dir, params);
+  MarkovModel markov_model(bias_model_order, 21, 21, bias_alpha);
+
+  vector<pair<string, BenchFunc> > benches;
+  benches.push_back(make_pair("process_fragment",
+                              boost::bind(bench_process_fragment, &workload)));
+  benches.push_back(make_pair("mismatch_log_likelihood",
+                              boost::bind(bench_mismatch_likelihood,
+                                          &workload)));
+  benches.push_back(make_pair("markov_seq_prob",
+                              boost::bind(bench_markov_seq_prob, &workload,
+                                          &markov_model)));
+  benches.push_back(make_pair("sam_next_fragment",
+                              boost::bind(bench_parse, &workload, false)));
+  benches.push_back(make_pair("bam_next_fragment",
+                              boost::bind(bench_parse, &workload, true)));
+  benches.push_back(make_pair("frag_queue", BenchFunc(bench_frag_queue)));
+
+  bool json = format == "json";
+  if (!json) {
+    cout << "benchmark\tversion\titems\trepeats\tmin_ns_per_item\t"
+         << "median_ns_per_item\tmax_ns_per_item\titems_per_sec\tnum_targets\t"
+         << "num_frags\tmulti_rate\tindel_rate\tpaired_frac\tseed" << endl;
+  }
+  for (size_t i = 0; i < benches.size(); ++i) {
+    if (benches[i].first.find(filter) == string::npos) {
+      continue;
+    }
+    logger.info("Running benchmark '%s'...", benches[i].first.c_str());
+    BenchResult res = run_bench(benches[i].first, benches[i].second, repeats);
+    output_result(cout, res, params, json);
+  }
+  return 0;
+}
@@ -0,0 +1,504 @@
+//
+//  simulator.cpp
+//  express
+//
+//  Created by Adam Roberts on 10/14/12.
+//  Copyright 2012 Adam Roberts. All rights reserved.
+//
+
+#include "simulator.h"
+#include "main.h"
+#include <boost/cstdint.hpp>
+#include <boost/random/mersenne_twister.hpp>
+#include <algorithm>
+#include <fstream>
+#include <math.h>
+#include <stdio.h>
+#include <vector>
+#include <zlib.h>
+
+using namespace std;
+
+/**
+ * The maximum number of uncompressed bytes in a BGZF block.
+ */
+const size_t BGZF_BLOCK_SIZE = 0xff00;
+
+/**
+ * The Rng class wraps a Mersenne twister with the distributions used by the
+ * simulator, so that workloads do not depend on the platform's rand().
+ *  @author    Adam Roberts
+ *  @date      2012
+ *  @copyright Artistic License 2.0
+ **/
+class Rng {
+  /**
+   * The private Mersenne twister generating the random numbers.
+   */
+  boost::mt19937 _gen;
+public:
+  /**
+   * Rng constructor seeds the generator.
+   * @param seed the seed of the generator.
+   */
+  Rng(unsigned int seed) : _gen(seed) {}
+  /**
+   * A member function that draws from the uniform distribution on [0,1).
+   * @return A uniform double in [0,1).
+   */
+  double uniform() { return _gen()/4294967296.0; }
+  /**
+   * A member function that draws a uniform integer below a bound.
+   * @param n the number of values, which must be positive.
+   * @return A uniform size_t in [0,n).
+   */
+  size_t uniform(size_t n) { return min((size_t)(uniform()*n), n - 1); }
+  /**
+   * A member function that draws from the standard normal distribution, by the
+   * Box-Muller transform.
+   * @return A standard normal double.
+   */
+  double normal() {
+    double u = 1 - uniform();
+    return sqrt(-2*log(u))*cos(2*M_PI*uniform());
+  }
+  /**
+   * A member function that draws a uniformly distributed nucleotide.
+   * @return A nucleotide character.
+   */
+  char nuc() { return "ACGT"[uniform(4)]; }
+};
+
+/**
+ * The SimRead struct stores the alignment of a simulated read.
+ */
+struct SimRead {
+  /**
+   * The 0-based position of the first aligned base.
+   */
+  size_t pos;
+  /**
+   * The number of target bases covered by the alignment.
+   */
+  size_t span;
+  /**
+   * The CIGAR string of the alignment and its (length, operation) pairs.
+   */
+  string cigar;
+  vector<pair<size_t, char> > cigar_ops;
+  /**
+   * The read sequence.
+   */
+  string seq;
+};
+
+/**
+ * A helper function that reads the sequences of a MultiFASTA file.
+ * @param fasta the path to the MultiFASTA file.
+ * @return The sequences in the file.
+ */
+vector<string> read_fasta(const string& fasta) {
+  ifstream in(fasta.c_str());
+  if (!in.is_open()) {
+    logger.severe("Unable to open MultiFASTA file '%s'.", fasta.c_str());
+  }
+  vector<string> seqs;
+  string line;
+  while (getline(in, line)) {
+    if (line.empty()) {
+      continue;
+    }
+    if (line[0] == '>') {
+      seqs.push_back("");
+    } else if (seqs.size()) {
+      seqs.back() += line;
+    }
+  }
+  if (seqs.empty()) {
+    logger.severe("No targets found in MultiFASTA file '%s'.", fasta.c_str());
+  }
+  return seqs;
+}
+
+/**
+ * A helper function that simulates a read of a target, possibly with an indel
+ * and sequencing errors.
+ * @param rng the random number generator.
+ * @param targ the target sequence.
+ * @param start the position of the first aligned base, or of the base after
+ *        the last aligned base if from_end.
+ * @param from_end a bool that is true iff start marks the end of the read.
+ * @param params the parameters of the workload.
+ * @param read the SimRead to fill.
+ * @return True iff the read fits within the target.
+ */
+bool simulate_read(Rng& rng, const string& targ, size_t start, bool from_end,
+                   const SimParams& params, SimRead& read) {
+  size_t len = params.read_len;
+  size_t indel = 0;
+  bool ins = false;
+  size_t indel_at = len/4 + rng.uniform(len/2 + 1);
+  if (rng.uniform() < params.indel_rate) {
+    indel = 1 + rng.uniform(3);
+    ins = rng.uniform() < 0.5;
+  }
+  read.span = (ins) ? len - indel : len + indel;
+  if (from_end) {
+    if (start < read.span) {
+      return false;
+    }
+    start -= read.span;
+  }
+  if (start + read.span > targ.size()) {
+    return false;
+  }
+  read.pos = start;
+
+  read.cigar_ops.clear();
+  read.seq.clear();
+  if (indel) {
+    read.seq = targ.substr(start, indel_at);
+    read.cigar_ops.push_back(make_pair(indel_at, 'M'));
+    if (ins) {
+      for (size_t i = 0; i < indel; ++i) {
+        read.seq += rng.nuc();
+      }
+      read.seq += targ.substr(start + indel_at, len - indel_at - indel);
+      read.cigar_ops.push_back(make_pair(indel, 'I'));
+      read.cigar_ops.push_back(make_pair(len - indel_at - indel, 'M'));
+    } else {
+      read.seq += targ.substr(start + indel_at + indel, len - indel_at);
+      read.cigar_ops.push_back(make_pair(indel, 'D'));
+      read.cigar_ops.push_back(make_pair(len - indel_at, 'M'));
+    }
+  } else {
+    read.seq = targ.substr(start, len);
+    read.cigar_ops.push_back(make_pair(len, 'M'));
+  }
+  for (size_t i = 0; i < read.seq.size(); ++i) {
+    if (rng.uniform() < params.error_rate) {
+      read.seq[i] = rng.nuc();
+    }
+  }
+
+  read.cigar.clear();
+  char buff[32];
+  for (size_t i = 0; i < read.cigar_ops.size(); ++i) {
+    sprintf(buff, "%d%c", (int)read.cigar_ops[i].first, read.cigar_ops[i].second);
+    read.cigar += buff;
+  }
+  return true;
+}
+
+/**
+ * A helper function that appends the bytes of a value to a buffer.
+ * @param buff the buffer to append to.
+ * @param val the value to append.
+ */
+template <typename T>
+inline void append_le(string& buff, T val) {
+  for (size_t i = 0; i < sizeof(T); ++i) {
+    buff += (char)((boost::uint64_t)val >> (8*i));
+  }
+}
+
+/**
+ * A helper function that computes the BAM bin of an alignment.
+ * @param beg the 0-based position of the first aligned base.
+ * @param end the 0-based position after the last aligned base.
+ * @return The bin of the alignment, as defined by the SAM specification.
+ */
+inline int reg2bin(int beg, int end) {
+  --end;
+  if (beg>>14 == end>>14) return ((1<<15)-1)/7 + (beg>>14);
+  if (beg>>17 == end>>17) return ((1<<12)-1)/7 + (beg>>17);
+  if (beg>>20 == end>>20) return ((1<<9)-1)/7 + (beg>>20);
+  if (beg>>23 == end>>23) return ((1<<6)-1)/7 + (beg>>23);
+  if (beg>>26 == end>>26) return ((1<<3)-1)/7 + (beg>>26);
+  return 0;
+}
+
+/**
+ * The SimWriter class writes simulated alignments in both SAM and BAM format.
+ *  @author    Adam Roberts
+ *  @date      2012
+ *  @copyright Artistic License 2.0
+ **/
+class SimWriter {
+  /**
+   * Private output streams for the SAM and BAM files.
+   */
+  ofstream _sam;
+  ofstream _bam;
+  /**
+   * A private buffer of the uncompressed BAM bytes not yet written as a BGZF
+   * block.
+   */
+  string _buff;
+  /**
+   * A private member function that compresses bytes into a BGZF block and
+   * writes it to the BAM file.
+   * @param data a pointer to the uncompressed bytes.
+   * @param len the number of bytes, at most BGZF_BLOCK_SIZE.
+   */
+  void write_block(const char* data, size_t len) {
+    vector<unsigned char> out(compressBound(len) + 26);
+    z_stream zs;
+    zs.zalloc = Z_NULL;
+    zs.zfree = Z_NULL;
+    zs.opaque = Z_NULL;
+    deflateInit2(&zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -15, 8,
+                 Z_DEFAULT_STRATEGY);
+    zs.next_in = (Bytef*)data;
+    zs.avail_in = (uInt)len;
+    zs.next_out = &out[18];
+    zs.avail_out = (uInt)(out.size() - 26);
+    deflate(&zs, Z_FINISH);
+    size_t clen = zs.total_out;
+    deflateEnd(&zs);
+
+    static const unsigned char header[16] = {31, 139, 8, 4, 0, 0, 0, 0, 0, 255,
+                                             6, 0, 'B', 'C', 2, 0};
+    copy(header, header + 16, out.begin());
+    size_t bsize = clen + 25;
+    out[16] = bsize & 0xff;
+    out[17] = bsize >> 8;
+    boost::uint32_t crc = (boost::uint32_t)crc32(0, (const Bytef*)data,
+                                                 (uInt)len);
+    for (size_t i = 0; i < 4; ++i) {
+      out[18 + clen + i] = (crc >> (8*i)) & 0xff;
+      out[22 + clen + i] = ((boost::uint32_t)len >> (8*i)) & 0xff;
+    }
+    _bam.write((const char*)&out[0], clen + 26);
+  }
+  /**
+   * A private member function that writes the buffered bytes as full BGZF
+   * blocks.
+   * @param all a bool that is true iff a final partial block should be
+   *        written as well.
+   */
+  void flush(bool all) {
+    size_t i = 0;
+    for (; i + BGZF_BLOCK_SIZE <= _buff.size() ||
+           (all && i < _buff.size()); i += BGZF_BLOCK_SIZE) {
+      write_block(_buff.data() + i, min(BGZF_BLOCK_SIZE, _buff.size() - i));
+    }
+    _buff.erase(0, min(i, _buff.size()));
+  }
+
+public:
+  /**
+   * SimWriter constructor opens the output files and writes their headers.
+   * @param out_prefix the prefix of the '.sam' and '.bam' files.
+   * @param names the names of the targets.
+   * @param seqs the sequences of the targets.
+   */
+  SimWriter(const string& out_prefix, const vector<string>& names,
+            const vector<string>& seqs)
+      : _sam((out_prefix + ".sam").c_str()),
+        _bam((out_prefix + ".bam").c_str(), ios::out | ios::binary) {
+    if (!_sam.is_open() || !_bam.is_open()) {
+      logger.severe("Unable to open simulated alignment files '%s.(sam/bam)'.",
+                    out_prefix.c_str());
+    }
+    string text = "@HD\tVN:1.0\tSO:queryname\n";
+    char buff[1000];
+    for (size_t i = 0; i < names.size(); ++i) {
+      sprintf(buff, "@SQ\tSN:%s\tLN:%d\n", names[i].c_str(),
+              (int)seqs[i].size());
+      text += buff;
+    }
+    text += "@PG\tID:express_bench\n";
+    _sam << text;
+
+    _buff = "BAM\1";
+    append_le(_buff, (boost::int32_t)text.size());
+    _buff += text;
+    append_le(_buff, (boost::int32_t)names.size());
+    for (size_t i = 0; i < names.size(); ++i) {
+      append_le(_buff, (boost::int32_t)names[i].size() + 1);
+      _buff += names[i];
+      _buff += '\0';
+      append_le(_buff, (boost::int32_t)seqs[i].size());
+    }
+  }
+  /**
+   * SimWriter destructor writes the remaining BAM blocks and the end-of-file
+   * marker.
+   */
+  ~SimWriter() {
+    flush(true);
+    // BGZF end-of-file marker
+    static const unsigned char eof[28] = {31, 139, 8, 4, 0, 0, 0, 0, 0, 255,
+                                          6, 0, 66, 67, 2, 0, 27, 0, 3, 0,
+                                          0, 0, 0, 0, 0, 0, 0, 0};
+    _bam.write((const char*)eof, 28);
+  }
+  /**
+   * A member function that writes an alignment to both files.
+   * @param qname the name of the fragment.
+   * @param flag the SAM flag of the alignment.
+   * @param names the names of the targets.
+   * @param ref the index of the target aligned to.
+   * @param read the simulated read.
+   * @param mate_pos the 0-based position of the mate, or -1 if unpaired.
+   * @param tlen the signed length of the fragment, or 0 if unpaired.
+   */
+  void write(const string& qname, int flag, const vector<string>& names,
+             size_t ref, const SimRead& read, int mate_pos, int tlen) {
+    _sam << qname << '\t' << flag << '\t' << names[ref] << '\t'
+         << read.pos + 1 << "\t255\t" << read.cigar << '\t'
+         << ((mate_pos >= 0) ? "=" : "*") << '\t' << mate_pos + 1 << '\t'
+         << tlen << '\t' << read.seq << '\t'
+         << string(read.seq.size(), 'I') << '\n';
+
+    static const string cigar_chars = "MIDNSHP=X";
+    static const string nuc_chars = "=ACMGRSVTWYHKDBN";
+    string rec;
+    append_le(rec, (boost::int32_t)ref);
+    append_le(rec, (boost::int32_t)read.pos);
+    append_le(rec, (boost::uint32_t)((reg2bin((int)read.pos,
+                                              (int)(read.pos + read.span))
+                                      << 16) | (255 << 8) |
+                                     (qname.size() + 1)));
+    append_le(rec, (boost::uint32_t)((flag << 16) | read.cigar_ops.size()));
+    append_le(rec, (boost::int32_t)read.seq.size());
+    append_le(rec, (boost::int32_t)((mate_pos >= 0) ? ref : -1));
+    append_le(rec, (boost::int32_t)mate_pos);
+    append_le(rec, (boost::int32_t)tlen);
+    rec += qname;
+    rec += '\0';
+    for (size_t i = 0; i < read.cigar_ops.size(); ++i) {
+      append_le(rec, (boost::uint32_t)((read.cigar_ops[i].first << 4) |
+                                       cigar_chars.find(
+                                           read.cigar_ops[i].second)));
+    }
+    for (size_t i = 0; i < read.seq.size(); i += 2) {
+      unsigned char packed = nuc_chars.find(read.seq[i]) << 4;
+      if (i + 1 < read.seq.size()) {
+        packed |= nuc_chars.find(read.seq[i+1]);
+      }
+      rec += (char)packed;
+    }
+    rec += string(read.seq.size(), (char)('I' - 33));
+    append_le(_buff, (boost::int32_t)rec.size());
+    _buff += rec;
+    if (_buff.size() >= BGZF_BLOCK_SIZE) {
+      flush(false);
+    }
+  }
+};
+
+size_t simulate_workload(const string& source_fasta, const string& out_prefix,
+                         const SimParams& params) {
+  Rng rng(params.seed);
+  vector<string> sources = read_fasta(source_fasta);
+  size_t min_len = params.frag_len_mean + 3*params.frag_len_stddev +
+                   params.read_len;
+
+  // Synthetic targets are mutated substrings of the source targets, so that
+  // targets derived from the same source share sequence.
+  vector<string> names(params.num_targets);
+  vector<string> seqs(params.num_targets);
+  vector<double> cum_abundance(params.num_targets);
+  double tot_abundance = 0;
+  char buff[100];
+  for (size_t t = 0; t < params.num_targets; ++t) {
+    const string& src = sources[t % sources.size()];
+    size_t len = src.size();
+    if (len > min_len) {
+      len = max(min_len, (size_t)(len*(0.6 + 0.4*rng.uniform())));
+    }
+    string seq = src.substr(rng.uniform(src.size() - len + 1), len);
+    for (size_t i = 0; i < seq.size(); ++i) {
+      if (t >= sources.size() && rng.uniform() < 0.02) {
+        seq[i] = rng.nuc();
+      }
+    }
+    sprintf(buff, "synth_%d", (int)t);
+    names[t] = buff;
+    seqs[t] = seq;
+    tot_abundance += exp(rng.normal());
+    cum_abundance[t] = tot_abundance;
+  }
+
+  ofstream fasta((out_prefix + ".fa").c_str());
+  if (!fasta.is_open()) {
+    logger.severe("Unable to open simulated MultiFASTA file '%s.fa'.",
+                  out_prefix.c_str());
+  }
+  for (size_t t = 0; t < params.num_targets; ++t) {
+    fasta << '>' << names[t] << '\n';
+    for (size_t i = 0; i < seqs[t].size(); i += 70) {
+      fasta << seqs[t].substr(i, 70) << '\n';
+    }
+  }
+  fasta.close();
+
+  SimWriter writer(out_prefix, names, seqs);
+  size_t num_alignments = 0;
+  vector<size_t> hits;
+  SimRead left;
+  SimRead right;
+  for (size_t k = 0; k < params.num_frags; ++k) {
+    size_t t = lower_bound(cum_abundance.begin(), cum_abundance.end(),
+                           rng.uniform()*tot_abundance) - cum_abundance.begin();
+    t = min(t, params.num_targets - 1);
+    bool paired = rng.uniform() < params.paired_frac;
+    bool reverse = rng.uniform() < 0.5;
+    size_t frag_len = params.read_len;
+    if (paired) {
+      double fl = params.frag_len_mean + params.frag_len_stddev*rng.normal();
+      frag_len = (size_t)max(fl, (double)params.read_len + 4);
+    }
+    if (seqs[t].size() < frag_len + 4) {
+      continue;
+    }
+    size_t pos = rng.uniform(seqs[t].size() - frag_len - 3);
+
+    hits.assign(1, t);
+    if (rng.uniform() < params.multi_rate) {
+      size_t num_extra = 1 + rng.uniform(3);
+      for (size_t i = 0; i < num_extra; ++i) {
+        size_t h = rng.uniform(params.num_targets);
+        if (find(hits.begin(), hits.end(), h) == hits.end() &&
+            seqs[h].size() >= pos + frag_len + 4) {
+          hits.push_back(h);
+        }
+      }
+      sort(hits.begin(), hits.end());
+    }
+
+    sprintf(buff, "f%d", (int)k);
+    string qname = buff;
+    foreach (size_t h, hits) {
+      if (!simulate_read(rng, seqs[h], pos, false, params, left)) {
+        continue;
+      }
+      if (!paired) {
+        writer.write(qname, (reverse) ? 16 : 0, names, h, left, -1, 0);
+        num_alignments++;
+        continue;
+      }
+      if (!simulate_read(rng, seqs[h], pos + frag_len, true, params, right)) {
+        continue;
+      }
+      int tlen = (int)(right.pos + right.span - left.pos);
+      // The first read of the pair is written first, aligning to the forward
+      // strand unless the fragment is reversed.
+      if (reverse) {
+        writer.write(qname, 83, names, h, right, (int)left.pos, -tlen);
+        writer.write(qname, 163, names, h, left, (int)right.pos, tlen);
+      } else {
+        writer.write(qname, 99, names, h, left, (int)right.pos, tlen);
+        writer.write(qname, 147, names, h, right, (int)left.pos, -tlen);
+      }
+      num_alignments++;
+    }
+  }
+
+  logger.info("Simulated %d fragments (%d alignments) to %d targets in "
+              "'%s.(fa/sam/bam)'.", params.num_frags, num_alignments,
+              params.num_targets, out_prefix.c_str());
+  return num_alignments;
+}
@@ -0,0 +1,90 @@
+/**
+ *  simulator.h
+ *  express
+ *
+ *  Created by Adam Roberts on 10/14/12.
+ *  Copyright 2012 Adam Roberts. All rights reserved.
+ */
+
+#ifndef express_simulator_h
+#define express_simulator_h
+
+#include <string>
+
+/**
+ * The SimParams struct stores the parameters of a synthetic workload.
+ *  @author    Adam Roberts
+ *  @date      2012
+ *  @copyright Artistic License 2.0
+ **/
+struct SimParams {
+  /**
+   * The number of targets in the synthetic transcriptome.
+   */
+  size_t num_targets;
+  /**
+   * The number of fragments to simulate.
+   */
+  size_t num_frags;
+  /**
+   * The probability that a fragment has additional alignments to other
+   * targets.
+   */
+  double multi_rate;
+  /**
+   * The probability that a read contains a (1-3 bp) insertion or deletion.
+   */
+  double indel_rate;
+  /**
+   * The probability that a fragment is paired-end rather than single-end.
+   */
+  double paired_frac;
+  /**
+   * The per-base probability of a sequencing error.
+   */
+  double error_rate;
+  /**
+   * The length of each read.
+   */
+  size_t read_len;
+  /**
+   * The mean and standard deviation of the fragment length distribution.
+   */
+  size_t frag_len_mean;
+  size_t frag_len_stddev;
+  /**
+   * The seed of the random number generator.
+   */
+  unsigned int seed;
+  SimParams()
+      : num_targets(200),
+        num_frags(200000),
+        multi_rate(0.3),
+        indel_rate(0.02),
+        paired_frac(0.8),
+        error_rate(0.01),
+        read_len(50),
+        frag_len_mean(200),
+        frag_len_stddev(30),
+        seed(1) {}
+};
+
+/**
+ * This function writes a synthetic workload derived from the targets of the
+ * given MultiFASTA file. Synthetic targets are mutated substrings of the source
+ * targets with log-normally distributed abundances. Fragments are sampled from
+ * them and their alignments written in name-sorted SAM and BAM format, with
+ * all alignments of a fragment consecutive. The same parameters always produce
+ * the same files.
+ * @param source_fasta the path to the MultiFASTA file of source targets, such
+ *        as 'sample_data/transcripts.fasta'.
+ * @param out_prefix the prefix of the output files, to which '.fa', '.sam' and
+ *        '.bam' are appended.
+ * @param params the parameters of the workload.
+ * @return The number of alignments written.
+ */
+size_t simulate_workload(const std::string& source_fasta,
+                         const std::string& out_prefix,
+                         const SimParams& params);
+
+#endif
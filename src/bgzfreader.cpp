@@ -0,0 +1,212 @@
+//
+//  bgzfreader.cpp
+//  express
+//
+//  Created by Adam Roberts on 10/14/12.
+//  Copyright 2012 Adam Roberts. All rights reserved.
+//
+
+#include "bgzfreader.h"
+#include "main.h"
+#include <string.h>
+#include <zlib.h>
+
+using namespace std;
+
+BGZFReader::BGZFReader(const string& file_name, size_t num_threads)
+    : _file_name(file_name),
+      _in(file_name.c_str(), ios::in | ios::binary),
+      _blocks(max(4*num_threads, (size_t)8)),
+      _next_read(0),
+      _next_use(0),
+      _in_use(false),
+      _pos(0),
+      _eof(false),
+      _stop(false),
+      _num_threads(max(num_threads, (size_t)1)) {
+  if (!_in.is_open()) {
+    logger.severe("Unable to open input BAM file '%s'.", file_name.c_str());
+  }
+  start();
+}
+
+BGZFReader::~BGZFReader() {
+  stop();
+}
+
+void BGZFReader::start() {
+  assert(_threads.empty());
+  for (size_t i = 0; i < _num_threads; ++i) {
+    _threads.push_back(
+        new boost::thread(&BGZFReader::inflate_blocks, this));
+  }
+}
+
+void BGZFReader::stop() {
+  {
+    boost::unique_lock<boost::mutex> lock(_mut);
+    _stop = true;
+  }
+  _slot_free.notify_all();
+  _block_ready.notify_all();
+  foreach (boost::thread* t, _threads) {
+    t->join();
+    delete t;
+  }
+  _threads.clear();
+}
+
+bool BGZFReader::read_block(Block& block, size_t& isize) {
+  // Fixed part of the gzip member header, up to and including XLEN.
+  unsigned char header[12];
+  _in.read((char*)header, 12);
+  if (_in.gcount() == 0) {
+    return false;
+  }
+  if (_in.gcount() < 12 || header[0] != 31 || header[1] != 139 ||
+      header[2] != 8 || !(header[3] & 4)) {
+    logger.severe("Input file '%s' is not in valid BGZF format.",
+                  _file_name.c_str());
+  }
+
+  // Find the size of the block in the "BC" extra subfield.
+  size_t xlen = le_uint16(header + 10);
+  if (xlen < 6) {
+    logger.severe("Input file '%s' contains a malformed BGZF block header.",
+                  _file_name.c_str());
+  }
+  block.cdata.resize(xlen);
+  _in.read(&block.cdata[0], xlen);
+  const unsigned char* extra = (const unsigned char*)&block.cdata[0];
+  size_t bsize = 0;
+  for (size_t i = 0; i + 4 <= xlen; i += 4 + le_uint16(extra + i + 2)) {
+    if (extra[i] == 'B' && extra[i+1] == 'C' && le_uint16(extra + i + 2) == 2
+        && i + 6 <= xlen) {
+      bsize = le_uint16(extra + i + 4) + 1;
+      break;
+    }
+  }
+  if ((size_t)_in.gcount() != xlen || bsize < 12 + xlen + 8) {
+    logger.severe("Input file '%s' contains a malformed BGZF block header.",
+                  _file_name.c_str());
+  }
+
+  // Read the deflate stream and the CRC32/ISIZE footer.
+  size_t remaining = bsize - 12 - xlen;
+  block.cdata.resize(remaining);
+  _in.read(&block.cdata[0], remaining);
+  if ((size_t)_in.gcount() != remaining) {
+    logger.severe("Input file '%s' ends with a truncated BGZF block.",
+                  _file_name.c_str());
+  }
+  isize = le_uint32((const unsigned char*)&block.cdata[remaining - 4]);
+  block.cdata.resize(remaining - 8);
+  return true;
+}
+
+void BGZFReader::inflate_blocks() {
+  z_stream zs;
+  memset(&zs, 0, sizeof(zs));
+  if (inflateInit2(&zs, -15) != Z_OK) {
+    logger.severe("Unable to initialize zlib to read '%s'.",
+                  _file_name.c_str());
+  }
+
+  while (true) {
+    Block* block = NULL;
+    size_t isize = 0;
+    {
+      boost::unique_lock<boost::mutex> lock(_mut);
+      while (!_stop && !_eof && _next_read >= _next_use + _blocks.size()) {
+        _slot_free.wait(lock);
+      }
+      if (_stop || _eof) {
+        break;
+      }
+      block = &_blocks[_next_read % _blocks.size()];
+      if (!read_block(*block, isize)) {
+        _eof = true;
+        _block_ready.notify_all();
+        break;
+      }
+      _next_read++;
+    }
+
+    // Inflate outside of the lock so that blocks are decompressed in parallel.
+    block->data.resize(isize);
+    if (isize) {
+      inflateReset(&zs);
+      zs.next_in = (Bytef*)&block->cdata[0];
+      zs.avail_in = (uInt)block->cdata.size();
+      zs.next_out = (Bytef*)&block->data[0];
+      zs.avail_out = (uInt)isize;
+      if (inflate(&zs, Z_FINISH) != Z_STREAM_END || zs.avail_out != 0) {
+        logger.severe("Input file '%s' contains a corrupt BGZF block.",
+                      _file_name.c_str());
+      }
+    }
+
+    {
+      boost::unique_lock<boost::mutex> lock(_mut);
+      block->ready = true;
+    }
+    _block_ready.notify_all();
+  }
+
+  inflateEnd(&zs);
+}
+
+bool BGZFReader::next_block() {
+  boost::unique_lock<boost::mutex> lock(_mut);
+  if (_in_use) {
+    _blocks[_next_use % _blocks.size()].ready = false;
+    _next_use++;
+    _in_use = false;
+    _slot_free.notify_all();
+  }
+
+  Block& block = _blocks[_next_use % _blocks.size()];
+  while (!block.ready && !(_eof && _next_use >= _next_read)) {
+    _block_ready.wait(lock);
+  }
+  if (!block.ready) {
+    return false;
+  }
+  _in_use = true;
+  _pos = 0;
+  return true;
+}
+
+bool BGZFReader::read(char* dst, size_t n) {
+  while (n) {
+    if (!_in_use || _pos == _blocks[_next_use % _blocks.size()].data.size()) {
+      if (!next_block()) {
+        return false;
+      }
+      continue;
+    }
+    const vector<char>& data = _blocks[_next_use % _blocks.size()].data;
+    size_t len = min(n, data.size() - _pos);
+    memcpy(dst, &data[_pos], len);
+    dst += len;
+    n -= len;
+    _pos += len;
+  }
+  return true;
+}
+
+void BGZFReader::rewind() {
+  stop();
+  foreach (Block& block, _blocks) {
+    block.ready = false;
+  }
+  _next_read = 0;
+  _next_use = 0;
+  _in_use = false;
+  _pos = 0;
+  _eof = false;
+  _stop = false;
+  _in.clear();
+  _in.seekg(0, ios::beg);
+  start();
+}
@@ -0,0 +1,185 @@
+/**
+ *  bgzfreader.h
+ *  express
+ *
+ *  Created by Adam Roberts on 10/14/12.
+ *  Copyright 2012 Adam Roberts. All rights reserved.
+ */
+
+#ifndef express_bgzfreader_h
+#define express_bgzfreader_h
+
+#include <boost/thread.hpp>
+#include <fstream>
+#include <string>
+#include <vector>
+
+/**
+ * A helper function that decodes a little-endian 16-bit unsigned integer.
+ * @param p a pointer to the first byte of the integer.
+ * @return The decoded integer.
+ */
+inline size_t le_uint16(const unsigned char* p) {
+  return (size_t)p[0] | ((size_t)p[1] << 8);
+}
+
+/**
+ * A helper function that decodes a little-endian 32-bit unsigned integer.
+ * @param p a pointer to the first byte of the integer.
+ * @return The decoded integer.
+ */
+inline size_t le_uint32(const unsigned char* p) {
+  return (size_t)p[0] | ((size_t)p[1] << 8) | ((size_t)p[2] << 16) |
+         ((size_t)p[3] << 24);
+}
+
+/**
+ * The BGZFReader class presents a BGZF-compressed file (such as a BAM file) as
+ * a sequential stream of uncompressed bytes. Worker threads read and inflate
+ * blocks ahead of the consumer in parallel, while the consumer always receives
+ * the bytes in file order. The read and rewind methods must only be called by a
+ * single consumer thread.
+ *  @author    Adam Roberts
+ *  @date      2012
+ *  @copyright Artistic License 2.0
+ **/
+class BGZFReader {
+  /**
+   * The Block struct stores a single BGZF block in compressed and (once
+   * inflated) uncompressed form.
+   */
+  struct Block {
+    /**
+     * The compressed deflate stream of the block (not including the header or
+     * the CRC32 and ISIZE footer).
+     */
+    std::vector<char> cdata;
+    /**
+     * The uncompressed contents of the block. Only valid if ready.
+     */
+    std::vector<char> data;
+    /**
+     * True iff the block has been inflated and is ready to be consumed.
+     */
+    bool ready;
+    Block() : ready(false) {}
+  };
+  /**
+   * A private string storing the path to the BGZF file.
+   */
+  std::string _file_name;
+  /**
+   * A private input stream for the BGZF file. Only accessed by workers while
+   * holding _mut.
+   */
+  std::ifstream _in;
+  /**
+   * A private vector of Blocks used as a ring buffer. Block with sequence
+   * number i is stored at index i % _blocks.size().
+   */
+  std::vector<Block> _blocks;
+  /**
+   * A private size_t for the sequence number of the next block to be read from
+   * the file.
+   */
+  size_t _next_read;
+  /**
+   * A private size_t for the sequence number of the block being consumed.
+   */
+  size_t _next_use;
+  /**
+   * A private bool that is true iff the consumer has taken the block with
+   * sequence number _next_use.
+   */
+  bool _in_use;
+  /**
+   * A private size_t storing the offset of the next byte to consume in the
+   * current block.
+   */
+  size_t _pos;
+  /**
+   * A private bool that is true iff all blocks have been read from the file.
+   */
+  bool _eof;
+  /**
+   * A private bool signalling the workers to exit.
+   */
+  bool _stop;
+  /**
+   * A private mutex protecting the file and all block bookkeeping.
+   */
+  boost::mutex _mut;
+  /**
+   * A private condition variable notified when a block has been inflated or
+   * the end of the file is reached.
+   */
+  boost::condition_variable _block_ready;
+  /**
+   * A private condition variable notified when the consumer frees a block.
+   */
+  boost::condition_variable _slot_free;
+  /**
+   * A private vector of pointers to the worker threads.
+   */
+  std::vector<boost::thread*> _threads;
+  /**
+   * A private size_t storing the number of worker threads to use.
+   */
+  size_t _num_threads;
+  /**
+   * A private member function that reads the next BGZF block from the file into
+   * the given Block. Must be called while holding _mut.
+   * @param block the Block to store the compressed data and size in.
+   * @param isize a reference to a size_t to store the uncompressed size in.
+   * @return True iff a block was read and false on end of file.
+   */
+  bool read_block(Block& block, size_t& isize);
+  /**
+   * A private member function run by each worker thread that repeatedly reads
+   * and inflates blocks until the end of the file is reached or the reader is
+   * stopped.
+   */
+  void inflate_blocks();
+  /**
+   * A private member function that starts the worker threads at the current
+   * position in the file.
+   */
+  void start();
+  /**
+   * A private member function that stops and joins the worker threads.
+   */
+  void stop();
+  /**
+   * A private member function that releases the current block (if any) and
+   * waits until the next one is ready.
+   * @return True iff another block is available and false at end of file.
+   */
+  bool next_block();
+
+public:
+  /**
+   * BGZFReader constructor opens the file and starts the worker threads.
+   * @param file_name the path to the BGZF file.
+   * @param num_threads the number of worker threads to inflate blocks with.
+   */
+  BGZFReader(const std::string& file_name, size_t num_threads);
+  /**
+   * BGZFReader destructor stops the worker threads and closes the file.
+   */
+  ~BGZFReader();
+  /**
+   * A member function that copies the next n uncompressed bytes of the stream
+   * into the given buffer.
+   * @param dst a pointer to the buffer to copy the bytes into.
+   * @param n the number of bytes to copy.
+   * @return True iff all n bytes were copied and false if the end of the file
+   *         was reached first.
+   */
+  bool read(char* dst, size_t n);
+  /**
+   * A member function that rewinds the stream to the beginning of the file.
+   */
+  void rewind();
+};
+
+#endif
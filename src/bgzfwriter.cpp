@@ -0,0 +1,219 @@
+//
+//  bgzfwriter.cpp
+//  express
+//
+//  Created by Adam Roberts on 10/14/12.
+//  Copyright 2012 Adam Roberts. All rights reserved.
+//
+
+#include "bgzfwriter.h"
+#include "main.h"
+#include <string.h>
+#include <zlib.h>
+
+using namespace std;
+
+/**
+ * The maximum number of uncompressed bytes in a block, as used by samtools so
+ * that even incompressible data fits in a block when stored.
+ */
+const size_t BGZF_BLOCK_SIZE = 0xff00;
+/**
+ * The maximum size of a compressed block, including the header and footer.
+ */
+const size_t BGZF_MAX_BLOCK_SIZE = 0x10000;
+/**
+ * The size of the BGZF block header, with the "BC" extra subfield.
+ */
+const size_t BGZF_HEADER_SIZE = 18;
+/**
+ * The size of the CRC32 and ISIZE footer of a block.
+ */
+const size_t BGZF_FOOTER_SIZE = 8;
+/**
+ * The empty block that marks the end of a BGZF file.
+ */
+const unsigned char BGZF_EOF[28] = {
+  31, 139, 8, 4, 0, 0, 0, 0, 0, 255, 6, 0, 66, 67, 2, 0, 27, 0, 3, 0, 0, 0, 0,
+  0, 0, 0, 0, 0
+};
+
+BGZFWriter::BGZFWriter(const string& file_name, size_t num_threads)
+    : _file_name(file_name),
+      _out(file_name.c_str(), ios::out | ios::binary | ios::trunc),
+      _blocks(max(4*num_threads, (size_t)8)),
+      _next_fill(0),
+      _next_deflate(0),
+      _next_write(0),
+      _closed(false) {
+  if (!_out.is_open()) {
+    logger.severe("Unable to open output BAM file '%s'.", file_name.c_str());
+  }
+  _blocks[0].data.reserve(BGZF_BLOCK_SIZE);
+  for (size_t i = 0; i < max(num_threads, (size_t)1); ++i) {
+    _threads.push_back(new boost::thread(&BGZFWriter::deflate_blocks, this));
+  }
+  _threads.push_back(new boost::thread(&BGZFWriter::write_blocks, this));
+}
+
+BGZFWriter::~BGZFWriter() {
+  close();
+}
+
+void BGZFWriter::deflate_blocks() {
+  // Blocks that do not fit once compressed are stored with level 0 instead.
+  z_stream zs[2];
+  memset(zs, 0, sizeof(zs));
+  if (deflateInit2(&zs[0], Z_DEFAULT_COMPRESSION, Z_DEFLATED, -15, 8,
+                   Z_DEFAULT_STRATEGY) != Z_OK ||
+      deflateInit2(&zs[1], Z_NO_COMPRESSION, Z_DEFLATED, -15, 8,
+                   Z_DEFAULT_STRATEGY) != Z_OK) {
+    logger.severe("Unable to initialize zlib to write '%s'.",
+                  _file_name.c_str());
+  }
+
+  while (true) {
+    Block* block = NULL;
+    {
+      boost::unique_lock<boost::mutex> lock(_mut);
+      while (!_closed && _next_deflate >= _next_fill) {
+        _block_full.wait(lock);
+      }
+      if (_next_deflate >= _next_fill) {
+        break;
+      }
+      block = &_blocks[_next_deflate % _blocks.size()];
+      _next_deflate++;
+    }
+
+    // Deflate outside of the lock so that blocks are compressed in parallel.
+    vector<char>& cdata = block->cdata;
+    cdata.resize(BGZF_MAX_BLOCK_SIZE);
+    size_t csize = 0;
+    for (size_t level = 0; level < 2; ++level) {
+      deflateReset(&zs[level]);
+      zs[level].next_in = (Bytef*)((block->data.empty()) ? NULL
+                                                         : &block->data[0]);
+      zs[level].avail_in = (uInt)block->data.size();
+      zs[level].next_out = (Bytef*)&cdata[BGZF_HEADER_SIZE];
+      zs[level].avail_out = (uInt)(BGZF_MAX_BLOCK_SIZE - BGZF_HEADER_SIZE -
+                                   BGZF_FOOTER_SIZE);
+      if (deflate(&zs[level], Z_FINISH) == Z_STREAM_END) {
+        csize = zs[level].total_out;
+        break;
+      }
+    }
+    if (!csize) {
+      logger.severe("Unable to compress a block of output BAM file '%s'.",
+                    _file_name.c_str());
+    }
+
+    size_t bsize = BGZF_HEADER_SIZE + csize + BGZF_FOOTER_SIZE;
+    const unsigned char header[BGZF_HEADER_SIZE] = {
+      31, 139, 8, 4, 0, 0, 0, 0, 0, 255, 6, 0, 66, 67, 2, 0,
+      (unsigned char)((bsize - 1) & 0xff), (unsigned char)((bsize - 1) >> 8)
+    };
+    memcpy(&cdata[0], header, BGZF_HEADER_SIZE);
+    uLong crc = crc32(0L, Z_NULL, 0);
+    if (!block->data.empty()) {
+      crc = crc32(crc, (const Bytef*)&block->data[0],
+                  (uInt)block->data.size());
+    }
+    string footer;
+    append_le_uint32(footer, crc);
+    append_le_uint32(footer, block->data.size());
+    memcpy(&cdata[bsize - BGZF_FOOTER_SIZE], footer.data(), BGZF_FOOTER_SIZE);
+    cdata.resize(bsize);
+
+    {
+      boost::unique_lock<boost::mutex> lock(_mut);
+      block->ready = true;
+    }
+    _block_ready.notify_all();
+  }
+
+  deflateEnd(&zs[0]);
+  deflateEnd(&zs[1]);
+}
+
+void BGZFWriter::write_blocks() {
+  while (true) {
+    Block* block = NULL;
+    {
+      boost::unique_lock<boost::mutex> lock(_mut);
+      block = &_blocks[_next_write % _blocks.size()];
+      while (!block->ready && !(_closed && _next_write >= _next_fill)) {
+        _block_ready.wait(lock);
+      }
+      if (!block->ready) {
+        break;
+      }
+    }
+
+    // Write outside of the lock so that the producer and workers can continue.
+    _out.write(&block->cdata[0], block->cdata.size());
+    if (!_out.good()) {
+      logger.severe("Unable to write to output BAM file '%s'.",
+                    _file_name.c_str());
+    }
+
+    {
+      boost::unique_lock<boost::mutex> lock(_mut);
+      block->ready = false;
+      block->data.clear();
+      _next_write++;
+    }
+    _slot_free.notify_all();
+  }
+}
+
+void BGZFWriter::next_block() {
+  boost::unique_lock<boost::mutex> lock(_mut);
+  _next_fill++;
+  _block_full.notify_one();
+  while (_next_fill >= _next_write + _blocks.size()) {
+    _slot_free.wait(lock);
+  }
+  _blocks[_next_fill % _blocks.size()].data.reserve(BGZF_BLOCK_SIZE);
+}
+
+void BGZFWriter::write(const char* src, size_t n) {
+  assert(!_closed);
+  while (n) {
+    vector<char>& data = _blocks[_next_fill % _blocks.size()].data;
+    size_t len = min(n, BGZF_BLOCK_SIZE - data.size());
+    data.insert(data.end(), src, src + len);
+    src += len;
+    n -= len;
+    if (data.size() == BGZF_BLOCK_SIZE) {
+      next_block();
+    }
+  }
+}
+
+void BGZFWriter::close() {
+  if (_threads.empty()) {
+    return;
+  }
+  {
+    boost::unique_lock<boost::mutex> lock(_mut);
+    if (!_blocks[_next_fill % _blocks.size()].data.empty()) {
+      _next_fill++;
+    }
+    _closed = true;
+  }
+  _block_full.notify_all();
+  _block_ready.notify_all();
+  foreach (boost::thread* t, _threads) {
+    t->join();
+    delete t;
+  }
+  _threads.clear();
+
+  _out.write((const char*)BGZF_EOF, sizeof(BGZF_EOF));
+  _out.close();
+  if (_out.fail()) {
+    logger.severe("Unable to write to output BAM file '%s'.",
+                  _file_name.c_str());
+  }
+}
@@ -0,0 +1,159 @@
+/**
+ *  bgzfwriter.h
+ *  express
+ *
+ *  Created by Adam Roberts on 10/14/12.
+ *  Copyright 2012 Adam Roberts. All rights reserved.
+ */
+
+#ifndef express_bgzfwriter_h
+#define express_bgzfwriter_h
+
+#include <boost/thread.hpp>
+#include <fstream>
+#include <string>
+#include <vector>
+
+/**
+ * A helper function that appends a little-endian 32-bit unsigned integer to a
+ * buffer.
+ * @param buff the buffer to append to.
+ * @param val the integer to append.
+ */
+inline void append_le_uint32(std::string& buff, size_t val) {
+  buff.push_back((char)(val & 0xff));
+  buff.push_back((char)((val >> 8) & 0xff));
+  buff.push_back((char)((val >> 16) & 0xff));
+  buff.push_back((char)((val >> 24) & 0xff));
+}
+
+/**
+ * The BGZFWriter class writes a sequential stream of uncompressed bytes to a
+ * BGZF-compressed file (such as a BAM file). The producer fills blocks, which
+ * worker threads deflate in parallel while a separate thread writes them to the
+ * file in order. The producer only blocks when all blocks of the bounded ring
+ * buffer are waiting to be compressed or written. The write and close methods
+ * must only be called by a single producer thread.
+ *  @author    Adam Roberts
+ *  @date      2012
+ *  @copyright Artistic License 2.0
+ **/
+class BGZFWriter {
+  /**
+   * The Block struct stores a single BGZF block in uncompressed and (once
+   * deflated) compressed form.
+   */
+  struct Block {
+    /**
+     * The uncompressed contents of the block.
+     */
+    std::vector<char> data;
+    /**
+     * The complete compressed block, including the header and the CRC32 and
+     * ISIZE footer. Only valid if ready.
+     */
+    std::vector<char> cdata;
+    /**
+     * True iff the block has been deflated and is ready to be written.
+     */
+    bool ready;
+    Block() : ready(false) {}
+  };
+  /**
+   * A private string storing the path to the BGZF file.
+   */
+  std::string _file_name;
+  /**
+   * A private output stream for the BGZF file. Only accessed by the writing
+   * thread until it is joined.
+   */
+  std::ofstream _out;
+  /**
+   * A private vector of Blocks used as a ring buffer. Block with sequence
+   * number i is stored at index i % _blocks.size().
+   */
+  std::vector<Block> _blocks;
+  /**
+   * A private size_t for the sequence number of the block being filled by the
+   * producer.
+   */
+  size_t _next_fill;
+  /**
+   * A private size_t for the sequence number of the next block to be deflated.
+   */
+  size_t _next_deflate;
+  /**
+   * A private size_t for the sequence number of the next block to be written to
+   * the file.
+   */
+  size_t _next_write;
+  /**
+   * A private bool that is true iff the producer has filled its last block.
+   */
+  bool _closed;
+  /**
+   * A private mutex protecting all block bookkeeping.
+   */
+  boost::mutex _mut;
+  /**
+   * A private condition variable notified when a block has been filled or the
+   * writer is closed.
+   */
+  boost::condition_variable _block_full;
+  /**
+   * A private condition variable notified when a block has been deflated or
+   * the writer is closed.
+   */
+  boost::condition_variable _block_ready;
+  /**
+   * A private condition variable notified when a block has been written.
+   */
+  boost::condition_variable _slot_free;
+  /**
+   * A private vector of pointers to the deflating threads and the writing
+   * thread.
+   */
+  std::vector<boost::thread*> _threads;
+  /**
+   * A private member function run by each worker thread that repeatedly
+   * deflates filled blocks until the writer is closed and all blocks have been
+   * deflated.
+   */
+  void deflate_blocks();
+  /**
+   * A private member function run by the writing thread that writes deflated
+   * blocks to the file in order until the writer is closed and all blocks have
+   * been written.
+   */
+  void write_blocks();
+  /**
+   * A private member function that passes the block being filled to the
+   * workers and waits until the next one is free.
+   */
+  void next_block();
+
+public:
+  /**
+   * BGZFWriter constructor opens the file and starts the worker threads.
+   * @param file_name the path to the BGZF file.
+   * @param num_threads the number of worker threads to deflate blocks with.
+   */
+  BGZFWriter(const std::string& file_name, size_t num_threads);
+  /**
+   * BGZFWriter destructor closes the writer if it has not been already.
+   */
+  ~BGZFWriter();
+  /**
+   * A member function that appends n uncompressed bytes to the stream.
+   * @param src a pointer to the bytes to append.
+   * @param n the number of bytes to append.
+   */
+  void write(const char* src, size_t n);
+  /**
+   * A member function that compresses and writes any remaining bytes, appends
+   * the BGZF end-of-file marker, and stops the worker threads.
+   */
+  void close();
+};
+
+#endif
@@ -89,25 +89,50 @@ SeqWeightTable::SeqWeightTable(size_t window_size, size_t order,
 
 
 void SeqWeightTable::copy_observed(const SeqWeightTable& other) {
+  _weight_cache.clear();
   _observed = other._observed;
 }
 
+void SeqWeightTable::add_observed(const SeqWeightTable& other) {
+  _weight_cache.clear();
+  _observed.add(other._observed);
+}
+
+void SeqWeightTable::clear_observed() {
+  _weight_cache.clear();
+  _observed.clear();
+}
+
 void SeqWeightTable::copy_expected(const SeqWeightTable& other) {
+  _weight_cache.clear();
   _expected = other._expected;
 }
 
+void SeqWeightTable::add_expected(const SeqWeightTable& other) {
+  _weight_cache.clear();
+  _expected.add(other._expected);
+}
+
+void SeqWeightTable::clear_expected() {
+  _weight_cache.clear();
+  _expected.clear();
+}
+
 void SeqWeightTable::increment_expected(const Sequence& seq, double mass,
                                         const vector<double>& fl_cdf) {
+  _weight_cache.clear();
   _expected.fast_learn(seq, mass, fl_cdf);
 }
 
 void SeqWeightTable::normalize_expected() {
+  _weight_cache.clear();
   _expected.calc_marginals();
 }
 
 void SeqWeightTable::increment_observed(const Sequence& seq, size_t i,
                                         double mass) {
   int left = (int)i - SURROUND;
+  _weight_cache.clear();
   _observed.update(seq, left, mass);
 }
 
@@ -116,6 +141,56 @@ double SeqWeightTable::get_weight(const Sequence& seq, size_t i) const {
   return _observed.seq_prob(seq, left) - _expected.seq_prob(seq, left);
 }
 
+double SeqWeightTable::get_weight(const Sequence& seq,
+                                  const vector<unsigned int>& kmers,
+                                  size_t i) const {
+  int left = (int)i - SURROUND;
+  int order = (int)_order;
+  // Windows starting within the first _order positions are conditioned on a
+  // shifted context by MarkovModel::seq_prob, so they are not cached.
+  if (_weight_cache.empty() || seq.prob() || (left > 0 && left < order)) {
+    return get_weight(seq, i);
+  }
+  assert(kmers.size() == seq.length());
+
+  // Windows overlapping the start of the sequence begin with a full context,
+  // and the uniform probabilities of the missing positions cancel.
+  const size_t num_kmers = _weight_cache.size() / WINDOW;
+  int p = (left > 0) ? 0 : order - left;
+  int end = min(WINDOW, (int)kmers.size() - left);
+  double v = 0;
+  for (; p < min(order, end); ++p) {
+    size_t kmer = kmers[left+p] & ((4U << (2*p)) - 1);
+    v += _weight_cache[p*num_kmers + kmer];
+  }
+  for (; p < end; ++p) {
+    v += _weight_cache[p*num_kmers + kmers[left+p]];
+  }
+  return v;
+}
+
+void SeqWeightTable::cache_weights() {
+  const size_t num_kmers = (size_t)1 << (2*(_order+1));
+  _weight_cache.resize(WINDOW*num_kmers);
+  for (size_t p = 0; p < (size_t)WINDOW; ++p) {
+    for (size_t k = 0; k < num_kmers; ++k) {
+      _weight_cache[p*num_kmers + k] =
+          _observed.transition_prob(p, k >> 2, k & 3) -
+          _expected.transition_prob(min(p, _order), k >> 2, k & 3);
+    }
+  }
+}
+
+double SeqWeightTable::weight_change(const SeqWeightTable& other) const {
+  assert(!_weight_cache.empty() &&
+         _weight_cache.size() == other._weight_cache.size());
+  double tot = 0;
+  for (size_t k = 0; k < _weight_cache.size(); ++k) {
+    tot += fabs(_weight_cache[k] - other._weight_cache[k]);
+  }
+  return tot / _weight_cache.size();
+}
+
 void SeqWeightTable::append_output(ofstream& outfile) const {
   char buff[200];
   string header = "";
@@ -199,11 +274,31 @@ void BiasBoss::copy_observations(const BiasBoss& other) {
   _3_seq_bias.copy_observed(other._3_seq_bias);
 }
 
+void BiasBoss::add_observations(const BiasBoss& other) {
+  _5_seq_bias.add_observed(other._5_seq_bias);
+  _3_seq_bias.add_observed(other._3_seq_bias);
+}
+
+void BiasBoss::clear_observations() {
+  _5_seq_bias.clear_observed();
+  _3_seq_bias.clear_observed();
+}
+
 void BiasBoss::copy_expectations(const BiasBoss& other) {
   _5_seq_bias.copy_expected(other._5_seq_bias);
   _3_seq_bias.copy_expected(other._3_seq_bias);
 }
 
+void BiasBoss::add_expectations(const BiasBoss& other) {
+  _5_seq_bias.add_expected(other._5_seq_bias);
+  _3_seq_bias.add_expected(other._3_seq_bias);
+}
+
+void BiasBoss::clear_expectations() {
+  _5_seq_bias.clear_expected();
+  _3_seq_bias.clear_expected();
+}
+
 void BiasBoss::update_expectations(const Target& targ, double mass,
                                    const vector<double>& fl_cdf) {
   if (mass == LOG_0) {
@@ -225,6 +320,16 @@ void BiasBoss::normalize_expectations() {
   _3_seq_bias.normalize_expected();
 }
 
+void BiasBoss::cache_weights() {
+  _5_seq_bias.cache_weights();
+  _3_seq_bias.cache_weights();
+}
+
+double BiasBoss::weight_change(const BiasBoss& other) const {
+  return (_5_seq_bias.weight_change(other._5_seq_bias) +
+          _3_seq_bias.weight_change(other._3_seq_bias)) / 2;
+}
+
 void BiasBoss::update_observed(const FragHit& hit, double normalized_mass)
 {
   assert (hit.pair_status() != PAIRED || (int)hit.length() > WINDOW);
@@ -250,11 +355,19 @@ double BiasBoss::get_target_bias(std::vector<float>& start_bias,
   const Sequence& t_seq_fwd = targ.seq(0);
   const Sequence& t_seq_rev = targ.seq(1);
 
+  vector<unsigned int> fwd_kmers;
+  vector<unsigned int> rev_kmers;
+  if (!t_seq_fwd.prob()) {
+    t_seq_fwd.kmer_indices(_order+1, fwd_kmers);
+    t_seq_rev.kmer_indices(_order+1, rev_kmers);
+  }
+
   for (size_t i = 0; i < targ.length(); ++i) {
-    start_bias[i] = _5_seq_bias.get_weight(t_seq_fwd, i);
-    end_bias[targ.length()-i-1] = _3_seq_bias.get_weight(t_seq_rev, i);
+    start_bias[i] = _5_seq_bias.get_weight(t_seq_fwd, fwd_kmers, i);
+    end_bias[targ.length()-i-1] = _3_seq_bias.get_weight(t_seq_rev, rev_kmers,
+                                                         i);
     tot_start = log_add(tot_start, start_bias[i]);
-    tot_end = log_add(tot_end, end_bias[i]);
+    tot_end = log_add(tot_end, end_bias[targ.length()-i-1]);
   }
 
   double avg_bias = (tot_start + tot_end) - (2*log((double)targ.length()));
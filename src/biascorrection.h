@@ -47,6 +47,12 @@ class SeqWeightTable {
    * targets.
    */
   MarkovModel _expected;
+  /**
+   * A private vector caching the bias weight (logged) contributed at each
+   * position of the window by each k-mer index of length _order+1, or empty if
+   * the parameters have changed since cache_weights was last called.
+   */
+  std::vector<double> _weight_cache;
 public:
   /**
    * SeqWeightTable Constructor.
@@ -77,12 +83,32 @@ public:
    * @param other another SeqWeightTable from which to copy the parameters.
    */
   void copy_observed(const SeqWeightTable& other);
+  /**
+   * A member function that adds the "observed" counts from another
+   * SeqWeightTable to this one.
+   * @param other another SeqWeightTable from which to add the counts.
+   */
+  void add_observed(const SeqWeightTable& other);
+  /**
+   * A member function that sets the "observed" counts to zero.
+   */
+  void clear_observed();
   /**
    * A member function that overwrites the "expected" parameters with those from
    * another SeqWeightTable.
    * @param other another SeqWeightTable from which to copy the parameters.
    */
   void copy_expected(const SeqWeightTable& other);
+  /**
+   * A member function that adds the "expected" counts from another
+   * SeqWeightTable to this one.
+   * @param other another SeqWeightTable from which to add the counts.
+   */
+  void add_expected(const SeqWeightTable& other);
+  /**
+   * A member function that sets the "expected" counts to zero.
+   */
+  void clear_expected();
   /**
    * A member function that increments the expected counts for a sliding window
    * through the given target sequence by some mass.
@@ -116,6 +142,34 @@ public:
    * @return The bias weight for the window.
    */
    double get_weight(const Sequence& seq, size_t i) const;
+  /**
+   * A member function that calculates the bias weight (logged) of a window
+   * using the k-mer indices of the sequence (see Sequence::kmer_indices) and
+   * the cached weights. Falls back to the above if the weights are not cached
+   * or the sequence is probabilistic.
+   * @param seq the target sequence.
+   * @param kmers the indices of the k-mers of length order+1 ending at each
+   *        position of the sequence.
+   * @param i the central point of the bias window, ie the fragment end.
+   * @return The bias weight for the window.
+   */
+   double get_weight(const Sequence& seq, const std::vector<unsigned int>& kmers,
+                     size_t i) const;
+  /**
+   * A member function that caches the bias weight of each k-mer at each
+   * position of the window based on the current parameters. The cache is
+   * discarded when the parameters are modified.
+   */
+  void cache_weights();
+  /**
+   * A member function that returns the mean absolute change between the cached
+   * bias weights of this table and another of the same order. The weights of
+   * both tables must be cached.
+   * @param other the SeqWeightTable to compare to.
+   * @return The mean absolute change in the (logged) weight of a k-mer at a
+   *         position of the window.
+   */
+  double weight_change(const SeqWeightTable& other) const;
   /**
    * A member function that appends the marginal and conditional probabilities
    * for the foreground and background Markov models to the given file,
@@ -181,12 +235,34 @@ public:
    * @param other a BiasBoss to copy the parameters from.
    */
   void copy_observations(const BiasBoss& other);
+  /**
+   * A member function that adds the observed counts from another BiasBoss to
+   * this one.
+   * @param other a BiasBoss to add the counts from.
+   */
+  void add_observations(const BiasBoss& other);
+  /**
+   * A member function that sets the observed counts to zero so that this
+   * BiasBoss can accumulate new observations to add to another.
+   */
+  void clear_observations();
   /**
    * A member function that copies the expected parameters from another
    * BiasBoss.
    * @param other a BiasBoss to copy the parameters from.
    */
   void copy_expectations(const BiasBoss& other);
+  /**
+   * A member function that adds the expected counts from another BiasBoss to
+   * this one.
+   * @param other a BiasBoss to add the counts from.
+   */
+  void add_expectations(const BiasBoss& other);
+  /**
+   * A member function that sets the expected counts to zero so that this
+   * BiasBoss can accumulate new expectations to add to another.
+   */
+  void clear_expectations();
   /**
    * A member function that updates the expectation parameters assuming uniform
    * abundance of and coverage accross the target's sequence.
@@ -200,6 +276,21 @@ public:
    * lower-ordered marginals.
    */
   void normalize_expectations();
+  /**
+   * A member function that caches the 5' and 3' bias weights of each k-mer so
+   * that get_target_bias can compute target bias from k-mer indices until the
+   * parameters are next modified.
+   */
+  void cache_weights();
+  /**
+   * A member function that returns the mean absolute change between the cached
+   * 5' and 3' bias weights of this table and another of the same order. The
+   * weights of both tables must be cached.
+   * @param other the BiasBoss to compare to.
+   * @return The mean absolute change in the (logged) weight of a k-mer at a
+   *         position of the window, averaged over both ends.
+   */
+  double weight_change(const BiasBoss& other) const;
   /**
    * A member function that updates the observed parameters given a fragment
    * mapping to a target and its logged probabilistic assignment value.
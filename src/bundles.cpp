@@ -8,24 +8,29 @@
 
 #include "bundles.h"
 
+#include <algorithm>
+
 #include "main.h"
 #include "targets.h"
 
 using namespace std;
 
-void CovarTable::increment(TargID targ1, TargID targ2, double incr_amt) {
-  size_t pair_id = size()*min(targ1, targ2)+max(targ1, targ2);
-  if (_covar_map.count(pair_id)) {
-    _covar_map[pair_id] = log_add(_covar_map[pair_id], incr_amt);
+void CovarRow::increment(TargID targ, double incr_amt) {
+  vector<TargID>::iterator it = lower_bound(_targs.begin(), _targs.end(), targ);
+  size_t i = it - _targs.begin();
+  if (it != _targs.end() && *it == targ) {
+    _covars[i] = log_add(_covars[i], incr_amt);
   } else {
-    _covar_map[pair_id] = incr_amt;
+    _targs.insert(it, targ);
+    _covars.insert(_covars.begin() + i, incr_amt);
   }
 }
 
-double CovarTable::get(TargID targ1, TargID targ2) {
-  size_t pair_id = size()*min(targ1, targ2)+max(targ1, targ2);
-  if (_covar_map.count(pair_id)) {
-    return _covar_map[pair_id];
+double CovarRow::get(TargID targ) const {
+  vector<TargID>::const_iterator it = lower_bound(_targs.begin(), _targs.end(),
+                                                  targ);
+  if (it != _targs.end() && *it == targ) {
+    return _covars[it - _targs.begin()];
   } else {
     return LOG_0;
   }
@@ -39,7 +44,7 @@ Bundle::Bundle(Target* targ)
 }
 
 size_t Bundle::size() const {
-  boost::unique_lock<boost::mutex>(_mut);
+  boost::unique_lock<boost::mutex> lock(_mut);
   if (_merged_into) {
     return _targets.size() + _merged_into->size();
   }
@@ -47,7 +52,7 @@ size_t Bundle::size() const {
 }
 
 void Bundle::incr_counts(size_t incr_amt) {
-  boost::unique_lock<boost::mutex>(_mut);
+  boost::unique_lock<boost::mutex> lock(_mut);
   if (_merged_into) {
     _merged_into->incr_counts(incr_amt);
   } else {
@@ -56,7 +61,7 @@ void Bundle::incr_counts(size_t incr_amt) {
 }
 
 void Bundle::incr_mass(double incr_amt) {
-  boost::unique_lock<boost::mutex>(_mut);
+  boost::unique_lock<boost::mutex> lock(_mut);
   if (_merged_into) {
     _merged_into->incr_mass(incr_amt);
   } else {
@@ -65,12 +70,12 @@ void Bundle::incr_mass(double incr_amt) {
 }
 
 void Bundle::reset_mass() {
-  boost::unique_lock<boost::mutex>(_mut);
+  boost::unique_lock<boost::mutex> lock(_mut);
   _mass = LOG_0;
 }
 
 size_t Bundle::counts() const {
-  boost::unique_lock<boost::mutex>(_mut);
+  boost::unique_lock<boost::mutex> lock(_mut);
   if (_merged_into) {
     return _merged_into->counts();
   }
@@ -78,7 +83,7 @@ size_t Bundle::counts() const {
 }
 
 double Bundle::mass() const {
-  boost::unique_lock<boost::mutex>(_mut);
+  boost::unique_lock<boost::mutex> lock(_mut);
   if (_merged_into) {
     return _merged_into->mass();
   }
@@ -103,13 +108,15 @@ Bundle* BundleTable::get_rep(Bundle* b) {
 
 Bundle* BundleTable::create_bundle(Target* targ) {
   Bundle* b = new Bundle(targ);
+  // Lazy targets are given bundles while others are being merged.
+  boost::unique_lock<boost::mutex> lock(_mut);
   _bundles.insert(b);
   return b;
 }
 
 Bundle* BundleTable::merge(Bundle* b1, Bundle* b2) {
   // Lock so that only one merge can happen at a time...
-  boost::unique_lock<boost::mutex>(_mut);
+  boost::unique_lock<boost::mutex> lock(_mut);
   
   b1 = get_rep(b1);
   b2 = get_rep(b2);
@@ -123,8 +130,8 @@ Bundle* BundleTable::merge(Bundle* b1, Bundle* b2) {
   
   if (_threadsafe_mode) {
     // Lock b1 and b2
-    boost::unique_lock<boost::mutex>(b1->_mut);
-    boost::unique_lock<boost::mutex>(b2->_mut);
+    boost::unique_lock<boost::mutex> lock1(b1->_mut);
+    boost::unique_lock<boost::mutex> lock2(b2->_mut);
     b1->_counts += b2->_counts;
     b1->_mass = log_add(b1->_mass, b2->_mass);
     b2->_counts = 0;
@@ -147,7 +154,7 @@ Bundle* BundleTable::merge(Bundle* b1, Bundle* b2) {
 
 void BundleTable::collapse() {
   // Lock
-  boost::unique_lock<boost::mutex>(_mut);
+  boost::unique_lock<boost::mutex> lock(_mut);
   
   BundleSet to_delete;
   foreach(Bundle* b, _bundles) {
@@ -16,52 +16,68 @@
 
 class Target;
 typedef size_t TargID;
-typedef boost::unordered_map<size_t, float> CovarMap;
-
 /**
- * The CovarTable is a sparse matrix for storing and updating pairwise
- * covariances between targets.
+ * The CovarRow class is a sparse row of the covariance matrix, storing the
+ * covariances between a single target and the targets it shares fragments
+ * with, sorted by TargID. Rows are owned by their Target and protected by its
+ * mutex, so that updates from different fragments do not contend.
  *  @author    Adam Roberts
  *  @date      2011
  *  @copyright Artistic License 2.0
  **/
-class CovarTable {
+class CovarRow {
+  /**
+   * A private vector of the TargIDs of the targets with non-zero covariance,
+   * in increasing order.
+   */
+  std::vector<TargID> _targs;
   /**
-   * A private map to look up the covariance for pairs of Targets by their
-   * combined hashed TargIDs. These values are stored positive and logged,
-   * even though the true covariances are negative.
+   * A private vector of the covariances with the targets in _targs. These
+   * values are stored positive and logged, even though the true covariances
+   * are negative.
    */
-  CovarMap _covar_map;
+  std::vector<float> _covars;
 
 public:
   /**
-   * CovarTable Constructor.
+   * CovarRow Constructor.
    */
-  CovarTable() {};
+  CovarRow() {};
   /**
-   * A member function that increases the covariance between two targets by the
+   * A member function that increases the covariance with a target by the
    * specified amount (logged). These values are stored positive even though
    * the true covariance is negative.
-   * @param targ1 one of the targets in the pair.
-   * @param targ2 the other target in the pair.
+   * @param targ the other target in the pair.
    * @param covar a double specifying the amount to increase the pair's
    *        covariance by (logged, positive).
    */
-  void increment(TargID targ1, TargID targ2, double covar);
+  void increment(TargID targ, double covar);
   /**
-   * A member function that returns the covariance between two targets.
+   * A member function that returns the covariance with a target.
    * The returned value will be the the negative of the true value (logged).
-   * @param targ1 one of the targets in the pair.
-   * @param targ2 the other target in the pair.
+   * @param targ the other target in the pair.
    * @return The negative of the pair's covariance (logged).
    */
-   double get(TargID targ1, TargID targ2);
+  double get(TargID targ) const;
   /**
-   * A member function that returns the number of pairs of targets with non-zero
+   * A member function that returns the number of targets with non-zero
    * covariance.
-   * @return The number of target pairs with non-zero covariance.
+   * @return The number of targets with non-zero covariance.
+   */
+  size_t size() const { return _targs.size(); }
+  /**
+   * An accessor for the TargID of the target at a given index of the row.
+   * @param i the index in the row.
+   * @return The TargID of the target at index i.
+   */
+  TargID targ(size_t i) const { return _targs[i]; }
+  /**
+   * An accessor for the covariance (logged, positive) at a given index of the
+   * row.
+   * @param i the index in the row.
+   * @return The negative of the covariance at index i (logged).
    */
-  size_t size() const { return _covar_map.size(); }
+  double covar(size_t i) const { return _covars[i]; }
 };
 
 class BundleTable;
@@ -0,0 +1,63 @@
+//
+//  equivclasses.cpp
+//  express
+//
+//  Created by Adam Roberts on 10/14/12.
+//  Copyright 2012 Adam Roberts. All rights reserved.
+//
+
+#include "equivclasses.h"
+#include "main.h"
+#include "fragments.h"
+#include "targets.h"
+#include <algorithm>
+#include <math.h>
+
+using namespace std;
+
+EquivClassTable::EquivClassTable() : _num_frags(0) {
+  _offsets.push_back(0);
+}
+
+void EquivClassTable::add_fragment(const Fragment& frag) {
+  assert(frag.num_hits());
+  _num_frags++;
+
+  // Posteriors are unchanged by adding a constant to all of the likelihoods,
+  // so store them relative to the most likely hit.
+  double max_likelihood = frag[0]->params()->align_likelihood;
+  for (size_t i = 1; i < frag.num_hits(); ++i) {
+    max_likelihood = max(max_likelihood, frag[i]->params()->align_likelihood);
+  }
+
+  _hit_buff.resize(frag.num_hits());
+  for (size_t i = 0; i < frag.num_hits(); ++i) {
+    const FragHit& hit = *frag[i];
+    double rel_likelihood = hit.params()->align_likelihood - max_likelihood;
+    _hit_buff[i].id = hit.target_id();
+    _hit_buff[i].likelihood = (long)floor(rel_likelihood/EQUIV_CLASS_PRECISION
+                                          + 0.5);
+    _hit_buff[i].targ = hit.target();
+  }
+  sort(_hit_buff.begin(), _hit_buff.end());
+
+  _key_buff.resize(_hit_buff.size());
+  for (size_t i = 0; i < _hit_buff.size(); ++i) {
+    _key_buff[i] = make_pair(_hit_buff[i].id, _hit_buff[i].likelihood);
+  }
+
+  boost::unordered_map<ClassKey, size_t>::iterator it =
+      _class_index.find(_key_buff);
+  if (it != _class_index.end()) {
+    _counts[it->second]++;
+    return;
+  }
+
+  _class_index[_key_buff] = _counts.size();
+  _counts.push_back(1);
+  foreach (const HitKey& hit, _hit_buff) {
+    _targets.push_back(hit.targ);
+    _likelihoods.push_back(hit.likelihood*EQUIV_CLASS_PRECISION);
+  }
+  _offsets.push_back(_targets.size());
+}
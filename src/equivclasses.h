@@ -0,0 +1,143 @@
+/**
+ *  equivclasses.h
+ *  express
+ *
+ *  Created by Adam Roberts on 10/14/12.
+ *  Copyright 2012 Adam Roberts. All rights reserved.
+ */
+
+#ifndef express_equivclasses_h
+#define express_equivclasses_h
+
+#include <boost/unordered_map.hpp>
+#include <utility>
+#include <vector>
+
+class Fragment;
+class Target;
+typedef size_t TargID;
+
+/**
+ * The step size used to quantize the (logged) alignment likelihoods of hits
+ * relative to the most likely hit of their fragment.
+ */
+const double EQUIV_CLASS_PRECISION = 1e-4;
+
+/**
+ * The EquivClassTable class collapses fragments into equivalence classes that
+ * are guaranteed to have the same posterior assignment probabilities during a
+ * round of batch EM. Two fragments are equivalent if they align to the same
+ * targets with the same alignment likelihoods, up to a shared constant and
+ * quantization by EQUIV_CLASS_PRECISION. This allows additional batch rounds to
+ * be run in memory once the auxiliary parameters are fixed, without re-parsing
+ * the input.
+ *  @author    Adam Roberts
+ *  @date      2012
+ *  @copyright Artistic License 2.0
+ **/
+class EquivClassTable {
+  /**
+   * The key identifying an equivalence class, made up of the id and quantized
+   * relative alignment likelihood of each hit in sorted order.
+   */
+  typedef std::vector<std::pair<TargID, long> > ClassKey;
+  /**
+   * The HitKey struct stores the key and target of a single hit for sorting.
+   */
+  struct HitKey {
+    TargID id;
+    long likelihood;
+    Target* targ;
+    bool operator<(const HitKey& other) const {
+      if (id != other.id) {
+        return id < other.id;
+      }
+      return likelihood < other.likelihood;
+    }
+  };
+  /**
+   * A private map to look up the index of an equivalence class by its key.
+   */
+  boost::unordered_map<ClassKey, size_t> _class_index;
+  /**
+   * A private vector storing, for each class, the index of its first hit in
+   * _targets and _likelihoods. Has one more element than the number of classes.
+   */
+  std::vector<size_t> _offsets;
+  /**
+   * A private vector of pointers to the target of each hit of all classes.
+   */
+  std::vector<Target*> _targets;
+  /**
+   * A private vector of the (logged) relative alignment likelihood of each hit
+   * of all classes.
+   */
+  std::vector<double> _likelihoods;
+  /**
+   * A private vector storing the number of fragments in each class.
+   */
+  std::vector<size_t> _counts;
+  /**
+   * A private size_t storing the total number of fragments added.
+   */
+  size_t _num_frags;
+  /**
+   * Private buffers reused between calls to add_fragment.
+   */
+  std::vector<HitKey> _hit_buff;
+  ClassKey _key_buff;
+
+public:
+  /**
+   * EquivClassTable constructor creates an empty table.
+   */
+  EquivClassTable();
+  /**
+   * A member function that adds a processed Fragment to its equivalence class,
+   * creating the class if it has not been seen before. The alignment
+   * likelihoods of the hits must already be set.
+   * @param frag the Fragment to add.
+   */
+  void add_fragment(const Fragment& frag);
+  /**
+   * An accessor for the number of equivalence classes.
+   * @return The number of equivalence classes.
+   */
+  size_t size() const { return _counts.size(); }
+  /**
+   * An accessor for the total number of fragments added to the table.
+   * @return The number of fragments added.
+   */
+  size_t num_frags() const { return _num_frags; }
+  /**
+   * An accessor for the number of hits of the fragments in a class.
+   * @param c the index of the class.
+   * @return The number of hits of the fragments in the class.
+   */
+  size_t num_hits(size_t c) const { return _offsets[c+1] - _offsets[c]; }
+  /**
+   * An accessor for the targets of the hits in a class, with hits to the same
+   * target consecutive. The returned array does not outlive this.
+   * @param c the index of the class.
+   * @return A pointer to the array of pointers to the targets of the hits.
+   */
+  Target* const* targets(size_t c) const { return &_targets[_offsets[c]]; }
+  /**
+   * An accessor for the (logged) alignment likelihoods of the hits in a class,
+   * relative to the most likely hit of the class. The returned array does not
+   * outlive this.
+   * @param c the index of the class.
+   * @return A pointer to the array of relative alignment likelihoods (logged).
+   */
+  const double* align_likelihoods(size_t c) const {
+    return &_likelihoods[_offsets[c]];
+  }
+  /**
+   * An accessor for the number of fragments in a class.
+   * @param c the index of the class.
+   * @return The number of fragments in the class.
+   */
+  size_t count(size_t c) const { return _counts[c]; }
+};
+
+#endif
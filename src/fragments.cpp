@@ -13,7 +13,7 @@
 
 using namespace std;
 
-Fragment::Fragment(Library* lib) : _lib(lib) {}
+Fragment::Fragment(Library* lib, FragPool* pool) : _lib(lib), _pool(pool) {}
 
 Fragment::~Fragment() {
   for (size_t i = 0; i < num_hits(); i++) {
@@ -36,7 +36,7 @@ bool Fragment::add_map_end(ReadHit* r)
   if (r->mate_l >= 0) {
     add_open_mate(r);
   } else {  // single-end fragment
-    _frag_hits.push_back(new FragHit(r));
+    _frag_hits.push_back((_pool) ? _pool->frag_hit(r) : new FragHit(r));
   }
 
   return true;
@@ -55,9 +55,9 @@ void Fragment::add_open_mate(ReadHit* nm) {
         nm->reversed != om->reversed) {
       FragHit* h = NULL;
 	    if (nm->left < om->left || (nm->left == om->left && om->reversed)) {
-        h = new FragHit(nm, om);
+        h = (_pool) ? _pool->frag_hit(nm, om) : new FragHit(nm, om);
       } else {
-        h = new FragHit(om, nm);
+        h = (_pool) ? _pool->frag_hit(om, nm) : new FragHit(om, nm);
       }
 
       found = true;
@@ -91,3 +91,129 @@ bool fraghit_compare(FragHit* h1, FragHit* h2) {
 void Fragment::sort_hits() {
   sort(_frag_hits.begin(), _frag_hits.end(), fraghit_compare);
 }
+
+FragPool::~FragPool() {
+  reclaim();
+  for (size_t i = 0; i < _frags.size(); ++i) {
+    delete _frags[i];
+  }
+  for (size_t i = 0; i < _hits.size(); ++i) {
+    delete _hits[i];
+  }
+  for (size_t i = 0; i < _reads.size(); ++i) {
+    delete _reads[i];
+  }
+}
+
+/**
+ * A helper function that moves all elements of src to the end of dst.
+ * @param src the vector to move the elements from, which is left empty.
+ * @param dst the vector to move the elements to.
+ */
+template <typename T>
+inline void move_all(vector<T*>& src, vector<T*>& dst) {
+  if (dst.empty()) {
+    dst.swap(src);
+  } else {
+    dst.insert(dst.end(), src.begin(), src.end());
+    src.clear();
+  }
+}
+
+void FragPool::reclaim() {
+  boost::unique_lock<boost::mutex> lock(_returned_mut);
+  move_all(_returned_frags, _frags);
+  move_all(_returned_hits, _hits);
+  move_all(_returned_reads, _reads);
+}
+
+Fragment* FragPool::fragment(Library* lib) {
+  if (_frags.empty()) {
+    reclaim();
+  }
+  if (_frags.empty()) {
+    return new Fragment(lib, this);
+  }
+  Fragment* f = _frags.back();
+  _frags.pop_back();
+  f->_lib = lib;
+  return f;
+}
+
+ReadHit* FragPool::read_hit() {
+  if (_reads.empty()) {
+    reclaim();
+  }
+  if (_reads.empty()) {
+    return new ReadHit();
+  }
+  ReadHit* r = _reads.back();
+  _reads.pop_back();
+  return r;
+}
+
+FragHit* FragPool::frag_hit(ReadHit* h) {
+  if (_hits.empty()) {
+    reclaim();
+  }
+  if (_hits.empty()) {
+    return new FragHit(h);
+  }
+  FragHit* fh = _hits.back();
+  _hits.pop_back();
+  fh->reset(h);
+  return fh;
+}
+
+FragHit* FragPool::frag_hit(ReadHit* l, ReadHit* r) {
+  if (_hits.empty()) {
+    reclaim();
+  }
+  if (_hits.empty()) {
+    return new FragHit(l, r);
+  }
+  FragHit* fh = _hits.back();
+  _hits.pop_back();
+  fh->reset(l, r);
+  return fh;
+}
+
+void FragPool::release(ReadHit* r) {
+  _reads.push_back(r);
+}
+
+void FragPool::recycle(Fragment* f, vector<Fragment*>& frags,
+                       vector<FragHit*>& hits, vector<ReadHit*>& reads) {
+  foreach (FragHit* fh, f->_frag_hits) {
+    if (fh->_read_l) {
+      reads.push_back(fh->_read_l);
+      fh->_read_l = NULL;
+    }
+    if (fh->_read_r) {
+      reads.push_back(fh->_read_r);
+      fh->_read_r = NULL;
+    }
+    hits.push_back(fh);
+  }
+  foreach (ReadHit* r, f->_open_mates) {
+    reads.push_back(r);
+  }
+  // Clearing keeps the capacity of the vectors and name for reuse.
+  f->_frag_hits.clear();
+  f->_open_mates.clear();
+  f->_name.clear();
+  f->_mass = 0;
+  f->_pool = this;
+  frags.push_back(f);
+}
+
+void FragPool::release(Fragment* f) {
+  recycle(f, _frags, _hits, _reads);
+}
+
+void FragPool::release_all(const vector<Fragment*>& frags) {
+  boost::unique_lock<boost::mutex> lock(_returned_mut);
+  foreach (Fragment* f, frags) {
+    recycle(f, _returned_frags, _returned_hits, _returned_reads);
+  }
+}
@@ -9,6 +9,7 @@
 #ifndef FRAGMENTS_H
 #define FRAGMENTS_H
 
+#include <boost/thread.hpp>
 #include <string>
 #include <vector>
 #include <iostream>
@@ -16,12 +17,12 @@
 #include <cassert>
 #include <api/BamAlignment.h>
 #include "sequence.h"
-#include "boost/scoped_ptr.hpp"
 
 typedef size_t TargID;
 struct Library;
 class Target;
 class TargetTable;
+class FragPool;
 
 /**
  * PairStatus enum.
@@ -147,43 +148,71 @@ class FragHit {
    * Private pointer to data for the upstream (left) read alignment (if it
    * exists). Pointer is deleted with this.
    */
-  boost::scoped_ptr<ReadHit> _read_l;
+  ReadHit* _read_l;
   /**
    * Private pointer to data for the downstream (right) read alignment (if it
    * exists). Pointer is deleted with this.
    */
-  boost::scoped_ptr<ReadHit> _read_r;
+  ReadHit* _read_r;
   /**
    * A private vector storing pointers to "neighboring" targets. This is being
    * used for an experimental feature and may be removed without notice.
    */
   std::vector<const Target*> _neighbors;
   HitParams _params;
-  
-public:
   /**
-   * FragHit constructor for single-end read.
+   * A private member function that resets the FragHit to hold the given
+   * single-end read. Any previously held reads must already be released.
    * @param h pointer to the ReadHit struct for the single-end read.
    */
-  FragHit(ReadHit* h) : _target(NULL) {
-    if (h->reversed) {
-      _read_r.reset(h);
-    } else {
-      _read_l.reset(h);
-    }
+  void reset(ReadHit* h) {
+    _target = NULL;
+    _neighbors.clear();
+    _read_l = (h->reversed) ? NULL : h;
+    _read_r = (h->reversed) ? h : NULL;
   }
   /**
-   * Fraghit constructor for paired-end read.
+   * A private member function that resets the FragHit to hold the given
+   * paired-end reads. Any previously held reads must already be released.
    * @param l pointer to the ReadHit struct for the upstream (left) read.
    * @param r pointer to the ReadHit struct for the downstream (right) read.
    */
-  FragHit(ReadHit* l, ReadHit* r) : _target(NULL), _read_l(l), _read_r(r) {
+  void reset(ReadHit* l, ReadHit* r) {
     assert(!l->reversed);
     assert(r->reversed);
     assert(l->name == r->name);
     assert(l->targ_id == r->targ_id);
     assert(l->left <= r->left);
     assert(l->first != r->first);
+    _target = NULL;
+    _neighbors.clear();
+    _read_l = l;
+    _read_r = r;
+  }
+  // FragHits own their reads and are not copyable.
+  FragHit(const FragHit&);
+  FragHit& operator=(const FragHit&);
+
+  friend class FragPool;
+
+public:
+  /**
+   * FragHit constructor for single-end read.
+   * @param h pointer to the ReadHit struct for the single-end read.
+   */
+  FragHit(ReadHit* h) { reset(h); }
+  /**
+   * Fraghit constructor for paired-end read.
+   * @param l pointer to the ReadHit struct for the upstream (left) read.
+   * @param r pointer to the ReadHit struct for the downstream (right) read.
+   */
+  FragHit(ReadHit* l, ReadHit* r) { reset(l, r); }
+  /**
+   * FragHit destructor deletes the ReadHit objects pointed to by the FragHit.
+   */
+  ~FragHit() {
+    delete _read_l;
+    delete _read_r;
   }
   /**
    * Accessor for the name of the fragment.
@@ -284,7 +313,7 @@ public:
    */
   const ReadHit* left_read() const {
     if (_read_l) {
-      return _read_l.get();
+      return _read_l;
     }
     return NULL;
   }
@@ -295,7 +324,7 @@ public:
    */
   const ReadHit* right_read() const {
     if (_read_r) {
-      return _read_r.get();
+      return _read_r;
     }
     return NULL;
   }
@@ -306,10 +335,10 @@ public:
    */
   const ReadHit* first_read() const {
     if (_read_l && _read_l->first) {
-      return _read_l.get();
+      return _read_l;
     }
     assert(_read_r);
-    return _read_r.get();
+    return _read_r;
   }
   /**
    * Const accessor for the alignment of the second read sequenced in
@@ -318,9 +347,9 @@ public:
    */
   const ReadHit* second_read() const {
     if (_read_l && !_read_l->first) {
-      return _read_l.get();
+      return _read_l;
     } else if (_read_r && !_read_r->first) {
-      return _read_r.get();
+      return _read_r;
     } else {
       return NULL;
     }
@@ -402,11 +431,22 @@ class Fragment {
    * forgetting factor during processing.
    */
   double _mass;
+  /**
+   * A private double for the mass of the Fragment within its library as
+   * determined by the forgetting factor, used to weight auxiliary parameter
+   * updates.
+   */
+  double _lib_mass;
   /**
    * A private pointer to the global variables associated with the library
    * this fragment is from.
    */
   Library* _lib;
+  /**
+   * A private pointer to the FragPool that new FragHits are taken from, or
+   * NULL if they should be allocated directly. Pointer outlives this.
+   */
+  FragPool* _pool;
   /**
    * A private method that searches for the mate of the given read mapping.
    * If found, the mates are combined into a single FragHit and added to
@@ -415,11 +455,15 @@ class Fragment {
    */
   void add_open_mate(ReadHit* om);
 
+  friend class FragPool;
+
 public:
   /**
    * Fragment Constructor.
+   * @param lib a pointer to the library the fragment is from.
+   * @param pool an optional pointer to the FragPool to take FragHits from.
    */
-  Fragment(Library* lib);
+  Fragment(Library* lib, FragPool* pool=NULL);
   /**
    * Fragment destructor deletes all FragHit and ReadHit objects pointed to by
    * the Fragment.
@@ -480,6 +524,18 @@ public:
    * @return The mass of the fragment.
    */
   double mass() const { return _mass; }
+  /**
+   * Mutator for the mass of the fragment within its library according to the
+   * forgetting factor.
+   * @param m a double representing the value to set to the library mass to.
+   */
+  void lib_mass(double m) { _lib_mass = m; }
+  /**
+   * An accessor for the mass of the fragment within its library according to
+   * the forgetting factor.
+   * @return The library mass of the fragment.
+   */
+  double lib_mass() const { return _lib_mass; }
   /**
    * A member function that sorts the FragHits by the TargID of the targets they
    * are aligned to.
@@ -497,4 +553,108 @@ public:
   }
 };
 
+/**
+ * The FragPool class recycles Fragment, FragHit, and ReadHit objects so that
+ * their strings and vectors keep their capacity across fragments and the
+ * parser does not need to allocate once it reaches a steady state. Objects
+ * must be taken and released by a single thread, except that batches of
+ * Fragments may also be returned from another thread with release_all. These
+ * are only reclaimed by the taking thread once its own objects run out, so
+ * that the lock is not taken for every object.
+ *  @author    Adam Roberts
+ *  @date      2012
+ *  @copyright Artistic License 2.0
+ **/
+class FragPool {
+  /**
+   * A private vector of released Fragments available for reuse.
+   */
+  std::vector<Fragment*> _frags;
+  /**
+   * A private vector of released FragHits (holding no reads) available for
+   * reuse.
+   */
+  std::vector<FragHit*> _hits;
+  /**
+   * A private vector of released ReadHits available for reuse.
+   */
+  std::vector<ReadHit*> _reads;
+  /**
+   * Private vectors of the objects returned from other threads with
+   * release_all but not yet reclaimed, protected by _returned_mut.
+   */
+  std::vector<Fragment*> _returned_frags;
+  std::vector<FragHit*> _returned_hits;
+  std::vector<ReadHit*> _returned_reads;
+  /**
+   * A private mutex protecting the returned objects.
+   */
+  boost::mutex _returned_mut;
+  /**
+   * A private member function that moves the given Fragment, along with all of
+   * its FragHits and ReadHits, to the given vectors of free objects.
+   * @param f a pointer to the Fragment to recycle.
+   * @param frags the vector of free Fragments.
+   * @param hits the vector of free FragHits.
+   * @param reads the vector of free ReadHits.
+   */
+  void recycle(Fragment* f, std::vector<Fragment*>& frags,
+               std::vector<FragHit*>& hits, std::vector<ReadHit*>& reads);
+  /**
+   * A private member function that moves the objects returned from other
+   * threads into the free objects of the taking thread.
+   */
+  void reclaim();
+
+public:
+  /**
+   * FragPool destructor deletes all objects held by the pool. Objects that
+   * have been taken but not released are not deleted.
+   */
+  ~FragPool();
+  /**
+   * A member function that returns an empty Fragment for the given library.
+   * The Fragment must be returned to the pool with release.
+   * @param lib a pointer to the library the fragment is from.
+   * @return A pointer to an empty Fragment.
+   */
+  Fragment* fragment(Library* lib);
+  /**
+   * A member function that returns a ReadHit whose fields may contain stale
+   * data from a previous read and must be overwritten by the caller.
+   * @return A pointer to a ReadHit.
+   */
+  ReadHit* read_hit();
+  /**
+   * A member function that returns a FragHit for the given single-end read.
+   * @param h pointer to the ReadHit struct for the single-end read.
+   * @return A pointer to a FragHit holding the read.
+   */
+  FragHit* frag_hit(ReadHit* h);
+  /**
+   * A member function that returns a FragHit for the given paired-end reads.
+   * @param l pointer to the ReadHit struct for the upstream (left) read.
+   * @param r pointer to the ReadHit struct for the downstream (right) read.
+   * @return A pointer to a FragHit holding the reads.
+   */
+  FragHit* frag_hit(ReadHit* l, ReadHit* r);
+  /**
+   * A member function that returns the given ReadHit to the pool.
+   * @param r a pointer to the ReadHit to release.
+   */
+  void release(ReadHit* r);
+  /**
+   * A member function that returns the given Fragment, along with all of its
+   * FragHits and ReadHits, to the pool.
+   * @param f a pointer to the Fragment to release.
+   */
+  void release(Fragment* f);
+  /**
+   * A thread-safe member function that returns the given Fragments, along with
+   * all of their FragHits and ReadHits, to the pool.
+   * @param frags the vector of pointers to the Fragments to release.
+   */
+  void release_all(const std::vector<Fragment*>& frags);
+};
+
 #endif
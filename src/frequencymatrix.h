@@ -9,6 +9,7 @@
  *  Copyright 2011 Adam Roberts. All rights reserved.
  **/
 
+#include <algorithm>
 #include <cassert>
 #include <vector>
 #include "main.h"
@@ -119,6 +120,16 @@ public:
    * @return The argmax of the distribution.
    */
   size_t argmax(size_t i) const;
+  /**
+   * A member function that returns the largest total variation distance
+   * between a distribution (row) of this matrix and the corresponding
+   * distribution of another matrix with the same dimensions. Rows without any
+   * mass in either matrix are skipped.
+   * @param other the FrequencyMatrix to compare to.
+   * @return The maximum over rows of half the sum of the absolute differences
+   *         of the (non-logged) normalized frequencies, between 0 and 1.
+   */
+  T max_total_variation(const FrequencyMatrix<T>& other) const;
   /**
    * A member function that converts the table between log-space and non-log
    * space. Does nothing if _fixed is true.
@@ -126,6 +137,17 @@ public:
    *        non-logged space.
    */
   void set_logged(bool logged);
+  /**
+   * A member function that adds the (unnormalized) counts of another
+   * FrequencyMatrix with the same dimensions and scale to this one. Has no
+   * effect if the matrix is fixed.
+   * @param other the FrequencyMatrix whose counts are added.
+   */
+  void add(const FrequencyMatrix<T>& other);
+  /**
+   * A member function that sets all counts in the (unfixed) matrix to zero.
+   */
+  void clear();
   /**
    * A member function that normalizes and "locks" the matrix values so that
    * no changes can be made. This allows for faster future lookups, but is
@@ -228,6 +250,52 @@ size_t FrequencyMatrix<T>::argmax(size_t i) const {
   return arg;
 }
 
+template <class T>
+T FrequencyMatrix<T>::max_total_variation(const FrequencyMatrix<T>& other)
+const {
+  assert(_M == other._M && _N == other._N);
+  T max_tv = 0;
+  for (size_t i = 0; i < _M; ++i) {
+    T sum = (_logged) ? sexp(_rowsums[i]) : _rowsums[i];
+    T other_sum = (other._logged) ? sexp(other._rowsums[i])
+                                  : other._rowsums[i];
+    if (sum == 0 || other_sum == 0) {
+      continue;
+    }
+    T tv = 0;
+    for (size_t j = 0; j < _N; ++j) {
+      T p = operator()(i, j);
+      T q = other(i, j);
+      tv += fabs(((_logged) ? sexp(p) : p) - ((other._logged) ? sexp(q) : q));
+    }
+    max_tv = std::max(max_tv, tv / 2);
+  }
+  return max_tv;
+}
+
+template <class T>
+void FrequencyMatrix<T>::add(const FrequencyMatrix<T>& other) {
+  if (_fixed) {
+    return;
+  }
+  assert(_M == other._M && _N == other._N && _logged == other._logged);
+  for (size_t k = 0; k < _M*_N; ++k) {
+    _array[k] = (_logged) ? log_add(_array[k], other._array[k])
+                          : _array[k] + other._array[k];
+  }
+  for (size_t i = 0; i < _M; ++i) {
+    _rowsums[i] = (_logged) ? log_add(_rowsums[i], other._rowsums[i])
+                            : _rowsums[i] + other._rowsums[i];
+  }
+}
+
+template <class T>
+void FrequencyMatrix<T>::clear() {
+  assert(!_fixed);
+  std::fill(_array.begin(), _array.end(), (_logged) ? LOG_0 : 0);
+  std::fill(_rowsums.begin(), _rowsums.end(), (_logged) ? LOG_0 : 0);
+}
+
 template <class T>
 void FrequencyMatrix<T>::fix() {
   if (_fixed) {
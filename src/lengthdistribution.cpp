@@ -123,6 +123,7 @@ void LengthDistribution::add_val(size_t len, double mass) {
   if (len < _min) {
     _min = len;
   }
+  clear_prefix_sums();
 
   size_t offset = len - _kernel.size()/2;
 
@@ -137,6 +138,80 @@ void LengthDistribution::add_val(size_t len, double mass) {
   }
 }
 
+void LengthDistribution::add(const LengthDistribution& other) {
+  assert(_hist.size() == other._hist.size());
+  for (size_t i = 0; i < _hist.size(); ++i) {
+    _hist[i] = log_add(_hist[i], other._hist[i]);
+  }
+  _sum = log_add(_sum, other._sum);
+  _tot_mass = log_add(_tot_mass, other._tot_mass);
+  _min = min(_min, other._min);
+  clear_prefix_sums();
+}
+
+double LengthDistribution::total_variation(const LengthDistribution& other)
+const {
+  assert(_hist.size() == other._hist.size());
+  double tv = 0;
+  for (size_t i = 0; i < _hist.size(); ++i) {
+    tv += fabs(sexp(_hist[i] - _tot_mass) -
+               sexp(other._hist[i] - other._tot_mass));
+  }
+  return tv / 2;
+}
+
+void LengthDistribution::clear() {
+  fill(_hist.begin(), _hist.end(), LOG_0);
+  _sum = LOG_0;
+  _tot_mass = LOG_0;
+  _min = _hist.size() - 1;
+  clear_prefix_sums();
+}
+
+void LengthDistribution::cache_prefix_sums() {
+  _cum_pmf.resize(max_val() + 1);
+  _cum_len_pmf.resize(max_val() + 1);
+  double cum = 0;
+  double cum_len = 0;
+  for (size_t l = 0; l <= max_val(); ++l) {
+    double p = sexp(pmf(l));
+    cum += p;
+    cum_len += l*p;
+    _cum_pmf[l] = cum;
+    _cum_len_pmf[l] = cum_len;
+  }
+}
+
+double LengthDistribution::effective_length(size_t len) const {
+  size_t min_l = min_val();
+  size_t max_l = min(len, max_val());
+  if (max_l < min_l) {
+    return LOG_0;
+  }
+
+  if (_cum_pmf.empty()) {
+    vector<double> terms(max_l - min_l + 1);
+    for(size_t l = min_l; l <= max_l; l++) {
+      terms[l - min_l] = pmf(l) + log((double)len - l + 1);
+    }
+    return log_sum_exp(&terms[0], terms.size());
+  }
+
+  // sum_{l=min_l}^{max_l} pmf(l)*(len-l+1) = (len+1)*P - S, where P and S are
+  // the sums of pmf(l) and l*pmf(l) over the range.
+  double p = _cum_pmf[max_l];
+  double s = _cum_len_pmf[max_l];
+  if (min_l > 0) {
+    p -= _cum_pmf[min_l - 1];
+    s -= _cum_len_pmf[min_l - 1];
+  }
+  double eff_len = (len + 1)*p - s;
+  if (eff_len <= 0) {
+    return LOG_0;
+  }
+  return log(eff_len);
+}
+
 double LengthDistribution::pmf(size_t len) const {
   len /= _bin_size;
   if (len > max_val()) {
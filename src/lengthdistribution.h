@@ -45,7 +45,26 @@ class LengthDistribution {
    * A size for internal binning of the lengths in the distribution.
    */
   size_t _bin_size;
-  
+  /**
+   * A private vector storing the cumulative (non-logged) probability of each
+   * length and all shorter lengths. Empty unless cache_prefix_sums has been
+   * called since the distribution was last modified.
+   */
+  std::vector<double> _cum_pmf;
+  /**
+   * A private vector storing the cumulative (non-logged) sum of the product of
+   * each length and its probability. Valid iff _cum_pmf is.
+   */
+  std::vector<double> _cum_len_pmf;
+  /**
+   * A private member function that discards the prefix sums after the
+   * distribution is modified.
+   */
+  void clear_prefix_sums() {
+    _cum_pmf.clear();
+    _cum_len_pmf.clear();
+  }
+
 public:
   /**
    * LengthDistribution Constructor.
@@ -120,6 +139,40 @@ public:
    * @return Total observation mass.
    */
   double tot_mass() const;
+  /**
+   * A member function that adds the observations of another
+   * LengthDistribution with the same range and binning to this one.
+   * @param other the LengthDistribution whose observations are added.
+   */
+  void add(const LengthDistribution& other);
+  /**
+   * A member function that returns the total variation distance between this
+   * distribution and another with the same range and binning.
+   * @param other the LengthDistribution to compare to.
+   * @return Half the sum of the absolute differences of the (non-logged)
+   *         probabilities of each bin, between 0 and 1.
+   */
+  double total_variation(const LengthDistribution& other) const;
+  /**
+   * A member function that removes all observations (and pseudo-counts) so
+   * that the distribution can accumulate new observations to add to another.
+   */
+  void clear();
+  /**
+   * A member function that computes prefix sums of the current distribution,
+   * allowing effective_length to be computed in constant time until the
+   * distribution is next modified.
+   */
+  void cache_prefix_sums();
+  /**
+   * A member function that returns the (logged) expected number of positions
+   * a fragment drawn from the distribution can start at in a target of the
+   * given length. Runs in constant time if cache_prefix_sums has been called
+   * since the distribution was last modified.
+   * @param len the length of the target.
+   * @return The (logged) sum of pmf(l)*(len-l+1) over lengths l up to len.
+   */
+  double effective_length(size_t len) const;
   /**
    * A member function that returns a string containing the current
    * distribution.
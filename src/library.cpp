@@ -0,0 +1,51 @@
+//
+//  library.cpp
+//  express
+//
+//  Created by Adam Roberts on 10/14/12.
+//  Copyright (c) 2012 Adam Roberts. All rights reserved.
+//
+
+#include "main.h"
+#include "biascorrection.h"
+#include "lengthdistribution.h"
+#include "mapparser.h"
+#include "mismatchmodel.h"
+#include "targets.h"
+#include "library.h"
+
+using namespace std;
+
+void Library::flush_aux_accumulators() const {
+  foreach (const boost::shared_ptr<AuxAccumulator>& accum, aux_accumulators) {
+    accum->flush(*this);
+  }
+}
+
+AuxAccumulator::AuxAccumulator(const Library& lib)
+    : fld(new LengthDistribution(*lib.fld)) {
+  fld->clear();
+  if (lib.mismatch_table) {
+    mismatch_table.reset(new MismatchTable(*lib.mismatch_table));
+    mismatch_table->clear();
+  }
+  if (lib.bias_table) {
+    bias_table.reset(new BiasBoss(*lib.bias_table));
+    bias_table->clear_observations();
+  }
+}
+
+AuxAccumulator::~AuxAccumulator() {}
+
+void AuxAccumulator::flush(const Library& lib) {
+  lib.fld->add(*fld);
+  fld->clear();
+  if (mismatch_table) {
+    lib.mismatch_table->add(*mismatch_table);
+    mismatch_table->clear();
+  }
+  if (bias_table) {
+    lib.bias_table->add_observations(*bias_table);
+    bias_table->clear_observations();
+  }
+}
@@ -10,7 +10,13 @@
 #define express_library_h
 
 #include <vector>
+#include "boost/scoped_ptr.hpp"
 #include "boost/shared_ptr.hpp"
+#include "boost/thread/tss.hpp"
+
+struct AuxAccumulator;
+class EquivClassTable;
+class SpillReader;
 
 /**
  * The Library struct holds pointers to the global parameter tables for a set of
@@ -60,10 +66,82 @@ struct Library {
    * The mass of the next read to be processed (logged).
    */
   double mass_n;
+  /**
+   * True when the auxiliary params of this library are finished burning in.
+   * This is primarily used to notify the processing and bias update threads
+   * to stop updating certain parameters. While the library is being
+   * processed, it is only read or written while holding the mutex protecting
+   * the auxiliary parameter tables, since the bias update thread may set it.
+   */
+  bool burned_out;
+  /**
+   * Pointers to the per-thread accumulators of burn-in updates to the auxiliary
+   * parameter tables, or empty if fragments are processed serially.
+   */
+  std::vector<boost::shared_ptr<AuxAccumulator> > aux_accumulators;
+  /**
+   * A pointer to the equivalence classes of the fragments in this library,
+   * used for additional batch rounds. NULL if they have not been collected.
+   */
+  boost::shared_ptr<EquivClassTable> equiv_classes;
+  /**
+   * A pointer to the reader for the spill file holding the processed fragments
+   * of this library, used for additional rounds. NULL if none was written.
+   */
+  boost::shared_ptr<SpillReader> spill;
   /**
    * Library constructor sets initial values for parameters
    */
-  Library() : n(1), mass_n(0) {};
+  Library() : n(1), mass_n(0), burned_out(false) {};
+  /**
+   * A member function that adds the counts held by all of the auxiliary
+   * parameter accumulators to the shared tables and clears the accumulators.
+   * The caller must prevent concurrent processing while this runs.
+   */
+  void flush_aux_accumulators() const;
+};
+
+/**
+ * The AuxAccumulator struct holds one processing thread's private counts for
+ * the auxiliary parameter tables (fragment length distribution, error model,
+ * and observed bias) of a Library during burn-in. This allows fragments to be
+ * processed in parallel while the shared tables are only read, with the counts
+ * added to the shared tables at synchronization points.
+ *  @author    Adam Roberts
+ *  @date      2012
+ *  @copyright Artistic License 2.0
+ */
+struct AuxAccumulator {
+  /**
+   * A pointer to the accumulated fragment length observations.
+   */
+  boost::scoped_ptr<LengthDistribution> fld;
+  /**
+   * A pointer to the accumulated error model counts, or NULL if the Library
+   * has no error model.
+   */
+  boost::scoped_ptr<MismatchTable> mismatch_table;
+  /**
+   * A pointer to the accumulated observed bias counts, or NULL if the Library
+   * has no bias model.
+   */
+  boost::scoped_ptr<BiasBoss> bias_table;
+  /**
+   * AuxAccumulator constructor creates empty tables with the same dimensions
+   * as those of the given Library.
+   * @param lib the Library whose tables will be accumulated for.
+   */
+  AuxAccumulator(const Library& lib);
+  /**
+   * AuxAccumulator destructor deletes the accumulator tables.
+   */
+  ~AuxAccumulator();
+  /**
+   * A member function that adds the accumulated counts to the tables of the
+   * given Library and clears them.
+   * @param lib the Library whose tables the counts are added to.
+   */
+  void flush(const Library& lib);
 };
 
 /**
@@ -82,6 +160,11 @@ class Librarian
    * The index of the library currently being processed.
    */
   size_t _curr;
+  /**
+   * The index of the library being processed by the calling thread, when
+   * libraries are processed concurrently. Overrides _curr if set.
+   */
+  boost::thread_specific_ptr<size_t> _thread_curr;
 
 public:
   /**
@@ -102,10 +185,14 @@ public:
   }
   /**
    * An accessor for the Library struct associated with the library currently
-   * being processed. Returned value does not outlive this.
-   * @return The Library struct indexed by _curr.
+   * being processed by the calling thread. Returned value does not outlive
+   * this.
+   * @return The Library struct indexed by the thread's index if set, or _curr.
    */
-  const Library& curr_lib() const { return _libs[_curr]; }
+  const Library& curr_lib() const {
+    const size_t* thread_curr = _thread_curr.get();
+    return _libs[(thread_curr) ? *thread_curr : _curr];
+  }
   /**
    * A mutator of the index of the library currently being processed.
    * @param i a size_t to set the index of the current Library struct to.
@@ -114,6 +201,22 @@ public:
     assert (i < _libs.size());
     _curr = i;
   }
+  /**
+   * A mutator of the index of the library being processed by the calling
+   * thread, which takes precedence over the global index for this thread.
+   * @param i a size_t to set the index of the thread's current Library to.
+   */
+  void set_thread_curr(size_t i) {
+    assert (i < _libs.size());
+    _thread_curr.reset(new size_t(i));
+  }
+  /**
+   * A mutator that clears the index of the library being processed by the
+   * calling thread, so that it follows the global index again.
+   */
+  void clear_thread_curr() {
+    _thread_curr.reset();
+  }
   /**
    * An accessor for the number of Library structs. This should be equal to the
    * number of libraries to be processed in the run.
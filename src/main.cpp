@@ -6,13 +6,15 @@
  *  Copyright 2011 Adam Roberts. All rights reserved.
  **/
 
+#include <boost/bind.hpp>
 #include <boost/unordered_map.hpp>
-#include <boost/unordered_set.hpp>
 #include <boost/filesystem.hpp>
 #include <boost/program_options.hpp>
 #include <boost/thread.hpp>
+#include <algorithm>
 #include <iostream>
 #include <iomanip>
+#include <iterator>
 #include <fstream>
 #include <stdio.h>
 #include <stdlib.h>
@@ -27,8 +29,12 @@
 #include "mapparser.h"
 #include "threadsafety.h"
 #include "robertsfilter.h"
-#include "directiondetector.h"
+#include "equivclasses.h"
+#include "spillfile.h"
 #include "library.h"
+#include "targetindex.h"
+#include "runstats.h"
+#include "taskscheduler.h"
 
 #ifdef PROTO
   #include PROTO_ALIGNMENT_INCL
@@ -47,6 +53,7 @@ namespace po = boost::program_options;
 namespace fs = boost::filesystem;
 
 Logger logger;
+RunStats run_stats;
 
 // the forgetting factor parameter controls the growth of the fragment mass
 double ff_param = 0.85;
@@ -55,7 +62,7 @@ double ff_param = 0.85;
 // error and bias models are applied to probabilistic assignment
 size_t burn_in = 100000;
 size_t burn_out = 5000000;
-bool burned_out = false;
+double burn_out_tolerance = 0;
 
 size_t max_read_len = 250;
 
@@ -70,6 +77,11 @@ string in_map_file_names = "";
 string param_file_name = "";
 string haplotype_file_name = "";
 
+// checkpoint parameters
+bool checkpoint = false;
+string resume_dir = "";
+string warm_start_dir = "";
+
 // intial pseudo-count parameters (non-logged)
 double expr_alpha = .005;
 double fld_alpha = 1;
@@ -94,15 +106,46 @@ bool output_align_prob = false;
 bool output_align_samp = false;
 bool output_running_rounds = false;
 bool output_running_reads = false;
+bool output_binary = false;
+bool concurrent_libs = false;
+bool lazy_targets = false;
 size_t num_threads = 2;
 size_t num_neighbors = 0;
 size_t library_size = 0;
 
+// pipeline queue parameters
+size_t frag_batch_size = 256;
+size_t frag_queue_size = 0;
+size_t bam_threads = 0;
+size_t bias_threads = 0;
+size_t output_threads = 0;
+
 // directional parameters
 Direction direction = BOTH;
 
 bool running = true;
 
+/**
+ * The ResumePoint struct stores the position of the online EM in the first
+ * round, as saved in a checkpoint.
+ */
+struct ResumePoint {
+  /**
+   * The number of fragments processed before the checkpoint, to be skipped.
+   */
+  size_t num_frags;
+  /**
+   * The number of the next fragment to be processed (starting at 1).
+   */
+  size_t n;
+  /**
+   * The (logged) mass of the next fragment to be processed.
+   */
+  double mass_n;
+  ResumePoint() : num_frags(0), n(1), mass_n(0) {}
+};
+ResumePoint resume_point;
+
 // used for multiple rounds of EM
 bool first_round = true;
 bool last_round = true;
@@ -143,6 +186,17 @@ AlphaMap* parse_priors(string in_file) {
   return alphas;
 };
 
+/**
+ * This function returns whether the online EM state can be saved to and
+ * restored from a checkpoint. The state of haplotype handlers and RDD
+ * detection is not saved, and fragments are only skipped in a single input.
+ * @return True iff checkpoints are supported for the run.
+ */
+bool checkpoint_supported() {
+  return haplotype_file_name == "" && !edit_detect &&
+         in_map_file_names.find(',') == string::npos;
+}
+
 /**
  * Parses argument options and sets variables appropriately.
  * @param ac number of arguments.
@@ -205,12 +259,29 @@ bool parse_options(int ac, char ** av) {
    po::value<size_t>(&max_indel_size)->default_value(max_indel_size),
    "sets the maximum allowed indel size, affecting geometric indel prior")
   ("calc-covar", "calculate and output covariance matrix")
+  ("concurrent-libs", "process multiple libraries at the same time in the "
+   "first round (requires --no-bias-correct)")
+  ("output-binary", "also output results in binary columnar form")
+  ("lazy-targets", "only load target sequences once they are aligned to, for "
+   "large sets of targets that are mostly unexpressed")
+  ("checkpoint", "periodically save the online EM state to 'checkpoint/' in "
+   "the output directory so that the run can be resumed")
+  ("resume", po::value<string>(&resume_dir)->default_value(resume_dir),
+   "path to a checkpoint directory to resume an interrupted run from")
+  ("warm-start",
+   po::value<string>(&warm_start_dir)->default_value(warm_start_dir),
+   "path to a checkpoint directory whose auxiliary parameters are used (fixed) "
+   "for a new sample, skipping burn-in")
   ("expr-alpha", po::value<double>(&expr_alpha)->default_value(expr_alpha),
    "sets the strength of the prior, per bp")
   ("stop-at", po::value<size_t>(&stop_at)->default_value(stop_at),
    "sets the number of fragments to process, disabled with 0")
   ("burn-out", po::value<size_t>(&burn_out)->default_value(burn_out),
    "sets number of fragments after which to stop updating auxiliary parameters")
+  ("burn-out-tolerance",
+   po::value<double>(&burn_out_tolerance)->default_value(burn_out_tolerance),
+   "stops updating auxiliary parameters before burn-out once they change by "
+   "less than this between synchronizations (0 = disabled)")
   ("no-bias-correct", "disables bias correction")
   ("no-error-model", "disables error modelling")
   ("aux-param-file",
@@ -224,6 +295,21 @@ bool parse_options(int ac, char ** av) {
   hidden.add_options()
   ("num-threads,p", po::value<size_t>(&num_threads)->default_value(num_threads),
    "number of threads (>= 2)")
+  ("frag-batch-size",
+   po::value<size_t>(&frag_batch_size)->default_value(frag_batch_size),
+   "number of fragments passed between pipeline stages at a time")
+  ("frag-queue-size",
+   po::value<size_t>(&frag_queue_size)->default_value(frag_queue_size),
+   "number of fragment batches buffered between pipeline stages (0 = auto)")
+  ("bam-threads", po::value<size_t>(&bam_threads)->default_value(bam_threads),
+   "number of threads used to decompress BAM input and compress BAM output "
+   "(0 = num-threads)")
+  ("bias-threads",
+   po::value<size_t>(&bias_threads)->default_value(bias_threads),
+   "number of threads used to update target bias (0 = num-threads)")
+  ("output-threads",
+   po::value<size_t>(&output_threads)->default_value(output_threads),
+   "number of threads used to compute output results (0 = num-threads)")
   ("edit-detect","")
   ("single-round", "")
   ("output-running-rounds", "")
@@ -274,18 +360,33 @@ bool parse_options(int ac, char ** av) {
          << "File Usage:  express [options] <target_seqs.fa> <hits.(sam/bam)>\n"
          << "Piped Usage: bowtie [options] -S <index> <reads.fq> | express "
          << "[options] <target_seqs.fa>\n\n"
+         << "Index Usage: express index <target_seqs.fa> [<target_seqs.xidx>]\n\n"
          << "Required arguments:\n"
-         << " <target_seqs.fa>     target sequence file in fasta format\n"
+         << " <target_seqs.fa>     target sequence file in fasta format, or a "
+         << "target index\n"
          << " <hits.(sam/bam)>     read alignment file in SAM or BAM format\n\n"
          << standard
          << advanced;
     return 1;
   }
 
+  checkpoint = vm.count("checkpoint");
+  if (resume_dir.size() && warm_start_dir.size()) {
+    logger.severe("Command-Line Argument Error: resume and warm-start options "
+                  "cannot be used together.");
+  }
+  string checkpoint_dir = (resume_dir.size()) ? resume_dir : warm_start_dir;
+  if (checkpoint_dir.size()) {
+    if (param_file_name.size()) {
+      logger.severe("Command-Line Argument Error: aux-param-file option cannot "
+                    "be used with a checkpoint.");
+    }
+    param_file_name = checkpoint_dir + "/params.xprs";
+  }
+
   if (param_file_name.size()) {
     burn_in = 0;
     burn_out = 0;
-    burned_out = true;
   }
   
   size_t stranded_count = 0;
@@ -321,6 +422,9 @@ bool parse_options(int ac, char ** av) {
   output_align_samp = vm.count("output-align-samp");
   output_running_rounds = vm.count("output-running-rounds");
   output_running_reads = vm.count("output-running-reads");
+  output_binary = vm.count("output-binary");
+  lazy_targets = vm.count("lazy-targets");
+  concurrent_libs = vm.count("concurrent-libs");
   batch_mode = vm.count("batch-mode");
   both = vm.count("both");
   remaining_rounds = max(additional_online, additional_batch);
@@ -336,6 +440,13 @@ bool parse_options(int ac, char ** av) {
     online_additional = true;
   }
   
+  if (concurrent_libs && bias_correct) {
+    // The target bias is shared by all libraries but can only be learned from
+    // one of them at a time.
+    logger.severe("Libraries cannot be processed concurrently with bias "
+                  "correction. Use '--no-bias-correct' to disable it.");
+  }
+
   if (output_align_prob && output_align_samp) {
     logger.severe("Cannot output both alignment probabilties and sampled "
                   "alignments.");
@@ -346,21 +457,53 @@ bool parse_options(int ac, char ** av) {
                 "alignments. Use the '-B' or '-O' option to enable.");
   }
   
+  if (bam_threads == 0) {
+    bam_threads = max(num_threads, (size_t)1);
+  }
+  if (bias_threads == 0) {
+    bias_threads = max(num_threads, (size_t)1);
+  }
+  if (output_threads == 0) {
+    output_threads = max(num_threads, (size_t)1);
+  }
+
   // We have 1 processing thread and 1 parsing thread always, so we should not
   // count these as additional threads.
   if (num_threads < 2) {
-    num_threads = 0;
+    num_threads = 2;
   }
   num_threads -= 2;
   if (num_threads > 0) {
     num_threads -= edit_detect;
   }
+  if (frag_batch_size == 0) {
+    logger.severe("Command-Line Argument Error: frag-batch-size must be "
+                  "positive.");
+  }
+  if (frag_queue_size == 0) {
+    frag_queue_size = max(2*num_threads, (size_t)4);
+  }
   if (remaining_rounds && in_map_file_names == "") {
     logger.severe("Cannot process multiple rounds from streaming input.");
   }
   if (remaining_rounds) {
     last_round = false;
   }
+  if (checkpoint && !checkpoint_supported()) {
+    logger.warn("Checkpoints are not supported with multiple input files, "
+                "haplotypes, or RDD detection. They will be disabled.");
+    checkpoint = false;
+  }
+  if (resume_dir.size()) {
+    if (!checkpoint_supported()) {
+      logger.severe("Cannot resume from a checkpoint with multiple input "
+                    "files, haplotypes, or RDD detection.");
+    }
+    if (output_align_prob || output_align_samp) {
+      logger.severe("Cannot resume from a checkpoint when outputting "
+                    "alignments.");
+    }
+  }
   if (prior_file != "") {
     expr_alpha_map = parse_priors(prior_file);
   }
@@ -374,6 +517,29 @@ bool parse_options(int ac, char ** av) {
   return 0;
 }
 
+/**
+ * A global uint64_t identifying a checkpoint state file and its version.
+ */
+const boost::uint64_t CHECKPOINT_MAGIC = 0x0100504B43525058ULL;
+
+/**
+ * This function writes the auxiliary parameters of a library to a file in the
+ * format read by the '--aux-param-file' option.
+ * @param lib the Library whose parameter tables are written.
+ * @param file_name the path to the file to write.
+ */
+void output_params(const Library& lib, const string& file_name) {
+  ofstream paramfile(file_name.c_str());
+  (lib.fld)->append_output(paramfile, "Fragment");
+  if (lib.mismatch_table) {
+    (lib.mismatch_table)->append_output(paramfile);
+  }
+  if (lib.bias_table) {
+    (lib.bias_table)->append_output(paramfile);
+  }
+  paramfile.close();
+}
+
 /**
  * This function writes the current abundance parameters to one file and the
  * auxiliary parameters for each library to a separate file.
@@ -397,7 +563,7 @@ void output_results(Librarian& libs, size_t tot_counts, int n=-1) {
     }
   }
   libs[0].targ_table->output_results(dir, tot_counts, last_round&calc_covar,
-                                     last_round&edit_detect);
+                                     last_round&edit_detect, output_binary);
 
   for (size_t l = 0; l < libs.size(); l++) {
     if (libs.size() > 1) {
@@ -405,16 +571,107 @@ void output_results(Librarian& libs, size_t tot_counts, int n=-1) {
     } else {
       sprintf(buff, "%s/params.xprs", dir.c_str());
     }
-    ofstream paramfile(buff);
-    (libs[l].fld)->append_output(paramfile, "Fragment");
-    if (libs[l].mismatch_table) {
-      (libs[l].mismatch_table)->append_output(paramfile);
-    }
-    if (libs[l].bias_table) {
-      (libs[l].bias_table)->append_output(paramfile);
-    }
-    paramfile.close();
+    output_params(libs[l], buff);
+  }
+}
+
+/**
+ * This function writes the online EM state of the first library to a
+ * checkpoint directory named 'checkpoint' in the output directory, from which
+ * the run can be resumed with the '--resume' option. The auxiliary parameters
+ * are written to 'params.xprs' and the position in the input and target state
+ * to 'state.ckpt' in native byte order. Both files are written to temporary
+ * names and renamed so that an interrupted write does not replace the previous
+ * checkpoint. Must only be called once the auxiliary parameters are burned
+ * out, while no fragments are being processed.
+ * @param libs a Librarian containing the parameters tables for each Library.
+ * @param n the number of the next fragment to be processed (starting at 1).
+ * @param mass_n the (logged) mass of the next fragment to be processed.
+ * @param num_frags the number of fragments processed in this round.
+ */
+void write_checkpoint(Librarian& libs, size_t n, double mass_n,
+                      size_t num_frags) {
+  const Library& lib = libs[0];
+  string dir = output_dir + "/checkpoint";
+  try {
+    fs::create_directories(dir);
+  } catch (fs::filesystem_error& e) {
+    logger.severe(e.what());
+  }
+
+  string params_file_name = dir + "/params.xprs";
+  output_params(lib, params_file_name + ".tmp");
+
+  string buff;
+  buff.append((const char*)&CHECKPOINT_MAGIC, sizeof(CHECKPOINT_MAGIC));
+  boost::uint64_t header[] = {num_frags, n, lib.n};
+  buff.append((const char*)header, sizeof(header));
+  double masses[] = {mass_n, lib.mass_n};
+  buff.append((const char*)masses, sizeof(masses));
+  lib.targ_table->save_state(buff);
+
+  string state_file_name = dir + "/state.ckpt";
+  ofstream state_file((state_file_name + ".tmp").c_str(),
+                      ios::out | ios::binary | ios::trunc);
+  state_file.write(buff.data(), buff.size());
+  state_file.close();
+  if (!state_file) {
+    logger.severe("Unable to write checkpoint file '%s'.",
+                  state_file_name.c_str());
+  }
+  try {
+    fs::rename(params_file_name + ".tmp", params_file_name);
+    fs::rename(state_file_name + ".tmp", state_file_name);
+  } catch (fs::filesystem_error& e) {
+    logger.severe(e.what());
+  }
+  logger.info("Wrote checkpoint after %d fragments.", num_frags);
+}
+
+/**
+ * This function restores the online EM state of the first library and the
+ * position in the input from the checkpoint directory given by '--resume'.
+ * @param libs a Librarian containing the parameters tables for each Library,
+ *        whose TargetTable has just been constructed.
+ */
+void read_checkpoint(Librarian& libs) {
+  Library& lib = libs[0];
+  string state_file_name = resume_dir + "/state.ckpt";
+  ifstream state_file(state_file_name.c_str(), ios::in | ios::binary);
+  if (!state_file.is_open()) {
+    logger.severe("Unable to open checkpoint file '%s'.",
+                  state_file_name.c_str());
+  }
+  string buff((istreambuf_iterator<char>(state_file)),
+              istreambuf_iterator<char>());
+  boost::uint64_t magic = 0;
+  boost::uint64_t header[3];
+  double masses[2];
+  const size_t header_size = sizeof(magic) + sizeof(header) + sizeof(masses);
+  if (buff.size() > header_size) {
+    memcpy(&magic, buff.data(), sizeof(magic));
+  }
+  if (magic != CHECKPOINT_MAGIC) {
+    logger.severe("'%s' is not a valid checkpoint file.",
+                  state_file_name.c_str());
+  }
+  memcpy(header, buff.data() + sizeof(magic), sizeof(header));
+  memcpy(masses, buff.data() + sizeof(magic) + sizeof(header), sizeof(masses));
+  resume_point.num_frags = header[0];
+  resume_point.n = header[1];
+  resume_point.mass_n = masses[0];
+  lib.n = header[2];
+  lib.mass_n = masses[1];
+
+  const char* p = buff.data() + header_size;
+  const char* end = buff.data() + buff.size();
+  lib.targ_table->load_state(p, end);
+  if (p != end) {
+    logger.severe("'%s' is not a valid checkpoint file.",
+                  state_file_name.c_str());
   }
+  logger.info("Resuming from checkpoint after %d fragments.",
+              resume_point.num_frags);
 }
 
 /**
@@ -423,18 +680,25 @@ void output_results(Librarian& libs, size_t tot_counts, int n=-1) {
  * fragment is divided based on the normalized marginals to update the model
  * parameters.
  * @param frag_p pointer to the fragment to probabilistically assign.
+ * @param locks a reference to a scratch vector used to store the indices of the
+ *        Target locks held. Reused between calls to avoid allocation.
+ * @param aux pointer to the accumulator for auxiliary parameter updates, or
+ *        NULL if they should be made directly to the library tables.
  */
 /// @brief processing階段
-void process_fragment(Fragment* frag_p) {
+void process_fragment(Fragment* frag_p, vector<size_t>& locks,
+                      AuxAccumulator* aux=NULL) {
   Fragment& frag = *frag_p;
   const Library& lib = *frag.lib();
+  const double lib_mass = frag.lib_mass();
 
-  // sort hits to avoid deadlock
+  // sort hits so that hits to the same target are consecutive
   frag.sort_hits();
   double mass_n = frag.mass();
 
   assert(frag.num_hits());
 
+  vector<double> likelihoods(frag.num_hits(), LOG_0);
   vector<double> masses(frag.num_hits(), 0);
   vector<double> variances(frag.num_hits(), 0);
   double total_likelihood = LOG_0;
@@ -442,15 +706,36 @@ void process_fragment(Fragment* frag_p) {
   double total_variance = LOG_0;
   size_t num_solvable = 0;
 
-  // set of locked targets
-  boost::unordered_set<const Target*> targ_set;
-  boost::unordered_set<const Target*> locked_set;
+  // Lock the targets and their neighbors. The locks are taken in increasing
+  // index order, and only once each, to avoid deadlock.
+  locks.clear();
+  size_t num_targs = 0;
+  for (size_t i = 0; i < frag.num_hits(); ++i) {
+    const FragHit& m = *frag.hits()[i];
+    if (i == 0 || frag[i-1]->target_id() != m.target_id()) {
+      num_targs++;
+    }
+    locks.push_back(Target::lock_index(m.target_id()));
+    foreach (const Target* neighbor, *m.neighbors()) {
+      locks.push_back(Target::lock_index(neighbor->id()));
+    }
+  }
+  sort(locks.begin(), locks.end());
+  locks.erase(unique(locks.begin(), locks.end()), locks.end());
+  foreach (size_t k, locks) {
+    // Only contended acquisitions are timed.
+    if (!Target::try_lock_by_index(k)) {
+      Stopwatch wait;
+      Target::lock_by_index(k);
+      run_stats.target_lock_wait.add(wait.elapsed());
+    }
+  }
 
   // Update bundles and merge in first loop
   Bundle* bundle = frag.hits()[0]->target()->bundle();
   
   if (frag.num_hits() > 1) {
-    // Calculate marginal likelihoods and lock targets.
+    // Calculate marginal likelihoods.
     for (size_t i = 0; i < frag.num_hits(); ++i) {
       FragHit& m = *frag.hits()[i];
       Target* t = m.target();
@@ -459,18 +744,6 @@ void process_fragment(Fragment* frag_p) {
       bundle = lib.targ_table->merge_bundles(bundle, t->bundle());
       t->bundle(bundle);
       
-      if (locked_set.count(t) == 0) {
-        t->lock();
-        locked_set.insert(t);
-      }
-      targ_set = locked_set;
-      // lock neighbors
-      foreach (const Target* neighbor, *m.neighbors()) {
-        if (locked_set.count(neighbor) == 0) {
-          neighbor->lock();
-          locked_set.insert(neighbor);
-        }
-      }
       /// @brief align_likelihood 是 Pr(l)*Pr(a)*Pr(bias)
       m.params()->align_likelihood = t->align_likelihood(m);
 
@@ -478,36 +751,28 @@ void process_fragment(Fragment* frag_p) {
       m.params()->full_likelihood = m.params()->align_likelihood +
                                     t->sample_likelihood(first_round,
                                                          m.neighbors());
+      likelihoods[i] = m.params()->full_likelihood;
       masses[i] = t->mass();
       variances[i] = t->mass_var();
-      total_likelihood = log_add(total_likelihood, m.params()->full_likelihood);
-      total_mass = log_add(total_mass, masses[i]);
-      total_variance = log_add(total_variance, variances[i]);
       num_solvable += t->solvable();
-      assert(!isnan(total_likelihood));
     }
+    total_likelihood = log_sum_exp(&likelihoods[0], frag.num_hits());
+    total_mass = log_sum_exp(&masses[0], frag.num_hits());
+    total_variance = log_sum_exp(&variances[0], frag.num_hits());
+    assert(!isnan(total_likelihood));
   } else {
     FragHit& m = *frag.hits()[0];
-    Target* t = m.target();
-    t->lock();
-    locked_set.insert(t);
     total_likelihood = 0;
     m.params()->align_likelihood = 0;
     m.params()->full_likelihood = 0;
-    foreach (const Target* neighbor, *frag.hits()[0]->neighbors()) {
-      if (targ_set.count(neighbor) == 0) {
-        neighbor->lock();
-        locked_set.insert(neighbor);
-      }
-    }
   }
 
   if (islzero(total_likelihood)){
     assert(expr_alpha_map);
     logger.warn("Fragment '%s' has 0 likelihood of originating from the "
                 "transcriptome. Skipping...", frag.name().c_str());
-    foreach (const Target* t, locked_set) {
-      t->unlock();
+    foreach (size_t k, locks) {
+      Target::unlock_by_index(k);
     }
     return;
   }
@@ -526,7 +791,7 @@ void process_fragment(Fragment* frag_p) {
     
     double p = m.params()->full_likelihood-total_likelihood;
     m.params()->posterior = p;
-    if (targ_set.size() > 1) {
+    if (num_targs > 1) {
       double v = log_add(variances[i] - 2*total_mass,
                   total_variance + 2*masses[i] - 4*total_mass);
       t->add_hit(m, v, mass_n);
@@ -539,25 +804,31 @@ void process_fragment(Fragment* frag_p) {
       double r = rand()/double(RAND_MAX);
       
       if (i == 0 || frag[i-1]->target_id() != t->id()) {
-        t->incr_counts(targ_set.size() <= 1);
+        t->incr_counts(num_targs <= 1);
       }
       if (!t->solvable() && num_solvable == frag.num_hits()-1) {
         t->solvable(true);
       }
       if (edit_detect && lib.mismatch_table) {
-        (lib.mismatch_table)->update(m, p, lib.mass_n);
+        MismatchTable& mm_accum = (aux) ? *aux->mismatch_table :
+                                          *lib.mismatch_table;
+        (lib.mismatch_table)->update(m, p, lib_mass, mm_accum);
       }
 
       /// @brief 5千~5百萬不斷更新3個model
-      if (!burned_out && r < sexp(p)) {
+      if (!lib.burned_out && r < sexp(p)) {
         if (lib.mismatch_table && !edit_detect) {
-          (lib.mismatch_table)->update(m, LOG_1, lib.mass_n);
+          MismatchTable& mm_accum = (aux) ? *aux->mismatch_table :
+                                            *lib.mismatch_table;
+          (lib.mismatch_table)->update(m, LOG_1, lib_mass, mm_accum);
         }
         if (m.pair_status() == PAIRED) {
-          (lib.fld)->add_val(m.length(), lib.mass_n);
+          LengthDistribution& fld_accum = (aux) ? *aux->fld : *lib.fld;
+          fld_accum.add_val(m.length(), lib_mass);
         }
         if (lib.bias_table) {
-          (lib.bias_table)->update_observed(m, lib.mass_n);
+          BiasBoss& bias_accum = (aux) ? *aux->bias_table : *lib.bias_table;
+          bias_accum.update_observed(m, lib_mass);
         }
       }
     }
@@ -576,178 +847,868 @@ void process_fragment(Fragment* frag_p) {
     }
   }
 
-  foreach (const Target* t, locked_set) {
-    t->unlock();
+  foreach (size_t k, locks) {
+    Target::unlock_by_index(k);
   }
 }
 
 /**
- * This function processes Fragments asynchronously. Fragments are popped from
- * a threadsafe input queue, processed, and then pushed onto a threadsafe output
- * queue.
- * @param pts pointer to a struct with the input and output Fragment queues.
+ * This function returns whether additional rounds can be run from saved hit
+ * likelihoods (spill files) instead of re-parsing the input. This requires
+ * that posteriors depend only on the targets and alignment likelihoods of the
+ * hits.
+ * @return True iff fragments can be replayed from their saved likelihoods.
  */
-void proc_thread(ParseThreadSafety* pts) {
-  while (true) {
-    Fragment* frag = pts->proc_on.pop();
-    if (!frag) {
-      break;
+bool replay_supported() {
+  return num_neighbors == 0 && haplotype_file_name == "";
+}
+
+/**
+ * This function returns whether additional batch rounds can be run over
+ * equivalence classes of fragments instead of re-parsing the input.
+ * @return True iff fragments can be collapsed into equivalence classes.
+ */
+bool equiv_classes_supported() {
+  return replay_supported() && !edit_detect;
+}
+
+/**
+ * This function probabilistically assigns the mass of one or more identical
+ * fragments whose alignment likelihoods are already known, as process_fragment
+ * does after the first round. Used for rounds that do not re-parse the input.
+ * Concurrent calls must either assign to disjoint sets of targets or hold the
+ * Target locks of the hits.
+ * @param lib the Library the fragments are from.
+ * @param targets pointers to the targets of the hits, with hits to the same
+ *        target consecutive.
+ * @param align_likelihoods the (logged) alignment likelihoods of the hits, up
+ *        to a shared constant.
+ * @param num_hits the number of hits of each fragment.
+ * @param mass_n the (logged) mass of each fragment.
+ * @param log_count the (logged) number of fragments.
+ * @param buff a reference to a scratch vector reused between calls to avoid
+ *        allocation.
+ * @param fpb_incr a pointer to a (logged) sum to add the increase in total mass
+ *        per base to in place of the TargetTable, or NULL.
+ * @return True iff the fragments have a non-zero likelihood.
+ */
+bool assign_hits(const Library& lib, Target* const* targets,
+                 const double* align_likelihoods, size_t num_hits,
+                 double mass_n, double log_count, vector<double>& buff,
+                 double* fpb_incr=NULL) {
+  buff.assign(3*num_hits, LOG_0);
+  double* likelihoods = &buff[0];
+  double* masses = likelihoods + num_hits;
+  double* variances = masses + num_hits;
+  size_t num_targs = 0;
+
+  for (size_t i = 0; i < num_hits; ++i) {
+    const Target* t = targets[i];
+    if (i == 0 || targets[i-1] != t) {
+      num_targs++;
+    }
+    if (num_hits > 1) {
+      likelihoods[i] = align_likelihoods[i] +
+                       t->sample_likelihood(first_round, NULL);
+      masses[i] = t->mass();
+      variances[i] = t->mass_var();
+    } else {
+      likelihoods[i] = LOG_1;
+    }
+  }
+  double total_likelihood = log_sum_exp(likelihoods, num_hits);
+  double total_mass = log_sum_exp(masses, num_hits);
+  double total_variance = log_sum_exp(variances, num_hits);
+
+  if (islzero(total_likelihood)) {
+    return false;
+  }
+
+  if (online_additional) {
+    targets[0]->bundle()->incr_mass(mass_n + log_count);
+  }
+
+  for (size_t i = 0; i < num_hits; ++i) {
+    Target* t = targets[i];
+    double p = likelihoods[i] - total_likelihood;
+    if (num_targs > 1) {
+      double v = log_add(variances[i] - 2*total_mass,
+                         total_variance + 2*masses[i] - 4*total_mass);
+      t->add_mass(p, v, mass_n, log_count, fpb_incr);
+    } else if (i == 0) {
+      t->add_mass(p, LOG_0, mass_n, log_count, fpb_incr);
+    }
+
+    if (calc_covar && (last_round || online_additional)) {
+      double var = 2*mass_n + p + log_sub(LOG_1, p) + log_count;
+      lib.targ_table->update_covar(t->id(), t->id(), var);
+      for (size_t j = i+1; j < num_hits; ++j) {
+        double p2 = likelihoods[j] - total_likelihood;
+        if (sexp(p2) == 0) {
+          continue;
+        }
+        double covar = 2*mass_n + p + p2 + log_count;
+        lib.targ_table->update_covar(t->id(), targets[j]->id(), covar);
+      }
     }
-    process_fragment(frag); /// @brief proc_on的東西拿出來processing 
-    pts->proc_out.push(frag); /// @brief processing完畢放進proc_out等待post_processing
   }
+  return true;
 }
 
 /**
- * This is the driver function for the main processing thread. This function
- * updates the current fragment mass for libraries, dispatches fragments to be
- * processed once they are passed by the parsing thread, outputs intermediate
- * results, and handles additional online rounds.
- * @param libs a struct containing pointers to the parameter tables (bias_table,
- *        mismatch_table, fld) and parser for all libraries being processed.
+ * The number of hits of the equivalence classes assigned by each batch EM task.
+ * Bundles with fewer hits are packed together into tasks, and larger bundles
+ * are split across several.
+ */
+const size_t EM_TASK_HITS = 1 << 14;
+
+/**
+ * This function is run as a TaskScheduler task to assign a range of the
+ * equivalence classes of a library during a round of batch EM.
+ * @param lib a pointer to the Library the classes are from.
+ * @param order a pointer to the indices of the classes, grouped by bundle.
+ * @param begin the position in order of the first class to assign.
+ * @param end the position in order after the last class to assign.
+ * @param lock a bool that is true iff other tasks may assign classes of the
+ *        same bundle, so that the Target locks must be held for each class.
+ * @param fpb_incr a pointer to the (logged) sum to add the increase in total
+ *        mass per base to.
+ * @param w the index of the worker running the task (unused).
+ */
+void assign_equiv_classes(const Library* lib, const vector<size_t>* order,
+                          size_t begin, size_t end, bool lock,
+                          double* fpb_incr, size_t w) {
+  const EquivClassTable& classes = *lib->equiv_classes;
+  vector<double> buff;
+  vector<size_t> locks;
+
+  for (size_t k = begin; k < end; ++k) {
+    size_t c = (*order)[k];
+    Target* const* targets = classes.targets(c);
+    if (lock) {
+      // As in process_fragment, the locks are taken in increasing index order
+      // and only once each to avoid deadlock.
+      locks.clear();
+      for (size_t i = 0; i < classes.num_hits(c); ++i) {
+        locks.push_back(Target::lock_index(targets[i]->id()));
+      }
+      sort(locks.begin(), locks.end());
+      locks.erase(unique(locks.begin(), locks.end()), locks.end());
+      foreach (size_t i, locks) {
+        Target::lock_by_index(i);
+      }
+    }
+    if (!assign_hits(*lib, targets, classes.align_likelihoods(c),
+                     classes.num_hits(c), LOG_1, log((double)classes.count(c)),
+                     buff, fpb_incr)) {
+      logger.warn("%d fragments have 0 likelihood of originating from the "
+                  "transcriptome. Skipping...", classes.count(c));
+    }
+    if (lock) {
+      foreach (size_t i, locks) {
+        Target::unlock_by_index(i);
+      }
+    }
+  }
+}
+
+/**
+ * This function runs a round of batch EM over the equivalence classes collected
+ * for each library during a previous round, in place of re-parsing the input.
+ * Each class is assigned as a single one of its fragments would be, weighted by
+ * the number of fragments in the class. The targets of a class are all in one
+ * bundle, and the assignments only depend on the parameters of the previous
+ * round, so the classes are grouped by bundle and assigned by num_threads
+ * workers with a TaskScheduler. Bundles with few hits are packed into tasks of
+ * about EM_TASK_HITS hits and larger bundles are split across several tasks,
+ * which then hold the Target locks. Bundle sizes are highly skewed, so idle
+ * workers steal the remaining tasks of busy ones.
+ * @param libs a struct containing pointers to the parameter tables and
+ *        equivalence classes for all libraries being processed.
  * @return The total number of fragments processed.
  */
-size_t threaded_calc_abundances(Librarian& libs) {
-  logger.info("Processing input fragment alignments...");
-  boost::scoped_ptr<boost::thread> bias_update;
+size_t process_equiv_classes(Librarian& libs) {
+  size_t num_frags = 0;
+
+  for (size_t l = 0; l < libs.size(); l++) {
+    Library& lib = libs[l];
+    libs.set_curr(l);
+    const EquivClassTable& classes = *lib.equiv_classes;
+
+    // Group the classes by bundle, keeping their order within each bundle so
+    // that the mass of each target is accumulated in the same order as when
+    // the classes are assigned serially.
+    boost::unordered_map<const Bundle*, size_t> bundle_index;
+    vector<size_t> class_bundle(classes.size());
+    vector<size_t> bundle_classes(1, 0);
+    vector<size_t> bundle_hits;
+    for (size_t c = 0; c < classes.size(); ++c) {
+      const Bundle* bundle = classes.targets(c)[0]->bundle();
+      size_t next_b = bundle_index.size();
+      size_t b = bundle_index.insert(make_pair(bundle, next_b)).first->second;
+      if (b == bundle_hits.size()) {
+        bundle_classes.push_back(0);
+        bundle_hits.push_back(0);
+      }
+      class_bundle[c] = b;
+      bundle_classes[b+1]++;
+      bundle_hits[b] += classes.num_hits(c);
+    }
+    for (size_t b = 1; b < bundle_classes.size(); ++b) {
+      bundle_classes[b] += bundle_classes[b-1];
+    }
+    vector<size_t> order(classes.size());
+    for (size_t c = 0; c < classes.size(); ++c) {
+      order[bundle_classes[class_bundle[c]]++] = c;
+    }
+
+    // Cut the grouped classes into tasks of about EM_TASK_HITS hits. Bundles
+    // with more hits are split into tasks of their own, which are the only
+    // ones that need the Target locks. Smaller bundles are only cut at their
+    // ends so that no two unlocked tasks share a Target.
+    vector<size_t> task_start(1, 0);
+    vector<bool> task_lock;
+    size_t task_hits = 0;
+    for (size_t k = 0; k < order.size(); ++k) {
+      size_t b = class_bundle[order[k]];
+      bool large = bundle_hits[b] > EM_TASK_HITS;
+      bool bundle_begin = (k == 0 || class_bundle[order[k-1]] != b);
+      if (large && bundle_begin && task_hits) {
+        task_start.push_back(k);
+        task_lock.push_back(false);
+        task_hits = 0;
+      }
+      task_hits += classes.num_hits(order[k]);
+      bool bundle_end = (k + 1 == order.size() ||
+                         class_bundle[order[k+1]] != b);
+      if ((task_hits >= EM_TASK_HITS && (large || bundle_end)) ||
+          (large && bundle_end) || k + 1 == order.size()) {
+        task_start.push_back(k + 1);
+        task_lock.push_back(large);
+        task_hits = 0;
+      }
+    }
+
+    TaskScheduler scheduler(num_threads);
+    vector<double> fpb_incrs(task_lock.size(), LOG_0);
+    for (size_t t = 0; t < task_lock.size(); ++t) {
+      scheduler.spawn(boost::bind(assign_equiv_classes, &lib, &order,
+                                  task_start[t], task_start[t+1],
+                                  (bool)task_lock[t], &fpb_incrs[t], _1),
+                      t % scheduler.num_workers());
+    }
+    scheduler.run();
+
+    // The increases in total mass per base are added in task order so that
+    // the total does not depend on the scheduling.
+    foreach (double fpb_incr, fpb_incrs) {
+      if (fpb_incr != LOG_0) {
+        lib.targ_table->update_total_fpb(fpb_incr);
+      }
+    }
+    num_frags += classes.num_frags();
+  }
+
+  logger.info("COMPLETED: Processed %d mapped fragments in memory.",
+              num_frags);
+
+  return num_frags;
+}
 
-  size_t n = 1;
+/**
+ * This function runs a round over the fragments in the spill file of a
+ * library, in place of parsing the input. The fragment masses are updated as
+ * they are in threaded_calc_abundances.
+ * @param lib the Library to process the spilled fragments of.
+ * @param n a reference to the number of the next fragment to be processed in
+ *        this round, which is updated.
+ * @param mass_n a reference to the (logged) mass of the next fragment to be
+ *        processed in this round, which is updated.
+ * @return The number of fragments processed.
+ */
+size_t process_spill(Library& lib, size_t& n, double& mass_n) {
+  SpillReader& spill = *lib.spill;
+  spill.rewind();
+  vector<TargID> targ_ids;
+  vector<double> likelihoods;
+  vector<Target*> targets;
+  vector<double> buff;
   size_t num_frags = 0;
-  double mass_n = 0;
 
-  // For log-scale output
-  size_t i = 1;
-  size_t j = 6;
+  while (spill.next_fragment(targ_ids, likelihoods)) {
+    targets.resize(targ_ids.size());
+    for (size_t i = 0; i < targ_ids.size(); ++i) {
+      targets[i] = lib.targ_table->get_targ(targ_ids[i]);
+    }
+    if (!assign_hits(lib, &targets[0], &likelihoods[0], targets.size(),
+                     mass_n, LOG_1, buff)) {
+      logger.warn("A spilled fragment has 0 likelihood of originating from the "
+                  "transcriptome. Skipping...");
+    }
+    num_frags++;
 
-  DirectionDetector dir_detector;
-  Fragment* frag;
-  
-  while (true) {
-    // Loop through libraries
-    for (size_t l = 0; l < libs.size(); l++) {
-      Library& lib = libs[l];
-      libs.set_curr(l);
-      MapParser& map_parser = *lib.map_parser;
-      boost::mutex bu_mut;
-      // Used to signal bias update thread
-      running = true;
-      ParseThreadSafety pts(max((int)num_threads,10));
-      /// @brief 要把剛剛parsed的fragment放上proc_in
-      boost::thread parse(&MapParser::threaded_parse, &map_parser, &pts,
-                          stop_at, num_neighbors);
-      vector<boost::thread*> thread_pool;
-      RobertsFilter frags_seen;
-
-      burned_out = lib.n >= burn_out;
-      while(true) {
-        if (lib.n == burn_in) {
-          bias_update.reset(new boost::thread(&TargetTable::asynch_bias_update,
-                                              lib.targ_table, &bu_mut));
-          if (lib.mismatch_table) {
-            (lib.mismatch_table)->activate();
-          }
-        }
-        if (lib.n == burn_out) {
-          if (lib.mismatch_table) {
-            (lib.mismatch_table)->fix();
-          };
-          burned_out = true;
+    if (num_frags % 1000000 == 0) {
+      logger.info("Fragments Processed (%s): %d\tNumber of Bundles: %d.",
+                  lib.in_file_name.c_str(), num_frags,
+                  lib.targ_table->num_bundles());
+    }
+
+    n++;
+    lib.n++;
+    mass_n += ff_param*log((double)n-1) - log(pow(n,ff_param) - 1);
+    lib.mass_n += ff_param*log((double)lib.n-1) -
+                  log(pow(lib.n,ff_param) - 1);
+  }
+
+  return num_frags;
+}
+
+/**
+ * The number of fragments between synchronizations of the auxiliary parameter
+ * accumulators of libraries that are processed concurrently without their own
+ * bias update thread.
+ */
+const size_t CONCURRENT_AUX_SYNC_INTERVAL = 100000;
+
+/**
+ * The FragCounter struct stores the number and (logged) mass of the next
+ * fragment to be processed across all libraries, along with the position of
+ * the next intermediate output on the log scale. It is shared by libraries
+ * being processed concurrently, so all accesses must hold mut.
+ */
+struct FragCounter {
+  /**
+   * The number of the next fragment to be processed (starting at 1).
+   */
+  size_t n;
+  /**
+   * The (logged) mass of the next fragment to be processed.
+   */
+  double mass_n;
+  /**
+   * The leading digit and exponent of the next intermediate output.
+   */
+  size_t i;
+  size_t j;
+  /**
+   * A mutex protecting the counter.
+   */
+  boost::mutex mut;
+  FragCounter() : n(1), mass_n(0), i(1), j(6) {}
+  /**
+   * A member function that advances the next intermediate output past the
+   * current fragment number, such as after resuming from a checkpoint.
+   */
+  void skip_outputs() {
+    while (i*pow(10.,(double)j) < n) {
+      next_output();
+    }
+  }
+  /**
+   * A member function that advances the next intermediate output.
+   */
+  void next_output() {
+    if (i++ == 9) {
+      i = 1;
+      j++;
+    }
+  }
+};
+
+/**
+ * This function computes the (logged) masses of consecutive fragments under the
+ * forgetting factor schedule, in which the mass of fragment k+1 is that of
+ * fragment k multiplied by k^c/((k+1)^c - 1). The log of each ordinal is
+ * carried to the next fragment, so each mass costs one exp and two logs.
+ * @param n the number of the first fragment (starting at 1).
+ * @param mass_n the (logged) mass of the first fragment.
+ * @param count the number of fragments.
+ * @param masses a pointer to the array to store the count masses in.
+ * @return The (logged) mass of fragment n + count.
+ */
+double mass_schedule(size_t n, double mass_n, size_t count, double* masses) {
+  double log_k = log((double)n);
+  for (size_t i = 0; i < count; ++i) {
+    masses[i] = mass_n;
+    double log_k1 = log((double)(n + i + 1));
+    mass_n += ff_param*log_k - log(exp(ff_param*log_k1) - 1);
+    log_k = log_k1;
+  }
+  return mass_n;
+}
+
+/**
+ * The LibraryDispatch struct stores the state of a round over a single library
+ * that is shared by its processing threads. Each thread pops batches of parsed
+ * Fragments directly and dispatches them itself while holding mut, so that the
+ * fragment masses, burn-in, intermediate outputs, and checkpoints are handled
+ * in input order without a separate dispatching thread.
+ */
+struct LibraryDispatch {
+  Librarian* libs;
+  size_t l;
+  FragCounter* counter;
+  /**
+   * A pointer to the mutex protecting the auxiliary parameter tables and
+   * published target bias, shared by concurrent libraries.
+   */
+  boost::shared_mutex* bu_mut;
+  /**
+   * A pointer to the holder of the bias update thread.
+   */
+  boost::scoped_ptr<boost::thread>* bias_update;
+  /**
+   * True iff this library updates the shared target bias.
+   */
+  bool updates_bias;
+  ParseThreadSafety* pts;
+  /**
+   * A mutex held while popping and dispatching a batch or writing a
+   * checkpoint, so that batches are dispatched in the order they were parsed.
+   */
+  boost::mutex mut;
+  /**
+   * The number of fragments and batches dispatched in this round.
+   */
+  size_t num_frags;
+  size_t num_dispatched;
+  /**
+   * Scratch space for the global and library masses of the batch being
+   * dispatched.
+   */
+  vector<double> masses;
+  vector<double> lib_masses;
+  LibraryDispatch() : num_frags(0), num_dispatched(0) {}
+};
+
+/**
+ * This function dispatches a batch of parsed Fragments before it is processed.
+ * The numbers and masses of the fragments are reserved from the shared counter
+ * at once for the whole batch, and the burn-in, synchronization, intermediate
+ * outputs, and progress reports that fall due within it are handled in order.
+ * The caller must hold the dispatch mutex from when the batch was popped.
+ * @param d a reference to the dispatch state of the library.
+ * @param batch the batch of Fragments to dispatch.
+ * @return True iff a checkpoint is due once the batch has been processed.
+ */
+bool dispatch_batch(LibraryDispatch& d, FragBatch& batch) {
+  Library& lib = (*d.libs)[d.l];
+  boost::shared_mutex* bu_mut = d.bu_mut;
+  FragCounter* counter = d.counter;
+  bool checkpoint_due = false;
+
+  d.masses.resize(batch.size());
+  d.lib_masses.resize(batch.size());
+  size_t n0;
+  {
+    boost::unique_lock<boost::mutex> lock(counter->mut);
+    n0 = counter->n;
+    counter->mass_n = mass_schedule(n0, counter->mass_n, batch.size(),
+                                    &d.masses[0]);
+    counter->n += batch.size();
+  }
+  double lib_mass_end = mass_schedule(lib.n, lib.mass_n, batch.size(),
+                                      &d.lib_masses[0]);
+
+  for (size_t k = 0; k < batch.size(); ++k) {
+    Fragment* frag = batch[k];
+    if (lib.n == burn_in) {
+      {
+        boost::unique_lock<boost::shared_mutex> lock(*bu_mut);
+        lib.flush_aux_accumulators();
+        if (lib.mismatch_table) {
+          (lib.mismatch_table)->activate();
         }
-        // Start threads once aux parameters are burned out
-        if (burned_out && num_threads && thread_pool.size() == 0) {
-          lib.targ_table->enable_bundle_threadsafety();
-          thread_pool = vector<boost::thread*>(num_threads);
-          for (size_t k = 0; k < thread_pool.size(); k++) {
-            thread_pool[k] = new boost::thread(proc_thread, &pts);
-          }
+      }
+      if (d.updates_bias) {
+        d.bias_update->reset(
+            new boost::thread(&TargetTable::asynch_bias_update,
+                              lib.targ_table, bu_mut, &lib));
+      }
+    }
+    // The bias updater may end burn-out early once the parameters converge,
+    // so the flag is only read and written while holding the mutex.
+    if (lib.n == burn_out) {
+      boost::unique_lock<boost::shared_mutex> lock(*bu_mut);
+      if (!lib.burned_out) {
+        lib.flush_aux_accumulators();
+        if (lib.mismatch_table) {
+          (lib.mismatch_table)->fix();
         }
+        lib.burned_out = true;
+      }
+    } else if (!d.updates_bias && lib.n > burn_in &&
+               lib.n % CONCURRENT_AUX_SYNC_INTERVAL == 0) {
+      // Without a bias updater to synchronize the tables periodically, add
+      // the accumulated counts here.
+      boost::unique_lock<boost::shared_mutex> lock(*bu_mut);
+      if (!lib.burned_out) {
+        lib.flush_aux_accumulators();
+      }
+    }
 
-        // Pop next parsed fragment and set mass
-        frag = pts.proc_in.pop();
-        if (frag) {
-          frag->mass(mass_n);
-          dir_detector.add_fragment(frag);
-        }
+    size_t n = n0 + k;
+    frag->mass(d.masses[k]);
+    frag->lib_mass(d.lib_masses[k]);
+
+    // Output intermediate results and checkpoints, if necessary
+    bool output_due = false;
+    if (output_running_reads || checkpoint) {
+      boost::unique_lock<boost::mutex> lock(counter->mut);
+      output_due = n == counter->i*pow(10.,(double)counter->j);
+      if (output_due) {
+        counter->next_output();
+      }
+    }
+    if (output_due) {
+      if (output_running_reads) {
+        boost::unique_lock<boost::shared_mutex> lock(*bu_mut);
+        lib.flush_aux_accumulators();
+        output_results(*d.libs, n, (int)n);
+      }
+      if (checkpoint && first_round) {
+        boost::shared_lock<boost::shared_mutex> lock(*bu_mut);
+        checkpoint_due = lib.burned_out;
+      }
+    }
+    d.num_frags++;
 
-        // Test that we have not already seen this fragment
-        if (frag && first_round && frags_seen.test_and_push(frag->name())) {
-          logger.severe("Alignments are not properly sorted. Read '%s' has "
-                        "alignments which are non-consecutive.",
-                        frag->name().c_str());
-        }
+    // Output progress
+    if (d.num_frags % 1000000 == 0) {
+      logger.info("Fragments Processed (%s): %d\tNumber of Bundles: %d.",
+                  lib.in_file_name.c_str(), d.num_frags,
+                  lib.targ_table->num_bundles());
+      logger.info(run_stats.summary().c_str());
+    }
 
-        // If multi-threaded and burned out, push to the processing queue
-        if (num_threads && burned_out) {
-          // If no more fragments, send stop signal (NULL) to processing threads
-          if (!frag) {
-            for (size_t k = 0; k < thread_pool.size(); ++k) {
-              pts.proc_on.push(NULL);
-            }
-            break;
-          }
-          pts.proc_on.push(frag);
+    lib.n++;
+  }
+  lib.mass_n = lib_mass_end;
+  d.num_dispatched++;
+  return checkpoint_due;
+}
+
+/**
+ * This function writes a checkpoint once every dispatched batch of a library
+ * has been processed and the final bias update is done, so that the state
+ * reflects exactly the fragments dispatched so far. No further batches are
+ * dispatched while it is written.
+ * @param d a reference to the dispatch state of the library.
+ */
+void dispatch_checkpoint(LibraryDispatch& d) {
+  Library& lib = (*d.libs)[d.l];
+  boost::unique_lock<boost::mutex> dispatch_lock(d.mut);
+  d.pts->wait_done(d.num_dispatched);
+  if (*d.bias_update) {
+    (*d.bias_update)->join();
+    d.bias_update->reset(NULL);
+  }
+  boost::unique_lock<boost::shared_mutex> lock(*d.bu_mut);
+  lib.flush_aux_accumulators();
+  lib.targ_table->collapse_bundles();
+  write_checkpoint(*d.libs, d.counter->n, d.counter->mass_n, d.num_frags);
+}
+
+/**
+ * This function processes Fragments asynchronously. Batches of Fragments are
+ * popped from the threadsafe queue filled by the parser, dispatched, processed,
+ * and then pushed onto a threadsafe output queue. Until the auxiliary
+ * parameters are burned out, their updates are made to a private accumulator
+ * that is merged into the library tables while the mutex is held exclusively.
+ * @param d pointer to the dispatch state of the library, including the input
+ *        and output Fragment queues.
+ * @param aux pointer to the auxiliary parameter accumulator for this thread, or
+ *        NULL if burn-in was already complete when the thread was started or
+ *        if it is the only processing thread.
+ * @param exclusive a bool that is true iff this is the only processing thread,
+ *        in which case the auxiliary parameter mutex is held exclusively for
+ *        each batch, since its updates are made directly to the tables.
+ *        Otherwise it is held in shared mode.
+ */
+void proc_thread(LibraryDispatch* d, AuxAccumulator* aux, bool exclusive) {
+  d->libs->set_thread_curr(d->l);
+  const Library& lib = (*d->libs)[d->l];
+  ParseThreadSafety* pts = d->pts;
+  vector<size_t> locks;
+  while (true) {
+    // Batches are popped and dispatched under the same lock, so that the
+    // numbers and masses of the fragments follow the input order.
+    FragBatch* batch = NULL;
+    bool checkpoint_due = false;
+    {
+      boost::unique_lock<boost::mutex> dispatch_lock(d->mut);
+      batch = pts->proc_in.pop();
+      if (batch) {
+        Stopwatch dispatch_time;
+        checkpoint_due = dispatch_batch(*d, *batch);
+        run_stats.dispatch.add(dispatch_time.elapsed(), batch->size());
+      }
+    }
+    if (!batch) {
+      // Pass the stop signal on to the other processing threads.
+      pts->proc_in.push(NULL);
+      break;
+    }
+
+    {
+      boost::shared_lock<boost::shared_mutex> shared(*d->bu_mut,
+                                                     boost::defer_lock);
+      boost::unique_lock<boost::shared_mutex> unique(*d->bu_mut,
+                                                     boost::defer_lock);
+      bool locked = (exclusive) ? unique.try_lock() : shared.try_lock();
+      if (!locked) {
+        Stopwatch wait;
+        if (exclusive) {
+          unique.lock();
         } else {
-          if (!frag) {
-            break;
-          }
-          {
-            // Block the bias update thread from updating the paramater tables
-            // during processing. We don't need to do this during multi-threaded
-            // processing since the parameters are burned out before we start
-            // the threads.
-            boost::unique_lock<boost::mutex> lock(bu_mut);
-            process_fragment(frag);
-            pts.proc_out.push(frag);
-          }
+          shared.lock();
         }
+        run_stats.aux_lock_wait.add(wait.elapsed());
+      }
+      Stopwatch proc_time;
+      AuxAccumulator* batch_aux = (lib.burned_out) ? NULL : aux;
+      foreach (Fragment* frag, *batch) {
+        process_fragment(frag, locks, batch_aux); /// @brief proc_in的東西拿出來processing
+      }
+      run_stats.process.add(proc_time.elapsed(), batch->size());
+    }
+    pts->batch_done();
+    pts->proc_out.push(batch); /// @brief processing完畢放進proc_out等待post_processing
 
-        // Output intermediate results, if necessary
-        if (output_running_reads && n == i*pow(10.,(double)j)) {
-          boost::unique_lock<boost::mutex> lock(bu_mut);
-          output_results(libs, n, (int)n);
-          if (i++ == 9) {
-            i = 1;
-            j++;
-          }
-        }
-        num_frags++;
-
-        // Output progress
-        if (num_frags % 1000000 == 0) {
-          logger.info("Fragments Processed (%s): %d\tNumber of Bundles: %d.",
-                      lib.in_file_name.c_str(), num_frags,
-                      lib.targ_table->num_bundles());
-          dir_detector.report_if_improper_direction();
-        }
+    if (checkpoint_due) {
+      dispatch_checkpoint(*d);
+    }
+  }
+}
 
-        n++;
-        lib.n++;
-        mass_n += ff_param*log((double)n-1) - log(pow(n,ff_param) - 1);
-        lib.mass_n += ff_param*log((double)lib.n-1) -
-                      log(pow(lib.n,ff_param) - 1);
+/**
+ * This function runs the current round over the input of a single library.
+ * Fragments are parsed by a separate thread and passed directly to this thread
+ * and any processing threads, which each dispatch the batches they pop with
+ * dispatch_batch, handling the fragment masses, burn-in, intermediate outputs,
+ * and checkpoints, before processing them. When libraries are
+ * processed concurrently, each runs this function in its own thread into the
+ * shared TargetTable. Only the first library then updates the target bias, and
+ * the caller is left to stop the bias updater and collapse the bundles once
+ * all libraries are done.
+ * @param libs a pointer to the struct containing the parameter tables and
+ *        parsers for all libraries being processed.
+ * @param l the index of the library to process.
+ * @param counter a pointer to the shared fragment counter.
+ * @param bu_mut a pointer to the mutex protecting the auxiliary parameter
+ *        tables and published target bias, shared by concurrent libraries.
+ * @param bias_update a pointer to the holder of the bias update thread.
+ * @param concurrent a bool that is true iff libraries are being processed
+ *        concurrently.
+ * @param num_frags_out a pointer to store the number of fragments processed in.
+ */
+void process_library(Librarian* libs, size_t l, FragCounter* counter,
+                     boost::shared_mutex* bu_mut,
+                     boost::scoped_ptr<boost::thread>* bias_update,
+                     bool concurrent, size_t* num_frags_out) {
+  Library& lib = (*libs)[l];
+  // Sequential runs process libraries on the main thread, which follows the
+  // global cursor.
+  if (concurrent) {
+    libs->set_thread_curr(l);
+  }
+  size_t num_frags = 0;
+
+  // Once the library has been spilled, rounds are run from the spill file
+  // unless the input alignments need to be output.
+  bool output_align = output_align_prob || output_align_samp;
+  if (lib.spill && !(last_round && output_align)) {
+    *num_frags_out = process_spill(lib, counter->n, counter->mass_n);
+    return;
+  }
+
+  MapParser& map_parser = *lib.map_parser;
+  if (first_round && resume_point.num_frags) {
+    map_parser.skip_fragments(resume_point.num_frags);
+    num_frags = resume_point.num_frags;
+    resume_point.num_frags = 0;
+  }
+
+  // Spill the fragments during this pass if a later round can use them and
+  // batch rounds will not be run over equivalence classes instead.
+  boost::scoped_ptr<SpillWriter> spill_writer;
+  string spill_file_name;
+  if (!first_round && !lib.spill && replay_supported() &&
+      (online_additional || !equiv_classes_supported()) &&
+      remaining_rounds > (size_t)output_align) {
+    char buff[500];
+    sprintf(buff, "%s/frags.%d.spill", output_dir.c_str(), (int)l);
+    spill_file_name = buff;
+    spill_writer.reset(new SpillWriter(spill_file_name));
+    map_parser.spill_writer(spill_writer.get());
+  }
+  map_parser.check_sorted(first_round);
+  ParseThreadSafety pts(frag_queue_size, frag_batch_size);
+  /// @brief 要把剛剛parsed的fragment放上proc_in
+  boost::thread parse(&MapParser::threaded_parse, &map_parser, &pts,
+                      stop_at, num_neighbors);
+
+  LibraryDispatch dispatch;
+  dispatch.libs = libs;
+  dispatch.l = l;
+  dispatch.counter = counter;
+  dispatch.bu_mut = bu_mut;
+  dispatch.bias_update = bias_update;
+  // Only one library can update the shared target bias.
+  dispatch.updates_bias = !concurrent || l == 0;
+  dispatch.pts = &pts;
+  dispatch.num_frags = num_frags;
+
+  // The auxiliary parameters may have converged before burn-out in a previous
+  // round, in which case they are already fixed.
+  lib.burned_out = lib.burned_out || lib.n >= burn_out;
+
+  // Start the processing threads, dividing them between the libraries if they
+  // are processed concurrently. This thread processes batches along with
+  // them. If the auxiliary parameters are still burning in, each thread
+  // accumulates its updates privately so that the shared tables are only
+  // modified during synchronization.
+  // Concurrent libraries each need at least one additional thread, or they
+  // would hold the shared mutex exclusively and run one at a time.
+  size_t lib_threads = (concurrent) ? max(num_threads / libs->size(), (size_t)1)
+                                    : num_threads;
+  vector<boost::thread*> thread_pool;
+  if (lib_threads) {
+    lib.targ_table->enable_bundle_threadsafety();
+    if (!lib.burned_out) {
+      for (size_t k = 0; k <= lib_threads; k++) {
+        lib.aux_accumulators.push_back(
+            boost::shared_ptr<AuxAccumulator>(new AuxAccumulator(lib)));
       }
+    }
+    for (size_t k = 1; k <= lib_threads; k++) {
+      AuxAccumulator* aux = (lib.burned_out) ? NULL :
+                                               lib.aux_accumulators[k].get();
+      thread_pool.push_back(new boost::thread(proc_thread, &dispatch, aux,
+                                              false));
+    }
+    proc_thread(&dispatch, (lib.burned_out) ? NULL :
+                                              lib.aux_accumulators[0].get(),
+                false);
+  } else {
+    proc_thread(&dispatch, NULL, true);
+  }
 
-      // Signal bias update thread to stop
-      running = false;
+  parse.join();
+  foreach(boost::thread* t, thread_pool) {
+    t->join();
+    delete t;
+  }
+  num_frags = dispatch.num_frags;
+
+  if (!concurrent) {
+    // Signal bias update thread to stop
+    running = false;
+
+    lib.targ_table->disable_bundle_threadsafety();
+    lib.targ_table->collapse_bundles();
+
+    if (*bias_update) {
+      logger.info("Waiting for auxiliary parameter update to complete...");
+      (*bias_update)->join();
+      bias_update->reset(NULL);
+    }
+  }
+
+  // Add any updates made since the last synchronization.
+  {
+    boost::unique_lock<boost::shared_mutex> lock(*bu_mut);
+    lib.flush_aux_accumulators();
+    lib.aux_accumulators.clear();
+  }
+
+  if (spill_writer) {
+    map_parser.spill_writer(NULL);
+    spill_writer->close();
+    logger.info("Spilled %d fragments for additional rounds.",
+                spill_writer->num_frags());
+    lib.spill.reset(new SpillReader(spill_file_name,
+                                    spill_writer->num_frags()));
+  }
+
+  // This thread also ran proc_thread, which set its library index. Clear it
+  // so that a sequential caller follows the global cursor again.
+  libs->clear_thread_curr();
+  *num_frags_out = num_frags;
+}
+
+/**
+ * This is the driver function for the main processing thread. This function
+ * runs each round over the libraries, either one at a time or concurrently in
+ * the first round if requested, and handles additional online rounds.
+ * @param libs a struct containing pointers to the parameter tables (bias_table,
+ *        mismatch_table, fld) and parser for all libraries being processed.
+ * @return The total number of fragments processed.
+ */
+size_t threaded_calc_abundances(Librarian& libs) {
+  logger.info("Processing input fragment alignments...");
+  boost::scoped_ptr<boost::thread> bias_update;
+  boost::shared_mutex bu_mut;
+
+  FragCounter counter;
+  size_t num_frags = 0;
+  if (first_round && resume_point.num_frags) {
+    counter.n = resume_point.n;
+    counter.mass_n = resume_point.mass_n;
+  }
+  counter.skip_outputs();
 
-      parse.join();
-      foreach(boost::thread* t, thread_pool) {
+  while (true) {
+    bool concurrent = concurrent_libs && first_round && libs.size() > 1;
+    // Used to signal bias update thread
+    running = true;
+    libs.set_curr(0);
+    if (concurrent) {
+      logger.info("Processing %d libraries concurrently...", libs.size());
+      libs[0].targ_table->enable_bundle_threadsafety();
+      vector<size_t> lib_frags(libs.size(), 0);
+      vector<boost::thread*> lib_threads;
+      for (size_t l = 0; l < libs.size(); l++) {
+        lib_threads.push_back(new boost::thread(process_library, &libs, l,
+                                                &counter, &bu_mut,
+                                                &bias_update, true,
+                                                &lib_frags[l]));
+      }
+      foreach (boost::thread* t, lib_threads) {
         t->join();
+        delete t;
+      }
+      foreach (size_t frags, lib_frags) {
+        num_frags += frags;
       }
 
-      lib.targ_table->disable_bundle_threadsafety();
-      lib.targ_table->collapse_bundles();
-      
+      // Signal bias update thread to stop
+      running = false;
+
+      libs[0].targ_table->disable_bundle_threadsafety();
+      libs[0].targ_table->collapse_bundles();
+
       if (bias_update) {
         logger.info("Waiting for auxiliary parameter update to complete...");
         bias_update->join();
         bias_update.reset(NULL);
       }
+      libs[0].flush_aux_accumulators();
+    } else {
+      // Loop through libraries
+      for (size_t l = 0; l < libs.size(); l++) {
+        libs.set_curr(l);
+        running = true;
+        size_t lib_frags = 0;
+        process_library(&libs, l, &counter, &bu_mut, &bias_update, false,
+                        &lib_frags);
+        num_frags += lib_frags;
+      }
     }
 
     if (online_additional && remaining_rounds--) {
       if (output_running_rounds) {
-        output_results(libs, n, (int)remaining_rounds);
+        output_results(libs, counter.n, (int)remaining_rounds);
       }
 
       logger.info("%d remaining rounds.", remaining_rounds);
@@ -765,6 +1726,7 @@ size_t threaded_calc_abundances(Librarian& libs) {
 
   logger.info("COMPLETED: Processed %d mapped fragments, targets are in %d "
               "bundles.", num_frags, libs[0].targ_table->num_bundles());
+  logger.info(run_stats.summary().c_str());
 
   return num_frags;
 }
@@ -848,11 +1810,10 @@ int estimation_main() {
                                                   edit_detect,
                                                   param_file_name.size(),
                                                   expr_alpha, expr_alpha_map,
-                                                  &libs));
+                                                  &libs, lazy_targets));
   size_t max_target_length = 0;
   for(size_t tid=0; tid < targ_table->size(); tid++) {
-    max_target_length = max(max_target_length,
-                            targ_table->get_targ(tid)->length());
+    max_target_length = max(max_target_length, targ_table->targ_length(tid));
   }
 
   for (size_t i = 0; i < libs.size(); ++i) {
@@ -873,13 +1834,21 @@ int estimation_main() {
   if (batch_mode) {
     targ_table->round_reset();
   }
+
+  if (resume_dir.size()) {
+    read_checkpoint(libs);
+  }
   
   size_t tot_counts = threaded_calc_abundances(libs);
   if (library_size) {
     tot_counts = library_size;
   }
   
-  if (!burned_out && bias_correct && param_file_name == "") {
+  bool all_burned_out = true;
+  for (size_t l = 0; l < libs.size(); l++) {
+    all_burned_out &= libs[l].burned_out;
+  }
+  if (!all_burned_out && bias_correct && param_file_name == "") {
     logger.warn("Not enough fragments observed to accurately learn bias "
                 "parameters. Either disable bias correction "
                 "(--no-bias-correct) or provide a file containing auxiliary "
@@ -908,11 +1877,35 @@ int estimation_main() {
     logger.info("\nRe-estimating counts with additional round of EM (%d "
                 "remaining)...", remaining_rounds);
     last_round = (remaining_rounds == 0);
-    for (size_t l = 0; l < libs.size(); l++) {
-      libs[l].map_parser->write_active(last_round);
-      libs[l].map_parser->reset_reader();
+
+    // Once the equivalence classes have been collected, rounds are run over
+    // them in memory unless the input alignments need to be output.
+    bool output_align = output_align_prob || output_align_samp;
+    if (libs[0].equiv_classes && !(last_round && output_align)) {
+      tot_counts = process_equiv_classes(libs);
+    } else {
+      // Collect the classes during this pass if a later round can use them.
+      bool collect = equiv_classes_supported() && !libs[0].equiv_classes &&
+                     remaining_rounds > (size_t)output_align;
+      for (size_t l = 0; l < libs.size(); l++) {
+        libs[l].map_parser->write_active(last_round);
+        libs[l].map_parser->reset_reader();
+        if (collect) {
+          libs[l].equiv_classes.reset(new EquivClassTable());
+          libs[l].map_parser->collect_equiv_classes(
+              libs[l].equiv_classes.get());
+        }
+      }
+      tot_counts = threaded_calc_abundances(libs);
+      for (size_t l = 0; l < libs.size(); l++) {
+        libs[l].map_parser->collect_equiv_classes(NULL);
+        if (collect) {
+          logger.info("Collapsed %d fragments into %d equivalence classes.",
+                      libs[l].equiv_classes->num_frags(),
+                      libs[l].equiv_classes->size());
+        }
+      }
     }
-    tot_counts = threaded_calc_abundances(libs);
     if (library_size) {
       tot_counts = library_size;
     }
@@ -921,11 +1914,69 @@ int estimation_main() {
   
 	logger.info("Writing results to file...");
   output_results(libs, tot_counts);
+  run_stats.write(output_dir + "/run_stats");
   logger.info("Done.");
   
   return 0;
 }
 
+/**
+ * This function handles the 'index' command, which writes a binary target
+ * index for a MultiFASTA file. The index can be given in place of the
+ * MultiFASTA file in later runs, which then memory-map the target sequences
+ * instead of parsing them.
+ * @param ac the number of arguments following 'index'.
+ * @param av the arguments following 'index'.
+ * @return 0 on success and 1 on a command-line error.
+ */
+int index_main(int ac, char** av) {
+  string index_fasta_file;
+  string index_file;
+  po::options_description index_options("Index Options");
+  index_options.add_options()
+  ("help,h", "produce help message")
+  ("fasta-file", po::value<string>(&index_fasta_file)->default_value(""), "")
+  ("index-file", po::value<string>(&index_file)->default_value(""), "")
+  ;
+  po::positional_options_description positional;
+  positional.add("fasta-file",1).add("index-file",1);
+
+  bool error = false;
+  po::variables_map vm;
+  try {
+    po::store(po::command_line_parser(ac, av).options(index_options)
+              .positional(positional).run(), vm);
+  } catch (po::error& e) {
+    logger.info("Command-Line Argument Error: %s.", e.what());
+    error = true;
+  }
+  po::notify(vm);
+
+  if (index_fasta_file == "" && !vm.count("help")) {
+    logger.info("Command-Line Argument Error: target sequence fasta file "
+                "required.");
+    error = true;
+  }
+  if (error || vm.count("help")) {
+    cerr << "express v" << PACKAGE_VERSION << endl
+         << "-----------------------------\n"
+         << "Index Usage: express index <target_seqs.fa> [<target_seqs.xidx>]"
+         << "\n\n"
+         << "Writes a binary target index that can be given to express in "
+         << "place of the\nfasta file. The index is written to "
+         << "<target_seqs.fa>.xidx if no path is given.\n";
+    return 1;
+  }
+  if (index_file == "") {
+    index_file = index_fasta_file + ".xidx";
+  }
+
+  logger.info("Writing target index for '%s'...", index_fasta_file.c_str());
+  size_t num_targs = TargetIndex::write(index_fasta_file, index_file);
+  logger.info("Wrote %d targets to '%s'.", num_targs, index_file.c_str());
+  return 0;
+}
+
 #ifdef PROTO
 inline string base64_encode(const string& to_encode) {
   using namespace boost::archive::iterators;
@@ -981,111 +2032,112 @@ int preprocess_main() {
   ostream frag_out(cout.rdbuf());
   
   size_t num_frags = 0;
-  Fragment* frag;
   
-  ParseThreadSafety pts(10);
+  ParseThreadSafety pts(frag_queue_size, frag_batch_size);
   boost::thread parse(&MapParser::threaded_parse, lib.map_parser.get(), &pts,
                       stop_at, 0);
   RobertsFilter frags_seen;
   proto::Fragment frag_proto;
   while(true) {
-    frag_proto.Clear();
-    
-    // Pop next parsed fragment and set mass
-    frag = pts.proc_in.pop();
+    // Pop next batch of parsed fragments
+    FragBatch* batch = pts.proc_in.pop();
     
-    if (!frag) {
+    if (!batch) {
       break;
     }
     
-    // Test that we have not already seen this fragment
-    if (frags_seen.test_and_push(frag->name())) {
-      logger.severe("Alignments are not properly sorted. Read '%s' has "
-                    "alignments which are non-consecutive.",
-                    frag->name().c_str());
-    }
+    foreach (Fragment* frag, *batch) {
+      frag_proto.Clear();
+      
+      // Test that we have not already seen this fragment
+      if (frags_seen.test_and_push(frag->name())) {
+        logger.severe("Alignments are not properly sorted. Read '%s' has "
+                      "alignments which are non-consecutive.",
+                      frag->name().c_str());
+      }
     
-    frag_proto.set_paired(frag->paired());
+      frag_proto.set_paired(frag->paired());
     
-    vector<char> ref_left_mm_indices;
-    vector<char> ref_left_mm_seq;
-    vector<char> ref_left_mm_ref;
-    vector<char> ref_right_mm_indices;
-    vector<char> ref_right_mm_seq;
-    vector<char> ref_right_mm_ref;
-    bool ref_left_first = false;
+      vector<char> ref_left_mm_indices;
+      vector<char> ref_left_mm_seq;
+      vector<char> ref_left_mm_ref;
+      vector<char> ref_right_mm_indices;
+      vector<char> ref_right_mm_seq;
+      vector<char> ref_right_mm_ref;
+      bool ref_left_first = false;
     
-    for (size_t i = 0; i < frag->num_hits(); ++i) {
-      FragHit& fh = *(*frag)[i];
-      proto::FragmentAlignment& align_proto = *frag_proto.add_alignments();
-      align_proto.set_target_id((unsigned int)fh.target_id());
+      for (size_t i = 0; i < frag->num_hits(); ++i) {
+        FragHit& fh = *(*frag)[i];
+        proto::FragmentAlignment& align_proto = *frag_proto.add_alignments();
+        align_proto.set_target_id((unsigned int)fh.target_id());
       
-      vector<char> left_mm_indices;
-      vector<char> left_mm_seq;
-      vector<char> left_mm_ref;
-      vector<char> right_mm_indices;
-      vector<char> right_mm_seq;
-      vector<char> right_mm_ref;
+        vector<char> left_mm_indices;
+        vector<char> left_mm_seq;
+        vector<char> left_mm_ref;
+        vector<char> right_mm_indices;
+        vector<char> right_mm_seq;
+        vector<char> right_mm_ref;
       
-      mismatch_table.get_indices(fh, left_mm_indices, left_mm_seq, left_mm_ref,
-                                 right_mm_indices, right_mm_seq, right_mm_ref);
+        mismatch_table.get_indices(fh, left_mm_indices, left_mm_seq, left_mm_ref,
+                                   right_mm_indices, right_mm_seq, right_mm_ref);
       
-      if (i == 0) {
-        ref_left_mm_indices = left_mm_indices;
-        ref_left_mm_seq = left_mm_seq;
-        ref_left_mm_ref = left_mm_ref;
-        ref_right_mm_indices = right_mm_indices;
-        ref_right_mm_seq = right_mm_seq;
-        ref_right_mm_ref = right_mm_ref;
-      }
+        if (i == 0) {
+          ref_left_mm_indices = left_mm_indices;
+          ref_left_mm_seq = left_mm_seq;
+          ref_left_mm_ref = left_mm_ref;
+          ref_right_mm_indices = right_mm_indices;
+          ref_right_mm_seq = right_mm_seq;
+          ref_right_mm_ref = right_mm_ref;
+        }
       
-      ReadHit* read_l = fh.left_read();
-      if (read_l) {
-        if (i==0) { ref_left_first = read_l->first; }
-        proto::ReadAlignment& read_proto = *align_proto.mutable_read_l();
-        read_proto.set_first(read_l->first);
-        read_proto.set_left_pos(read_l->left);
-        read_proto.set_right_pos(read_l->right-1);
-        if (i == 0 || read_l->first != ref_left_first ||
-            left_mm_indices != ref_left_mm_indices ||
-            left_mm_seq != ref_left_mm_seq ||
-            left_mm_ref != ref_left_mm_ref) {
-          read_proto.set_mismatch_indices(string(left_mm_indices.begin(),
-                                                 left_mm_indices.end()));
-          read_proto.set_mismatch_nucs(string(left_mm_seq.begin(),
-                                              left_mm_seq.end()));
+        ReadHit* read_l = fh.left_read();
+        if (read_l) {
+          if (i==0) { ref_left_first = read_l->first; }
+          proto::ReadAlignment& read_proto = *align_proto.mutable_read_l();
+          read_proto.set_first(read_l->first);
+          read_proto.set_left_pos(read_l->left);
+          read_proto.set_right_pos(read_l->right-1);
+          if (i == 0 || read_l->first != ref_left_first ||
+              left_mm_indices != ref_left_mm_indices ||
+              left_mm_seq != ref_left_mm_seq ||
+              left_mm_ref != ref_left_mm_ref) {
+            read_proto.set_mismatch_indices(string(left_mm_indices.begin(),
+                                                   left_mm_indices.end()));
+            read_proto.set_mismatch_nucs(string(left_mm_seq.begin(),
+                                                left_mm_seq.end()));
+          }
         }
-      }
       
-      ReadHit* read_r = fh.right_read();
-      if (read_r) {
-        if (i==0) { ref_left_first = !read_r->first; }
-        proto::ReadAlignment& read_proto = *align_proto.mutable_read_r();
-        read_proto.set_first(read_r->first);
-        read_proto.set_left_pos(read_r->left);
-        read_proto.set_right_pos(read_r->right-1);
-        if (i == 0 || read_r->first == ref_left_first ||
-            right_mm_indices != ref_right_mm_indices ||
-            right_mm_seq != ref_right_mm_seq ||
-            right_mm_ref != ref_right_mm_ref) {
-          read_proto.set_mismatch_indices(string(right_mm_indices.begin(),
-                                                 right_mm_indices.end()));
-          read_proto.set_mismatch_nucs(string(right_mm_seq.begin(),
-                                              right_mm_seq.end()));
+        ReadHit* read_r = fh.right_read();
+        if (read_r) {
+          if (i==0) { ref_left_first = !read_r->first; }
+          proto::ReadAlignment& read_proto = *align_proto.mutable_read_r();
+          read_proto.set_first(read_r->first);
+          read_proto.set_left_pos(read_r->left);
+          read_proto.set_right_pos(read_r->right-1);
+          if (i == 0 || read_r->first == ref_left_first ||
+              right_mm_indices != ref_right_mm_indices ||
+              right_mm_seq != ref_right_mm_seq ||
+              right_mm_ref != ref_right_mm_ref) {
+            read_proto.set_mismatch_indices(string(right_mm_indices.begin(),
+                                                   right_mm_indices.end()));
+            read_proto.set_mismatch_nucs(string(right_mm_seq.begin(),
+                                                right_mm_seq.end()));
+          }
         }
       }
-    }
-    frag_proto.SerializeToString(&out_buff);
-    frag_out << base64_encode(out_buff) << endl;
-    
-    pts.proc_out.push(frag);
+      frag_proto.SerializeToString(&out_buff);
+      frag_out << base64_encode(out_buff) << endl;
     
-    num_frags++;
+      num_frags++;
     
-    // Output progress
-    if (num_frags % 1000000 == 0) {
-      logger.info("Fragments Processed: %d", num_frags);
+      // Output progress
+      if (num_frags % 1000000 == 0) {
+        logger.info("Fragments Processed: %d", num_frags);
+      }
     }
+    
+    pts.proc_out.push(batch);
   }
   
   parse.join();
@@ -1094,11 +2146,16 @@ int preprocess_main() {
 }
 #endif
 
-
+// The benchmarks link this file for the globals and processing functions, and
+// provide their own main function.
+#ifndef EXPRESS_BENCH
 int main (int argc, char ** argv)
 {
 
   srand((unsigned int)time(NULL));
+  if (argc > 1 && string(argv[1]) == "index") {
+    return index_main(argc - 1, argv + 1);
+  }
   int parse_ret = parse_options(argc,argv);
   if (parse_ret) {
     return parse_ret;
@@ -1112,3 +2169,4 @@ int main (int argc, char ** argv)
   
   return estimation_main();
 }
+#endif
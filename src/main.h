@@ -17,6 +17,8 @@
 #include <cmath>
 #include <cassert>
 #include <limits>
+#include <string.h>
+#include <boost/cstdint.hpp>
 
 #define foreach BOOST_FOREACH
 
@@ -32,12 +34,6 @@ extern Logger logger;
  * This is primarily used to notify the bias update thread to stop running.
  */
 extern bool running;
-/**
- * A global bool that is true when the auxilary params are finished burning in.
- * This is primarily used to notify the bias update thread to stop updating
- * certain parameters.
- */
-extern bool burned_out;
 /**
  * A global bool that is true when edit detection is enabled
  */
@@ -66,6 +62,32 @@ extern Direction direction;
  * A global size_t specifying the maximum read length supported.
  */
 extern size_t max_read_len;
+/**
+ * A global size_t specifying the number of threads used to decompress BAM
+ * input.
+ */
+extern size_t bam_threads;
+/**
+ * A global double specifying the largest change in the auxiliary parameters
+ * between synchronizations by the bias updater at which burn-out is ended
+ * early, or 0 if burn-out always ends after a fixed number of fragments.
+ */
+extern double burn_out_tolerance;
+/**
+ * A global size_t specifying the number of threads used to update target bias
+ * parameters and effective lengths.
+ */
+extern size_t bias_threads;
+/**
+ * A global size_t specifying the number of threads used to compute and format
+ * output results.
+ */
+extern size_t output_threads;
+/**
+ * A global bool that is true iff results should also be output in binary
+ * columnar form.
+ */
+extern bool output_binary;
 /**
  * A global size_t specifying the number of possible nucleotides.
  */
@@ -92,6 +114,53 @@ const double LOG_QUARTER = log(0.25);
 const double EPSILON = 0.000001;
 const double LOG_EPSILON = log(EPSILON);
 const double LOG_MAX = log(std::numeric_limits<double>::max());
+/**
+ * A global double specifying the difference between two logged values below
+ * which the smaller no longer changes their logged sum, since
+ * exp(LOG_ADD_CUTOFF) is less than half the machine epsilon.
+ */
+const double LOG_ADD_CUTOFF = -37;
+
+/**
+ * Global function to approximate exp(x) without calling the math library, so
+ * that loops using it can be vectorized. Relative error is below 3e-10 for all
+ * x that do not overflow, and values below -708 return 0.
+ * @param x a double for the value to exponentiate.
+ * @return An approximation of exp(x).
+ */
+inline double fast_exp(double x) {
+  x = std::max(x, -708.0);
+  x = std::min(x, 709.0);
+  // Reduce to exp(r) * 2^k with |r| <= ln(2)/2. Adding 1.5*2^52 rounds to the
+  // nearest integer and leaves k in the low bits of t.
+  const double round_shift = 6755399441055744.0;
+  double t = x*1.4426950408889634 + round_shift;
+  double k = t - round_shift;
+  double r = x - k*0.6931471803691238 - k*1.9082149292705877e-10;
+  double p = 1 + r*(1 + r*(1./2 + r*(1./6 + r*(1./24 + r*(1./120 +
+             r*(1./720 + r*(1./5040 + r*(1./40320))))))));
+  boost::int64_t bits;
+  memcpy(&bits, &t, sizeof(bits));
+  bits = (bits - 0x4338000000000000LL + 1023) << 52;
+  double scale;
+  memcpy(&scale, &bits, sizeof(scale));
+  return p*scale;
+}
+
+/**
+ * Global function to calculate exp(x) for x <= 0 in the log-space kernels. Uses
+ * fast_exp when compiled with FAST_MATH and exp otherwise. Only used in loops
+ * over arrays, since the math library is faster for single values.
+ * @param x a double for the value to exponentiate.
+ * @return exp(x) (possibly approximated).
+ */
+inline double kernel_exp(double x) {
+#ifdef FAST_MATH
+  return fast_exp(x);
+#else
+  return exp(x);
+#endif
+}
 
 /**
  * Global function that determines if two doubles are within some epsilon of
@@ -124,6 +193,9 @@ inline double log_add(double x, double y) {
   if (y > x) {
     std::swap(x,y);
   }
+  if (y - x < LOG_ADD_CUTOFF) {
+    return x;
+  }
 
   double sum = x+log(1+exp(y-x));
   return sum;
@@ -174,4 +246,33 @@ inline double sexp(double x)
   return exp(x);
 }
 
+/**
+ * Global function to calculate the log of the sum of an array of logged values
+ * with a single logarithm, by subtracting the maximum before exponentiating.
+ * Equivalent to folding log_add over the array, but much faster for more than
+ * a couple of values. The exponentiation loop is vectorizable when compiled
+ * with FAST_MATH.
+ * @param x a pointer to the array of logged values.
+ * @param n the number of values in the array.
+ * @return a double for the log of the sum of exp(x[i]).
+ */
+inline double log_sum_exp(const double* x, size_t n) {
+  double max_x = -LOG_0;
+  for (size_t i = 0; i < n; ++i) {
+    if (!islzero(x[i])) {
+      max_x = std::max(max_x, x[i]);
+    }
+  }
+  if (max_x == -LOG_0) {
+    return LOG_0;
+  }
+
+  double sum = 0;
+  for (size_t i = 0; i < n; ++i) {
+    double d = (islzero(x[i])) ? -LOG_0 : x[i] - max_x;
+    sum += (d < LOG_ADD_CUTOFF) ? 0 : kernel_exp(d);
+  }
+  return max_x + log(sum);
+}
+
 #endif
@@ -8,34 +8,78 @@
 
 #include "mapparser.h"
 #include "main.h"
+#include "equivclasses.h"
 #include "fragments.h"
 #include "targets.h"
 #include "threadsafety.h"
 #include "library.h"
+#include "runstats.h"
+#include "spillfile.h"
+#include "robertsfilter.h"
+#include "directiondetector.h"
 #include <boost/algorithm/string/predicate.hpp>
+#include <string.h>
+
+#ifndef WIN32
+  #include <fcntl.h>
+  #include <sys/mman.h>
+  #include <sys/stat.h>
+  #include <unistd.h>
+#endif
 
 using namespace std;
 
-const size_t BUFF_SIZE = 9999;
+/**
+ * The size of the blocks read from SAM input streams. The buffer grows if a
+ * single line is longer.
+ */
+const size_t STREAM_BUFF_SIZE = 1 << 20;
+
+/**
+ * A helper function that parses a (possibly negative) decimal integer from a
+ * character array that is not null-terminated.
+ * @param p a pointer to the first character of the integer.
+ * @param end a pointer to one past the last character that may be read.
+ * @return The parsed integer.
+ */
+inline int parse_int(const char* p, const char* end) {
+  bool neg = (p < end && *p == '-');
+  if (neg) {
+    p++;
+  }
+  int val = 0;
+  while (p < end && *p >= '0' && *p <= '9') {
+    val = val*10 + (*p++ - '0');
+  }
+  return (neg) ? -val : val;
+}
 
 /**
  * A helper functon that calculates the length of the reference spanned by the
  * read and populates the indel vectors (for SAM input).
  * @param cigar_str a pointer to the char array containing the cigar string.
+ * @param cigar_end a pointer to one past the end of the cigar string.
  * @param inserts an empty Indel vector into which to add inserts.
  * @param deletes an empty Indel vector into which to add deletions.
  */
-size_t cigar_length(const char* cigar_str, vector<Indel>& inserts,
-                    vector<Indel>& deletes) {
+size_t cigar_length(const char* cigar_str, const char* cigar_end,
+                    vector<Indel>& inserts, vector<Indel>& deletes) {
   inserts.clear();
   deletes.clear();
   const char* p_cig = cigar_str;
   size_t i = 0; // read index
   size_t j = 0; // genomic index
-  while (*p_cig) {
-    char* t;
-    size_t op_len = (size_t)strtol(p_cig, &t, 10);
-    char op_char = toupper(*t);
+  while (p_cig < cigar_end) {
+    // The string is not null-terminated when mapped, so the length is read
+    // without passing the end.
+    size_t op_len = 0;
+    while (p_cig < cigar_end && *p_cig >= '0' && *p_cig <= '9') {
+      op_len = op_len*10 + (*p_cig++ - '0');
+    }
+    if (p_cig == cigar_end) {
+      break;
+    }
+    char op_char = toupper(*p_cig);
     switch(op_char) {
       case 'I':
       case 'S':
@@ -52,7 +96,7 @@ size_t cigar_length(const char* cigar_str, vector<Indel>& inserts,
         j += op_len;
         break;
     }
-    p_cig = t + 1;
+    p_cig++;
   }
   return j;
 }
@@ -94,7 +138,9 @@ size_t cigar_length(vector<BamTools::CigarOp>& cigar_vec,
 }
 
 MapParser::MapParser(Library* lib, bool write_active)
-    : _lib(lib), _write_active(write_active) {
+    : _pool(new FragPool()), _lib(lib), _write_active(write_active),
+      _equiv_classes(NULL), _spill_writer(NULL), _skip(0),
+      _check_sorted(false) {
 
   string in_file = lib->in_file_name;
   string out_file = lib->out_file_name;
@@ -102,34 +148,24 @@ MapParser::MapParser(Library* lib, bool write_active)
   if (in_file.size() == 0) {
     logger.info("No alignment file specified. Expecting streaming input on "
                 "stdin...\n");
-    _parser.reset(new SAMParser(&cin));
+    _parser.reset(new SAMParser(&cin, _pool.get()));
     is_sam = true;
   } else {
     logger.info("Attempting to read '%s' in BAM format...", in_file.c_str());
     BamTools::BamReader* reader = new BamTools::BamReader();
     if (reader->Open(in_file)) {
       logger.info("Parsing BAM header...");
-      _parser.reset(new BAMParser(reader));
+      _parser.reset(new BAMParser(reader, in_file, _pool.get()));
       if (out_file.size()) {
         out_file += ".bam";
-        BamTools::BamWriter* writer = new BamTools::BamWriter();
-        if (writer->Open(out_file, reader->GetHeader(),
-                         reader->GetReferenceData())) {
-          bool sample = out_file.substr(out_file.length()-8,4) == "samp";
-          _writer.reset(new BAMWriter(writer, sample));
-        } else {
-          logger.severe("Unable to open output BAM file '%s'.",
-                        out_file.c_str());
-        }
+        bool sample = out_file.substr(out_file.length()-8,4) == "samp";
+        _writer.reset(new BAMWriter(out_file, reader->GetHeaderText(),
+                                    reader->GetReferenceData(), sample));
       }
     } else {
       delete reader;
       logger.info("Input is not in BAM format. Trying SAM...");
-      ifstream* ifs = new ifstream(in_file.c_str());
-      if (!ifs->is_open()) {
-        logger.severe("Unable to open input SAM file '%s'.", in_file.c_str());
-      }
-      _parser.reset(new SAMParser(ifs));
+      _parser.reset(new SAMParser(in_file, _pool.get()));
       is_sam = true;
     }
   }
@@ -144,6 +180,7 @@ MapParser::MapParser(Library* lib, bool write_active)
     bool sample = out_file.substr(out_file.length()-8,4) == "samp";
     _writer.reset(new SAMWriter(ofs, sample));
   }
+  _parser->keep_lines(_writer && _write_active);
 }
 
 void MapParser::threaded_parse(ParseThreadSafety* thread_safety_p,
@@ -153,91 +190,169 @@ void MapParser::threaded_parse(ParseThreadSafety* thread_safety_p,
   bool fragments_remain = true;
   size_t n = 0;
   size_t still_out = 0;
+  // Empty batches returned by the processing stages, ready for reuse.
+  vector<FragBatch*> free_batches;
+
+  // Processed batches are written out and released on a separate thread,
+  // which returns the emptied batches here.
+  ThreadSafeFragQueue recycled(0);
+  boost::thread output(&MapParser::output_batches, this, thread_safety_p,
+                       &recycled);
 
   TargetTable& targ_table = *(_lib->targ_table);
+  vector<const Target*> neighbors;
+  RobertsFilter frags_seen;
+  DirectionDetector dir_detector;
+
+  while (fragments_remain && (!stop_at || n < stop_at)) {
+    FragBatch* batch = NULL;
+    if (free_batches.empty()) {
+      batch = new FragBatch();
+      batch->reserve(pts.batch_size);
+    } else {
+      batch = free_batches.back();
+      free_batches.pop_back();
+    }
 
-  while (!stop_at || n < stop_at) {
-    Fragment* frag = NULL;
-    while (fragments_remain) {
-      frag = new Fragment(_lib);
-      fragments_remain = _parser->next_fragment(*frag);
-      if (frag->num_hits()) {
-        break;
+    Stopwatch parse_time;
+    while (batch->size() < pts.batch_size && (!stop_at || n < stop_at)) {
+      Fragment* frag = NULL;
+      while (fragments_remain) {
+        frag = _pool->fragment(_lib);
+        fragments_remain = _parser->next_fragment(*frag);
+        if (frag->num_hits()) {
+          break;
+        }
+        _pool->release(frag);
+        frag = NULL;
       }
-      delete frag;
-      frag = NULL;
-    }
-    for (size_t i = 0; frag && i < frag->hits().size(); ++i) {
-      FragHit& m = *(frag->hits()[i]);
-      
-      if (m.first_read() && m.first_read()->seq.length() > max_read_len) {
-        logger.severe("Length of first read for fragment '%s' is longer than "
-                      "maximum allowed read length (%d vs. %d). Increase the "
-                      "limit using the '--max-read-len,L' option.",
-                      m.frag_name().c_str(),  m.first_read()->seq.length(),
-                      max_read_len);
+      if (!frag) {
+        break;
       }
-      if (m.second_read() && m.second_read()->seq.length() > max_read_len) {
-        logger.severe("Length of second read for fragment '%s' is longer than "
-                      "maximum allowed read length (%d vs. %d). Increase the "
-                      "limit using the '--max-read-len,L' option.",
-                      m.frag_name().c_str(),  m.second_read()->seq.length(),
-                      max_read_len);
+      if (_skip) {
+        _skip--;
+        _pool->release(frag);
+        n++;
+        continue;
       }
-      
-      Target* t = targ_table.get_targ(m.target_id());
-      if (!t) {
-        logger.severe("Target sequence at index '%s' not found. Verify that it "
-                      "is in the SAM/BAM header and FASTA file.",
-                      m.target_id());
+
+      // Test that we have not already seen this fragment
+      if (_check_sorted && frags_seen.test_and_push(frag->name())) {
+        logger.severe("Alignments are not properly sorted. Read '%s' has "
+                      "alignments which are non-consecutive.",
+                      frag->name().c_str());
       }
-      m.target(t);
-      assert(t->id() == m.target_id());
-      
-      // Add num_neighbors targets on either side to the neighbors list.
-      // Used for experimental feature.
-      vector<const Target*> neighbors;
-      for (TargID j = 1; j <= num_neighbors;  j++) {
-        if (j <= m.target_id()) {
-          neighbors.push_back(targ_table.get_targ(m.target_id() - j));
+      dir_detector.add_fragment(frag);
+
+      for (size_t i = 0; i < frag->hits().size(); ++i) {
+        FragHit& m = *(frag->hits()[i]);
+
+        if (m.first_read() && m.first_read()->seq.length() > max_read_len) {
+          logger.severe("Length of first read for fragment '%s' is longer "
+                        "than maximum allowed read length (%d vs. %d). "
+                        "Increase the limit using the '--max-read-len,L' "
+                        "option.", m.frag_name().c_str(),
+                        m.first_read()->seq.length(), max_read_len);
         }
-        if (j + m.target_id() < targ_table.size()) {
-          neighbors.push_back(targ_table.get_targ(m.target_id() + j));
+        if (m.second_read() && m.second_read()->seq.length() > max_read_len) {
+          logger.severe("Length of second read for fragment '%s' is longer "
+                        "than maximum allowed read length (%d vs. %d). "
+                        "Increase the limit using the '--max-read-len,L' "
+                        "option.", m.frag_name().c_str(),
+                        m.second_read()->seq.length(), max_read_len);
         }
+
+        Target* t = targ_table.get_targ(m.target_id());
+        if (!t) {
+          logger.severe("Target sequence at index '%s' not found. Verify that "
+                        "it is in the SAM/BAM header and FASTA file.",
+                        m.target_id());
+        }
+        m.target(t);
+        assert(t->id() == m.target_id());
+
+        // Add num_neighbors targets on either side to the neighbors list.
+        // Used for experimental feature.
+        neighbors.clear();
+        for (TargID j = 1; j <= num_neighbors;  j++) {
+          if (j <= m.target_id()) {
+            neighbors.push_back(targ_table.get_targ(m.target_id() - j));
+          }
+          if (j + m.target_id() < targ_table.size()) {
+            neighbors.push_back(targ_table.get_targ(m.target_id() + j));
+          }
+        }
+        m.neighbors(neighbors);
       }
-      m.neighbors(neighbors);
-    }
-    boost::scoped_ptr<Fragment> done_frag(pts.proc_out.pop(false));
-    while (done_frag) {
-      if (_writer && _write_active) {
-        _writer->write_fragment(*done_frag);
+      batch->push_back(frag);
+      n++;
+      if (n % 1000000 == 0) {
+        dir_detector.report_if_improper_direction();
       }
+    }
+    if (!batch->empty()) {
+      run_stats.parse.add(parse_time.elapsed(), batch->size());
+    }
+
+    // Reuse any batches that have been written out without blocking.
+    FragBatch* done_batch = recycled.pop(false);
+    while (done_batch) {
+      free_batches.push_back(done_batch);
       still_out--;
-      done_frag.reset(pts.proc_out.pop(false));
+      done_batch = recycled.pop(false);
     }
 
-    if (!frag) {
+    if (batch->empty()) {
+      free_batches.push_back(batch);
       break;
     }
 
-    pts.proc_in.push(frag);
-    n++;
+    pts.proc_in.push(batch);
     still_out++;
   }
 
   pts.proc_in.push(NULL);
 
   while (still_out) {
-    boost::scoped_ptr<Fragment> done_frag(pts.proc_out.pop(true));
+    free_batches.push_back(recycled.pop(true));
+    still_out--;
+  }
+  pts.proc_out.push(NULL);
+  output.join();
+
+  foreach (FragBatch* batch, free_batches) {
+    delete batch;
+  }
+}
+
+void MapParser::post_process(FragBatch& batch) {
+  foreach (Fragment* done_frag, batch) {
     if (_writer && _write_active) {
       _writer->write_fragment(*done_frag);
     }
-    still_out--;
+    if (_equiv_classes) {
+      _equiv_classes->add_fragment(*done_frag);
+    }
+    if (_spill_writer) {
+      _spill_writer->write_fragment(*done_frag);
+    }
+  }
+  _pool->release_all(batch);
+  batch.clear();
+}
+
+void MapParser::output_batches(ParseThreadSafety* thread_safety,
+                               ThreadSafeFragQueue* recycled) {
+  while (FragBatch* batch = thread_safety->proc_out.pop()) {
+    post_process(*batch);
+    recycled->push(batch);
   }
 }
 
-BAMParser::BAMParser(BamTools::BamReader* reader) : _reader(reader) {
-  BamTools::BamAlignment a;
+BAMParser::BAMParser(BamTools::BamReader* reader, const string& file_name,
+                     FragPool* pool)
+    : _reader(reader), _bgzf(new BGZFReader(file_name, bam_threads)) {
+  _pool = pool;
 
   size_t index = 0;
   foreach(const BamTools::RefData& ref, _reader->GetReferenceData()) {
@@ -250,34 +365,130 @@ BAMParser::BAMParser(BamTools::BamReader* reader) : _reader(reader) {
   }
 
   // Get first valid ReadHit
-  _read_buff = new ReadHit();
+  skip_header();
+  _read_buff = _pool->read_hit();
   do {
-    if (!_reader->GetNextAlignment(a)) {
+    if (!read_alignment(_read_buff->bam)) {
       logger.severe("Input BAM file contains no valid alignments.");
     }
-  } while(!map_end_from_alignment(a));
+  } while(!map_end_from_alignment());
+}
+
+void BAMParser::skip_header() {
+  char magic[4];
+  unsigned char len_buff[4];
+  if (!_bgzf->read(magic, 4) || strncmp(magic, "BAM\1", 4)) {
+    logger.severe("Input BAM file has an invalid header.");
+  }
+
+  // Skip the header text.
+  _bgzf->read((char*)len_buff, 4);
+  _rec_buff.resize(le_uint32(len_buff));
+  _bgzf->read(&_rec_buff[0], _rec_buff.size());
+
+  // Skip the reference names and lengths, which BamTools has already parsed.
+  _bgzf->read((char*)len_buff, 4);
+  size_t num_refs = le_uint32(len_buff);
+  for (size_t i = 0; i < num_refs; ++i) {
+    _bgzf->read((char*)len_buff, 4);
+    _rec_buff.resize(le_uint32(len_buff) + 4);
+    if (!_bgzf->read(&_rec_buff[0], _rec_buff.size())) {
+      logger.severe("Input BAM file has a truncated header.");
+    }
+  }
+}
+
+bool BAMParser::read_alignment(BamTools::BamAlignment& a) {
+  static const char* CIGAR_OPS = "MIDNSHP=X";
+  static const char* SEQ_NUCS = "=ACMGRSVTWYHKDBN";
+
+  unsigned char len_buff[4];
+  if (!_bgzf->read((char*)len_buff, 4)) {
+    return false;
+  }
+  size_t block_size = le_uint32(len_buff);
+  if (block_size < 32) {
+    logger.severe("Input BAM file contains a malformed alignment record.");
+  }
+  _rec_buff.resize(block_size);
+  if (!_bgzf->read(&_rec_buff[0], block_size)) {
+    logger.severe("Input BAM file ends with a truncated alignment record.");
+  }
+  const unsigned char* p = (const unsigned char*)&_rec_buff[0];
+
+  // Fixed-length fields, as laid out in the SAM/BAM specification.
+  a.RefID = (int32_t)(uint32_t)le_uint32(p);
+  a.Position = (int32_t)(uint32_t)le_uint32(p + 4);
+  size_t bin_mq_nl = le_uint32(p + 8);
+  a.Bin = (uint16_t)(bin_mq_nl >> 16);
+  a.MapQuality = (uint16_t)((bin_mq_nl >> 8) & 0xff);
+  size_t name_len = bin_mq_nl & 0xff;
+  size_t flag_nc = le_uint32(p + 12);
+  a.AlignmentFlag = (uint32_t)(flag_nc >> 16);
+  size_t num_cigar = flag_nc & 0xffff;
+  size_t seq_len = le_uint32(p + 16);
+  a.Length = (int32_t)seq_len;
+  a.MateRefID = (int32_t)(uint32_t)le_uint32(p + 20);
+  a.MatePosition = (int32_t)(uint32_t)le_uint32(p + 24);
+  a.InsertSize = (int32_t)(uint32_t)le_uint32(p + 28);
+
+  size_t off = 32;
+  if (off + name_len + 4*num_cigar + (seq_len+1)/2 + seq_len > block_size) {
+    logger.severe("Input BAM file contains a malformed alignment record.");
+  }
+
+  a.Name.assign((const char*)p + off, (name_len) ? name_len - 1 : 0);
+  off += name_len;
+
+  a.CigarData.resize(num_cigar);
+  for (size_t i = 0; i < num_cigar; ++i) {
+    size_t op = le_uint32(p + off);
+    a.CigarData[i].Type = ((op & 0xf) < 9) ? CIGAR_OPS[op & 0xf] : '?';
+    a.CigarData[i].Length = (uint32_t)(op >> 4);
+    off += 4;
+  }
+
+  a.QueryBases.resize(seq_len);
+  for (size_t i = 0; i < seq_len; ++i) {
+    size_t code = (i & 1) ? p[off + i/2] & 0xf : p[off + i/2] >> 4;
+    a.QueryBases[i] = SEQ_NUCS[code];
+  }
+  off += (seq_len+1)/2;
+
+  if (seq_len && p[off] == 0xff) {
+    a.Qualities = "*";
+  } else {
+    a.Qualities.resize(seq_len);
+    for (size_t i = 0; i < seq_len; ++i) {
+      a.Qualities[i] = (char)(p[off + i] + 33);
+    }
+  }
+  off += seq_len;
+
+  a.TagData.assign((const char*)p + off, block_size - off);
+  return true;
 }
 
 bool BAMParser::next_fragment(Fragment& nf) {
   nf.add_map_end(_read_buff);
 
-  BamTools::BamAlignment a;
-  _read_buff = new ReadHit();
+  _read_buff = _pool->read_hit();
 
   while(true) {
-    if (!_reader->GetNextAlignment(a)) {
+    if (!read_alignment(_read_buff->bam)) {
       return false;
-    } else if (!map_end_from_alignment(a)) {
+    } else if (!map_end_from_alignment()) {
       continue;
     } else if (!nf.add_map_end(_read_buff)) {
       return true;
     }
-    _read_buff = new ReadHit();
+    _read_buff = _pool->read_hit();
   }
 }
 
-bool BAMParser::map_end_from_alignment(BamTools::BamAlignment& a) {
+bool BAMParser::map_end_from_alignment() {
   ReadHit& r = *_read_buff;
+  BamTools::BamAlignment& a = r.bam;
 
   if (!a.IsMapped()) {
     return false;
@@ -323,7 +534,6 @@ bool BAMParser::map_end_from_alignment(BamTools::BamAlignment& a) {
   r.left = a.Position;
   r.mate_l = a.MatePosition;
   r.seq.set(a.QueryBases, is_reversed);
-  r.bam = a;
   r.right = r.left + cigar_length(a.CigarData, r.inserts, r.deletes);
   
   foreach (Indel& indel, r.inserts) {
@@ -341,37 +551,129 @@ bool BAMParser::map_end_from_alignment(BamTools::BamAlignment& a) {
 }
 
 void BAMParser::reset() {
-  _reader->Rewind();
+  _bgzf->rewind();
+  skip_header();
 
-  // Get first valid FragHit
-  BamTools::BamAlignment a;
-  delete _read_buff;
-  _read_buff = new ReadHit();
+  // Get first valid FragHit. The current read buffer is not owned by a
+  // Fragment and can be reused.
   do {
-    _reader->GetNextAlignment(a);
-  } while(!map_end_from_alignment(a));
+    if (!read_alignment(_read_buff->bam)) {
+      logger.severe("Input BAM file contains no valid alignments.");
+    }
+  } while(!map_end_from_alignment());
 }
 
-SAMParser::SAMParser(istream* in) {
-  _in = in;
+SAMParser::SAMParser(istream* in, FragPool* pool)
+    : _in(in), _map(NULL), _map_len(0), _cur(NULL), _end(NULL), _body(NULL) {
+  _pool = pool;
+  _read_buff = _pool->read_hit();
+  parse_header(true);
+}
 
-  char line_buff[BUFF_SIZE];
-  _read_buff = new ReadHit();
-  _header = "";
+SAMParser::SAMParser(const string& file_name, FragPool* pool)
+    : _in(NULL), _map(NULL), _map_len(0), _cur(NULL), _end(NULL), _body(NULL) {
+  _pool = pool;
+#ifndef WIN32
+  int fd = open(file_name.c_str(), O_RDONLY);
+  struct stat st;
+  if (fd >= 0 && fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size) {
+    void* map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map != MAP_FAILED) {
+      _map = (char*)map;
+      _map_len = st.st_size;
+      madvise(_map, _map_len, MADV_SEQUENTIAL);
+    }
+  }
+  if (fd >= 0) {
+    close(fd);
+  }
+#endif
+  if (_map) {
+    _cur = _map;
+    _end = _map + _map_len;
+  } else {
+    // Fall back to streaming for pipes and other unmappable files.
+    _owned_in.reset(new ifstream(file_name.c_str(), ios::in | ios::binary));
+    if (!_owned_in->is_open()) {
+      logger.severe("Unable to open input SAM file '%s'.", file_name.c_str());
+    }
+    _in = _owned_in.get();
+  }
+  _read_buff = _pool->read_hit();
+  parse_header(true);
+}
+
+SAMParser::~SAMParser() {
+#ifndef WIN32
+  if (_map) {
+    munmap(_map, _map_len);
+  }
+#endif
+}
+
+bool SAMParser::fill_buffer() {
+  if (!_in->good()) {
+    return false;
+  }
+  size_t rem = _end - _cur;
+  if (_stream_buff.size() < STREAM_BUFF_SIZE) {
+    _stream_buff.resize(STREAM_BUFF_SIZE);
+  } else if (rem == _stream_buff.size()) {
+    // The current line does not fit in the buffer.
+    vector<char> bigger(2*_stream_buff.size());
+    copy(_cur, _end, bigger.begin());
+    _stream_buff.swap(bigger);
+    _cur = _end = &_stream_buff[0];
+  }
+  if (rem && _cur != &_stream_buff[0]) {
+    memmove(&_stream_buff[0], _cur, rem);
+  }
+  _in->read(&_stream_buff[rem], _stream_buff.size() - rem);
+  size_t n = _in->gcount();
+  _cur = &_stream_buff[0];
+  _end = _cur + rem + n;
+  return n > 0;
+}
 
-  // Parse header
+bool SAMParser::next_line(const char*& line, size_t& len) {
+  while (true) {
+    const char* nl = (_cur) ? (const char*)memchr(_cur, '\n', _end - _cur)
+                            : NULL;
+    if (nl) {
+      line = _cur;
+      len = nl - _cur;
+      _cur = nl + 1;
+      return true;
+    }
+    if (!_in || !fill_buffer()) {
+      // Return the final line if it is not terminated by a newline.
+      if (_cur == _end) {
+        return false;
+      }
+      line = _cur;
+      len = _end - _cur;
+      _cur = _end;
+      return true;
+    }
+  }
+}
+
+void SAMParser::parse_header(bool index_targets) {
+  const char* line = NULL;
+  size_t len = 0;
   size_t index = 0;
-  while(_in->good()) {
-    _in->getline(line_buff, BUFF_SIZE-1, '\n');
-    if (line_buff[0] != '@') {
+  _header = "";
+
+  while(next_line(line, len)) {
+    if (len == 0 || line[0] != '@') {
       break;
     }
-    _header += line_buff;
+    string str(line, len);
+    _header += str;
     _header += "\n";
 
-    string str(line_buff);
     size_t idx = str.find("SN:");
-    if (idx!=string::npos) {
+    if (index_targets && idx!=string::npos) {
       string name = str.substr(idx+3);
       name = name.substr(0,name.find_first_of("\n\t "));
       if (_targ_index.count(name)) {
@@ -386,51 +688,56 @@ SAMParser::SAMParser(istream* in) {
         _targ_lengths[name] = atoi(len.c_str());
       }
     }
+    line = NULL;
   }
+  _body = line;
 
   // Load first aligned read
-  while(!map_end_from_line(line_buff)) {
-    if (!_in->good()) {
+  while(!line || !map_end_from_line(line, len)) {
+    if (!next_line(line, len)) {
       logger.severe("Input SAM file contains no valid alignments.");
     }
-    _in->getline(line_buff, BUFF_SIZE-1, '\n');
   }
 }
 
 bool SAMParser::next_fragment(Fragment& nf) {
   nf.add_map_end(_read_buff);
 
-  _read_buff = new ReadHit();
-  char line_buff[BUFF_SIZE];
+  _read_buff = _pool->read_hit();
+  const char* line = NULL;
+  size_t len = 0;
 
-  while(_in->good()) {
-    _in->getline (line_buff, BUFF_SIZE-1, '\n');
-    if (!map_end_from_line(line_buff)) {
+  while(next_line(line, len)) {
+    if (!map_end_from_line(line, len)) {
       continue;
     }
     if (!nf.add_map_end(_read_buff)) {
-      break;
+      return true;
     }
-    _read_buff = new ReadHit();
+    _read_buff = _pool->read_hit();
   }
 
-  return _in->good();
+  return false;
 }
 
-bool SAMParser::map_end_from_line(char* line) {
+bool SAMParser::map_end_from_line(const char* line, size_t len) {
   ReadHit& r = *_read_buff;
-  string sam_line(line);
-  char *p = strtok(line, "\t");
+  const char* end = line + len;
+  const char* p = line;
   int sam_flag = 0;
   bool paired = 0;
   bool left_first = 0;
   bool other_reversed = 0;
 
   int i = 0;
-  while (p && i <= 9) {
+  while (p < end && i <= 9) {
+    const char* q = (const char*)memchr(p, '\t', end - p);
+    if (!q) {
+      q = end;
+    }
     switch(i++) {
       case 0: {
-        r.name = p;
+        r.name.assign(p, q - p);
         if (boost::algorithm::ends_with(r.name, "\1") ||
             boost::algorithm::ends_with(r.name, "\2")) {
           r.name = r.name.substr(r.name.size()-2);
@@ -438,7 +745,7 @@ bool SAMParser::map_end_from_line(char* line) {
         break;
       }
       case 1: {
-        sam_flag = atoi(p);
+        sam_flag = parse_int(p, q);
         if (sam_flag & 0x4) {
           goto stop;
         }
@@ -467,22 +774,25 @@ bool SAMParser::map_end_from_line(char* line) {
         if(p[0] == '*') {
           goto stop;
         }
-        if (!_targ_index.count(p)) {
+        _key_buff.assign(p, q - p);
+        TransIndex::const_iterator it = _targ_index.find(_key_buff);
+        if (it == _targ_index.end()) {
           logger.severe("Target sequence '%s' not found. Verify that it is in "
-                        "the SAM/BAM header and FASTA file.", p);
+                        "the SAM/BAM header and FASTA file.",
+                        _key_buff.c_str());
         }
-        r.targ_id = _targ_index[p];
+        r.targ_id = it->second;
         break;
       }
       case 3: {
-        r.left = (size_t)(atoi(p)-1);
+        r.left = (size_t)(parse_int(p, q)-1);
         break;
       }
       case 4: {
         break;
       }
       case 5: {
-        r.right = r.left + cigar_length(p, r.inserts, r.deletes);
+        r.right = r.left + cigar_length(p, q, r.inserts, r.deletes);
         foreach (Indel& indel, r.inserts) {
           if (indel.len > max_indel_size) {
             goto stop;
@@ -503,7 +813,7 @@ bool SAMParser::map_end_from_line(char* line) {
         break;
       }
       case 7: {
-        r.mate_l = atoi(p)-1;
+        r.mate_l = parse_int(p, q)-1;
         if (paired && ((r.reversed && r.left < (size_t)r.mate_l) ||
                        (other_reversed && r.left > (size_t)r.mate_l))) {
           goto stop;
@@ -514,74 +824,153 @@ bool SAMParser::map_end_from_line(char* line) {
         break;
       }
       case 9: {
-        r.seq.set(p, r.reversed);
-        r.sam = sam_line;
+        r.seq.set(p, q - p, r.reversed);
+        // Only the raw line is copied, into the recycled buffer, and only if
+        // it will be output.
+        if (_keep_lines) {
+          r.sam.assign(line, len);
+        }
         goto stop;
       }
     }
-    p = strtok(NULL, "\t");
+    p = q + 1;
   }
  stop:
   return i == 10;
 }
 
 void SAMParser::reset() {
+  // The current read buffer is not owned by a Fragment and can be reused.
+  if (_map) {
+    // Rewind to the first alignment without re-reading the header.
+    _cur = _body;
+    const char* line = NULL;
+    size_t len = 0;
+    while(!next_line(line, len) || !map_end_from_line(line, len)) {
+      if (_cur == _end) {
+        logger.severe("Input SAM file contains no valid alignments.");
+      }
+    }
+    return;
+  }
+
   // Rewind input file
   _in->clear();
   _in->seekg(0, ios::beg);
+  _cur = _end = NULL;
+  parse_header(false);
+}
 
-  // Load first alignment
-  char line_buff[BUFF_SIZE];
-  delete _read_buff;
-  _read_buff = new ReadHit();
+BAMWriter::BAMWriter(const string& file_name, const string& header_text,
+                     const BamTools::RefVector& refs, bool sample)
+    : _bgzf(new BGZFWriter(file_name, bam_threads)) {
+  _sample = sample;
 
-  while(_in->good()) {
-    _in->getline(line_buff, BUFF_SIZE-1, '\n');
-    if (line_buff[0] != '@') {
-      break;
+  // Header, as laid out in the SAM/BAM specification.
+  _rec_buff = "BAM\1";
+  append_le_uint32(_rec_buff, header_text.size());
+  _rec_buff.append(header_text);
+  append_le_uint32(_rec_buff, refs.size());
+  foreach (const BamTools::RefData& ref, refs) {
+    append_le_uint32(_rec_buff, ref.RefName.size() + 1);
+    _rec_buff.append(ref.RefName.c_str(), ref.RefName.size() + 1);
+    append_le_uint32(_rec_buff, (uint32_t)ref.RefLength);
+  }
+  _bgzf->write(_rec_buff.data(), _rec_buff.size());
+  _rec_buff.clear();
+}
+
+BAMWriter::~BAMWriter() {
+  _bgzf->close();
+}
+
+void BAMWriter::encode_alignment(const BamTools::BamAlignment& a,
+                                 const float* xp) {
+  static const string CIGAR_OPS = "MIDNSHP=X";
+  static const string SEQ_NUCS = "=ACMGRSVTWYHKDBN";
+
+  // The block size is filled in once the record is encoded.
+  size_t start = _rec_buff.size();
+  append_le_uint32(_rec_buff, 0);
+
+  append_le_uint32(_rec_buff, (uint32_t)a.RefID);
+  append_le_uint32(_rec_buff, (uint32_t)a.Position);
+  append_le_uint32(_rec_buff, ((size_t)a.Bin << 16) |
+                              ((size_t)(a.MapQuality & 0xff) << 8) |
+                              (a.Name.size() + 1));
+  append_le_uint32(_rec_buff, ((size_t)a.AlignmentFlag << 16) |
+                              a.CigarData.size());
+  append_le_uint32(_rec_buff, a.QueryBases.size());
+  append_le_uint32(_rec_buff, (uint32_t)a.MateRefID);
+  append_le_uint32(_rec_buff, (uint32_t)a.MatePosition);
+  append_le_uint32(_rec_buff, (uint32_t)a.InsertSize);
+
+  _rec_buff.append(a.Name.c_str(), a.Name.size() + 1);
+
+  foreach (const BamTools::CigarOp& op, a.CigarData) {
+    size_t code = CIGAR_OPS.find(op.Type);
+    if (code == string::npos) {
+      logger.severe("Alignment '%s' has an invalid CIGAR operation '%c'.",
+                    a.Name.c_str(), op.Type);
     }
+    append_le_uint32(_rec_buff, ((size_t)op.Length << 4) | code);
   }
 
-  while(!map_end_from_line(line_buff)) {
-    _in->getline(line_buff, BUFF_SIZE-1, '\n');
+  const string& seq = a.QueryBases;
+  for (size_t i = 0; i < seq.size(); i += 2) {
+    size_t hi = SEQ_NUCS.find(seq[i]);
+    size_t lo = (i + 1 < seq.size()) ? SEQ_NUCS.find(seq[i+1]) : 0;
+    hi = (hi == string::npos) ? 15 : hi;
+    lo = (lo == string::npos) ? 15 : lo;
+    _rec_buff.push_back((char)((hi << 4) | lo));
   }
-}
 
-BAMWriter::BAMWriter(BamTools::BamWriter* writer, bool sample)
-   : _writer(writer) {
-  _sample = sample;
-}
+  if (a.Qualities == "*" || a.Qualities.size() != seq.size()) {
+    _rec_buff.append(seq.size(), (char)0xff);
+  } else {
+    for (size_t i = 0; i < seq.size(); ++i) {
+      _rec_buff.push_back((char)(a.Qualities[i] - 33));
+    }
+  }
 
-BAMWriter::~BAMWriter() {
-  _writer->Close();
+  _rec_buff.append(a.TagData);
+  if (xp) {
+    _rec_buff.append("XPf", 3);
+    _rec_buff.append((const char*)xp, sizeof(float));
+  }
+
+  string block_size;
+  append_le_uint32(block_size, _rec_buff.size() - start - 4);
+  _rec_buff.replace(start, 4, block_size);
 }
 
 void BAMWriter::write_fragment(Fragment& f) {
+  _rec_buff.clear();
   if (_sample) {
     const FragHit* hit = f.sample_hit();
     PairStatus ps = hit->pair_status();
     if (ps != RIGHT_ONLY) {
-      _writer->SaveAlignment(hit->left_read()->bam);
+      encode_alignment(hit->left_read()->bam, NULL);
     }
     if (ps != LEFT_ONLY) {
-      _writer->SaveAlignment(hit->right_read()->bam);
+      encode_alignment(hit->right_read()->bam, NULL);
     }
   } else {
     double total = 0;
     foreach(FragHit* hit, f.hits()) {
       total += sexp(hit->params()->posterior);
+      float xp = (float)sexp(hit->params()->posterior);
       PairStatus ps = hit->pair_status();
       if (ps != RIGHT_ONLY) {
-        hit->left_read()->bam.AddTag("XP","f",(float)sexp(hit->params()->posterior));
-        _writer->SaveAlignment(hit->left_read()->bam);
+        encode_alignment(hit->left_read()->bam, &xp);
       }
       if (ps != LEFT_ONLY) {
-        hit->right_read()->bam.AddTag("XP","f",(float)sexp(hit->params()->posterior));
-        _writer->SaveAlignment(hit->right_read()->bam);
+        encode_alignment(hit->right_read()->bam, &xp);
       }
     }
     assert(approx_eq(total, 1.0));
   }
+  _bgzf->write(_rec_buff.data(), _rec_buff.size());
 }
 
 SAMWriter::SAMWriter(ostream* out, bool sample) : _out(out) {
@@ -10,19 +10,25 @@
 #define express_mapparser_h
 
 #include <api/BamReader.h>
-#include <api/BamWriter.h>
 #include <boost/scoped_ptr.hpp>
 #include <boost/thread.hpp>
 #include <boost/unordered_map.hpp>
 #include <string>
 #include <vector>
 
+#include <fstream>
 #include <iostream>
 
+#include "bgzfreader.h"
+#include "bgzfwriter.h"
+#include "threadsafety.h"
+
 class Fragment;
 class TargetTable;
 class FragHit;
-struct ParseThreadSafety;
+class FragPool;
+class EquivClassTable;
+class SpillWriter;
 struct ReadHit;
 struct Library;
 
@@ -50,12 +56,31 @@ class Parser {
    * A private pointer to the current/last read mapping being parsed.
    */
   ReadHit* _read_buff;
+  /**
+   * A private pointer to the FragPool that ReadHits are taken from. Pointer
+   * outlives this.
+   */
+  FragPool* _pool;
+  /**
+   * A private bool that is true iff the raw text of each mapping should be
+   * stored in its ReadHit, which is only needed to write SAM output.
+   */
+  bool _keep_lines;
 
  public:
+  /**
+   * Parser constructor.
+   */
+  Parser() : _keep_lines(false) {}
   /**
    * Dummy destructor.
    */
   virtual ~Parser(){};
+  /**
+   * A mutator that sets whether the raw text of each mapping is stored.
+   * @param b a bool that is true iff the raw text should be stored.
+   */
+  void keep_lines(bool b) { _keep_lines = b; }
   /**
    * An accessor for the SAM header string.
    * @return The SAM header string.
@@ -131,20 +156,44 @@ class BAMParser : public Parser {
    */
   boost::scoped_ptr<BamTools::BamReader> _reader;
   /**
-   * A private member function to parse a single read alignment and store the
-   * data in _read_buff.
-   * @param alignment a BamAlignment containing the data parsed by BamTools.
+   * A private pointer to the BGZFReader object that decompresses the BAM file
+   * in parallel. Alignment records are decoded directly from its stream.
+   * Automatically deleted with BAMParser object.
+   */
+  boost::scoped_ptr<BGZFReader> _bgzf;
+  /**
+   * A private buffer storing the raw bytes of the current alignment record.
+   */
+  std::vector<char> _rec_buff;
+  /**
+   * A private member function that skips past the BAM header in the
+   * decompressed stream.
+   */
+  void skip_header();
+  /**
+   * A private member function that decodes the next alignment record in the
+   * decompressed stream into the given BamAlignment.
+   * @param alignment the BamAlignment to fill.
+   * @return True iff an alignment was decoded and false at end of file.
+   */
+  bool read_alignment(BamTools::BamAlignment& alignment);
+  /**
+   * A private member function to parse the read alignment stored in
+   * _read_buff->bam and fill in the rest of _read_buff.
    * @return True if the mapping is valid and false otherwise
    */
-  bool map_end_from_alignment(BamTools::BamAlignment& alignment);
+  bool map_end_from_alignment();
 
  public:
   /**
-   * BAMParser constructor sets the reader.
-   * @param reader a pointer to the BamReader object that will directly parse
-   *        the BAM file.
+   * BAMParser constructor sets the reader and starts decompressing the file.
+   * @param reader a pointer to the BamReader object that has opened the BAM
+   *        file and parsed its header.
+   * @param file_name the path to the BAM file.
+   * @param pool a pointer to the FragPool to take ReadHits from.
    */
-  BAMParser(BamTools::BamReader* reader);
+  BAMParser(BamTools::BamReader* reader, const std::string& file_name,
+            FragPool* pool);
   /**
    * An accessor for the header string.
    * @return The header string.
@@ -166,7 +215,9 @@ class BAMParser : public Parser {
 
 /**
  * The SAMParser class fills Fragment objects by parsing an input in SAM format.
- * The input may come from a file or stdin.
+ * The input may come from a file, which is memory-mapped when possible, or a
+ * stream such as stdin, which is read in large blocks. Lines are parsed in
+ * place without length limits.
  *  @author    Adam Roberts
  *  @date      2011
  *  @copyright Artistic License 2.0
@@ -174,28 +225,102 @@ class BAMParser : public Parser {
 class SAMParser : public Parser
 {
   /**
-   * A private pointer to the input stream (either stdin or file) in SAM format.
+   * A private pointer to the input stream (either stdin or file) in SAM format,
+   * or NULL if the input file is memory-mapped.
    */
   std::istream* _in;
+  /**
+   * A private pointer to the input file stream if it was opened by this
+   * object. Automatically deleted with SAMParser object.
+   */
+  boost::scoped_ptr<std::ifstream> _owned_in;
+  /**
+   * A private pointer to the start of the memory-mapped input file, or NULL if
+   * reading from a stream.
+   */
+  char* _map;
+  /**
+   * A private size_t storing the length of the memory-mapped input file.
+   */
+  size_t _map_len;
+  /**
+   * A private buffer storing the current block read from the input stream.
+   * Unused if the input file is memory-mapped.
+   */
+  std::vector<char> _stream_buff;
+  /**
+   * A private pointer to the next unparsed character of the input.
+   */
+  const char* _cur;
+  /**
+   * A private pointer to one past the last available character of the input.
+   */
+  const char* _end;
+  /**
+   * A private pointer to the first alignment line of a memory-mapped input,
+   * which reset rewinds to.
+   */
+  const char* _body;
+  /**
+   * A private string used to look up target names without allocating.
+   */
+  std::string _key_buff;
   /**
    * A private string storing the SAM header.
    */
   std::string _header;
+  /**
+   * A private member function that reads more of the input stream into
+   * _stream_buff, keeping any unparsed partial line. The buffer is grown if the
+   * partial line fills it.
+   * @return True iff more characters were read.
+   */
+  bool fill_buffer();
+  /**
+   * A private member function that finds the next line of the input. The
+   * returned pointer is valid until the next call.
+   * @param line a reference to a pointer set to the start of the line.
+   * @param len a reference to a size_t set to the length of the line (not
+   *        including the newline).
+   * @return True iff a line was found and false at the end of the input.
+   */
+  bool next_line(const char*& line, size_t& len);
+  /**
+   * A private member function that parses the header lines of the input into
+   * _header (and the target maps if requested) and loads the first valid
+   * alignment into the existing _read_buff.
+   * @param index_targets true iff the target maps should be filled.
+   */
+  void parse_header(bool index_targets);
   /**
    * A private member function to parse a single read alignment and store the
    * data in _read_buff.
-   * @param alignment a BamAlignment containing the data parsed by BamTools.
+   * @param line a pointer to the (not null-terminated) SAM line.
+   * @param len the length of the line.
    * @return True if the mapping is valid and false otherwise
    */
-  bool map_end_from_line(char* line);
+  bool map_end_from_line(const char* line, size_t len);
 
 public:
   /**
-   * SAMParser constructor removes the header and parses the first line to
-   * start the first Fragment.
+   * SAMParser constructor for a stream. Removes the header and parses the
+   * first line to start the first Fragment.
    * @param in the input stream in SAM format, which may be a file or stdin.
+   * @param pool a pointer to the FragPool to take ReadHits from.
    */
-  SAMParser(std::istream* in);
+  SAMParser(std::istream* in, FragPool* pool);
+  /**
+   * SAMParser constructor for a file. Memory-maps the file if possible or
+   * otherwise opens it as a stream, then removes the header and parses the
+   * first line to start the first Fragment.
+   * @param file_name the path to the input file in SAM format.
+   * @param pool a pointer to the FragPool to take ReadHits from.
+   */
+  SAMParser(const std::string& file_name, FragPool* pool);
+  /**
+   * SAMParser destructor unmaps the input file if it is memory-mapped.
+   */
+  ~SAMParser();
   /**
    * An accessor for the header string.
    * @return The header string.
@@ -210,7 +335,8 @@ public:
   bool next_fragment(Fragment& f);
   /**
    * A member function that resets the parser and rewinds to the beginning of
-   * the SAM file.
+   * the SAM file. Memory-mapped input is rewound without re-reading the
+   * header.
    */
   void reset();
 };
@@ -225,31 +351,46 @@ public:
  **/
 class BAMWriter : public Writer {
   /**
-   * A private pointer to the BamTools::BamWriter object which directly writes
-   * the BAM file. Automatically deleted with BAMWriter object.
+   * A private pointer to the BGZFWriter object which compresses and writes the
+   * BAM file on its own threads. Automatically deleted with BAMWriter object.
+   */
+  boost::scoped_ptr<BGZFWriter> _bgzf;
+  /**
+   * A private buffer that alignment records are encoded into before being
+   * passed to the BGZFWriter, reused between fragments.
+   */
+  std::string _rec_buff;
+  /**
+   * A private member function that encodes an alignment as a BAM record at the
+   * end of _rec_buff.
+   * @param a the alignment to encode.
+   * @param xp a pointer to the posterior probability to add in the "XP" field,
+   *        or NULL if it should not be added.
    */
-  boost::scoped_ptr<BamTools::BamWriter> _writer;
+  void encode_alignment(const BamTools::BamAlignment& a, const float* xp);
 
  public:
   /**
-   * BAMWriter constructor stores a pointer to the BamTools::BamWriter object
-   * that will directly write to the BAM file.
-   * @param writer pointer to the BamTools::BamWriter objected assocaited with
-   *        the output BAM file.
+   * BAMWriter constructor opens the output BAM file and writes its header.
+   * @param file_name the path to the output BAM file.
+   * @param header_text the SAM header text of the input.
+   * @param refs the reference names and lengths of the input.
    * @param sample specifies if a single alignment should be sampled based on
    *        posteriors (true) or all output with their respective posterior
-
    *        probabilities (false).
    */
-  BAMWriter(BamTools::BamWriter* writer, bool sample);
+  BAMWriter(const std::string& file_name, const std::string& header_text,
+            const BamTools::RefVector& refs, bool sample);
   /**
-   * BAMWriter destructor closes the BamTools::BamWriter object.
+   * BAMWriter destructor compresses and writes any remaining alignments and
+   * closes the BAM file.
    */
   ~BAMWriter();
   /**
    * A member function that writes the mappings to the output BAM file. If
    * _sample is true, a only one alignment is output, otherwise all mappings are
-   * output along with their probabilities in the "XP" field.
+   * output along with their probabilities in the "XP" field. The records are
+   * encoded on the calling thread and compressed and written asynchronously.
    * @param f the processed Fragment to output alignments of.
    */
   void write_fragment(Fragment& f);
@@ -307,6 +448,12 @@ class SAMWriter : public Writer {
  **/
 class MapParser
 {
+  /**
+   * A private pointer to the FragPool that recycles the Fragment objects
+   * passed through the pipeline. Only used by the parsing thread.
+   * Automatically deleted with MapParser.
+   */
+  boost::scoped_ptr<FragPool> _pool;
   /**
    * A private pointer to the Parser object that will read the input in SAM/BAM
    * format. Automatically deleted with MapParser.
@@ -326,6 +473,47 @@ class MapParser
    * processing.
    */
   bool _write_active;
+  /**
+   * A private pointer to the EquivClassTable that processed Fragments are
+   * added to, or NULL if equivalence classes are not being collected. Pointer
+   * outlives this.
+   */
+  EquivClassTable* _equiv_classes;
+  /**
+   * A private pointer to the SpillWriter that processed Fragments are written
+   * to, or NULL if they are not being spilled. Pointer outlives this.
+   */
+  SpillWriter* _spill_writer;
+  /**
+   * A private size_t storing the number of Fragments at the start of the input
+   * that the next parse should read and discard without processing.
+   */
+  size_t _skip;
+  /**
+   * A private bool specifying whether the parser should check that the
+   * alignments of each fragment are consecutive in the input.
+   */
+  bool _check_sorted;
+  /**
+   * A private member function that writes the processed Fragments in the given
+   * batch to the output map file (depending on settings), adds them to the
+   * equivalence classes and spill file (if collecting), returns them to the
+   * FragPool, and empties the batch so that it can be reused.
+   * @param batch the FragBatch returned by the processing stages.
+   */
+  void post_process(FragBatch& batch);
+  /**
+   * A private member function run by the output thread of threaded_parse. It
+   * post-processes the batches returned by the processing stages, so that
+   * output never blocks parsing until the bounded proc_out queue is full, and
+   * passes the emptied batches back to the parser for reuse, until a NULL
+   * batch is popped.
+   * @param thread_safety a pointer to the struct containing the queue of
+   *        processed batches.
+   * @param recycled a pointer to the queue to return the emptied batches on.
+   */
+  void output_batches(ParseThreadSafety* thread_safety,
+                      ThreadSafeFragQueue* recycled);
 
  public:
   /**
@@ -338,11 +526,14 @@ class MapParser
   MapParser(Library* lib, bool write_active);
   /**
    * A member function that drives the parse thread. When all valid mappings of
-   * a fragment have been parsed, its mapped targets are found and the
-   * information is passed in a Fragment object to the processing thread through
-   * a queue in the ParseThreadSafety struct. After processing, the Fragment
-   * returns on a different in queue, and is written to the output map file
-   * (depending on settings) and deleted.
+   * a fragment have been parsed, its mapped targets are found, its direction
+   * is counted, the order of the input is checked (depending on settings), and
+   * the Fragment is added to the current batch. Full batches are passed
+   * directly to the processing threads through a queue in the
+   * ParseThreadSafety struct. After processing, the batch returns on a
+   * different queue to an output thread started here, which writes its
+   * Fragments to the output map file (depending on settings) and releases
+   * them before the batch is reused.
    * @param thread_safety a pointer to the struct containing shared queues with
    *        the processing thread.
    * @param stop_at a size_t indicating how many reads to process before
@@ -368,7 +559,39 @@ class MapParser
    * or not the alignments (sampled or with probs) should be ouptut.
    * @param b updated write-active status
    */
-  void write_active(bool b) { _write_active = b; }
+  void write_active(bool b) {
+    _write_active = b;
+    _parser->keep_lines(_writer && b);
+  }
+  /**
+   * A mutator for whether the parser checks that the alignments of each
+   * fragment are consecutive in the input, exiting with an error if not.
+   * @param b updated check-sorted status
+   */
+  void check_sorted(bool b) { _check_sorted = b; }
+  /**
+   * A mutator for the EquivClassTable that processed Fragments are added to.
+   * @param equiv_classes a pointer to the table to add Fragments to, or NULL to
+   *        stop collecting equivalence classes.
+   */
+  void collect_equiv_classes(EquivClassTable* equiv_classes) {
+    _equiv_classes = equiv_classes;
+  }
+  /**
+   * A mutator for the SpillWriter that processed Fragments are written to.
+   * @param spill_writer a pointer to the writer to write Fragments to, or NULL
+   *        to stop spilling.
+   */
+  void spill_writer(SpillWriter* spill_writer) {
+    _spill_writer = spill_writer;
+  }
+  /**
+   * A mutator for the number of Fragments at the start of the input that the
+   * next parse should read and discard, such as those already processed
+   * before a checkpoint. They still count towards stop_at.
+   * @param num_frags the number of Fragments to skip.
+   */
+  void skip_fragments(size_t num_frags) { _skip = num_frags; }
   /**
    * A member function that resets the input parser.
    */
@@ -117,6 +117,30 @@ void MarkovModel::fast_learn(const Sequence& seq, double mass,
     return;
   }
 
+  if (!seq.prob()) {
+    // Sum the (non-logged) weights of each k-mer so that the parameters are
+    // incremented once per distinct k-mer instead of once per position.
+    const size_t len = seq.length();
+    vector<unsigned int> kmers;
+    seq.kmer_indices(_order+1, kmers);
+    vector<double> weights((_bitclear+1) << 2, 0);
+    size_t tail_start = (fl_cmf.size() > len) ? 0 : len - fl_cmf.size() + 1;
+    tail_start = min(tail_start, len);
+    size_t i = _order;
+    for (; i < tail_start; ++i) {
+      weights[kmers[i]] += 1;
+    }
+    for (; i < len; ++i) {
+      weights[kmers[i]] += sexp(fl_cmf[len-i]);
+    }
+    for (size_t k = 0; k < weights.size(); ++k) {
+      if (weights[k] > 0) {
+        _params[_order].increment(k >> 2, k & 3, mass + log(weights[k]));
+      }
+    }
+    return;
+  }
+
   size_t cond = 0;
   for (int i = 0; i < _order; ++i) {
      cond = (cond << 2) + seq[i];
@@ -212,3 +236,16 @@ double MarkovModel::marginal_prob(size_t w, size_t nuc) const {
   }
   return marg-tot;
 }
+
+void MarkovModel::add(const MarkovModel& other) {
+  assert(_params.size() == other._params.size());
+  for (size_t p = 0; p < _params.size(); ++p) {
+    _params[p].add(other._params[p]);
+  }
+}
+
+void MarkovModel::clear() {
+  for (size_t p = 0; p < _params.size(); ++p) {
+    _params[p].clear();
+  }
+}
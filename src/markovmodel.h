@@ -139,6 +139,16 @@ class MarkovModel {
    * fills in the lower-order transitions.
    */
   void calc_marginals();
+  /**
+   * A member function that adds the transition counts of another MarkovModel
+   * with the same order and window to this one.
+   * @param other the MarkovModel whose counts are added.
+   */
+  void add(const MarkovModel& other);
+  /**
+   * A member function that sets all transition counts to zero.
+   */
+  void clear();
 };
 
 #endif
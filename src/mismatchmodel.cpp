@@ -11,11 +11,178 @@
 #include "targets.h"
 #include "fragments.h"
 #include "sequence.h"
+#include <boost/cstdint.hpp>
 #include <iostream>
 #include <fstream>
 
 using namespace std;
 
+/**
+ * The number of read positions whose mismatch table indices are computed at a
+ * time by the indel-free fast path. Must be a multiple of 32.
+ */
+const size_t MM_CHUNK_SIZE = 64;
+
+/**
+ * The UnpackTable struct stores, for each byte of a packed sequence, its 4
+ * encoded nucleotides as consecutive bytes of a little-endian 32-bit integer.
+ */
+struct UnpackTable {
+  boost::uint32_t nucs[256];
+  UnpackTable() {
+    for (size_t b = 0; b < 256; ++b) {
+      nucs[b] = (b & 3) | ((b >> 2 & 3) << 8) | ((b >> 4 & 3) << 16) |
+                ((boost::uint32_t)(b >> 6 & 3) << 24);
+    }
+  }
+};
+const UnpackTable UNPACK;
+
+/**
+ * A helper function that returns 32 nucleotides of a packed sequence starting
+ * at any position as a single word, with the first in the lowest 2 bits.
+ * Positions past the end of the sequence are 0.
+ * @param packed a pointer to the packed sequence.
+ * @param len the length of the sequence.
+ * @param pos the position of the first nucleotide, which must be < len.
+ * @return The word of 32 packed nucleotides.
+ */
+inline boost::uint64_t packed_word(const unsigned char* packed, size_t len,
+                                   size_t pos) {
+  size_t byte = pos >> 2;
+  size_t shift = (pos & 3) << 1;
+  size_t num_bytes = min(packed_size(len) - byte, (size_t)9);
+  boost::uint64_t word = 0;
+  for (size_t k = 0; k < min(num_bytes, (size_t)8); ++k) {
+    word |= (boost::uint64_t)packed[byte + k] << (k << 3);
+  }
+  word >>= shift;
+  if (num_bytes == 9 && shift) {
+    word |= (boost::uint64_t)packed[byte + 8] << (64 - shift);
+  }
+  return word;
+}
+
+/**
+ * A helper function that unpacks consecutive nucleotides of a packed sequence
+ * into one byte each, a word of 32 at a time.
+ * @param packed a pointer to the packed sequence.
+ * @param len the length of the sequence.
+ * @param pos the position of the first nucleotide to unpack.
+ * @param n the number of nucleotides to unpack, which must be at most
+ *        MM_CHUNK_SIZE.
+ * @param out a pointer to the MM_CHUNK_SIZE bytes to store the nucleotides in.
+ *        Bytes past the first n are overwritten.
+ */
+inline void unpack_nucs(const unsigned char* packed, size_t len, size_t pos,
+                        size_t n, unsigned char* out) {
+  for (size_t c = 0; c < n; c += 32) {
+    boost::uint64_t word = packed_word(packed, len, pos + c);
+    for (size_t b = 0; b < 8; ++b) {
+      boost::uint32_t nucs = UNPACK.nucs[(word >> (b << 3)) & 255];
+      memcpy(out + c + (b << 2), &nucs, 4);
+    }
+  }
+}
+
+/**
+ * A helper function that computes the mismatch table indices
+ * ((prev << 4) + (ref << 2) + cur) for a chunk of positions of a read without
+ * indels. The index of a position combines the read nucleotides at it (cur)
+ * and before it (prev, or 0 at the first position) with the reference
+ * nucleotide it is aligned to (ref). These are the row ((prev << 2) + ref) and
+ * column (cur) of the FrequencyMatrix of the position flattened.
+ * @param read_seq the sequence of the read.
+ * @param targ_seq the forward sequence of the target.
+ * @param ref_start the target position aligned to the first read position,
+ *        or one past it if rev.
+ * @param rev a bool that is true iff the read is compared to the reverse
+ *        complement of the target, going left from ref_start.
+ * @param i the first read position of the chunk.
+ * @param n the number of positions in the chunk (at most MM_CHUNK_SIZE).
+ * @param indices a pointer to the MM_CHUNK_SIZE bytes to store the indices in.
+ */
+inline void chunk_indices(const SequenceFwd& read_seq,
+                          const SequenceFwd& targ_seq, size_t ref_start,
+                          bool rev, size_t i, size_t n,
+                          unsigned char* indices) {
+  unsigned char cur[MM_CHUNK_SIZE];
+  unsigned char ref[MM_CHUNK_SIZE];
+  unpack_nucs(read_seq.packed(), read_seq.length(), i, n, cur);
+  if (rev) {
+    unsigned char fwd[MM_CHUNK_SIZE];
+    unpack_nucs(targ_seq.packed(), targ_seq.length(), ref_start - i - n, n,
+                fwd);
+    for (size_t k = 0; k < n; ++k) {
+      ref[k] = complement(fwd[n - 1 - k]);
+    }
+  } else {
+    unpack_nucs(targ_seq.packed(), targ_seq.length(), ref_start + i, n, ref);
+  }
+  unsigned char prev = (i) ? read_seq[i - 1] : 0;
+  indices[0] = (prev << 4) | (ref[0] << 2) | cur[0];
+  for (size_t k = 1; k < n; ++k) {
+    indices[k] = (cur[k - 1] << 4) | (ref[k] << 2) | cur[k];
+  }
+}
+
+/**
+ * A helper function that returns true iff the mismatches of a read to a target
+ * can be computed by the indel-free fast path.
+ * @param read the read.
+ * @param targ_seq the forward sequence of the target.
+ * @return True iff the read has no indels and neither sequence is
+ *         probabilistic.
+ */
+inline bool indel_free(const ReadHit& read, const Sequence& targ_seq) {
+  return read.inserts.empty() && read.deletes.empty() && !targ_seq.prob() &&
+         !read.seq.prob();
+}
+
+double MismatchTable::indel_free_log_likelihood(
+    const ReadHit& read, const SequenceFwd& targ_seq, bool rev,
+    const vector<FrequencyMatrix<double> >& mm, double ll) const {
+  size_t len = read.seq.length();
+  size_t ref_start = (rev) ? read.right : read.left;
+  double ins_0 = _insert_params(0);
+  double del_0 = _delete_params(0);
+  unsigned char indices[MM_CHUNK_SIZE];
+  for (size_t i = 0; i < len; i += MM_CHUNK_SIZE) {
+    size_t n = min(MM_CHUNK_SIZE, len - i);
+    chunk_indices(read.seq, targ_seq, ref_start, rev, i, n, indices);
+    for (size_t k = 0; k < n; ++k) {
+      ll += ins_0;
+      ll += del_0;
+      ll += mm[i + k]((size_t)indices[k] >> 2, (size_t)indices[k] & 3);
+    }
+  }
+  return ll;
+}
+
+void MismatchTable::indel_free_update(const ReadHit& read,
+                                      const SequenceFwd& targ_seq, bool rev,
+                                      double p, double mass,
+                                      MismatchTable& accum,
+                                      vector<FrequencyMatrix<double> >& acc)
+    const {
+  size_t len = read.seq.length();
+  size_t ref_start = (rev) ? read.right : read.left;
+  unsigned char indices[MM_CHUNK_SIZE];
+  for (size_t i = 0; i < len; i += MM_CHUNK_SIZE) {
+    size_t n = min(MM_CHUNK_SIZE, len - i);
+    chunk_indices(read.seq, targ_seq, ref_start, rev, i, n, indices);
+    for (size_t k = 0; k < n; ++k) {
+      accum._insert_params.increment(0, mass);
+      accum._delete_params.increment(0, mass);
+      acc[i + k].increment((size_t)indices[k] >> 2, (size_t)indices[k] & 3,
+                         mass + p);
+    }
+  }
+  if (len) {
+    accum._max_len = max(accum._max_len, len);
+  }
+}
+
 MismatchTable::MismatchTable(double alpha)
     : _first_read_mm(max_read_len, FrequencyMatrix<double>(16, 4, alpha)),
       _second_read_mm(max_read_len, FrequencyMatrix<double>(16, 4, alpha)),
@@ -272,7 +439,12 @@ double MismatchTable::log_likelihood(const FragHit& f) const {
 
   double ll = 0;
 
-  if (f.left_read()) {
+  if (f.left_read() && indel_free(*f.left_read(), t_seq_fwd)) {
+    const ReadHit& read_l = *f.left_read();
+    ll = indel_free_log_likelihood(read_l, targ.seq_fwd(), false,
+                                   (read_l.first) ? _first_read_mm :
+                                                    _second_read_mm, ll);
+  } else if (f.left_read()) {
     const ReadHit& read_l = *f.left_read();
     const vector<FrequencyMatrix<double> >& left_mm = (read_l.first) ?
                                                       _first_read_mm :
@@ -329,7 +501,12 @@ double MismatchTable::log_likelihood(const FragHit& f) const {
     }
   }
   
-  if (f.right_read()) {
+  if (f.right_read() && indel_free(*f.right_read(), t_seq_rev)) {
+    const ReadHit& read_r = *f.right_read();
+    ll = indel_free_log_likelihood(read_r, targ.seq_fwd(), true,
+                                   (read_r.first) ? _first_read_mm :
+                                                    _second_read_mm, ll);
+  } else if (f.right_read()) {
     const ReadHit& read_r = *f.right_read();
     
     const vector<FrequencyMatrix<double> >& right_mm = (read_r.first) ?
@@ -391,6 +568,11 @@ double MismatchTable::log_likelihood(const FragHit& f) const {
 }
 
 void MismatchTable::update(const FragHit& f, double p, double mass) {
+  update(f, p, mass, *this);
+}
+
+void MismatchTable::update(const FragHit& f, double p, double mass,
+                           MismatchTable& accum) const {
   if (mass == LOG_0) {
     return;
   }
@@ -399,11 +581,20 @@ void MismatchTable::update(const FragHit& f, double p, double mass) {
   Sequence& t_seq_fwd = targ.seq(0);
   Sequence& t_seq_rev = targ.seq(1);
 
-  if (f.left_read()) {
+  if (f.left_read() && indel_free(*f.left_read(), t_seq_fwd)) {
     const ReadHit& read_l = *f.left_read();
-    vector<FrequencyMatrix<double> >& left_mm = (read_l.first) ?
-                                                _first_read_mm :
-                                                _second_read_mm;
+    assert(targ.length() >= f.right());
+    indel_free_update(read_l, targ.seq_fwd(), false, p, mass, accum,
+                      (read_l.first) ? accum._first_read_mm :
+                                       accum._second_read_mm);
+  } else if (f.left_read()) {
+    const ReadHit& read_l = *f.left_read();
+    const vector<FrequencyMatrix<double> >& left_mm = (read_l.first) ?
+                                                      _first_read_mm :
+                                                      _second_read_mm;
+    vector<FrequencyMatrix<double> >& left_acc = (read_l.first) ?
+                                                 accum._first_read_mm :
+                                                 accum._second_read_mm;
     size_t i = 0;  // read index
     size_t j = read_l.left;  // genomic index
 
@@ -418,21 +609,21 @@ void MismatchTable::update(const FragHit& f, double p, double mass) {
     assert(targ.length() >= f.right());
     while (i < read_l.seq.length()) {
       if (del != read_l.deletes.end() && del->pos == i) {
-        _delete_params.increment(del->len, mass);
+        accum._delete_params.increment(del->len, mass);
         j += del->len;
         del++;
         deletion = true;
       } else if (ins != read_l.inserts.end() && ins->pos == i) {
-        _insert_params.increment(ins->len, mass);
+        accum._insert_params.increment(ins->len, mass);
         i += ins->len;
         ins++;
         insertion = true;
       } else {
         if (!insertion) {
-          _insert_params.increment(0, mass);
+          accum._insert_params.increment(0, mass);
         }
         if (!deletion) {
-          _delete_params.increment(0, mass);
+          accum._delete_params.increment(0, mass);
         }
         insertion = false;
         deletion = false;
@@ -461,7 +652,7 @@ void MismatchTable::update(const FragHit& f, double p, double mass) {
 
           for (size_t nuc = 0; !left_mm[i].is_fixed() && nuc < NUM_NUCS; nuc++) {
             size_t index = prev + nuc;
-            left_mm[i].increment(index, cur,
+            left_acc[i].increment(index, cur,
                                  mass + p + t_seq_fwd.get_prob(j, nuc));
           }
 
@@ -471,21 +662,29 @@ void MismatchTable::update(const FragHit& f, double p, double mass) {
         } else {
           size_t ref = t_seq_fwd[j];
           size_t index = prev + ref;
-          left_mm[i].increment(index, cur, mass + p);
+          left_acc[i].increment(index, cur, mass + p);
         }
 
         i++;
         j++;
       }
     }
-    _max_len = max(_max_len, read_l.seq.length());
+    accum._max_len = max(accum._max_len, read_l.seq.length());
   }
   
-  if (f.right_read()) {
+  if (f.right_read() && indel_free(*f.right_read(), t_seq_rev)) {
     const ReadHit& read_r = *f.right_read();
-    vector<FrequencyMatrix<double> >& right_mm = (read_r.first) ?
-                                                  _first_read_mm :
-                                                  _second_read_mm;
+    indel_free_update(read_r, targ.seq_fwd(), true, p, mass, accum,
+                      (read_r.first) ? accum._first_read_mm :
+                                       accum._second_read_mm);
+  } else if (f.right_read()) {
+    const ReadHit& read_r = *f.right_read();
+    const vector<FrequencyMatrix<double> >& right_mm = (read_r.first) ?
+                                                       _first_read_mm :
+                                                       _second_read_mm;
+    vector<FrequencyMatrix<double> >& right_acc = (read_r.first) ?
+                                                  accum._first_read_mm :
+                                                  accum._second_read_mm;
     
     size_t r_len = read_r.seq.length();
     size_t i = 0;
@@ -501,22 +700,22 @@ void MismatchTable::update(const FragHit& f, double p, double mass) {
 
     while (i < r_len) {
       if (del != read_r.deletes.begin()-1 && del->pos == r_len-i ) {
-        _delete_params.increment(del->len, mass);
+        accum._delete_params.increment(del->len, mass);
         j += del->len;
         del--;
         deletion = true;
       } else if (ins != read_r.inserts.begin() - 1 &&
                  ins->pos + ins->len == r_len-i) {
-        _insert_params.increment(ins->len, mass);
+        accum._insert_params.increment(ins->len, mass);
         i += ins->len;
         ins--;
         insertion = true;
       } else {
         if (!insertion) {
-          _delete_params.increment(0, mass);
+          accum._delete_params.increment(0, mass);
         }
         if (!deletion) {
-          _insert_params.increment(0, mass);
+          accum._insert_params.increment(0, mass);
         }
         insertion = false;
         deletion = false;
@@ -544,7 +743,8 @@ void MismatchTable::update(const FragHit& f, double p, double mass) {
 
           for (size_t nuc = 0; !right_mm[i].is_fixed() && nuc < NUM_NUCS; nuc++) {
             size_t index = prev + nuc;
-            right_mm[i].increment(index, cur, mass+p+t_seq_rev.get_prob(j, nuc));
+            right_acc[i].increment(index, cur,
+                                   mass+p+t_seq_rev.get_prob(j, nuc));
           }
 
           for (size_t nuc=0; nuc < NUM_NUCS; nuc++) {
@@ -553,17 +753,49 @@ void MismatchTable::update(const FragHit& f, double p, double mass) {
         } else {
           size_t ref = t_seq_rev[j];
           size_t index = prev + ref;
-          right_mm[i].increment(index, cur, mass+p);
+          right_acc[i].increment(index, cur, mass+p);
         }
 
         i++;
         j++;
       }
-      _max_len = max(_max_len, read_r.seq.length());
+      accum._max_len = max(accum._max_len, read_r.seq.length());
     }
   }
 }
 
+void MismatchTable::add(const MismatchTable& other) {
+  for (size_t i = 0; i < max_read_len; i++) {
+    _first_read_mm[i].add(other._first_read_mm[i]);
+    _second_read_mm[i].add(other._second_read_mm[i]);
+  }
+  _insert_params.add(other._insert_params);
+  _delete_params.add(other._delete_params);
+  _max_len = max(_max_len, other._max_len);
+}
+
+double MismatchTable::max_change(const MismatchTable& other) const {
+  double change = max(_insert_params.max_total_variation(other._insert_params),
+                      _delete_params.max_total_variation(other._delete_params));
+  size_t len = min(max(_max_len, other._max_len), max_read_len);
+  for (size_t i = 0; i < len; i++) {
+    change = max(change, max(
+        _first_read_mm[i].max_total_variation(other._first_read_mm[i]),
+        _second_read_mm[i].max_total_variation(other._second_read_mm[i])));
+  }
+  return change;
+}
+
+void MismatchTable::clear() {
+  for (size_t i = 0; i < max_read_len; i++) {
+    _first_read_mm[i].clear();
+    _second_read_mm[i].clear();
+  }
+  _insert_params.clear();
+  _delete_params.clear();
+  _max_len = 0;
+}
+
 void MismatchTable::fix() {
   for (size_t i = 0; i < max_read_len; i++) {
     _first_read_mm[i].fix();
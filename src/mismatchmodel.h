@@ -12,7 +12,9 @@
 #include "frequencymatrix.h"
 
 class FragHit;
+class SequenceFwd;
 class Target;
+struct ReadHit;
 
 /**
 
@@ -55,6 +57,41 @@ class MismatchTable {
    * probabalistic target sequences are not updated.
    */
   bool _active;
+  /**
+   * A private member function that adds the log likelihood of the mismatches
+   * of a read without indels to a non-probabilistic target to the given value.
+   * The mismatch table indices are computed from whole words of the packed
+   * read and target sequences, and the terms are accumulated in the same order
+   * as in log_likelihood so that the result is identical.
+   * @param read the read, which must not have any indels.
+   * @param targ_seq the forward sequence of the target the read is mapped to.
+   * @param rev a bool that is true iff the read is the right read, which is
+   *        compared to the reverse complement of the target.
+   * @param mm the mismatch parameters for the read's position in the fragment.
+   * @param ll the log likelihood to add to.
+   * @return The updated log likelihood.
+   */
+  double indel_free_log_likelihood(
+      const ReadHit& read, const SequenceFwd& targ_seq, bool rev,
+      const std::vector<FrequencyMatrix<double> >& mm, double ll) const;
+  /**
+   * A private member function that adds the error model counts of a read
+   * without indels to a non-probabilistic target to the given accumulator,
+   * making the same increments as update.
+   * @param read the read, which must not have any indels.
+   * @param targ_seq the forward sequence of the target the read is mapped to.
+   * @param rev a bool that is true iff the read is the right read, which is
+   *        compared to the reverse complement of the target.
+   * @param p the logged posterior probablity of the alignment.
+   * @param mass the logged mass of the fragment.
+   * @param accum the MismatchTable to add the indel counts to.
+   * @param acc the mismatch parameters of accum for the read's position in the
+   *        fragment.
+   */
+  void indel_free_update(const ReadHit& read, const SequenceFwd& targ_seq,
+                         bool rev, double p, double mass,
+                         MismatchTable& accum,
+                         std::vector<FrequencyMatrix<double> >& acc) const;
 
  public:
   /**
@@ -117,6 +154,38 @@ class MismatchTable {
    * @param mass the logged mass of the fragment.
    */
   void update(const FragHit&, double p, double mass);
+  /**
+   * A member function that computes the same update as the above, using the
+   * current parameters of this table, but adds the error model counts to the
+   * given accumulator table instead. The sequence parameters are still updated
+   * directly.
+   * @param f the fragment mapping.
+   * @param p the logged posterior probablity of the alignment.
+   * @param mass the logged mass of the fragment.
+   * @param accum the MismatchTable to add the counts to.
+   */
+  void update(const FragHit& f, double p, double mass,
+              MismatchTable& accum) const;
+  /**
+   * A member function that adds the error model counts of another
+   * MismatchTable to this one. Has no effect once the table is fixed.
+   * @param other the MismatchTable whose counts are added.
+   */
+  void add(const MismatchTable& other);
+  /**
+   * A member function that returns the largest change between the error model
+   * distributions of this table and another, as the maximum total variation
+   * distance of any mismatch distribution of an observed read position or of
+   * the indel length distributions.
+   * @param other the MismatchTable to compare to.
+   * @return The maximum total variation distance, between 0 and 1.
+   */
+  double max_change(const MismatchTable& other) const;
+  /**
+   * A member function that sets all error model counts to zero so that the
+   * table can be used as an accumulator for another.
+   */
+  void clear();
   /**
    * Freezes the parameters to allow for faster computation after burn out.
    * Cannot be undone.
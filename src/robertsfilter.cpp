@@ -7,33 +7,94 @@
 //
 
 #include "robertsfilter.h"
+#include <cassert>
+#include <stdlib.h>
 
 using namespace std;
 
 RobertsFilter::RobertsFilter(size_t local_size, size_t global_size)
-    : _global_vector(global_size),
+    : _local_queue(local_size + 1),
+      _local_head(0),
+      _local_count(0),
+      _global_vector(global_size),
+      _global_count(0),
+      _table_bits(4),
       _local_size(local_size),
       _global_size(global_size) {
+  // Keep the table at most half full.
+  while (((size_t)1 << _table_bits) < 2*(local_size + global_size + 1)) {
+    _table_bits++;
+  }
+  _table = vector<boost::uint64_t>((size_t)1 << _table_bits, 0);
+}
+
+boost::uint64_t RobertsFilter::fingerprint(const string& key) {
+  // 64-bit FNV-1a
+  boost::uint64_t fp = 0xCBF29CE484222325ULL;
+  for (size_t i = 0; i < key.size(); ++i) {
+    fp ^= (unsigned char)key[i];
+    fp *= 0x100000001B3ULL;
+  }
+  return (fp) ? fp : 1;
 }
 
-bool RobertsFilter::test_and_push(const string& key) {
-  if (_local_set.count(key) || _global_set.count(key)) {
+size_t RobertsFilter::find(boost::uint64_t fp) const {
+  size_t mask = _table.size() - 1;
+  size_t i = home(fp);
+  while (_table[i] && _table[i] != fp) {
+    i = (i + 1) & mask;
+  }
+  return i;
+}
+
+void RobertsFilter::erase(boost::uint64_t fp) {
+  size_t mask = _table.size() - 1;
+  size_t i = find(fp);
+  assert(_table[i] == fp);
+  size_t j = i;
+  while (true) {
+    j = (j + 1) & mask;
+    if (!_table[j]) {
+      break;
+    }
+    // Entries whose preferred slot is cyclically in (i, j] stay in place.
+    size_t k = home(_table[j]);
+    if ((i <= j) ? (i < k && k <= j) : (i < k || k <= j)) {
+      continue;
+    }
+    _table[i] = _table[j];
+    i = j;
+  }
+  _table[i] = 0;
+}
+
+bool RobertsFilter::test_and_push(boost::uint64_t fp) {
+  size_t i = find(fp);
+  if (_table[i]) {
     return true;
   }
 
-  _local_set.insert(key);
-  _local_queue.push(key);
-  if (_local_set.size() > _local_size) {
-    size_t r = _global_set.size();
-    if (_global_set.size() == _global_size) {
+  _table[i] = fp;
+  _local_queue[(_local_head + _local_count++) % _local_queue.size()] = fp;
+  if (_local_count > _local_size) {
+    boost::uint64_t oldest = _local_queue[_local_head];
+    _local_head = (_local_head + 1) % _local_queue.size();
+    _local_count--;
+
+    // The table already holds the oldest local key, which now moves to the
+    // global set unless there is no room for it.
+    if (_global_size == 0) {
+      erase(oldest);
+      return false;
+    }
+    size_t r = _global_count;
+    if (_global_count == _global_size) {
       r = (size_t)(rand()/double(RAND_MAX)*(_global_size-1));
-      _global_set.erase(_global_vector[r]);
+      erase(_global_vector[r]);
+    } else {
+      _global_count++;
     }
-
-    _local_set.erase(_local_queue.front());
-    _global_set.insert(_local_queue.front());
-    _global_vector[r] = _local_queue.front();
-    _local_queue.pop();
+    _global_vector[r] = oldest;
   }
   return false;
 }
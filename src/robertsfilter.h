@@ -9,8 +9,8 @@
 #ifndef express_robertsfilter_h
 #define express_robertsfilter_h
 
-#include <boost/unordered_set.hpp>
-#include <queue>
+#include <boost/cstdint.hpp>
+#include <string>
 #include <vector>
 
 static size_t DEFAULT_LOC_SIZE = 10000;
@@ -23,31 +23,47 @@ static size_t DEFAULT_GLOB_SIZE = 100000;
  * observations (set by local_size). After this number of observations, it is
  * removed from the local set, and placed in the global set, displacing a random
  * element of this set. To be used when the full set cannot be stored in memory.
+ * Keys are stored as 64-bit fingerprints in a single open-addressing table, so
+ * no strings are copied or allocated. Two keys with the same fingerprint are
+ * reported as a repeat, which for the default sizes is expected to happen less
+ * than once in 10^13 tests.
  *  @author    Adam Roberts
  *  @date      2011
  *  @copyright Artistic License 2.0
  **/
 class RobertsFilter {
   /**
-   * A private queue to store the local keys in FIFO order. Used to know which
-   * element to remove from the set next.
+   * A private ring buffer storing the fingerprints in the local set in FIFO
+   * order. Used to know which element to move to the global set next.
    */
-  std::queue<std::string> _local_queue;
+  std::vector<boost::uint64_t> _local_queue;
   /**
-   * A private set used to store the local keys. Allows for easy membership
-   * testing.
+   * A private size_t storing the index of the oldest fingerprint in the local
+   * ring buffer.
    */
-  boost::unordered_set<std::string> _local_set;
+  size_t _local_head;
   /**
-   * A private vector to store the global keys. Used to know which element to
-   * randomly replace when the global set is full.
+   * A private size_t storing the number of fingerprints in the local set.
    */
-  std::vector<std::string> _global_vector;
+  size_t _local_count;
   /**
-   * A private set used to store the global keys. Allows for easy membership
-   * testing.
+   * A private vector to store the global fingerprints. Used to know which
+   * element to randomly replace when the global set is full.
    */
-  boost::unordered_set<std::string> _global_set;
+  std::vector<boost::uint64_t> _global_vector;
+  /**
+   * A private size_t storing the number of fingerprints in the global set.
+   */
+  size_t _global_count;
+  /**
+   * A private open-addressing hash table (with linear probing) of the
+   * fingerprints in both sets, used for membership testing. Empty slots are 0.
+   */
+  std::vector<boost::uint64_t> _table;
+  /**
+   * A private size_t storing the number of bits used to index _table.
+   */
+  size_t _table_bits;
   /**
    * A private size_t specifying the maximum number of keys to store in the
    * local set.
@@ -58,6 +74,28 @@ class RobertsFilter {
    * global set.
    */
   size_t _global_size;
+  /**
+   * A private member function that returns the preferred slot in _table for a
+   * fingerprint.
+   * @param fp the fingerprint.
+   * @return The index of the preferred slot for the fingerprint.
+   */
+  size_t home(boost::uint64_t fp) const {
+    return (size_t)((fp * 0x9E3779B97F4A7C15ULL) >> (64 - _table_bits));
+  }
+  /**
+   * A private member function that finds the slot holding a fingerprint, or
+   * the empty slot where it would be inserted.
+   * @param fp the fingerprint.
+   * @return The index of the slot holding the fingerprint or an empty slot.
+   */
+  size_t find(boost::uint64_t fp) const;
+  /**
+   * A private member function that removes a fingerprint from _table, shifting
+   * back subsequent entries of its probe sequence.
+   * @param fp the fingerprint, which must be in the table.
+   */
+  void erase(boost::uint64_t fp);
 
  public:
   /**
@@ -67,6 +105,13 @@ class RobertsFilter {
    */
   RobertsFilter(size_t local_size=DEFAULT_LOC_SIZE,
                 size_t global_size=DEFAULT_GLOB_SIZE);
+  /**
+   * A static member function that computes the (non-zero) 64-bit fingerprint
+   * of a key.
+   * @param key the key to compute the fingerprint of.
+   * @return The fingerprint of the key.
+   */
+  static boost::uint64_t fingerprint(const std::string& key);
   /**
    * A member function that tests for membership of the key in either set. If
    * not found, the key is added to the local set, possibly pushing the oldest
@@ -74,7 +119,17 @@ class RobertsFilter {
    * @param key the key to be tested for and pushed into the local set.
    * @return True iff the key is in the local or global set.
    */
-  bool test_and_push(const std::string& key);
+  bool test_and_push(const std::string& key) {
+    return test_and_push(fingerprint(key));
+  }
+  /**
+   * A member function that tests for membership of a key by its fingerprint,
+   * as computed by fingerprint(), and pushes it into the local set if not
+   * found.
+   * @param fp the fingerprint of the key to be tested for and pushed.
+   * @return True iff the fingerprint is in the local or global set.
+   */
+  bool test_and_push(boost::uint64_t fp);
 };
 
 #endif
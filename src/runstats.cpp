@@ -0,0 +1,145 @@
+//
+//  runstats.cpp
+//  express
+//
+//  Created by Adam Roberts on 10/14/12.
+//  Copyright 2012 Adam Roberts. All rights reserved.
+//
+
+#include "runstats.h"
+#include "main.h"
+#include <fstream>
+
+using namespace std;
+
+void StageStats::add(const pt::time_duration& dur, size_t items) {
+  boost::int64_t dur_us = dur.total_microseconds();
+  boost::uint64_t us = (dur_us > 0) ? dur_us : 0;
+  boost::unique_lock<boost::mutex> lock(_mut);
+  _count++;
+  _items += items;
+  _total_us += us;
+  _max_us = max(_max_us, us);
+}
+
+size_t StageStats::count() const {
+  boost::unique_lock<boost::mutex> lock(_mut);
+  return _count;
+}
+
+size_t StageStats::items() const {
+  boost::unique_lock<boost::mutex> lock(_mut);
+  return _items;
+}
+
+double StageStats::total_secs() const {
+  boost::unique_lock<boost::mutex> lock(_mut);
+  return _total_us / 1e6;
+}
+
+double StageStats::us_per_item() const {
+  boost::unique_lock<boost::mutex> lock(_mut);
+  return (_items) ? (double)_total_us / _items : 0;
+}
+
+double StageStats::max_ms() const {
+  boost::unique_lock<boost::mutex> lock(_mut);
+  return _max_us / 1e3;
+}
+
+void LevelStats::add(size_t level) {
+  boost::unique_lock<boost::mutex> lock(_mut);
+  _count++;
+  _sum += level;
+  _max = std::max(_max, level);
+}
+
+size_t LevelStats::count() const {
+  boost::unique_lock<boost::mutex> lock(_mut);
+  return _count;
+}
+
+double LevelStats::mean() const {
+  boost::unique_lock<boost::mutex> lock(_mut);
+  return (_count) ? (double)_sum / _count : 0;
+}
+
+size_t LevelStats::max() const {
+  boost::unique_lock<boost::mutex> lock(_mut);
+  return _max;
+}
+
+string RunStats::summary() const {
+  char buff[1000];
+  sprintf(buff, "Pipeline (us/frag): parse %.2f, dispatch %.2f, process %.2f"
+          "\tQueued Batches: %.1f parsed"
+          "\tBlocked (s): parser %.1f, processors %.1f"
+          "\tLock Wait (s): targets %.1f, aux %.1f"
+          "\tBias Refresh: %d cycles, %.2f s mean.",
+          parse.us_per_item(), dispatch.us_per_item(), process.us_per_item(),
+          parsed_queue.occupancy.mean(),
+          parsed_queue.push_wait.total_secs(),
+          parsed_queue.pop_wait.total_secs(),
+          target_lock_wait.total_secs(), aux_lock_wait.total_secs(),
+          (int)bias_refresh.count(),
+          (bias_refresh.count()) ?
+              bias_refresh.total_secs() / bias_refresh.count() : 0.0);
+  return buff;
+}
+
+/**
+ * A helper function that writes a row of the stage table of the report.
+ * @param out the stream to write to.
+ * @param name the name of the stage.
+ * @param stats the StageStats of the stage.
+ */
+void write_stage(ofstream& out, const char* name, const StageStats& stats) {
+  char buff[500];
+  sprintf(buff, "%s\t%lu\t%lu\t%.6f\t%.4f\t%.3f\n", name,
+          (unsigned long)stats.count(), (unsigned long)stats.items(),
+          stats.total_secs(), stats.us_per_item(), stats.max_ms());
+  out << buff;
+}
+
+/**
+ * A helper function that writes a row of the queue table of the report.
+ * @param out the stream to write to.
+ * @param name the name of the queue.
+ * @param stats the QueueStats of the queue.
+ */
+void write_queue(ofstream& out, const char* name, const QueueStats& stats) {
+  char buff[500];
+  sprintf(buff, "%s\t%lu\t%.2f\t%lu\n", name,
+          (unsigned long)stats.occupancy.count(), stats.occupancy.mean(),
+          (unsigned long)stats.occupancy.max());
+  out << buff;
+}
+
+void RunStats::write(const string& file_name) const {
+  ofstream out(file_name.c_str());
+  if (!out.is_open()) {
+    logger.warn("Unable to open run statistics file '%s'.",
+                file_name.c_str());
+    return;
+  }
+  char buff[500];
+  sprintf(buff, "wall_time\t%.3f\n", wall.elapsed().total_milliseconds()/1e3);
+  out << buff << "\n";
+
+  out << "stage\tevents\titems\ttotal_s\tus_per_item\tmax_ms\n";
+  write_stage(out, "parse", parse);
+  write_stage(out, "dispatch", dispatch);
+  write_stage(out, "process", process);
+  write_stage(out, "parsed_queue.push_wait", parsed_queue.push_wait);
+  write_stage(out, "parsed_queue.pop_wait", parsed_queue.pop_wait);
+  write_stage(out, "processed_queue.pop_wait", processed_queue.pop_wait);
+  write_stage(out, "target_lock_wait", target_lock_wait);
+  write_stage(out, "aux_lock_wait", aux_lock_wait);
+  write_stage(out, "bias_refresh", bias_refresh);
+  out << "\n";
+
+  out << "queue\tbatches\tmean_occupancy\tmax_occupancy\n";
+  write_queue(out, "parsed_queue", parsed_queue);
+  write_queue(out, "processed_queue", processed_queue);
+  out.close();
+}
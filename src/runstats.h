@@ -0,0 +1,253 @@
+/**
+ *  runstats.h
+ *  express
+ *
+ *  Created by Adam Roberts on 10/14/12.
+ *  Copyright 2012 Adam Roberts. All rights reserved.
+ */
+
+#ifndef express_runstats_h
+#define express_runstats_h
+
+#include "logger.h"
+#include <boost/cstdint.hpp>
+#include <boost/thread.hpp>
+#include <string>
+
+/**
+ * The Stopwatch class measures the wall-clock time elapsed since it was
+ * constructed or last restarted.
+ *  @author    Adam Roberts
+ *  @date      2012
+ *  @copyright Artistic License 2.0
+ **/
+class Stopwatch {
+  /**
+   * A private ptime storing when the Stopwatch was started.
+   */
+  pt::ptime _start;
+
+public:
+  /**
+   * Stopwatch constructor starts the Stopwatch.
+   */
+  Stopwatch() : _start(pt::microsec_clock::universal_time()) {}
+  /**
+   * A member function that restarts the Stopwatch.
+   */
+  void restart() { _start = pt::microsec_clock::universal_time(); }
+  /**
+   * A member function that returns the time elapsed since the Stopwatch was
+   * started.
+   * @return The elapsed time.
+   */
+  pt::time_duration elapsed() const {
+    return pt::microsec_clock::universal_time() - _start;
+  }
+};
+
+/**
+ * The StageStats class accumulates the number of times a pipeline stage (or
+ * wait) occurred, the number of items it handled, and its total and maximum
+ * duration. It is threadsafe, but a lock is taken on each call to add, so it
+ * should only be updated once per batch or per blocking event.
+ *  @author    Adam Roberts
+ *  @date      2012
+ *  @copyright Artistic License 2.0
+ **/
+class StageStats {
+  /**
+   * A private size_t storing the number of events recorded.
+   */
+  size_t _count;
+  /**
+   * A private size_t storing the total number of items handled by the events.
+   */
+  size_t _items;
+  /**
+   * Private 64-bit integers storing the total and maximum duration of the
+   * events in microseconds.
+   */
+  boost::uint64_t _total_us;
+  boost::uint64_t _max_us;
+  /**
+   * A private mutex to make the accumulation threadsafe.
+   */
+  mutable boost::mutex _mut;
+
+public:
+  /**
+   * StageStats constructor initializes all counts to 0.
+   */
+  StageStats() : _count(0), _items(0), _total_us(0), _max_us(0) {}
+  /**
+   * A member function that records an event.
+   * @param dur the duration of the event.
+   * @param items the number of items handled by the event.
+   */
+  void add(const pt::time_duration& dur, size_t items=1);
+  /**
+   * An accessor for the number of events recorded.
+   * @return The number of events.
+   */
+  size_t count() const;
+  /**
+   * An accessor for the total number of items handled by the events.
+   * @return The number of items.
+   */
+  size_t items() const;
+  /**
+   * An accessor for the total duration of the events.
+   * @return The total duration in seconds.
+   */
+  double total_secs() const;
+  /**
+   * An accessor for the mean duration of the events per item handled.
+   * @return The mean duration per item in microseconds, or 0 if there were no
+   *         items.
+   */
+  double us_per_item() const;
+  /**
+   * An accessor for the maximum duration of a single event.
+   * @return The maximum duration in milliseconds.
+   */
+  double max_ms() const;
+};
+
+/**
+ * The LevelStats class accumulates samples of a level, such as the number of
+ * batches in a queue, to report its mean and maximum. It is threadsafe.
+ *  @author    Adam Roberts
+ *  @date      2012
+ *  @copyright Artistic License 2.0
+ **/
+class LevelStats {
+  /**
+   * Private size_ts storing the number, sum, and maximum of the samples.
+   */
+  size_t _count;
+  size_t _sum;
+  size_t _max;
+  /**
+   * A private mutex to make the accumulation threadsafe.
+   */
+  mutable boost::mutex _mut;
+
+public:
+  /**
+   * LevelStats constructor initializes all counts to 0.
+   */
+  LevelStats() : _count(0), _sum(0), _max(0) {}
+  /**
+   * A member function that records a sample of the level.
+   * @param level the sampled level.
+   */
+  void add(size_t level);
+  /**
+   * An accessor for the number of samples.
+   * @return The number of samples.
+   */
+  size_t count() const;
+  /**
+   * An accessor for the mean of the samples.
+   * @return The mean level, or 0 if there are no samples.
+   */
+  double mean() const;
+  /**
+   * An accessor for the maximum of the samples.
+   * @return The maximum level.
+   */
+  size_t max() const;
+};
+
+/**
+ * The QueueStats struct stores the statistics of one of the ThreadSafeFragQueue
+ * stages of the pipeline, summed over all instances of the queue.
+ **/
+struct QueueStats {
+  /**
+   * A public StageStats for pushes that blocked because the queue was full.
+   */
+  StageStats push_wait;
+  /**
+   * A public StageStats for blocking pops that waited for the queue to fill.
+   */
+  StageStats pop_wait;
+  /**
+   * A public LevelStats for the number of batches in the queue, sampled after
+   * each batch is pushed.
+   */
+  LevelStats occupancy;
+};
+
+/**
+ * The RunStats struct collects timers and counters for each stage of the
+ * processing pipeline so that slow runs can be diagnosed. Stages are timed per
+ * batch, and waits are only timed when a thread actually blocks, so that the
+ * overhead is small. A summary is added to the periodic progress output, and a
+ * full report is written to the output directory at the end of the run.
+ *  @author    Adam Roberts
+ *  @date      2012
+ *  @copyright Artistic License 2.0
+ **/
+struct RunStats {
+  /**
+   * A public Stopwatch started when the run begins.
+   */
+  Stopwatch wall;
+  /**
+   * A public StageStats for the time spent by the parser reading and preparing
+   * each batch of fragments.
+   */
+  StageStats parse;
+  /**
+   * A public StageStats for the time spent by the processing threads
+   * dispatching each batch of fragments, setting their masses along with any
+   * synchronization or intermediate output that falls due, including the time
+   * waiting for other threads to finish dispatching.
+   */
+  StageStats dispatch;
+  /**
+   * A public StageStats for the time spent processing each batch of fragments.
+   */
+  StageStats process;
+  /**
+   * Public QueueStats for the queues of parsed and processed batches.
+   */
+  QueueStats parsed_queue;
+  QueueStats processed_queue;
+  /**
+   * A public StageStats for contended acquisitions of the Target locks in
+   * process_fragment. Each acquisition that blocked is recorded separately.
+   */
+  StageStats target_lock_wait;
+  /**
+   * A public StageStats for the time spent waiting for the auxiliary parameter
+   * mutex (held exclusively by the bias updater and during synchronization)
+   * before processing a batch or fragment.
+   */
+  StageStats aux_lock_wait;
+  /**
+   * A public StageStats for the duration of each bias update cycle, with the
+   * number of targets refreshed as its items.
+   */
+  StageStats bias_refresh;
+  /**
+   * A member function that returns a one-line summary of the statistics for
+   * the periodic progress output.
+   * @return The summary.
+   */
+  std::string summary() const;
+  /**
+   * A member function that writes a report of all statistics to a file.
+   * @param file_name the path to the file to write.
+   */
+  void write(const std::string& file_name) const;
+};
+
+/**
+ * A global RunStats for the pipeline of the current run.
+ */
+extern RunStats run_stats;
+
+#endif
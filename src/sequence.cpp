@@ -25,101 +25,199 @@ string Sequence::serialize() {
   return string(seq.begin(), seq.end());
 }
 
-SequenceFwd::SequenceFwd():  _ref_seq(NULL), _prob(0), _len(0) {}
+/**
+ * A helper function that returns the mask for the bits used by a k-mer index.
+ * @param k the length of the k-mers.
+ * @return The mask for the lowest 2k bits.
+ */
+inline unsigned int kmer_mask(size_t k) {
+  assert(k <= 16);
+  return (k == 16) ? ~0U : (1U << (2*k)) - 1;
+}
 
-SequenceFwd::SequenceFwd(const std::string& seq, bool rev, bool prob)
-    : _prob(prob), _len(seq.length()) {
-  if (prob) {
-    _est_seq = FrequencyMatrix<float>(seq.length(), NUM_NUCS, 0.001);
-    _obs_seq = FrequencyMatrix<float>(seq.length(), NUM_NUCS, LOG_0);
-    _exp_seq = FrequencyMatrix<float>(seq.length(), NUM_NUCS, LOG_0);
+void Sequence::kmer_indices(size_t k, vector<unsigned int>& kmers) const {
+  const unsigned int mask = kmer_mask(k);
+  const size_t len = length();
+  kmers.resize(len);
+  unsigned int kmer = 0;
+  for (size_t i = 0; i < len; ++i) {
+    kmer = ((kmer << 2) | (unsigned int)operator[](i)) & mask;
+    kmers[i] = kmer;
+  }
+}
+
+/**
+ * A helper function that builds the nucleotide distributions of a position
+ * that has only been updated by the reference, with one row for each
+ * reference nucleotide.
+ * @return The distributions of an unupdated position given each reference.
+ */
+FrequencyMatrix<float> init_ref_est() {
+  FrequencyMatrix<float> est(NUM_NUCS, NUM_NUCS, 0.001);
+  for (size_t nuc = 0; nuc < NUM_NUCS; ++nuc) {
+    est.increment(nuc, nuc, log((float)2));
   }
+  return est;
+}
+
+/**
+ * The posterior nucleotide distributions of a probabilistic sequence position
+ * that has not been updated, indexed by the reference nucleotide.
+ */
+const FrequencyMatrix<float> REF_EST = init_ref_est();
+
+SequenceFwd::SequenceFwd()
+    : _ref_seq(NULL), _ref(NULL), _capacity(0), _prob(0), _len(0) {}
+
+SequenceFwd::SequenceFwd(const std::string& seq, bool rev, bool prob)
+    : _ref(NULL), _capacity(0), _prob(prob), _len(seq.length()) {
   set(seq, rev);
 }
 
+SequenceFwd::SequenceFwd(const unsigned char* packed, size_t len, bool prob)
+    : _ref_seq(NULL), _ref(packed), _capacity(0), _prob(prob), _len(len) {}
+
 SequenceFwd::SequenceFwd(const SequenceFwd& other)
-    : _obs_seq(other._obs_seq), _exp_seq(other._exp_seq),
-      _prob(other._prob), _len(other.length()) {
+    : _ref(other._ref), _capacity(0), _prob(other._prob),
+      _len(other.length()) {
   if (other._ref_seq) {
-    char* ref_seq = new char[_len];
-    std::copy(other._ref_seq.get(), other._ref_seq.get() + _len, ref_seq);
+    unsigned char* ref_seq = new unsigned char[packed_size(_len)];
+    std::copy(other._ref_seq.get(), other._ref_seq.get() + packed_size(_len),
+              ref_seq);
     _ref_seq.reset(ref_seq);
+    _ref = ref_seq;
+    _capacity = _len;
+  }
+  if (other._prob_seq) {
+    _prob_seq.reset(new ProbSeq(*other._prob_seq));
   }
 }
 
 SequenceFwd& SequenceFwd::operator=(const SequenceFwd& other) {
   if (other._ref_seq) {
     _len = other.length();
-    char* ref_seq = new char[_len];
-    std::copy(other._ref_seq.get(), other._ref_seq.get() + _len, ref_seq);
+    unsigned char* ref_seq = new unsigned char[packed_size(_len)];
+    std::copy(other._ref_seq.get(), other._ref_seq.get() + packed_size(_len),
+              ref_seq);
     _ref_seq.reset(ref_seq);
-    _obs_seq = other._obs_seq;
-    _exp_seq = other._exp_seq;
+    _ref = ref_seq;
+    _capacity = _len;
+    _prob_seq.reset((other._prob_seq) ? new ProbSeq(*other._prob_seq) : NULL);
+    _prob = other._prob;
+  } else if (other._ref) {
+    _len = other.length();
+    _ref_seq.reset(NULL);
+    _ref = other._ref;
+    _capacity = 0;
+    _prob_seq.reset((other._prob_seq) ? new ProbSeq(*other._prob_seq) : NULL);
     _prob = other._prob;
   }
   return *this;
 }
 
 void SequenceFwd::set(const std::string& seq, bool rev) {
-  char* ref_seq = new char[seq.length()];
-  for (size_t i = 0; i < seq.length(); i++) {
-    ref_seq[i] = (rev) ? complement(ctoi(seq[seq.length()-1-i])) : ctoi(seq[i]);
-    if (_prob) {
-      _est_seq.increment(i, ref_seq[i], log((float)2));
+  set(seq.c_str(), seq.length(), rev);
+}
+
+void SequenceFwd::set(const char* seq, size_t len, bool rev) {
+  // Reuse the existing array when it is large enough so that recycled reads
+  // do not reallocate.
+  if (!_ref_seq || _capacity < len) {
+    _ref_seq.reset(new unsigned char[packed_size(len)]);
+    _capacity = packed_size(len) * 4;
+  }
+  unsigned char* ref_seq = _ref_seq.get();
+  _ref = ref_seq;
+  for (size_t i = 0; i < len; i += 4) {
+    unsigned char packed = 0;
+    for (size_t j = i; j < min(i + 4, len); ++j) {
+      char nuc = (rev) ? complement(ctoi(seq[len-1-j])) : ctoi(seq[j]);
+      packed |= nuc << ((j & 3) << 1);
+    }
+    ref_seq[i >> 2] = packed;
+  }
+  _len = len;
+  _prob_seq.reset(NULL);
+}
+
+SequenceFwd::ProbSeq& SequenceFwd::prob_seq() {
+  assert(_prob);
+  if (!_prob_seq) {
+    // Fully initialize the distributions before publishing them, since they
+    // may be read concurrently by threads that do not hold the target's lock.
+    ProbSeq* prob_seq = new ProbSeq();
+    prob_seq->est_seq = FrequencyMatrix<float>(_len, NUM_NUCS, 0.001);
+    prob_seq->obs_seq = FrequencyMatrix<float>(_len, NUM_NUCS, LOG_0);
+    prob_seq->exp_seq = FrequencyMatrix<float>(_len, NUM_NUCS, LOG_0);
+    for (size_t i = 0; i < _len; ++i) {
+      prob_seq->est_seq.increment(i, ref_nuc(i), log((float)2));
     }
+    _prob_seq.reset(prob_seq);
   }
-  _ref_seq.reset(ref_seq);
-  _len = seq.length();
+  return *_prob_seq;
 }
 
 size_t SequenceFwd::operator[](const size_t index) const {
   assert(index < _len);
-  if (_prob) {
-    return _est_seq.argmax(index);
+  if (_prob_seq) {
+    return _prob_seq->est_seq.argmax(index);
   }
-  return _ref_seq[index];
+  return ref_nuc(index);
 }
 
 size_t SequenceFwd::get_ref(const size_t index) const {
   assert(index < _len);
-  //assert(_ref_seq[index] == operator[](index));
-  return _ref_seq[index];
+  return ref_nuc(index);
 }
 
 float SequenceFwd::get_prob(const size_t index, const size_t nuc) const {
   assert(_prob);
-  return _est_seq(index, nuc);
+  if (!_prob_seq) {
+    return REF_EST(ref_nuc(index), nuc);
+  }
+  return _prob_seq->est_seq(index, nuc);
 }
 
 float SequenceFwd::get_obs(const size_t index, const size_t nuc) const {
   assert(index < _len);
-  return _obs_seq(index,nuc, false);
+  if (!_prob_seq) {
+    return LOG_0;
+  }
+  return _prob_seq->obs_seq(index,nuc, false);
 }
 
 float SequenceFwd::get_exp(const size_t index, const size_t nuc) const {
   assert(index < _len);
-  return _exp_seq(index,nuc, false);
+  if (!_prob_seq) {
+    return LOG_0;
+  }
+  return _prob_seq->exp_seq(index,nuc, false);
 }
 
 void SequenceFwd::update_est(const size_t index, const size_t nuc, float mass) {
   assert(_prob);
-  _est_seq.increment(index, nuc, mass);
+  prob_seq().est_seq.increment(index, nuc, mass);
 }
 
 void SequenceFwd::update_obs(const size_t index, const size_t nuc, float mass) {
   assert(_prob);
-  _obs_seq.increment(index, nuc, mass);
+  prob_seq().obs_seq.increment(index, nuc, mass);
 }
 
 void SequenceFwd::update_exp(const size_t index, const size_t nuc, float mass) {
   assert(_prob);
-  _exp_seq.increment(index, nuc, mass);
+  prob_seq().exp_seq.increment(index, nuc, mass);
 }
 
 void SequenceFwd::calc_p_vals(vector<double>& p_vals) const {
   p_vals = vector<double>(_len, 1.0);
+  if (!_prob_seq) {
+    return;
+  }
+  const FrequencyMatrix<float>& obs_seq = _prob_seq->obs_seq;
+  const FrequencyMatrix<float>& exp_seq = _prob_seq->exp_seq;
   for (size_t i = 0; i < _len; ++i) {
-    double N = round(sexp(_obs_seq.sum(i)));
+    double N = round(sexp(obs_seq.sum(i)));
     if (N<5) {
       continue;
     }
@@ -130,7 +228,7 @@ void SequenceFwd::calc_p_vals(vector<double>& p_vals) const {
         continue;
       }
 
-      double obs_n = round(sexp(_obs_seq(i,nuc,false)));
+      double obs_n = round(sexp(obs_seq(i,nuc,false)));
       max_obs = max(max_obs, obs_n);
     }
     
@@ -141,7 +239,7 @@ void SequenceFwd::calc_p_vals(vector<double>& p_vals) const {
         continue;
       }
 
-      double exp_p = sexp(_exp_seq(i, nuc));
+      double exp_p = sexp(exp_seq(i, nuc));
       binomial binom(N, exp_p);
       p_val += log(cdf(binom, max_obs));
     }
@@ -149,6 +247,37 @@ void SequenceFwd::calc_p_vals(vector<double>& p_vals) const {
   }
 }
 
+void SequenceFwd::kmer_indices(size_t k, vector<unsigned int>& kmers) const {
+  if (_prob_seq) {
+    Sequence::kmer_indices(k, kmers);
+    return;
+  }
+  // Decode the packed array directly to avoid a virtual call per position.
+  const unsigned int mask = kmer_mask(k);
+  kmers.resize(_len);
+  unsigned int kmer = 0;
+  for (size_t i = 0; i < _len; ++i) {
+    kmer = ((kmer << 2) | (unsigned int)ref_nuc(i)) & mask;
+    kmers[i] = kmer;
+  }
+}
+
+void SequenceRev::kmer_indices(size_t k, vector<unsigned int>& kmers) const {
+  if (_seq == NULL || _seq->prob()) {
+    Sequence::kmer_indices(k, kmers);
+    return;
+  }
+  const unsigned int mask = kmer_mask(k);
+  const size_t len = _seq->length();
+  kmers.resize(len);
+  unsigned int kmer = 0;
+  for (size_t i = 0; i < len; ++i) {
+    size_t nuc = complement(_seq->SequenceFwd::get_ref(len-i-1));
+    kmer = ((kmer << 2) | (unsigned int)nuc) & mask;
+    kmers[i] = kmer;
+  }
+}
+
 void SequenceRev::calc_p_vals(vector<double>& p_vals) const
 {
   vector<double> temp;
@@ -10,9 +10,20 @@
 #define express_sequence_h
 
 #include <boost/scoped_array.hpp>
+#include <boost/scoped_ptr.hpp>
 #include <string>
 #include "frequencymatrix.h"
 
+/**
+ * A helper function that returns the number of bytes needed to store the given
+ * number of packed nucleotides.
+ * @param len the number of nucleotides.
+ * @return The number of bytes needed to pack len nucleotides.
+ */
+inline size_t packed_size(size_t len) {
+  return (len + 3) / 4;
+}
+
 /**
  * Helper function to encode a nucleotide character to a size_t value.
  * @param c the nucleotide character to be encoded.
@@ -159,6 +170,18 @@ class Sequence {
    *        p-values at each position.
    */
   virtual void calc_p_vals(std::vector<double>& p_vals) const = 0;
+  /**
+   * A member function that computes the index of the k-mer ending at each
+   * position of the sequence, with each nucleotide represented by 2 bits and
+   * the last nucleotide in the lowest bits. K-mers that would extend past the
+   * start of the sequence are truncated, leaving the high bits unset. The
+   * most likely nucleotide is used at each position of probabilistic
+   * sequences.
+   * @param k the length of the k-mers, which must be at most 16.
+   * @param kmers a reference to the vector to fill with the k-mer index of
+   *        each position.
+   */
+  virtual void kmer_indices(size_t k, std::vector<unsigned int>& kmers) const;
   /**
    * A member function to serialize a string into an array of bytes, with each
    * nucleotide represented by 2 bits.
@@ -177,25 +200,47 @@ class Sequence {
 class SequenceFwd: public Sequence
 {
   /**
-   * A char array that stores the encoded sequence (not null terminated).
-   * Deleted with this.
+   * The ProbSeq struct stores the per-position nucleotide distributions of a
+   * probabilistic sequence (all logged).
    */
-  boost::scoped_array<const char> _ref_seq;
+  struct ProbSeq {
+    /**
+     * The posterior nucleotide distributions.
+     */
+    FrequencyMatrix<float> est_seq;
+    /**
+     * The observed nucleotide frequencies.
+     */
+    FrequencyMatrix<float> obs_seq;
+    /**
+     * The expected nucleotide frequencies.
+     */
+    FrequencyMatrix<float> exp_seq;
+  };
   /**
-   * A private FrequencyMatrix to store the posterior nucleotide distributions
-   * (if _prob).
+   * A char array that stores the encoded sequence packed 4 nucleotides per
+   * byte, with position i in bits 2*(i%4) and 2*(i%4)+1 of byte i/4. Deleted
+   * with this. NULL if the sequence refers to an external packed array.
    */
-  FrequencyMatrix<float> _est_seq;
+  boost::scoped_array<unsigned char> _ref_seq;
   /**
-   * A private FrequencyMatrix to store the observed nucleotide frequencies
-   * (if _prob).
+   * A private pointer to the packed array the sequence is read from. This is
+   * either _ref_seq or an external array (such as a memory-mapped target
+   * index) that outlives this.
    */
-  FrequencyMatrix<float> _obs_seq;
+  const unsigned char* _ref;
   /**
-   * A private FrequencyMatrix to store the expected nucleotide frequencies
-   * (if _prob).
+   * A private size_t storing the number of nucleotides that fit in the
+   * allocated _ref_seq, which may exceed _len when the array is reused for a
+   * shorter sequence.
    */
-  FrequencyMatrix<float> _exp_seq;
+  size_t _capacity;
+  /**
+   * A private pointer to the nucleotide distributions (if _prob). They are only
+   * allocated once the sequence is first updated, and until then each position
+   * is distributed as if it had been updated by nothing but the reference.
+   */
+  boost::scoped_ptr<ProbSeq> _prob_seq;
   /**
    * A private bool specifying if the sequence is probabilistic (true) or fixed
    * to the reference (false).
@@ -205,6 +250,21 @@ class SequenceFwd: public Sequence
    * A private size_t storing the number of nucleotides in the sequence.
    */
   size_t _len;
+  /**
+   * A private member function that returns the nucleotide distributions,
+   * allocating and initializing them from the reference if necessary.
+   * @return A reference to the nucleotide distributions.
+   */
+  ProbSeq& prob_seq();
+  /**
+   * A private member function that decodes the reference nucleotide at the
+   * given position.
+   * @param index the position in the sequence.
+   * @return The encoded reference nucleotide.
+   */
+  size_t ref_nuc(const size_t index) const {
+    return (_ref[index >> 2] >> ((index & 3) << 1)) & 3;
+  }
 
  public:
   /**
@@ -219,7 +279,17 @@ class SequenceFwd: public Sequence
    */
   SequenceFwd(const std::string& seq, bool rev, bool prob=false);
   /**
-   * SequenceFwd copy constructor.
+   * SequenceFwd constructor refers to an already packed nucleotide sequence
+   * without copying it. The array must not be modified and must outlive this
+   * and any copies of this.
+   * @param packed a pointer to the nucleotide sequence packed as in _ref_seq.
+   * @param len the length of the sequence.
+   * @param prob a bool specifying if the sequence is probabilistic.
+   */
+  SequenceFwd(const unsigned char* packed, size_t len, bool prob=false);
+  /**
+   * SequenceFwd copy constructor. Copies of sequences referring to an external
+   * packed array refer to the same array.
    * @param other the SequenceFwd object to copy.
    */
   SequenceFwd(const SequenceFwd& other);
@@ -228,6 +298,21 @@ class SequenceFwd: public Sequence
    * @param other the Sequence object to copy.
    */
   SequenceFwd& operator=(const SequenceFwd& other);
+  /**
+   * A member function that encodes the given character array and overwrites
+   * the current stored sequence with it.
+   * @param seq a pointer to the (not null-terminated) nucleotide sequence.
+   * @param len the length of the sequence.
+   * @param rev a boolean if the sequence should be reverse complemented before
+   *        encoding.
+   */
+  void set(const char* seq, size_t len, bool rev);
+  /**
+   * An accessor for the packed reference sequence, stored as described for
+   * _ref_seq. The returned array does not outlive this.
+   * @return A pointer to the packed reference sequence.
+   */
+  const unsigned char* packed() const { return _ref; }
   // The following methods are documented in the abstract Sequence class.
   void set(const std::string& seq, bool rev);
   size_t operator[](const size_t index) const;
@@ -242,6 +327,7 @@ class SequenceFwd: public Sequence
   bool empty() const { return _len==0; }
   size_t length() const { return _len; }
   void calc_p_vals(std::vector<double>& p_vals) const;
+  void kmer_indices(size_t k, std::vector<unsigned int>& kmers) const;
 };
 
 /**
@@ -297,6 +383,7 @@ class SequenceRev: public Sequence {
     return _seq->get_prob(length()-index-1, complement(nuc)); }
   bool prob() const { return _seq->prob(); }
   void calc_p_vals(std::vector<double>& p_vals) const;
+  void kmer_indices(size_t k, std::vector<unsigned int>& kmers) const;
 };
 
 #endif
@@ -0,0 +1,165 @@
+//
+//  spillfile.cpp
+//  express
+//
+//  Created by Adam Roberts on 10/14/12.
+//  Copyright 2012 Adam Roberts. All rights reserved.
+//
+
+#include "spillfile.h"
+#include "main.h"
+#include "fragments.h"
+#include <boost/cstdint.hpp>
+#include <stdio.h>
+#include <string.h>
+
+#ifndef WIN32
+  #include <fcntl.h>
+  #include <sys/mman.h>
+  #include <sys/stat.h>
+  #include <unistd.h>
+#endif
+
+using namespace std;
+
+/**
+ * The number of buffered bytes at which SpillWriter writes to the file.
+ */
+const size_t SPILL_BUFF_SIZE = 1 << 20;
+
+/**
+ * A helper function that appends the bytes of a value to a buffer.
+ * @param buff the buffer to append to.
+ * @param val the value to append.
+ */
+template <typename T>
+inline void append_bytes(vector<char>& buff, T val) {
+  const char* p = (const char*)&val;
+  buff.insert(buff.end(), p, p + sizeof(T));
+}
+
+/**
+ * A helper function that copies a value from a possibly unaligned pointer and
+ * advances the pointer.
+ * @param p a reference to the pointer to read from.
+ * @return The value read.
+ */
+template <typename T>
+inline T read_bytes(const char*& p) {
+  T val;
+  memcpy(&val, p, sizeof(T));
+  p += sizeof(T);
+  return val;
+}
+
+SpillWriter::SpillWriter(const string& file_name)
+    : _file_name(file_name),
+      _out(file_name.c_str(), ios::out | ios::binary | ios::trunc),
+      _num_frags(0) {
+  if (!_out.is_open()) {
+    logger.severe("Unable to open spill file '%s'.", file_name.c_str());
+  }
+  _buff.reserve(SPILL_BUFF_SIZE);
+}
+
+SpillWriter::~SpillWriter() {
+  close();
+}
+
+void SpillWriter::flush() {
+  if (_buff.empty()) {
+    return;
+  }
+  _out.write(&_buff[0], _buff.size());
+  if (!_out.good()) {
+    logger.severe("Unable to write to spill file '%s'.", _file_name.c_str());
+  }
+  _buff.clear();
+}
+
+void SpillWriter::write_fragment(const Fragment& frag) {
+  assert(frag.num_hits());
+  double max_likelihood = frag[0]->params()->align_likelihood;
+  for (size_t i = 1; i < frag.num_hits(); ++i) {
+    max_likelihood = max(max_likelihood, frag[i]->params()->align_likelihood);
+  }
+
+  append_bytes(_buff, (boost::uint32_t)frag.num_hits());
+  foreach (const FragHit* hit, frag.hits()) {
+    assert(hit->target_id() <= 0xFFFFFFFF);
+    append_bytes(_buff, (boost::uint32_t)hit->target_id());
+    append_bytes(_buff,
+                 (float)(hit->params()->align_likelihood - max_likelihood));
+  }
+  _num_frags++;
+
+  if (_buff.size() >= SPILL_BUFF_SIZE) {
+    flush();
+  }
+}
+
+void SpillWriter::close() {
+  if (_out.is_open()) {
+    flush();
+    _out.close();
+  }
+}
+
+SpillReader::SpillReader(const string& file_name, size_t num_frags)
+    : _file_name(file_name), _map(NULL), _len(0), _num_frags(num_frags) {
+#ifndef WIN32
+  int fd = open(file_name.c_str(), O_RDONLY);
+  struct stat st;
+  if (fd >= 0 && fstat(fd, &st) == 0 && st.st_size) {
+    void* map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map != MAP_FAILED) {
+      _map = (char*)map;
+      _len = st.st_size;
+      madvise(_map, _len, MADV_SEQUENTIAL);
+    }
+  }
+  if (fd >= 0) {
+    close(fd);
+  }
+#endif
+  if (_map) {
+    _begin = _map;
+  } else {
+    ifstream in(file_name.c_str(), ios::in | ios::binary);
+    if (!in.is_open()) {
+      logger.severe("Unable to open spill file '%s'.", file_name.c_str());
+    }
+    in.seekg(0, ios::end);
+    _len = in.tellg();
+    in.seekg(0, ios::beg);
+    _buff.resize(_len + 1);
+    in.read(&_buff[0], _len);
+    _begin = &_buff[0];
+  }
+  _cur = _begin;
+}
+
+SpillReader::~SpillReader() {
+#ifndef WIN32
+  if (_map) {
+    munmap(_map, _len);
+  }
+#endif
+  remove(_file_name.c_str());
+}
+
+bool SpillReader::next_fragment(vector<TargID>& targ_ids,
+                                vector<double>& likelihoods) {
+  if (_cur == _begin + _len) {
+    return false;
+  }
+  size_t num_hits = read_bytes<boost::uint32_t>(_cur);
+  targ_ids.resize(num_hits);
+  likelihoods.resize(num_hits);
+  for (size_t i = 0; i < num_hits; ++i) {
+    targ_ids[i] = read_bytes<boost::uint32_t>(_cur);
+    likelihoods[i] = read_bytes<float>(_cur);
+  }
+  assert(_cur <= _begin + _len);
+  return true;
+}
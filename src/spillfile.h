@@ -0,0 +1,146 @@
+/**
+ *  spillfile.h
+ *  express
+ *
+ *  Created by Adam Roberts on 10/14/12.
+ *  Copyright 2012 Adam Roberts. All rights reserved.
+ */
+
+#ifndef express_spillfile_h
+#define express_spillfile_h
+
+#include <fstream>
+#include <string>
+#include <vector>
+
+class Fragment;
+typedef size_t TargID;
+
+/**
+ * The SpillWriter class writes a compact binary record for each processed
+ * fragment to a temporary file so that later rounds can be run without
+ * re-parsing the input alignments. Each record stores the number of hits
+ * followed by the target id and (logged) alignment likelihood of each hit,
+ * relative to the most likely hit. Values are stored in native byte order,
+ * since the file is only read back by the same process.
+ *  @author    Adam Roberts
+ *  @date      2012
+ *  @copyright Artistic License 2.0
+ **/
+class SpillWriter {
+  /**
+   * A private string storing the path to the spill file.
+   */
+  std::string _file_name;
+  /**
+   * A private output stream for the spill file.
+   */
+  std::ofstream _out;
+  /**
+   * A private buffer for records not yet written to the file.
+   */
+  std::vector<char> _buff;
+  /**
+   * A private size_t storing the number of records written.
+   */
+  size_t _num_frags;
+  /**
+   * A private member function that writes the buffered records to the file.
+   */
+  void flush();
+
+public:
+  /**
+   * SpillWriter constructor creates (or truncates) the spill file.
+   * @param file_name the path to the spill file.
+   */
+  SpillWriter(const std::string& file_name);
+  /**
+   * SpillWriter destructor writes any buffered records and closes the file.
+   */
+  ~SpillWriter();
+  /**
+   * A member function that appends a record for the given processed Fragment.
+   * The alignment likelihoods of the hits must already be set.
+   * @param frag the Fragment to write a record for.
+   */
+  void write_fragment(const Fragment& frag);
+  /**
+   * A member function that writes any buffered records and closes the file.
+   */
+  void close();
+  /**
+   * An accessor for the number of records written.
+   * @return The number of records written.
+   */
+  size_t num_frags() const { return _num_frags; }
+};
+
+/**
+ * The SpillReader class sequentially reads the records of a spill file written
+ * by SpillWriter. The file is memory-mapped if possible and is deleted when the
+ * SpillReader is destroyed.
+ *  @author    Adam Roberts
+ *  @date      2012
+ *  @copyright Artistic License 2.0
+ **/
+class SpillReader {
+  /**
+   * A private string storing the path to the spill file.
+   */
+  std::string _file_name;
+  /**
+   * A private pointer to the mapped file, or NULL if it was read into _buff.
+   */
+  char* _map;
+  /**
+   * A private size_t storing the length of the file in bytes.
+   */
+  size_t _len;
+  /**
+   * A private buffer holding the file contents if it could not be mapped.
+   */
+  std::vector<char> _buff;
+  /**
+   * Private pointers to the start of the file and the next record.
+   */
+  const char* _begin;
+  const char* _cur;
+  /**
+   * A private size_t storing the number of records in the file.
+   */
+  size_t _num_frags;
+
+public:
+  /**
+   * SpillReader constructor opens (and maps) the spill file.
+   * @param file_name the path to the spill file.
+   * @param num_frags the number of records in the file.
+   */
+  SpillReader(const std::string& file_name, size_t num_frags);
+  /**
+   * SpillReader destructor unmaps and deletes the spill file.
+   */
+  ~SpillReader();
+  /**
+   * A member function that reads the next record from the file.
+   * @param targ_ids a reference to the vector to store the target ids of the
+   *        hits in.
+   * @param likelihoods a reference to the vector to store the (logged)
+   *        relative alignment likelihoods of the hits in.
+   * @return True iff a record was read and false at the end of the file.
+   */
+  bool next_fragment(std::vector<TargID>& targ_ids,
+                     std::vector<double>& likelihoods);
+  /**
+   * A member function that rewinds to the first record of the file.
+   */
+  void rewind() { _cur = _begin; }
+  /**
+   * An accessor for the number of records in the file.
+   * @return The number of records in the file.
+   */
+  size_t num_frags() const { return _num_frags; }
+};
+
+#endif
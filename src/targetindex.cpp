@@ -0,0 +1,221 @@
+//
+//  targetindex.cpp
+//  express
+//
+//  Created by Adam Roberts on 10/14/12.
+//  Copyright 2012 Adam Roberts. All rights reserved.
+//
+
+#include "targetindex.h"
+#include "main.h"
+#include "sequence.h"
+#include <boost/unordered_set.hpp>
+#include <fstream>
+#include <stdio.h>
+
+#ifndef WIN32
+  #include <fcntl.h>
+  #include <sys/mman.h>
+  #include <sys/stat.h>
+  #include <unistd.h>
+#endif
+
+using namespace std;
+
+/**
+ * A global uint64_t identifying a target index file and its version.
+ */
+const boost::uint64_t TARGET_INDEX_MAGIC = 0x0158444953525058ULL;
+
+/**
+ * The number of 64-bit values in the header of a target index file.
+ */
+const size_t TARGET_INDEX_HEADER_SIZE = 4;
+
+/**
+ * A helper function that rounds a number of bytes up to a multiple of 8.
+ * @param n the number of bytes.
+ * @return The smallest multiple of 8 that is at least n.
+ */
+inline size_t pad8(size_t n) {
+  return (n + 7) & ~(size_t)7;
+}
+
+/**
+ * A helper function that appends the bytes of a value to a string.
+ * @param buff the string to append to.
+ * @param val the value to append.
+ */
+inline void append_uint64(string& buff, boost::uint64_t val) {
+  buff.append((const char*)&val, sizeof(val));
+}
+
+bool TargetIndex::is_index(const string& file_name) {
+  ifstream in(file_name.c_str(), ios::in | ios::binary);
+  boost::uint64_t magic = 0;
+  in.read((char*)&magic, sizeof(magic));
+  return in.good() && magic == TARGET_INDEX_MAGIC;
+}
+
+size_t TargetIndex::write(const string& fasta_file_name,
+                          const string& index_file_name) {
+  ifstream infile(fasta_file_name.c_str());
+  if (!infile.is_open()) {
+    logger.severe("Unable to open MultiFASTA file '%s'.",
+                  fasta_file_name.c_str());
+  }
+
+  vector<boost::uint64_t> name_offsets;
+  vector<boost::uint64_t> lengths;
+  vector<boost::uint64_t> seq_offsets;
+  string names;
+  string seqs;
+  boost::unordered_set<string> target_names;
+
+  string line;
+  string seq;
+  string name;
+  bool in_targ = false;
+  while (true) {
+    bool good = !getline(infile, line, '\n').fail();
+    if (good && line.empty()) {
+      continue;
+    }
+    if (!good || line[0] == '>') {
+      if (in_targ) {
+        SequenceFwd packed(seq, false);
+        name_offsets.push_back(names.size());
+        names.append(name.c_str(), name.size() + 1);
+        lengths.push_back(seq.size());
+        seq_offsets.push_back(seqs.size());
+        seqs.append((const char*)packed.packed(), packed_size(seq.size()));
+      }
+      if (!good) {
+        break;
+      }
+      name = line.substr(1,line.find(' ')-1);
+      if (target_names.count(name)) {
+        logger.severe("Target '%s' is duplicated in the input FASTA. Ensure "
+                      "target names are unique and re-map before re-running "
+                      "eXpress.", name.c_str());
+      }
+      target_names.insert(name);
+      seq = "";
+      in_targ = true;
+    } else {
+      seq += line;
+    }
+  }
+  infile.close();
+
+  if (lengths.empty()) {
+    logger.severe("No targets found in MultiFASTA file '%s'.",
+                  fasta_file_name.c_str());
+  }
+  name_offsets.push_back(names.size());
+  names.resize(pad8(names.size()), '\0');
+
+  string header;
+  append_uint64(header, TARGET_INDEX_MAGIC);
+  append_uint64(header, lengths.size());
+  append_uint64(header, names.size());
+  append_uint64(header, seqs.size());
+
+  // Write to a temporary file first so that a partial index is never used.
+  string tmp_file_name = index_file_name + ".tmp";
+  ofstream out(tmp_file_name.c_str(), ios::out | ios::binary | ios::trunc);
+  if (!out.is_open()) {
+    logger.severe("Unable to open target index file '%s'.",
+                  tmp_file_name.c_str());
+  }
+  out.write(header.data(), header.size());
+  out.write((const char*)&name_offsets[0],
+            name_offsets.size()*sizeof(boost::uint64_t));
+  out.write((const char*)&lengths[0], lengths.size()*sizeof(boost::uint64_t));
+  out.write((const char*)&seq_offsets[0],
+            seq_offsets.size()*sizeof(boost::uint64_t));
+  out.write(names.data(), names.size());
+  out.write(seqs.data(), seqs.size());
+  out.close();
+  if (!out.good() || rename(tmp_file_name.c_str(), index_file_name.c_str())) {
+    logger.severe("Unable to write target index file '%s'.",
+                  index_file_name.c_str());
+  }
+
+  return lengths.size();
+}
+
+TargetIndex::TargetIndex(const string& file_name)
+    : _file_name(file_name), _map(NULL), _len(0), _num_targs(0) {
+  const char* begin = NULL;
+#ifndef WIN32
+  int fd = open(file_name.c_str(), O_RDONLY);
+  struct stat st;
+  if (fd >= 0 && fstat(fd, &st) == 0 && st.st_size) {
+    // Map the file shared so that concurrent runs share the page cache.
+    void* map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (map != MAP_FAILED) {
+      _map = (char*)map;
+      _len = st.st_size;
+      begin = _map;
+    }
+  }
+  if (fd >= 0) {
+    close(fd);
+  }
+#endif
+  if (!_map) {
+    ifstream in(file_name.c_str(), ios::in | ios::binary);
+    if (!in.is_open()) {
+      logger.severe("Unable to open target index file '%s'.",
+                    file_name.c_str());
+    }
+    in.seekg(0, ios::end);
+    _len = in.tellg();
+    in.seekg(0, ios::beg);
+    _buff.resize(pad8(_len)/sizeof(boost::uint64_t) + 1);
+    in.read((char*)&_buff[0], _len);
+    begin = (const char*)&_buff[0];
+  }
+
+  const boost::uint64_t* header = (const boost::uint64_t*)begin;
+  if (_len < TARGET_INDEX_HEADER_SIZE*sizeof(boost::uint64_t) ||
+      header[0] != TARGET_INDEX_MAGIC) {
+    logger.severe("File '%s' is not a valid target index for this version of "
+                  "eXpress.", file_name.c_str());
+  }
+  _num_targs = header[1];
+  size_t names_size = header[2];
+  size_t seqs_size = header[3];
+  size_t tables_size = (3*_num_targs + 1)*sizeof(boost::uint64_t);
+  size_t expected_len = TARGET_INDEX_HEADER_SIZE*sizeof(boost::uint64_t) +
+                        tables_size + names_size + seqs_size;
+  if (_len != expected_len || names_size % 8) {
+    logger.severe("Target index file '%s' is truncated or corrupt.",
+                  file_name.c_str());
+  }
+
+  _name_offsets = header + TARGET_INDEX_HEADER_SIZE;
+  _lengths = _name_offsets + _num_targs + 1;
+  _seq_offsets = _lengths + _num_targs;
+  _names = (const char*)(_seq_offsets + _num_targs);
+  _seqs = (const unsigned char*)(_names + names_size);
+
+  for (size_t i = 0; i < _num_targs; ++i) {
+    if (_name_offsets[i] >= _name_offsets[i+1] ||
+        _name_offsets[i+1] > names_size ||
+        _names[_name_offsets[i+1]-1] != '\0' ||
+        _seq_offsets[i] + packed_size(_lengths[i]) > seqs_size) {
+      logger.severe("Target index file '%s' is truncated or corrupt.",
+                    file_name.c_str());
+    }
+  }
+}
+
+TargetIndex::~TargetIndex() {
+#ifndef WIN32
+  if (_map) {
+    munmap(_map, _len);
+  }
+#endif
+}
@@ -0,0 +1,124 @@
+/**
+ *  targetindex.h
+ *  express
+ *
+ *  Created by Adam Roberts on 10/14/12.
+ *  Copyright 2012 Adam Roberts. All rights reserved.
+ */
+
+#ifndef express_targetindex_h
+#define express_targetindex_h
+
+#include <boost/cstdint.hpp>
+#include <string>
+#include <vector>
+
+/**
+ * The TargetIndex class provides read-only access to a binary target index
+ * written by TargetIndex::write, which stores the names, lengths and packed
+ * sequences of the targets in a MultiFASTA file. The file is memory-mapped
+ * (shared between processes) if possible, so that targets can be loaded
+ * without parsing and their sequences used in place.
+ *
+ * The file consists of a header of four 64-bit values (TARGET_INDEX_MAGIC,
+ * the number of targets n, and the sizes in bytes of the name and sequence
+ * tables), followed by arrays of n+1 64-bit name offsets, n 64-bit lengths and
+ * n 64-bit sequence offsets, the name table of NUL-terminated names padded to 8
+ * bytes, and the sequence table. Each sequence is packed 4 nucleotides per
+ * byte as in SequenceFwd. Values are stored in native byte order, which is
+ * checked by the magic number.
+ *  @author    Adam Roberts
+ *  @date      2012
+ *  @copyright Artistic License 2.0
+ **/
+class TargetIndex {
+  /**
+   * A private string storing the path to the index file.
+   */
+  std::string _file_name;
+  /**
+   * A private pointer to the mapped file, or NULL if it was read into _buff.
+   */
+  char* _map;
+  /**
+   * A private size_t storing the length of the file in bytes.
+   */
+  size_t _len;
+  /**
+   * A private buffer holding the file contents if it could not be mapped,
+   * stored as 64-bit values to keep the tables aligned.
+   */
+  std::vector<boost::uint64_t> _buff;
+  /**
+   * A private size_t storing the number of targets in the index.
+   */
+  size_t _num_targs;
+  /**
+   * Private pointers to the name offset, length and sequence offset tables.
+   */
+  const boost::uint64_t* _name_offsets;
+  const boost::uint64_t* _lengths;
+  const boost::uint64_t* _seq_offsets;
+  /**
+   * Private pointers to the name and sequence tables.
+   */
+  const char* _names;
+  const unsigned char* _seqs;
+
+public:
+  /**
+   * A static member function that tests whether a file is a target index,
+   * based on its magic number.
+   * @param file_name the path to the file.
+   * @return True iff the file starts with the magic number of a target index.
+   */
+  static bool is_index(const std::string& file_name);
+  /**
+   * A static member function that parses a MultiFASTA file and writes a target
+   * index for it. Target names are taken up to the first space of each header
+   * line and must be unique.
+   * @param fasta_file_name the path to the MultiFASTA file.
+   * @param index_file_name the path to write the index to.
+   * @return The number of targets written.
+   */
+  static size_t write(const std::string& fasta_file_name,
+                      const std::string& index_file_name);
+  /**
+   * TargetIndex constructor opens (and maps) and validates the index file.
+   * @param file_name the path to the index file.
+   */
+  TargetIndex(const std::string& file_name);
+  /**
+   * TargetIndex destructor unmaps the index file. Sequences referring to the
+   * index must not outlive this.
+   */
+  ~TargetIndex();
+  /**
+   * An accessor for the number of targets in the index.
+   * @return The number of targets in the index.
+   */
+  size_t size() const { return _num_targs; }
+  /**
+   * An accessor for the name of a target.
+   * @param i the index of the target in the file.
+   * @return A pointer to the NUL-terminated name of the target.
+   */
+  const char* name(size_t i) const { return _names + _name_offsets[i]; }
+  /**
+   * An accessor for the length of a target.
+   * @param i the index of the target in the file.
+   * @return The length of the target sequence.
+   */
+  size_t length(size_t i) const { return (size_t)_lengths[i]; }
+  /**
+   * An accessor for the packed sequence of a target, which does not outlive
+   * this.
+   * @param i the index of the target in the file.
+   * @return A pointer to the target sequence packed as in SequenceFwd.
+   */
+  const unsigned char* packed_seq(size_t i) const {
+    return _seqs + _seq_offsets[i];
+  }
+};
+
+#endif
@@ -14,97 +14,123 @@
 #include "mismatchmodel.h"
 #include "mapparser.h"
 #include "library.h"
+#include "targetindex.h"
+#include "runstats.h"
+#include "taskscheduler.h"
+#include <boost/bind.hpp>
 #include <iostream>
 #include <fstream>
 #include <cassert>
+#include <stdarg.h>
 #include <stdio.h>
+#include <string.h>
 #include <limits>
 #include <float.h>
 
 using namespace std;
 
-Target::Target(TargID id, const std::string& name, const std::string& seq,
-               bool prob_seq, double alpha, const Librarian* libs,
-               const BiasBoss* known_bias_boss, const LengthDistribution* known_fld)
+boost::mutex Target::_locks[NUM_TARGET_LOCKS];
+
+Target::Target(TargID id, const std::string& name, const SequenceFwd& seq,
+               double alpha, const Librarian* libs,
+               const BiasBoss* known_bias_boss, const LengthDistribution* known_fld,
+               TargetState* state)
    : _libs(libs),
      _id(id),
      _name(name),
-     _seq_f(seq, 0, prob_seq),
+     _seq_f(seq),
      _seq_r(_seq_f),
-     _alpha(log(alpha)),
-     _ret_params(&_curr_params),
+     _state(state),
      _uniq_counts(0),
      _tot_counts(0),
-     _avg_bias(0),
-     _avg_bias_buffer(0),
-     _solvable(false) {
-  if ((_libs->curr_lib()).bias_table) {
-    _start_bias.reset(new std::vector<float>(seq.length(),0));
-    _start_bias_buffer.reset(new std::vector<float>(seq.length(),0));
-    _end_bias.reset(new std::vector<float>(seq.length(),0));
-    _end_bias_buffer.reset(new std::vector<float>(seq.length(),0));
-  }
-  update_target_bias_buffer(known_bias_boss, known_fld);
-  swap_bias_parameters();
-  _init_pseudo_mass = _cached_eff_len + _alpha;
+     _bias_dirty(false) {
+  assert(_id < _state->alpha.size());
+  _state->alpha[_id] = log(alpha);
+  // Slot 0 is visible from epoch 0, so it can be filled directly. Known bias
+  // parameters are never refreshed, so the bias at each position is stored up
+  // front. Otherwise it is only stored once the target receives a hit.
+  update_bias_parameters(0, known_bias_boss, known_fld, true);
+  _state->init_pseudo_mass[_id] = bias_state().summary[0].cached_eff_len +
+                                  _state->alpha[_id];
 }
 
 void Target::add_hit(const FragHit& hit, double v, double m) {
   double p = hit.params()->posterior;
-  _curr_params.mass = log_add(_curr_params.mass, p+m);
-  double mass_with_pseudo = log_add(_ret_params->mass, _init_pseudo_mass);
+  add_mass(p, v, m);
+  if (_haplotype) {
+    _haplotype->update_mass(this, hit.frag_name(),
+                            hit.params()->align_likelihood, p);
+  }
+}
+
+void Target::add_mass(double p, double v, double m, double log_count,
+                      double* fpb_incr) {
+  double tot_m = m + log_count;
+  RoundParams& params = curr_params();
+  params.mass = log_add(params.mass, p+tot_m);
+  double mass_with_pseudo = log_add(ret_params().mass,
+                                    _state->init_pseudo_mass[_id]);
   if (p != LOG_1 || v != LOG_0) {
     if (p != LOG_0) {
-      _curr_params.ambig_mass = log_add(_curr_params.ambig_mass, p+m);
-      _curr_params.tot_ambig_mass = log_add(_curr_params.tot_ambig_mass, m);
+      params.ambig_mass = log_add(params.ambig_mass, p+tot_m);
+      params.tot_ambig_mass = log_add(params.tot_ambig_mass, tot_m);
     }
-    double p_hat = _curr_params.ambig_mass;
-    if (_curr_params.tot_ambig_mass != LOG_0) {
-      p_hat -= _curr_params.tot_ambig_mass;
+    double p_hat = params.ambig_mass;
+    if (params.tot_ambig_mass != LOG_0) {
+      p_hat -= params.tot_ambig_mass;
     } else {
       assert(p_hat == LOG_0);
     }
     assert(p_hat == LOG_0 || p_hat <= LOG_1);
-    _curr_params.var_sum = min(log_add(_curr_params.var_sum, v + m),
-                               _curr_params.tot_ambig_mass + p_hat
-                               + log_sub(LOG_1, p_hat));
-    double var_update = log_add(p + 2*m, v + 2*m);
-    _curr_params.mass_var = min(log_add(_curr_params.mass_var, var_update),
-                                mass_with_pseudo + log_sub(_bundle->mass(),
-                                                      mass_with_pseudo));
+    params.var_sum = min(log_add(params.var_sum, v + tot_m),
+                         params.tot_ambig_mass + p_hat
+                         + log_sub(LOG_1, p_hat));
+    double var_update = log_add(p + 2*m, v + 2*m) + log_count;
+    params.mass_var = min(log_add(params.mass_var, var_update),
+                          mass_with_pseudo + log_sub(_bundle->mass(),
+                                                     mass_with_pseudo));
+  }
+  if (fpb_incr) {
+    *fpb_incr = log_add(*fpb_incr, tot_m - bias_summary().cached_eff_len);
+  } else {
+    (_libs->curr_lib()).targ_table->update_total_fpb(tot_m -
+                                                bias_summary().cached_eff_len);
   }
-  if (_curr_params.haplotype) {
-    _curr_params.haplotype->update_mass(this, hit.frag_name(),
-                                        hit.params()->align_likelihood, p);
+  if (!_bias_dirty) {
+    _bias_dirty = true;
+    (_libs->curr_lib()).targ_table->queue_bias_refresh(this);
   }
-  (_libs->curr_lib()).targ_table->update_total_fpb(m - _cached_eff_len);
 }
 
-void Target::round_reset() {
-  _last_params = _curr_params;
-  _curr_params = RoundParams();
-  _ret_params = &_last_params;
-  _init_pseudo_mass = LOG_0;
+double Target::rho() const {
+  double fpb = this->fpb();
+  if (fpb == LOG_0) {
+      return LOG_0;
+  }
+
+  return fpb - (_libs->curr_lib()).targ_table->total_fpb();
 }
 
-double Target::rho() const {
+double Target::fpb() const {
   double eff_len = cached_effective_length(false);
   if (eff_len == LOG_0) {
       return LOG_0;
   }
 
-  return mass(true) - eff_len - (_libs->curr_lib()).targ_table->total_fpb();
+  return mass(true) - eff_len;
 }
 
 double Target::mass(bool with_pseudo) const {
   if (!with_pseudo) {
-    return _ret_params->mass;
+    return ret_params().mass;
   }
-  return log_add(_ret_params->mass, _alpha+_cached_eff_len+_avg_bias);
+  const BiasSummary& summary = bias_summary();
+  return log_add(ret_params().mass, _state->alpha[_id] +
+                 summary.cached_eff_len + summary.avg_bias);
 }
 
 double Target::mass_var() const {
-  return _ret_params->mass_var;
+  return ret_params().mass_var;
 }
 
 double Target::sample_likelihood(bool with_pseudo,
@@ -139,11 +165,16 @@ double Target::align_likelihood(const FragHit& frag) const {
   }
 
   if (lib.bias_table) {
-    if (ps != RIGHT_ONLY) {
-      ll += _start_bias->at(frag.left());
-    }
-    if (ps != LEFT_ONLY) {
-      ll += _end_bias->at(frag.right() - 1);
+    const boost::shared_array<boost::int16_t>& bias = _pos_bias[bias_slot()];
+    if (bias) {
+      if (ps != RIGHT_ONLY) {
+        assert(frag.left() < length());
+        ll += unquantize_bias(bias[frag.left()]);
+      }
+      if (ps != LEFT_ONLY) {
+        assert(frag.right() - 1 < length());
+        ll += unquantize_bias(bias[length() + frag.right() - 1]);
+      }
     }
   }
   
@@ -171,40 +202,91 @@ double Target::est_effective_length(const LengthDistribution* fld,
   if (log_length < fld->mean()) {
     eff_len = log_length;
   } else {
-    for(size_t l = fld->min_val(); l <= min(length(), fld->max_val()); l++) {
-      eff_len = log_add(eff_len, fld->pmf(l)+log((double)length()-l+1));
-    }
+    eff_len = fld->effective_length(length());
   }
   
   if (with_bias) {
-    eff_len += _avg_bias;
+    eff_len += bias_summary().avg_bias;
   }
 
   return eff_len;
 }
 
 double Target::cached_effective_length(bool with_bias) const {
+  const BiasSummary& summary = bias_summary();
   if (with_bias) {
-    return _cached_eff_len + _avg_bias;
+    return summary.cached_eff_len + summary.avg_bias;
   }
-  return _cached_eff_len;
+  return summary.cached_eff_len;
 }
 
-void Target::update_target_bias_buffer(const BiasBoss* bias_table,
-                                       const LengthDistribution* fld) {
+void Target::update_bias_parameters(size_t slot, const BiasBoss* bias_table,
+                                    const LengthDistribution* fld,
+                                    bool store_bias) {
+  BiasSummary& summary = bias_state().summary[slot];
+  if (bias_table) {
+    vector<float> start_bias(length(), 0);
+    vector<float> end_bias(length(), 0);
+    summary.avg_bias = bias_table->get_target_bias(start_bias, end_bias, *this);
+    if (store_bias) {
+      // Allocate a new array rather than overwriting the old one, which may
+      // be shared with the published parameters.
+      _pos_bias[slot].reset(new boost::int16_t[2*length()]);
+      for (size_t i = 0; i < length(); ++i) {
+        _pos_bias[slot][i] = quantize_bias(start_bias[i]);
+        _pos_bias[slot][length() + i] = quantize_bias(end_bias[i]);
+      }
+    } else {
+      _pos_bias[slot].reset();
+    }
+  }
+  assert(!isnan(summary.avg_bias) && !isinf(summary.avg_bias));
+  summary.cached_eff_len = est_effective_length(fld, false);
+}
+
+double Target::bias_parameters_change(const BiasBoss* bias_table,
+                                      const LengthDistribution* fld) const {
+  const BiasSummary& summary = bias_summary();
+  const boost::shared_array<boost::int16_t>& bias = _pos_bias[bias_slot()];
+  double eff_len = est_effective_length(fld, false);
+  double change = 0;
+  if (islzero(eff_len) != islzero(summary.cached_eff_len)) {
+    return HUGE_VAL;
+  } else if (!islzero(eff_len)) {
+    change = fabs(eff_len - summary.cached_eff_len);
+  }
   if (bias_table) {
-    _avg_bias_buffer = bias_table->get_target_bias(*_start_bias_buffer,
-                                                   *_end_bias_buffer, *this);
+    vector<float> start_bias(length(), 0);
+    vector<float> end_bias(length(), 0);
+    double avg_bias = bias_table->get_target_bias(start_bias, end_bias, *this);
+    if (!bias) {
+      // Only the average bias is used by targets without hits.
+      return change + fabs(avg_bias - summary.avg_bias);
+    }
+    double tot = 0;
+    for (size_t i = 0; i < length(); ++i) {
+      tot += fabs(start_bias[i] - unquantize_bias(bias[i])) +
+             fabs(end_bias[i] - unquantize_bias(bias[length() + i]));
+    }
+    change += tot / length();
   }
-  assert(!isnan(_avg_bias_buffer) && !isinf(_avg_bias_buffer));
-  _cached_eff_len_buffer = est_effective_length(fld, false);
+  return change;
 }
 
-void Target::swap_bias_parameters() {
-  _cached_eff_len = _cached_eff_len_buffer;
-  _avg_bias = _avg_bias_buffer;
-  _start_bias.swap(_start_bias_buffer);
-  _end_bias.swap(_end_bias_buffer);
+void Target::update_target_bias_buffer(const BiasBoss* bias_table,
+                                       const LengthDistribution* fld,
+                                       bool store_bias) {
+  // Buffer into the slot that is not visible, to be published at the next
+  // epoch. Any previously buffered parameters have already been published.
+  BiasState& state = bias_state();
+  assert((state.buffer_state >> 1) <= _state->bias_epoch);
+  size_t i = (state.buffer_state & 1) ^ 1;
+  // The average bias is only recalculated with a bias table, so carry over the
+  // published value.
+  state.summary[i].avg_bias = state.summary[i ^ 1].avg_bias;
+  _pos_bias[i] = _pos_bias[i ^ 1];
+  update_bias_parameters(i, bias_table, fld, store_bias || _tot_counts > 0);
+  state.buffer_state = ((_state->bias_epoch + 1) << 1) | i;
 }
 
 void HaplotypeHandler::commit_buffer() {
@@ -261,7 +343,7 @@ double HaplotypeHandler::get_mass(const Target* targ, bool with_pseudo) {
   
   double total_mass = LOG_0;
   foreach(const Target* targ, _targets) {
-    total_mass = log_add(total_mass, targ->_ret_params->mass);
+    total_mass = log_add(total_mass, targ->mass(false));
     if (with_pseudo){
       total_mass = log_add(total_mass, targ->cached_effective_length());
     }
@@ -291,29 +373,83 @@ void HaplotypeHandler::update_mass(const Target* targ, const string& frag_name,
 
 TargetTable::TargetTable(string targ_fasta_file, string haplotype_file,
                          bool prob_seqs, bool known_aux_params, double alpha,
-                         const AlphaMap* alpha_map, const Librarian* libs)
-    :  _libs(libs) {
-  string info_msg = "Loading target sequences";
+                         const AlphaMap* alpha_map, const Librarian* libs,
+                         bool lazy)
+    :  _libs(libs),
+       _lazy(lazy),
+       _prob_seqs(prob_seqs),
+       _known_aux_params(known_aux_params),
+       _bias_fixed(false) {
+  string info_msg = (lazy) ? "Indexing target sequences"
+                           : "Loading target sequences";
   const Library& lib = _libs->curr_lib();
   const TransIndex& targ_index = lib.map_parser->targ_index();
   const TransIndex& targ_lengths = lib.map_parser->targ_lengths();
-  if (lib.bias_table && !known_aux_params) {
+  if (lib.bias_table && !known_aux_params && !lazy) {
     info_msg += " and measuring bias background";
   }
   info_msg += "...";
   logger.info(info_msg.c_str());
 
+  // Allow the initial effective lengths to be computed in constant time.
+  lib.fld->cache_prefix_sums();
+  if (lib.bias_table && known_aux_params) {
+    lib.bias_table->cache_weights();
+  }
+
   size_t num_targs = targ_index.size();
   _targ_map = vector<Target*>(num_targs, NULL);
+  _state.reset(new TargetState(num_targs));
   _total_fpb = log(alpha*num_targs);
+  if (lazy) {
+    // Targets may be instantiated after the shared distribution has started
+    // to be updated, so their initial effective lengths use a copy.
+    _entries.resize(num_targs);
+    _lazy_fld.reset(new LengthDistribution(*(lib.fld)));
+    _lazy_fld->cache_prefix_sums();
+  }
 
   boost::unordered_set<string> target_names;
       
-  ifstream infile (targ_fasta_file.c_str());
+  bool from_index = TargetIndex::is_index(targ_fasta_file);
+  ifstream infile;
+  if (!from_index) {
+    infile.open(targ_fasta_file.c_str());
+  }
   string line;
   string seq = "";
   string name = "";
-  if (infile.is_open()) {
+  if (from_index) {
+    // Sequences are used in place from the (mapped) index.
+    _targ_index_file.reset(new TargetIndex(targ_fasta_file));
+    const TargetIndex& index_file = *_targ_index_file;
+    for (size_t i = 0; i < index_file.size(); ++i) {
+      name = index_file.name(i);
+      if (alpha_map) {
+        AlphaMap::const_iterator alpha_it = alpha_map->find(name);
+        if (alpha_it == alpha_map->end()) {
+          logger.severe("Target '%s' is was not found in the prior parameter "
+                        "file.", name.c_str());
+        }
+        alpha = alpha_it->second;
+      }
+      if (lazy) {
+        add_entry(name, index_file.length(i), i, alpha, targ_index,
+                  targ_lengths);
+      } else {
+        add_targ(name, SequenceFwd(index_file.packed_seq(i),
+                                   index_file.length(i), prob_seqs),
+                 known_aux_params, alpha, targ_index, targ_lengths);
+      }
+    }
+    if (lib.bias_table && !known_aux_params) {
+      lib.bias_table->normalize_expectations();
+    }
+  } else if (infile.is_open()) {
+    // Lazy targets only store the length and offset of their sequences, which
+    // are read again once they are instantiated.
+    size_t length = 0;
+    size_t offset = 0;
     while (infile.good()) {
       getline(infile, line, '\n');
       if (line.empty()) {
@@ -324,8 +460,12 @@ TargetTable::TargetTable(string targ_fasta_file, string haplotype_file,
           if (alpha_map) {
             alpha = alpha_map->find(name)->second;
           }
-          add_targ(name, seq, prob_seqs, known_aux_params, alpha, targ_index,
-                   targ_lengths);
+          if (lazy) {
+            add_entry(name, length, offset, alpha, targ_index, targ_lengths);
+          } else {
+            add_targ(name, SequenceFwd(seq, false, prob_seqs),
+                     known_aux_params, alpha, targ_index, targ_lengths);
+          }
         }
         name = line.substr(1,line.find(' ')-1);
         if (target_names.count(name)) {
@@ -339,6 +479,10 @@ TargetTable::TargetTable(string targ_fasta_file, string haplotype_file,
         }
         target_names.insert(name);
         seq = "";
+        length = 0;
+        offset = (size_t)infile.tellg();
+      } else if (lazy) {
+        length += line.size();
       } else {
         seq += line;
       }
@@ -347,11 +491,22 @@ TargetTable::TargetTable(string targ_fasta_file, string haplotype_file,
       if (alpha_map) {
         alpha = alpha_map->find(name)->second;
       }
-      add_targ(name, seq, prob_seqs, known_aux_params, alpha, targ_index,
-               targ_lengths);
+      if (lazy) {
+        add_entry(name, length, offset, alpha, targ_index, targ_lengths);
+      } else {
+        add_targ(name, SequenceFwd(seq, false, prob_seqs), known_aux_params,
+                 alpha, targ_index, targ_lengths);
+      }
     }
 
     infile.close();
+    if (lazy) {
+      _lazy_fasta.open(targ_fasta_file.c_str());
+      if (!_lazy_fasta.is_open()) {
+        logger.severe("Unable to open MultiFASTA file '%s'.",
+                      targ_fasta_file.c_str());
+      }
+    }
     if (lib.bias_table && !known_aux_params) {
       lib.bias_table->normalize_expectations();
     }
@@ -367,12 +522,18 @@ TargetTable::TargetTable(string targ_fasta_file, string haplotype_file,
 
   for(TransIndex::const_iterator it = targ_index.begin();
       it != targ_index.end(); ++it) {
-    if (!_targ_map[it->second]) {
+    bool found = (lazy) ? !_entries[it->second].name.empty()
+                        : _targ_map[it->second] != NULL;
+    if (!found) {
       logger.severe("Sequence for target '%s' not found in MultiFASTA file "
                     "'%s'.", it->first.c_str(), targ_fasta_file.c_str());
     }
   }
-  logger.info("Initialized %d targets.", size());
+  if (lazy) {
+    logger.info("Indexed %d targets to be loaded once aligned to.", size());
+  } else {
+    logger.info("Initialized %d targets.", size());
+  }
   
   // Load haplotype information, if provided
   if (haplotype_file.size()) {
@@ -396,7 +557,7 @@ TargetTable::TargetTable(string targ_fasta_file, string haplotype_file,
             logger.severe("Haplotype target '%s' does not exist in MultiFASTA "
                           "or alignment files.", p);
           }
-          haplotype_targets.push_back(_targ_map[targ_index.at(p)]);
+          haplotype_targets.push_back(get_targ(targ_index.at(p)));
           p = strtok(NULL, ",");
         } while (p);
 
@@ -427,31 +588,23 @@ TargetTable::~TargetTable() {
   }
 }
 
-void TargetTable::add_targ(const string& name, const string& seq, bool prob_seq,
+void TargetTable::add_targ(const string& name, const SequenceFwd& seq,
                            bool known_aux_params, double alpha,
                            const TransIndex& targ_index,
                            const TransIndex& targ_lengths) {
-  TransIndex::const_iterator it = targ_index.find(name);
-  if (it == targ_index.end()) {
-    logger.warn("Target '%s' exists in MultiFASTA but not alignment "
-                   "(SAM/BAM) file.", name.c_str());
+  TargID id;
+  if (!find_targ(name, seq.length(), targ_index, targ_lengths, id)) {
     return;
   }
 
-  if (targ_lengths.find(name)->second != seq.length()) {
-    logger.severe("Target '%s' differs in length between MultiFASTA and "
-                  "alignment (SAM/BAM) files (%d  vs. %d).", name.c_str(),
-                  seq.length(), targ_lengths.find(name)->second);
-  }
-
   const Library& lib = _libs->curr_lib();
   const BiasBoss* known_bias_boss = (known_aux_params) ? lib.bias_table.get()
                                                        : NULL;
   const LengthDistribution* known_fld = (known_aux_params) ? lib.fld.get()
                                                            : NULL;
   
-  Target* targ = new Target(it->second, name, seq, prob_seq, alpha, _libs,
-                            known_bias_boss, known_fld);
+  Target* targ = new Target(id, name, seq, alpha, _libs, known_bias_boss,
+                            known_fld, _state.get());
   if (lib.bias_table && !known_aux_params) {
     (lib.bias_table)->update_expectations(*targ);
   }
@@ -459,8 +612,135 @@ void TargetTable::add_targ(const string& name, const string& seq, bool prob_seq,
   targ->bundle(_bundle_table.create_bundle(targ));
 }
 
+bool TargetTable::find_targ(const string& name, size_t length,
+                            const TransIndex& targ_index,
+                            const TransIndex& targ_lengths, TargID& id) const {
+  TransIndex::const_iterator it = targ_index.find(name);
+  if (it == targ_index.end()) {
+    logger.warn("Target '%s' exists in MultiFASTA but not alignment "
+                   "(SAM/BAM) file.", name.c_str());
+    return false;
+  }
+
+  if (targ_lengths.find(name)->second != length) {
+    logger.severe("Target '%s' differs in length between MultiFASTA and "
+                  "alignment (SAM/BAM) files (%d  vs. %d).", name.c_str(),
+                  length, targ_lengths.find(name)->second);
+  }
+  id = it->second;
+  return true;
+}
+
+void TargetTable::add_entry(const string& name, size_t length, size_t offset,
+                            double alpha, const TransIndex& targ_index,
+                            const TransIndex& targ_lengths) {
+  TargID id;
+  if (!find_targ(name, length, targ_index, targ_lengths, id)) {
+    return;
+  }
+  TargetEntry& entry = _entries[id];
+  entry.name = name;
+  entry.length = length;
+  entry.offset = offset;
+  entry.alpha = alpha;
+}
+
+Target* TargetTable::instantiate(TargID id) {
+  const TargetEntry& entry = _entries[id];
+  const Library& lib = _libs->curr_lib();
+  const BiasBoss* known_bias_boss = (_known_aux_params) ? lib.bias_table.get()
+                                                        : NULL;
+
+  // The initial bias background has already been measured, so unlike in
+  // add_targ the expectations of the target are only added once it is
+  // refreshed by the bias updater.
+  Target* targ = NULL;
+  if (_targ_index_file) {
+    const TargetIndex& index_file = *_targ_index_file;
+    targ = new Target(id, entry.name,
+                      SequenceFwd(index_file.packed_seq(entry.offset),
+                                  index_file.length(entry.offset), _prob_seqs),
+                      entry.alpha, _libs, known_bias_boss, _lazy_fld.get(),
+                      _state.get());
+  } else {
+    string seq;
+    seq.reserve(entry.length);
+    if (entry.length) {
+      string line;
+      _lazy_fasta.clear();
+      _lazy_fasta.seekg(entry.offset);
+      while (seq.size() < entry.length && getline(_lazy_fasta, line, '\n')) {
+        seq += line;
+      }
+    }
+    if (seq.size() != entry.length) {
+      logger.severe("Unable to read the sequence of target '%s' from the "
+                    "MultiFASTA file.", entry.name.c_str());
+    }
+    targ = new Target(id, entry.name, SequenceFwd(seq, false, _prob_seqs),
+                      entry.alpha, _libs, known_bias_boss, _lazy_fld.get(),
+                      _state.get());
+  }
+  if (_fixed_fld) {
+    // The bias updater has stopped, so publish the fixed parameters. The
+    // initial pseudo-mass keeps using the initial distribution, as it does for
+    // the targets instantiated before.
+    targ->update_bias_parameters(0, _fixed_bias.get(), _fixed_fld.get(), true);
+  }
+  _targ_map[id] = targ;
+  targ->bundle(_bundle_table.create_bundle(targ));
+  return targ;
+}
+
 Target* TargetTable::get_targ(TargID id) {
+  if (!_lazy) {
     return _targ_map[id];
+  }
+  boost::unique_lock<boost::mutex> lock(_lazy_mut);
+  Target* targ = _targ_map[id];
+  if (!targ && !_entries[id].name.empty()) {
+    targ = instantiate(id);
+  }
+  return targ;
+}
+
+const string& TargetTable::targ_name(TargID id) const {
+  return (_lazy) ? _entries[id].name : _targ_map[id]->name();
+}
+
+size_t TargetTable::targ_length(TargID id) const {
+  return (_lazy) ? _entries[id].length : _targ_map[id]->length();
+}
+
+TransMap TargetTable::fix_lazy_parameters(const BiasBoss* bias_table,
+                                          const LengthDistribution* fld) {
+  boost::unique_lock<boost::mutex> lock(_lazy_mut);
+  if (!_fixed_fld) {
+    _fixed_fld.reset(new LengthDistribution(*fld));
+    _fixed_fld->cache_prefix_sums();
+    if (bias_table) {
+      _fixed_bias.reset(new BiasBoss(*bias_table));
+      _fixed_bias->cache_weights();
+    }
+  }
+  TransMap targs;
+  foreach (Target* targ, _targ_map) {
+    if (targ) {
+      targs.push_back(targ);
+    }
+  }
+  return targs;
+}
+
+TransMap TargetTable::instantiated_targets() const {
+  boost::unique_lock<boost::mutex> lock(_lazy_mut);
+  TransMap targs;
+  foreach (Target* targ, _targ_map) {
+    if (targ) {
+      targs.push_back(targ);
+    }
+  }
+  return targs;
 }
 
 Bundle* TargetTable::merge_bundles(Bundle* b1, Bundle* b2) {
@@ -471,8 +751,13 @@ Bundle* TargetTable::merge_bundles(Bundle* b1, Bundle* b2) {
 }
 
 void TargetTable::round_reset() {
+  _state->round_reset();
+  boost::unique_lock<boost::mutex> lock(_lazy_mut);
   foreach(Target* targ, _targ_map) {
-    targ->round_reset();
+    if (!targ) {
+      continue;
+    }
+    targ->_haplotype.reset();
     targ->bundle()->incr_mass(targ->mass(false));
   }
   foreach(vector<Target*> hap_group, _haplotype_groups) {
@@ -537,329 +822,959 @@ struct Result {
   }
 };
 
+/**
+ * The number of buffered bytes at which output_results writes to a file.
+ */
+const size_t OUTPUT_BUFF_SIZE = 1 << 20;
+
+/**
+ * The number of targets whose results are computed by each output task.
+ * Bundles with fewer targets are packed together into tasks, and the targets
+ * of larger bundles are split into pieces of this size computed by tasks of
+ * their own.
+ */
+const size_t RESULT_TASK_TARGS = 1 << 10;
+
+/**
+ * The BundleCounts struct stores the values computed once for a Bundle by
+ * output_results that are shared by the tasks computing the Results of its
+ * Targets.
+ */
+struct BundleCounts {
+  const Bundle* bundle;
+  double l_bundle_mass;
+  double l_var_renorm;
+  /**
+   * The counts of the targets, indexed by their position in the bundle.
+   */
+  vector<double> targ_counts;
+  /**
+   * The covariances of the bundle, indexed by the position of the targets in
+   * the bundle. Only gathered when the variance-covariance matrix is output.
+   */
+  vector<vector<pair<size_t, double> > > covar;
+};
+
+/**
+ * The ResultsOutput struct stores the state shared by the tasks of
+ * output_results. The formatted varcov and RDD text is stored per piece of
+ * RESULT_TASK_TARGS targets, in output order.
+ */
+struct ResultsOutput {
+  size_t tot_counts;
+  vector<Result> res;
+  vector<size_t> bundle_index;
+  vector<string> varcov_buffs;
+  vector<string> rdds_buffs;
+  bool varcov;
+  bool rdds;
+  TaskScheduler* scheduler;
+};
+
+/**
+ * The magic number identifying a binary results file, the ASCII string "XPRS"
+ * when stored in little-endian byte order.
+ */
+const boost::uint32_t RESULTS_BIN_MAGIC = 0x53525058;
+/**
+ * The version of the binary results file format.
+ */
+const boost::uint32_t RESULTS_BIN_VERSION = 1;
+/**
+ * The number of columns in a binary results file, in the same order as the
+ * columns of 'results.xprs' excluding target_id.
+ */
+const boost::uint64_t RESULTS_BIN_COLUMNS = 14;
+
+/**
+ * A helper function that appends printf-style formatted text to a buffer.
+ * @param buff the buffer to append to.
+ * @param format the printf format string.
+ */
+void append_format(string& buff, const char* format, ...) {
+  char line[1024];
+  va_list args;
+  va_start(args, format);
+  int n = vsnprintf(line, sizeof(line), format, args);
+  va_end(args);
+  if (n < 0) {
+    return;
+  }
+  if ((size_t)n < sizeof(line)) {
+    buff.append(line, n);
+    return;
+  }
+  vector<char> long_line(n + 1);
+  va_start(args, format);
+  vsnprintf(&long_line[0], long_line.size(), format, args);
+  va_end(args);
+  buff.append(&long_line[0], n);
+}
+
+/**
+ * A helper function that appends the bytes of a value to a buffer.
+ * @param buff the buffer to append to.
+ * @param val the value to append.
+ */
+template <typename T>
+inline void append_bytes(string& buff, T val) {
+  buff.append((const char*)&val, sizeof(T));
+}
+
+/**
+ * A helper function that writes the contents of a buffer to a file and clears
+ * the buffer.
+ * @param file the file to write to.
+ * @param file_name the path to the file, for error messages.
+ * @param buff the buffer to write.
+ */
+void flush_buffer(FILE* file, const string& file_name, string& buff) {
+  if (buff.size() && fwrite(buff.data(), 1, buff.size(), file) != buff.size()) {
+    logger.severe("Unable to write to output file '%s'.", file_name.c_str());
+  }
+  buff.clear();
+}
+
+/**
+ * A helper function that opens an output file, exiting on failure.
+ * @param file_name the path to the file.
+ * @return A pointer to the opened file.
+ */
+FILE* open_output(const string& file_name) {
+  FILE* file = fopen(file_name.c_str(), "wb");
+  if (!file) {
+    logger.severe("Unable to open output file '%s'.", file_name.c_str());
+  }
+  return file;
+}
+
+void TargetTable::bundle_masses_to_counts(Bundle* bundle) {
+  const vector<Target*>& bundle_targ = *(bundle->targets());
+
+  // Calculate total counts for bundle and bundle-level rho
+  // Do not include pseudo-mass because it will screw up multi-round results
+  double l_bundle_mass = LOG_0;
+  foreach (Target* targ, bundle_targ) {
+    l_bundle_mass = log_add(l_bundle_mass, targ->mass(false));
+  }
+
+  if (bundle->counts()) {
+    double l_bundle_counts = log((double)bundle->counts());
+    double l_var_renorm = 2*(l_bundle_counts - l_bundle_mass);
+
+    vector<double> targ_counts(bundle_targ.size(),0);
+    bool requires_projection = false;
+
+    for (size_t i = 0; i < bundle_targ.size(); ++i) {
+      Target& targ = *bundle_targ[i];
+      double l_targ_frac = targ.mass(false) - l_bundle_mass;
+      targ_counts[i] = sexp(l_targ_frac + l_bundle_counts);
+      requires_projection |= targ_counts[i] > (double)targ.tot_counts() ||
+      targ_counts[i] < (double)targ.uniq_counts();
+    }
+
+    if (bundle_targ.size() > 1 && requires_projection) {
+      project_to_polytope(bundle_targ, targ_counts, bundle->counts());
+    }
+
+    // Calculate individual counts and rhos
+    for (size_t i = 0; i < bundle_targ.size(); ++i) {
+      Target& targ = *bundle_targ[i];
+      double mass = targ.mass(false);
+      RoundParams& params = targ.curr_params();
+      params.mass = log((double)targ_counts[i]);
+      params.mass_var = min(targ.mass_var(),
+                            mass + log_sub(l_bundle_mass, mass))
+                        + l_var_renorm;
+      params.var_sum = targ.var_sum() + l_var_renorm;
+    }
+  }
+
+  bundle->reset_mass();
+  bundle->incr_mass(log((double)bundle->counts()));
+}
+
+void TargetTable::masses_to_counts_task(const vector<Bundle*>* bundles,
+                                        size_t begin, size_t end, size_t w) {
+  for (size_t b = begin; b < end; ++b) {
+    bundle_masses_to_counts((*bundles)[b]);
+  }
+}
+
 void TargetTable::masses_to_counts() {
-  foreach (Bundle* bundle, _bundle_table.bundles()) {
-    
-    const vector<Target*>& bundle_targ = *(bundle->targets());
-
-    // Calculate total counts for bundle and bundle-level rho
-    // Do not include pseudo-mass because it will screw up multi-round results
-    double l_bundle_mass = LOG_0;
-    foreach (Target* targ, bundle_targ) {
-      l_bundle_mass = log_add(l_bundle_mass, targ->mass(false));
-    }
-    
-    if (bundle->counts()) {
-      double l_bundle_counts = log((double)bundle->counts());
-      double l_var_renorm = 2*(l_bundle_counts - l_bundle_mass);
-
-      vector<double> targ_counts(bundle_targ.size(),0);
-      bool requires_projection = false;
-      
-      for (size_t i = 0; i < bundle_targ.size(); ++i) {
-        Target& targ = *bundle_targ[i];
-        double l_targ_frac = targ.mass(false) - l_bundle_mass;
-        targ_counts[i] = sexp(l_targ_frac + l_bundle_counts);
-        requires_projection |= targ_counts[i] > (double)targ.tot_counts() ||
-        targ_counts[i] < (double)targ.uniq_counts();
+  // Bundles share no targets, so they can be converted independently. Small
+  // bundles are packed into tasks and idle workers steal the remaining tasks
+  // of those held up by large bundles.
+  vector<Bundle*> bundles(_bundle_table.bundles().begin(),
+                          _bundle_table.bundles().end());
+  TaskScheduler scheduler(output_threads);
+  size_t task_begin = 0;
+  size_t task_targs = 0;
+  size_t num_tasks = 0;
+  for (size_t b = 0; b < bundles.size(); ++b) {
+    task_targs += bundles[b]->targets()->size();
+    if (task_targs >= RESULT_TASK_TARGS || b + 1 == bundles.size()) {
+      scheduler.spawn(boost::bind(&TargetTable::masses_to_counts_task, this,
+                                  &bundles, task_begin, b + 1, _1),
+                      num_tasks++ % scheduler.num_workers());
+      task_begin = b + 1;
+      task_targs = 0;
+    }
+  }
+  scheduler.run();
+}
+
+void TargetTable::bundle_results(const Bundle* bundle, size_t bundle_id,
+                                 size_t first_piece, size_t num_pieces,
+                                 ResultsOutput* out, size_t w) const {
+  const vector<Target*>& bundle_targ = *(bundle->targets());
+  string* varcov_buff = (out->varcov) ? &out->varcov_buffs[first_piece] : NULL;
+
+  boost::shared_ptr<BundleCounts> counts(new BundleCounts());
+  counts->bundle = bundle;
+
+  if (varcov_buff) {
+    append_format(*varcov_buff, ">" SIZE_T_FMT ": ", bundle_id);
+    for (size_t i = 0; i < bundle_targ.size(); ++i) {
+      if (i) {
+        varcov_buff->append(", ");
       }
-      
-      if (bundle_targ.size() > 1 && requires_projection) {
-        project_to_polytope(bundle_targ, targ_counts, bundle->counts());
+      varcov_buff->append(bundle_targ[i]->name());
+    }
+    varcov_buff->append("\n");
+
+    // Each pair is stored once by the target with the smaller TargID, so
+    // walk the rows of the bundle to gather the symmetric covariances. Each
+    // Target is in a single bundle, so the shared index is written by only
+    // one task per entry.
+    vector<size_t>& bundle_index = out->bundle_index;
+    for (size_t i = 0; i < bundle_targ.size(); ++i) {
+      bundle_index[bundle_targ[i]->id()] = i;
+    }
+    counts->covar.resize(bundle_targ.size());
+    for (size_t i = 0; i < bundle_targ.size(); ++i) {
+      const CovarRow* row = bundle_targ[i]->covar();
+      if (!row) {
+        continue;
       }
-      
-      // Calculate individual counts and rhos
-      for (size_t i = 0; i < bundle_targ.size(); ++i) {
-        Target& targ = *bundle_targ[i];
-        double mass = targ.mass(false);
-        targ._curr_params.mass = log((double)targ_counts[i]);
-        targ._curr_params.mass_var = min(targ.mass_var(),
-                                         mass + log_sub(l_bundle_mass, mass))
-                                     + l_var_renorm;
-        targ._curr_params.var_sum = targ.var_sum() + l_var_renorm;
+      for (size_t k = 0; k < row->size(); ++k) {
+        size_t j = bundle_index[row->targ(k)];
+        assert(bundle_targ[j]->id() == row->targ(k));
+        counts->covar[i].push_back(make_pair(j, row->covar(k)));
+        if (j != i) {
+          counts->covar[j].push_back(make_pair(i, row->covar(k)));
+        }
       }
     }
-    
-    bundle->reset_mass();
-    bundle->incr_mass(log((double)bundle->counts()));
   }
-}
 
-void TargetTable::output_results(string output_dir, size_t tot_counts,
-                                 bool output_varcov, bool output_rdds) {
-  FILE * expr_file = fopen((output_dir + "/results.xprs").c_str(), "w");
-  ofstream varcov_file;
-  ofstream   rdds_file;
-  if (output_varcov) {
-      varcov_file.open((output_dir + "/varcov.xprs").c_str());
+  if (!bundle->counts()) {
+    for (size_t i = 0; i < bundle_targ.size(); ++i) {
+      out->res[bundle_targ[i]->id()].set_zeros();
+      if (varcov_buff) {
+        for (size_t j = 0; j < bundle_targ.size(); ++j) {
+          varcov_buff->append((j) ? "\t0.000000e+00" : "0.000000e+00");
+        }
+        varcov_buff->append("\n");
+      }
+    }
+    return;
   }
-  if (output_rdds) {
-      rdds_file.open((output_dir + "/rdds.xprs").c_str());
-      rdds_file << "target_id\tposition\tp_value\tref_nuc\tP(A)\tP(C)\tP(G)\t"
-               << "P(T)\tobs_A\tobs_C\tobs_G\tobs_T\texp_A\texp_C\texp_G\texp_T"
-               << endl;
+
+  // Calculate total counts for bundle and bundle-level rho
+  // Do not include pseudo-mass because it will screw up multi-round results
+  double l_bundle_mass = LOG_0;
+  foreach (Target* targ, bundle_targ) {
+    l_bundle_mass = log_add(l_bundle_mass, targ->mass(false));
   }
-  fprintf(expr_file, "bundle_id\ttarget_id\tlength\teff_length\ttot_counts\t"
-                     "uniq_counts\test_counts\teff_counts\tambig_distr_alpha\t"
-                     "ambig_distr_beta\tfpkm\tfpkm_conf_low\tfpkm_conf_high\t"
-                     "solvable\ttpm\n");
 
-  const double l_bil = log(1000000000.);
-  const double l_tot_counts = log((double)tot_counts);
-  
-  vector<Result> res(size());
-  
-  size_t bundle_id = 0;
-  size_t t_id = 0;
-  foreach (Bundle* bundle, _bundle_table.bundles()) {
-    ++bundle_id;
+  const double l_bundle_counts = log((double)bundle->counts());
+  counts->l_bundle_mass = l_bundle_mass;
+  counts->l_var_renorm = 2*(l_bundle_counts - l_bundle_mass);
 
-    const vector<Target*>& bundle_targ = *(bundle->targets());
+  vector<double>& targ_counts = counts->targ_counts;
+  targ_counts.assign(bundle_targ.size(), 0);
+  bool requires_projection = false;
 
-    if (output_varcov) {
-      varcov_file << ">" << bundle_id << ": ";
-      for (size_t i = 0; i < bundle_targ.size(); ++i) {
-        if (i) {
-          varcov_file << ", ";
-        }
-        varcov_file << bundle_targ[i]->name();
-      }
-      varcov_file << endl;
-    }
-
-    // Calculate total counts for bundle and bundle-level rho
-    // Do not include pseudo-mass because it will screw up multi-round results
-    double l_bundle_mass = LOG_0;
-    foreach (Target* targ, bundle_targ) {
-      l_bundle_mass = log_add(l_bundle_mass, targ->mass(false));
-    }
-
-    if (bundle->counts()) {
-      const double l_bundle_counts = log((double)bundle->counts());
-      const double l_var_renorm = 2*(l_bundle_counts - l_bundle_mass);
-
-      vector<double> targ_counts(bundle_targ.size(),0);
-      bool requires_projection = false;
-
-      for (size_t i = 0; i < bundle_targ.size(); ++i) {
-        Target& targ = *bundle_targ[i];
-        const double l_targ_frac = targ.mass(false) - l_bundle_mass;
-        targ_counts[i] = sexp(l_targ_frac + l_bundle_counts);
-        requires_projection |= targ_counts[i] > (double)targ.tot_counts() ||
-                               targ_counts[i] < (double)targ.uniq_counts();
-      }
-
-      if (bundle_targ.size() > 1 && requires_projection) {
-        project_to_polytope(bundle_targ, targ_counts, bundle->counts());
-      }
-
-      // Calculate individual counts and rhos
-      for (size_t i = 0; i < bundle_targ.size(); ++i) {
-        Target& targ = *bundle_targ[i];
-        const double l_eff_len = targ.est_effective_length();
-
-        // Calculate count variance
-        const double mass = targ.mass(false);
-        const double mass_var = min(targ.mass_var(),
-                              mass + log_sub(l_bundle_mass, mass));
-        double count_alpha = 0;
-        double count_beta = 0;
-        double count_var = 0;
-
-        if (targ.tot_counts() != targ.uniq_counts()) {
-          double n = targ.tot_counts()-targ.uniq_counts();
-          if (targ_counts[i] == 0) {
-            count_var = n * (n + 2.) / 12.;
-            count_alpha = 0;
-            count_beta = 0;
-          } else if (targ.solvable()) {
-            double m = (targ_counts[i] - targ.uniq_counts())/n;
-            assert (m >= 0 && m <= 1);
-            m = max(m, EPSILON);
-            m = min(m, 1-EPSILON);
-            m = log(m);
-            double v = numeric_limits<double>::max();
-            if (sexp(targ.var_sum()) != 0 && targ.tot_ambig_mass() != LOG_0) {
-              v = targ.var_sum() - targ.tot_ambig_mass();
-            }
-            v = min(v, m + log_sub(log_sub(LOG_1, m), LOG_EPSILON - log(2.)));
-
-            count_alpha = m + (log_sub(log_add(m,v), m+m)) - v;
-            count_alpha = sexp(min(LOG_MAX, count_alpha));
-
-            count_beta = log_sub(LOG_1, m) + log_sub(log_add(m,v), m+m)- v;
-            count_beta = sexp(min(LOG_MAX, count_beta));
-            
-            count_var = mass_var;
-            
-            assert(count_alpha > 0 && count_beta > 0);
-            assert(!isinf(count_alpha) && !isinf(count_beta));
-            assert(!isnan(count_var));
-          } else {
-            count_var = n * (n + 2.) / 12.;
-            count_alpha = 1;
-            count_beta = 1;
-          }
+  for (size_t i = 0; i < bundle_targ.size(); ++i) {
+    Target& targ = *bundle_targ[i];
+    const double l_targ_frac = targ.mass(false) - l_bundle_mass;
+    targ_counts[i] = sexp(l_targ_frac + l_bundle_counts);
+    requires_projection |= targ_counts[i] > (double)targ.tot_counts() ||
+                           targ_counts[i] < (double)targ.uniq_counts();
+  }
+
+  if (bundle_targ.size() > 1 && requires_projection) {
+    project_to_polytope(bundle_targ, targ_counts, bundle->counts());
+  }
+
+  if (num_pieces == 1) {
+    target_results(counts, 0, bundle_targ.size(), first_piece, out, w);
+    return;
+  }
+
+  // The projection is serial, but the Results of the targets only depend on
+  // the shared counts, so the pieces are spawned onto this worker for idle
+  // workers to steal.
+  for (size_t p = 0; p < num_pieces; ++p) {
+    size_t begin = p * RESULT_TASK_TARGS;
+    size_t end = min(begin + RESULT_TASK_TARGS, bundle_targ.size());
+    out->scheduler->spawn(boost::bind(&TargetTable::target_results, this,
+                                      counts, begin, end, first_piece + p,
+                                      out, _1), w);
+  }
+}
+
+void TargetTable::target_results(boost::shared_ptr<const BundleCounts> counts,
+                                 size_t begin, size_t end, size_t piece,
+                                 ResultsOutput* out, size_t w) const {
+  const double l_bil = log(1000000000.);
+  const double l_tot_counts = log((double)out->tot_counts);
+
+  const vector<Target*>& bundle_targ = *(counts->bundle->targets());
+  const vector<double>& targ_counts = counts->targ_counts;
+  const vector<vector<pair<size_t, double> > >& bundle_covar = counts->covar;
+  const double l_bundle_mass = counts->l_bundle_mass;
+  const double l_var_renorm = counts->l_var_renorm;
+  string* varcov_buff = (out->varcov) ? &out->varcov_buffs[piece] : NULL;
+  string* rdds_buff = (out->rdds) ? &out->rdds_buffs[piece] : NULL;
+
+  vector<double> covar_line;
+
+  // Calculate individual counts and rhos
+  for (size_t i = begin; i < end; ++i) {
+    Target& targ = *bundle_targ[i];
+    const double l_eff_len = targ.est_effective_length();
+
+    // Calculate count variance
+    const double mass = targ.mass(false);
+    const double mass_var = min(targ.mass_var(),
+                          mass + log_sub(l_bundle_mass, mass));
+    double count_alpha = 0;
+    double count_beta = 0;
+    double count_var = 0;
+
+    if (targ.tot_counts() != targ.uniq_counts()) {
+      double n = targ.tot_counts()-targ.uniq_counts();
+      if (targ_counts[i] == 0) {
+        count_var = n * (n + 2.) / 12.;
+        count_alpha = 0;
+        count_beta = 0;
+      } else if (targ.solvable()) {
+        double m = (targ_counts[i] - targ.uniq_counts())/n;
+        assert (m >= 0 && m <= 1);
+        m = max(m, EPSILON);
+        m = min(m, 1-EPSILON);
+        m = log(m);
+        double v = numeric_limits<double>::max();
+        if (sexp(targ.var_sum()) != 0 && targ.tot_ambig_mass() != LOG_0) {
+          v = targ.var_sum() - targ.tot_ambig_mass();
         }
-        
-        t_id = targ.id();
+        v = min(v, m + log_sub(log_sub(LOG_1, m), LOG_EPSILON - log(2.)));
 
-        // Store results for output
-        assert(t_id < size());
-        res[t_id].count_alpha = count_alpha;
-        res[t_id].count_beta = count_beta;
-        
-        double fpkm_constant = sexp(l_bil - l_eff_len - l_tot_counts);
-        res[t_id].fpkm_std_dev = sexp(0.5*(mass_var + l_var_renorm));
-        res[t_id].fpkm = targ_counts[i] * fpkm_constant;
-        res[t_id].fpkm_lo = max(0.0,
-                             (targ_counts[i] -
-                              2*res[t_id].fpkm_std_dev) * fpkm_constant);
-        res[t_id].fpkm_hi = (targ_counts[i] +
-                             2*res[t_id].fpkm_std_dev) * fpkm_constant;
-        
-        res[t_id].est_counts = targ_counts[i];
-        res[t_id].eff_len = sexp(l_eff_len);
-        res[t_id].eff_counts = targ_counts[i] / res[t_id].eff_len * targ.length();
-        
-        res[t_id].cpb = targ_counts[i] / res[t_id].eff_len;
-
-        if (output_varcov) {
-          for (size_t j = 0; j < bundle_targ.size(); ++j) {
-            if (j) {
-              varcov_file << "\t";
-            }
-            if (i==j) {
-              varcov_file << scientific << sexp(get_covar(targ.id(), targ.id())
-                                               + l_var_renorm);
-            } else {
-              varcov_file << scientific
-                         << -sexp(get_covar(targ.id(), bundle_targ[j]->id())
-                                  + l_var_renorm);
-            }
+        count_alpha = m + (log_sub(log_add(m,v), m+m)) - v;
+        count_alpha = sexp(min(LOG_MAX, count_alpha));
+
+        count_beta = log_sub(LOG_1, m) + log_sub(log_add(m,v), m+m)- v;
+        count_beta = sexp(min(LOG_MAX, count_beta));
+
+        count_var = mass_var;
+
+        assert(count_alpha > 0 && count_beta > 0);
+        assert(!isinf(count_alpha) && !isinf(count_beta));
+        assert(!isnan(count_var));
+      } else {
+        count_var = n * (n + 2.) / 12.;
+        count_alpha = 1;
+        count_beta = 1;
+      }
+    }
+
+    // Store results for output
+    assert(targ.id() < size());
+    Result& r = out->res[targ.id()];
+    r.count_alpha = count_alpha;
+    r.count_beta = count_beta;
+
+    double fpkm_constant = sexp(l_bil - l_eff_len - l_tot_counts);
+    r.fpkm_std_dev = sexp(0.5*(mass_var + l_var_renorm));
+    r.fpkm = targ_counts[i] * fpkm_constant;
+    r.fpkm_lo = max(0.0, (targ_counts[i] - 2*r.fpkm_std_dev) * fpkm_constant);
+    r.fpkm_hi = (targ_counts[i] + 2*r.fpkm_std_dev) * fpkm_constant;
+
+    r.est_counts = targ_counts[i];
+    r.eff_len = sexp(l_eff_len);
+    r.eff_counts = targ_counts[i] / r.eff_len * targ.length();
+
+    r.cpb = targ_counts[i] / r.eff_len;
+
+    if (varcov_buff) {
+      covar_line.assign(bundle_targ.size(), LOG_0);
+      for (size_t k = 0; k < bundle_covar[i].size(); ++k) {
+        covar_line[bundle_covar[i][k].first] = bundle_covar[i][k].second;
+      }
+      for (size_t j = 0; j < bundle_targ.size(); ++j) {
+        double covar = sexp(covar_line[j] + l_var_renorm);
+        append_format(*varcov_buff, (j) ? "\t%e" : "%e",
+                      (i==j) ? covar : -covar);
+      }
+      varcov_buff->append("\n");
+    }
+
+    if (rdds_buff) {
+      const Sequence& targ_seq = targ.seq();
+      vector<double> p_vals;
+      targ_seq.calc_p_vals(p_vals);
+      for (size_t k = 0; k < p_vals.size(); ++k) {
+        if (p_vals[k] < 0.01) {
+          append_format(*rdds_buff, "%s\t" SIZE_T_FMT "\t%g\t%c",
+                        targ.name().c_str(), k, p_vals[k],
+                        NUCS[targ_seq.get_ref(k)]);
+          for (size_t nuc=0; nuc < NUM_NUCS; nuc++) {
+            append_format(*rdds_buff, "\t%g", sexp(targ_seq.get_prob(k,nuc)));
           }
-          varcov_file << endl;
-        }
-        
-        if (output_rdds) {
-          const Sequence& targ_seq = targ.seq();
-          vector<double> p_vals;
-          targ_seq.calc_p_vals(p_vals);
-          for (size_t i = 0; i < p_vals.size(); ++i) {
-            if (p_vals[i] < 0.01) {
-              rdds_file << targ.name() << "\t" << i << "\t" << p_vals[i]
-              << "\t" << NUCS[targ_seq.get_ref(i)];
-              for (size_t nuc=0; nuc < NUM_NUCS; nuc++) {
-                rdds_file << "\t" << sexp(targ_seq.get_prob(i,nuc));
-              }
-              for (size_t nuc=0; nuc < NUM_NUCS; nuc++) {
-                rdds_file << "\t" << sexp(targ_seq.get_obs(i,nuc));
-              }
-              for (size_t nuc=0; nuc < NUM_NUCS; nuc++) {
-                rdds_file << "\t" << sexp(targ_seq.get_exp(i,nuc));
-              }
-              rdds_file << endl;
-            }
+          for (size_t nuc=0; nuc < NUM_NUCS; nuc++) {
+            append_format(*rdds_buff, "\t%g", sexp(targ_seq.get_obs(k,nuc)));
           }
-        }
-      }
-    } else {
-      for (size_t i = 0; i < bundle_targ.size(); ++i) {
-        
-        
-        if (output_varcov) {
-          for (size_t j = 0; j < bundle_targ.size(); ++j) {
-            if (j) {
-              varcov_file << "\t";
-            }
-            varcov_file << scientific << 0.0;
+          for (size_t nuc=0; nuc < NUM_NUCS; nuc++) {
+            append_format(*rdds_buff, "\t%g", sexp(targ_seq.get_exp(k,nuc)));
           }
-          varcov_file << endl;
+          rdds_buff->append("\n");
         }
       }
     }
   }
-  
+}
+
+void TargetTable::results_task(const vector<Bundle*>* bundles,
+                               const vector<size_t>* first_piece,
+                               size_t begin, size_t end, ResultsOutput* out,
+                               size_t w) const {
+  for (size_t b = begin; b < end; ++b) {
+    bundle_results((*bundles)[b], b + 1, (*first_piece)[b],
+                   (*first_piece)[b+1] - (*first_piece)[b], out, w);
+  }
+}
+
+/**
+ * A helper function that appends a row of the results file.
+ * @param buff the buffer to append the row to.
+ * @param bundle_id the id of the bundle the target is in.
+ * @param name the name of the target.
+ * @param length the length of the target.
+ * @param tot_counts the number of fragments aligned to the target.
+ * @param uniq_counts the number of fragments uniquely aligned to the target.
+ * @param r the Result of the target.
+ * @param solvable true iff the target is solvable.
+ * @param tpm the transcripts per million of the target.
+ */
+inline void append_result_row(string& buff, size_t bundle_id,
+                              const string& name, size_t length,
+                              size_t tot_counts, size_t uniq_counts,
+                              const Result& r, bool solvable, double tpm) {
+  append_format(buff, "" SIZE_T_FMT "\t%s\t" SIZE_T_FMT "\t%f\t"
+                SIZE_T_FMT "\t" SIZE_T_FMT "\t%f\t%f\t%e\t%e\t%e\t%e\t%e\t"
+                "%c\t%e\n",
+                bundle_id, name.c_str(), length, r.eff_len, tot_counts,
+                uniq_counts, r.est_counts, r.eff_counts, r.count_alpha,
+                r.count_beta, r.fpkm, r.fpkm_lo, r.fpkm_hi,
+                (solvable)?'T':'F', tpm);
+}
+
+void TargetTable::output_results(string output_dir, size_t tot_counts,
+                                 bool output_varcov, bool output_rdds,
+                                 bool output_binary) {
+  // Keep lazy targets from being instantiated while the bundles are read.
+  boost::unique_lock<boost::mutex> lock(_lazy_mut);
+  (_libs->curr_lib()).fld->cache_prefix_sums();
+
+  // Bundles are numbered by their position in the set, and the targets of each
+  // are divided into pieces of RESULT_TASK_TARGS, each stored with its
+  // formatted varcov and RDD text so that the files can be written in bundle
+  // order once all tasks have finished.
+  vector<Bundle*> bundles(_bundle_table.bundles().begin(),
+                          _bundle_table.bundles().end());
+  vector<size_t> first_piece(1, 0);
+  foreach (const Bundle* bundle, bundles) {
+    size_t n = bundle->targets()->size();
+    first_piece.push_back(first_piece.back() +
+                          max((n + RESULT_TASK_TARGS - 1) / RESULT_TASK_TARGS,
+                              (size_t)1));
+  }
+
+  TaskScheduler scheduler(output_threads);
+  ResultsOutput out;
+  out.tot_counts = tot_counts;
+  out.res.resize(size());
+  out.bundle_index.resize((output_varcov) ? size() : 0);
+  out.varcov_buffs.resize((output_varcov) ? first_piece.back() : 0);
+  out.rdds_buffs.resize((output_rdds) ? first_piece.back() : 0);
+  out.varcov = output_varcov;
+  out.rdds = output_rdds;
+  out.scheduler = &scheduler;
+
+  // Small bundles are packed into tasks of about RESULT_TASK_TARGS targets,
+  // and large bundles are split into pieces by the task that projects them.
+  size_t task_begin = 0;
+  size_t task_targs = 0;
+  size_t num_tasks = 0;
+  for (size_t b = 0; b < bundles.size(); ++b) {
+    task_targs += bundles[b]->targets()->size();
+    if (task_targs >= RESULT_TASK_TARGS || b + 1 == bundles.size()) {
+      scheduler.spawn(boost::bind(&TargetTable::results_task, this, &bundles,
+                                  &first_piece, task_begin, b + 1, &out, _1),
+                      num_tasks++ % scheduler.num_workers());
+      task_begin = b + 1;
+      task_targs = 0;
+    }
+  }
+  scheduler.run();
+  vector<Result>& res = out.res;
+  for (TargID id = 0; _lazy && id < size(); ++id) {
+    if (!_targ_map[id]) {
+      res[id].set_zeros();
+    }
+  }
+  vector<string>& varcov_buffs = out.varcov_buffs;
+  vector<string>& rdds_buffs = out.rdds_buffs;
+
   // Calculate total counts per base
   double cpb_sum = 0.0;
   for (size_t i = 0; i < size(); ++i) {
     cpb_sum += res[i].cpb;
   }
-  
+
   // Calculate TPMs and output results
+  const string expr_file_name = output_dir + "/results.xprs";
+  FILE* expr_file = open_output(expr_file_name);
+  string buff;
+  buff.reserve(OUTPUT_BUFF_SIZE + 1024);
+  buff.append("bundle_id\ttarget_id\tlength\teff_length\ttot_counts\t"
+              "uniq_counts\test_counts\teff_counts\tambig_distr_alpha\t"
+              "ambig_distr_beta\tfpkm\tfpkm_conf_low\tfpkm_conf_high\t"
+              "solvable\ttpm\n");
+
+  // The targets, bundle ids, and TPMs of the rows, for binary output.
+  vector<TargID> row_targs;
+  vector<size_t> row_bundles;
+  vector<double> row_tpms;
+
   const double l_mil = log(1000000.);
-  bundle_id = 0;
-  t_id = 0;
-  foreach (Bundle* bundle, _bundle_table.bundles()) {
-    ++bundle_id;
-    
-    const vector<Target*>& bundle_targ = *(bundle->targets());
-    
-    for (size_t i = 0; i < bundle_targ.size(); ++i) {
-      
-      Target& targ = *bundle_targ[i];
-      
-      t_id = targ.id();
-      
-      double tpm;
-      
-      if (bundle->counts()) {
-        double trans_frac = log(res[t_id].cpb / cpb_sum);
+  for (size_t b = 0; b < bundles.size(); ++b) {
+    const size_t bundle_id = b + 1;
+    const vector<Target*>& bundle_targ = *(bundles[b]->targets());
+
+    foreach (const Target* targ, bundle_targ) {
+      const Result& r = res[targ->id()];
+      double tpm = 0.0;
+      if (bundles[b]->counts()) {
+        double trans_frac = log(r.cpb / cpb_sum);
         tpm = sexp(trans_frac + l_mil);
-      } else {
-        res[targ.id()].set_zeros();
-        tpm = 0.0;
       }
-      
-      fprintf(expr_file, "" SIZE_T_FMT "\t%s\t" SIZE_T_FMT "\t%f\t" SIZE_T_FMT
-              "\t" SIZE_T_FMT "\t%f\t%f\t%e\t%e\t%e\t%e\t%e\t%c\t%e\n",
-              bundle_id, targ.name().c_str(), targ.length(), res[t_id].eff_len,
-              targ.tot_counts(), targ.uniq_counts(), res[t_id].est_counts,
-              res[t_id].eff_counts, res[t_id].count_alpha, res[t_id].count_beta,
-              res[t_id].fpkm, res[t_id].fpkm_lo, res[t_id].fpkm_hi,
-              (targ.solvable())?'T':'F', tpm);
-      ++t_id;
+
+      append_result_row(buff, bundle_id, targ->name(), targ->length(),
+                        targ->tot_counts(), targ->uniq_counts(), r,
+                        targ->solvable(), tpm);
+      if (buff.size() >= OUTPUT_BUFF_SIZE) {
+        flush_buffer(expr_file, expr_file_name, buff);
+      }
+
+      if (output_binary) {
+        row_targs.push_back(targ->id());
+        row_bundles.push_back(bundle_id);
+        row_tpms.push_back(tpm);
+      }
     }
   }
+
+  // Lazy targets that were never aligned to are output as they would be in
+  // their own bundles without counts, without instantiating them.
+  size_t bundle_id = bundles.size();
+  string untouched_varcov;
+  for (TargID id = 0; _lazy && id < size(); ++id) {
+    if (_targ_map[id] || _entries[id].name.empty()) {
+      continue;
+    }
+    bundle_id++;
+    append_result_row(buff, bundle_id, targ_name(id), targ_length(id), 0, 0,
+                      res[id], false, 0.0);
+    if (buff.size() >= OUTPUT_BUFF_SIZE) {
+      flush_buffer(expr_file, expr_file_name, buff);
+    }
+    if (output_varcov) {
+      append_format(untouched_varcov, ">" SIZE_T_FMT ": %s\n0.000000e+00\n",
+                    bundle_id, targ_name(id).c_str());
+    }
+    if (output_binary) {
+      row_targs.push_back(id);
+      row_bundles.push_back(bundle_id);
+      row_tpms.push_back(0.0);
+    }
+  }
+  varcov_buffs.push_back(untouched_varcov);
+  flush_buffer(expr_file, expr_file_name, buff);
   fclose(expr_file);
+
   if (output_varcov) {
-    varcov_file.close();
+    const string varcov_file_name = output_dir + "/varcov.xprs";
+    FILE* varcov_file = open_output(varcov_file_name);
+    foreach (string& bundle_buff, varcov_buffs) {
+      flush_buffer(varcov_file, varcov_file_name, bundle_buff);
+    }
+    fclose(varcov_file);
   }
+
   if (output_rdds) {
-    rdds_file.close();
+    const string rdds_file_name = output_dir + "/rdds.xprs";
+    FILE* rdds_file = open_output(rdds_file_name);
+    buff = "target_id\tposition\tp_value\tref_nuc\tP(A)\tP(C)\tP(G)\tP(T)\t"
+           "obs_A\tobs_C\tobs_G\tobs_T\texp_A\texp_C\texp_G\texp_T\n";
+    flush_buffer(rdds_file, rdds_file_name, buff);
+    foreach (string& bundle_buff, rdds_buffs) {
+      flush_buffer(rdds_file, rdds_file_name, bundle_buff);
+    }
+    fclose(rdds_file);
+  }
+
+  if (output_binary) {
+    output_binary_results(output_dir + "/results.bin", row_targs, row_bundles,
+                          row_tpms, res);
+  }
+}
+
+void TargetTable::output_binary_results(const string& file_name,
+                                        const vector<TargID>& targs,
+                                        const vector<size_t>& bundle_ids,
+                                        const vector<double>& tpms,
+                                        const vector<Result>& res) const {
+  FILE* file = open_output(file_name);
+  const size_t n = targs.size();
+  string buff;
+  buff.reserve(OUTPUT_BUFF_SIZE + 64);
+
+  append_bytes(buff, RESULTS_BIN_MAGIC);
+  append_bytes(buff, RESULTS_BIN_VERSION);
+  append_bytes(buff, (boost::uint64_t)n);
+  append_bytes(buff, RESULTS_BIN_COLUMNS);
+
+  for (size_t col = 0; col < RESULTS_BIN_COLUMNS; ++col) {
+    for (size_t i = 0; i < n; ++i) {
+      // Lazy targets that were never aligned to are not instantiated.
+      const Target* targ = _targ_map[targs[i]];
+      const Result& r = res[targs[i]];
+      switch (col) {
+        case 0: append_bytes(buff, (boost::uint64_t)bundle_ids[i]); break;
+        case 1: append_bytes(buff, (boost::uint64_t)targ_length(targs[i]));
+                break;
+        case 2: append_bytes(buff, r.eff_len); break;
+        case 3: append_bytes(buff,
+                             (boost::uint64_t)((targ) ? targ->tot_counts() : 0));
+                break;
+        case 4: append_bytes(buff,
+                             (boost::uint64_t)((targ) ? targ->uniq_counts() : 0));
+                break;
+        case 5: append_bytes(buff, r.est_counts); break;
+        case 6: append_bytes(buff, r.eff_counts); break;
+        case 7: append_bytes(buff, r.count_alpha); break;
+        case 8: append_bytes(buff, r.count_beta); break;
+        case 9: append_bytes(buff, r.fpkm); break;
+        case 10: append_bytes(buff, r.fpkm_lo); break;
+        case 11: append_bytes(buff, r.fpkm_hi); break;
+        case 12: append_bytes(buff,
+                              (boost::uint64_t)_state->solvable[targs[i]]);
+                 break;
+        case 13: append_bytes(buff, tpms[i]); break;
+      }
+      if (buff.size() >= OUTPUT_BUFF_SIZE) {
+        flush_buffer(file, file_name, buff);
+      }
+    }
+  }
+
+  // Name table: the offset of each name from the start of the name bytes,
+  // followed by the total length, and then the null-terminated names.
+  boost::uint64_t offset = 0;
+  for (size_t i = 0; i < n; ++i) {
+    append_bytes(buff, offset);
+    offset += targ_name(targs[i]).size() + 1;
+    if (buff.size() >= OUTPUT_BUFF_SIZE) {
+      flush_buffer(file, file_name, buff);
+    }
+  }
+  append_bytes(buff, offset);
+  for (size_t i = 0; i < n; ++i) {
+    const string& name = targ_name(targs[i]);
+    buff.append(name.c_str(), name.size() + 1);
+    if (buff.size() >= OUTPUT_BUFF_SIZE) {
+      flush_buffer(file, file_name, buff);
+    }
+  }
+  flush_buffer(file, file_name, buff);
+  fclose(file);
+}
+
+/**
+ * A helper function that copies a value from a possibly unaligned pointer and
+ * advances the pointer, exiting if it would pass the end of the buffer.
+ * @param p a reference to the pointer to read from.
+ * @param end a pointer to the end of the buffer.
+ * @return The value read.
+ */
+template <typename T>
+inline T read_bytes(const char*& p, const char* end) {
+  T val;
+  if ((size_t)(end - p) < sizeof(T)) {
+    logger.severe("Checkpoint state is truncated.");
+  }
+  memcpy(&val, p, sizeof(T));
+  p += sizeof(T);
+  return val;
+}
+
+void TargetTable::save_state(string& buff) const {
+  // Targets that have not been instantiated are saved as targets without hits
+  // in their own bundles, so the checkpoint does not depend on the mode.
+  boost::unique_lock<boost::mutex> lock(_lazy_mut);
+  append_bytes(buff, (boost::uint64_t)size());
+  append_bytes(buff, total_fpb());
+  size_t num_untouched = 0;
+  for (TargID id = 0; id < size(); ++id) {
+    const Target* targ = _targ_map[id];
+    const RoundParams& params = _state->curr_params[id];
+    append_bytes(buff, (boost::uint64_t)targ_length(id));
+    append_bytes(buff, params.mass);
+    append_bytes(buff, params.ambig_mass);
+    append_bytes(buff, params.tot_ambig_mass);
+    append_bytes(buff, params.mass_var);
+    append_bytes(buff, params.var_sum);
+    append_bytes(buff, _state->init_pseudo_mass[id]);
+    append_bytes(buff, (boost::uint64_t)((targ) ? targ->_uniq_counts : 0));
+    append_bytes(buff, (boost::uint64_t)((targ) ? targ->_tot_counts : 0));
+    append_bytes(buff, (boost::uint8_t)_state->solvable[id]);
+    const CovarRow* row = (targ) ? targ->covar() : NULL;
+    append_bytes(buff, (boost::uint64_t)((row) ? row->size() : 0));
+    for (size_t k = 0; row && k < row->size(); ++k) {
+      append_bytes(buff, (boost::uint64_t)row->targ(k));
+      append_bytes(buff, row->covar(k));
+    }
+    num_untouched += !targ;
+  }
+
+  append_bytes(buff, (boost::uint64_t)(_bundle_table.size() + num_untouched));
+  foreach (const Bundle* bundle, _bundle_table.bundles()) {
+    append_bytes(buff, (boost::uint64_t)bundle->counts());
+    append_bytes(buff, bundle->mass());
+    append_bytes(buff, (boost::uint64_t)bundle->targets()->size());
+    foreach (const Target* targ, *(bundle->targets())) {
+      append_bytes(buff, (boost::uint64_t)targ->id());
+    }
+  }
+  for (TargID id = 0; num_untouched && id < size(); ++id) {
+    if (!_targ_map[id]) {
+      append_bytes(buff, (boost::uint64_t)0);
+      append_bytes(buff, LOG_0);
+      append_bytes(buff, (boost::uint64_t)1);
+      append_bytes(buff, (boost::uint64_t)id);
+    }
+  }
+}
+
+void TargetTable::load_state(const char*& p, const char* end) {
+  if (read_bytes<boost::uint64_t>(p, end) != size()) {
+    logger.severe("Checkpoint does not match the number of targets.");
+  }
+  _total_fpb = read_bytes<double>(p, end);
+  for (TargID id = 0; id < size(); ++id) {
+    if (read_bytes<boost::uint64_t>(p, end) != targ_length(id)) {
+      logger.severe("Checkpoint does not match the length of target '%s'.",
+                    targ_name(id).c_str());
+    }
+    RoundParams params;
+    params.mass = read_bytes<double>(p, end);
+    params.ambig_mass = read_bytes<double>(p, end);
+    params.tot_ambig_mass = read_bytes<double>(p, end);
+    params.mass_var = read_bytes<double>(p, end);
+    params.var_sum = read_bytes<double>(p, end);
+    double init_pseudo_mass = read_bytes<double>(p, end);
+    size_t uniq_counts = read_bytes<boost::uint64_t>(p, end);
+    size_t tot_counts = read_bytes<boost::uint64_t>(p, end);
+    bool solvable = read_bytes<boost::uint8_t>(p, end);
+    size_t row_size = read_bytes<boost::uint64_t>(p, end);
+
+    // Lazy targets without hits are left to be instantiated once aligned to,
+    // which does not modify the restored parameters.
+    Target* targ = _targ_map[id];
+    if (!targ && (tot_counts || row_size)) {
+      targ = get_targ(id);
+    }
+    _state->curr_params[id] = params;
+    _state->init_pseudo_mass[id] = init_pseudo_mass;
+    _state->solvable[id] = solvable;
+    if (!targ) {
+      continue;
+    }
+    targ->_uniq_counts = uniq_counts;
+    targ->_tot_counts = tot_counts;
+    targ->_covar.reset(NULL);
+    for (size_t k = 0; k < row_size; ++k) {
+      TargID covar_targ = read_bytes<boost::uint64_t>(p, end);
+      targ->add_covar(covar_targ, read_bytes<float>(p, end));
+    }
+  }
+
+  // Each Target starts in its own Bundle, so merge them back into the saved
+  // partition and restore the totals.
+  size_t num_bundles = read_bytes<boost::uint64_t>(p, end);
+  size_t num_untouched = 0;
+  for (size_t b = 0; b < num_bundles; ++b) {
+    size_t counts = read_bytes<boost::uint64_t>(p, end);
+    double mass = read_bytes<double>(p, end);
+    size_t num_targs = read_bytes<boost::uint64_t>(p, end);
+    Bundle* bundle = NULL;
+    for (size_t i = 0; i < num_targs; ++i) {
+      TargID id = read_bytes<boost::uint64_t>(p, end);
+      if (id >= size()) {
+        logger.severe("Checkpoint contains an invalid target id.");
+      }
+      Target* targ = _targ_map[id];
+      if (!targ) {
+        continue;
+      }
+      bundle = (bundle) ? merge_bundles(bundle, targ->bundle()) : targ->bundle();
+    }
+    if (!bundle) {
+      num_untouched++;
+    } else {
+      assert(counts >= bundle->counts());
+      bundle->incr_counts(counts - bundle->counts());
+      bundle->reset_mass();
+      bundle->incr_mass(mass);
+    }
+  }
+  if (_bundle_table.size() + num_untouched != num_bundles) {
+    logger.severe("Checkpoint bundles do not partition the targets.");
   }
 }
 
 double TargetTable::total_fpb() const {
-  boost::unique_lock<boost::mutex>(_fpb_mut);
+  boost::unique_lock<boost::mutex> lock(_fpb_mut);
   return _total_fpb;
 }
 
 void TargetTable::update_total_fpb(double incr_amt) {
-  boost::unique_lock<boost::mutex>(_fpb_mut);
+  boost::unique_lock<boost::mutex> lock(_fpb_mut);
   _total_fpb = log_add(_total_fpb, incr_amt);
 }
 
-void TargetTable::asynch_bias_update(boost::mutex* mutex) {
+size_t TargetTable::covar_size() const {
+  size_t num_pairs = 0;
+  boost::unique_lock<boost::mutex> lock(_lazy_mut);
+  foreach (const Target* targ, _targ_map) {
+    if (targ && targ->covar()) {
+      num_pairs += targ->covar()->size();
+    }
+  }
+  return num_pairs;
+}
+
+void TargetTable::queue_bias_refresh(Target* targ) {
+  boost::unique_lock<boost::mutex> lock(_bias_refresh_mut);
+  _bias_refresh_queue.push_back(targ);
+}
+
+void TargetTable::update_bias_shard(size_t shard, size_t num_shards,
+                                    const vector<Target*>* targs, bool full,
+                                    const BiasBoss* bias_table,
+                                    const LengthDistribution* fld,
+                                    const vector<double>* fl_cdf,
+                                    BiasBoss* expectations) {
+  for (size_t i = shard; i < targs->size(); i += num_shards) {
+    Target* targ = (*targs)[i];
+    targ->lock();
+    targ->clear_bias_dirty();
+    if (expectations) {
+      // The expected counts are only compared between positions, so they can
+      // be weighted by mass per base rather than rho. Since mass per base only
+      // increases between refreshes, the expected counts can be updated by
+      // adding the contribution of the increase since the last refresh.
+      double fpb = targ->fpb();
+      double& last_fpb = _bias_refresh_fpbs[targ->id()];
+      double incr = (full) ? fpb : log_sub(fpb, last_fpb);
+      if (!islzero(incr)) {
+        expectations->update_expectations(*targ, incr, *fl_cdf);
+      }
+      last_fpb = fpb;
+    }
+    targ->update_target_bias_buffer(bias_table, fld, _bias_fixed);
+    targ->unlock();
+  }
+}
+
+void TargetTable::asynch_bias_update(boost::shared_mutex* mutex,
+                                     Library* library) {
   BiasBoss* bg_table = NULL;
   boost::scoped_ptr<BiasBoss> bias_table;
   boost::scoped_ptr<LengthDistribution> fld;
 
+  // The parameters as of the previous synchronization, used to measure how
+  // much they change between synchronizations while burning out early is
+  // enabled.
+  bool adaptive = burn_out_tolerance > 0;
+  boost::scoped_ptr<BiasBoss> last_bias_table;
+  boost::scoped_ptr<MismatchTable> last_mismatch_table;
+  size_t num_converged = 0;
+
+  // The expected counts of the targets as of their last refresh, and tables
+  // for additional shards to accumulate their expected counts in.
+  boost::scoped_ptr<BiasBoss> expectations;
+  vector<boost::shared_ptr<BiasBoss> > shard_tables;
+
+  bool refreshed_all = false;
+
+  // Targets that have been queued since the last cycle and those that were
+  // dirty but had not moved enough to be refreshed in previous cycles.
+  vector<Target*> queued_targs;
+  vector<Target*> pending_targs;
+
   bool burned_out_before = false;
 
-  const Library& lib = _libs->curr_lib();
+  Library& lib = *library;
 
   while(running) {
+    pt::ptime cycle_start = pt::microsec_clock::universal_time();
     if (bg_table) {
       bg_table->normalize_expectations();
     }
+    // The dispatcher may end burn-out concurrently, so the flag is only read
+    // while holding the mutex.
+    bool burned_out;
+    bool measure;
+    double change = 0;
     {
-      boost::unique_lock<boost::mutex> lock(*mutex);
+      boost::unique_lock<boost::shared_mutex> lock(*mutex);
+      burned_out = lib.burned_out;
+      measure = adaptive && !burned_out && fld;
+      lib.flush_aux_accumulators();
       if(!fld) {
         fld.reset(new LengthDistribution(*(lib.fld)));
       } else {
+        if (measure) {
+          change = fld->total_variation(*(lib.fld));
+        }
         *fld = *(lib.fld);
       }
+      fld->cache_prefix_sums();
+      if (adaptive && lib.mismatch_table) {
+        if (!last_mismatch_table) {
+          last_mismatch_table.reset(new MismatchTable(*(lib.mismatch_table)));
+        } else {
+          if (measure) {
+            change = max(change,
+                         last_mismatch_table->max_change(*(lib.mismatch_table)));
+          }
+          *last_mismatch_table = *(lib.mismatch_table);
+        }
+      }
       if (lib.bias_table) {
         BiasBoss& lib_bias_table = *(lib.bias_table);
         if (!bias_table) {
@@ -867,12 +1782,41 @@ void TargetTable::asynch_bias_update(boost::mutex* mutex) {
         } else {
           lib_bias_table.copy_expectations(*bg_table);
           bg_table->copy_observations(lib_bias_table);
+          // Keep the previous table to measure the change in bias weights.
+          if (adaptive) {
+            bias_table.swap(last_bias_table);
+          }
           bias_table.reset(bg_table);
         }
         bg_table = new BiasBoss(lib_bias_table.order(), 0);
       }
       logger.info("Synchronized auxiliary parameter tables.");
     }
+    if (bias_table) {
+      bias_table->cache_weights();
+      if (measure && last_bias_table) {
+        change = max(change, bias_table->weight_change(*last_bias_table));
+      }
+    }
+
+    // End burn-out once the parameters have stopped changing, as is otherwise
+    // done by the dispatcher after burn_out fragments.
+    if (measure) {
+      num_converged = (change < burn_out_tolerance) ? num_converged + 1 : 0;
+      if (num_converged == AUX_CONVERGENCE_SYNCS) {
+        boost::unique_lock<boost::shared_mutex> lock(*mutex);
+        if (!lib.burned_out) {
+          lib.flush_aux_accumulators();
+          if (lib.mismatch_table) {
+            (lib.mismatch_table)->fix();
+          }
+          lib.burned_out = true;
+          logger.info("Auxiliary parameters converged after %d fragments.",
+                      lib.n);
+        }
+        burned_out = true;
+      }
+    }
 
     if (!edit_detect && burned_out && burned_out_before) {
       break;
@@ -882,25 +1826,138 @@ void TargetTable::asynch_bias_update(boost::mutex* mutex) {
 
     vector<double> fl_cdf = fld->cmf();
 
-    // Buffer results of long computations.
-    foreach(Target* targ, _targ_map) {
-      targ->lock();
-      targ->update_target_bias_buffer(bias_table.get(), fld.get());
-      if (bg_table) {
-        bg_table->update_expectations(*targ, targ->rho(), fl_cdf);
+    // Refresh all targets if the parameters have moved enough to change the
+    // likelihoods of a sample of targets, or if they are about to be fixed.
+    // Otherwise only refresh the targets whose mass per base has increased
+    // enough. The published parameters are only modified by this thread, so
+    // the sample can be compared without locking.
+    // Lazy targets may be instantiated by the parser at any time, so only
+    // those built so far are refreshed, and the rest are refreshed once they
+    // are queued with their first hits. Once the parameters are fixed, later
+    // ones are instead built with them.
+    TransMap lazy_targs;
+    if (_lazy) {
+      lazy_targs = (burned_out) ? fix_lazy_parameters(bias_table.get(),
+                                                      fld.get())
+                                : instantiated_targets();
+    }
+    const TransMap& targs = (_lazy) ? lazy_targs : _targ_map;
+    bool full = !refreshed_all || burned_out;
+    if (!full && !targs.empty()) {
+      size_t step = max(targs.size() / BIAS_REFRESH_SAMPLE_SIZE, (size_t)1);
+      double sample_change = 0;
+      size_t num_sampled = 0;
+      for (size_t i = 0; i < targs.size(); i += step) {
+        sample_change += targs[i]->bias_parameters_change(bias_table.get(),
+                                                          fld.get());
+        num_sampled++;
       }
-      targ->unlock();
+      full = sample_change / num_sampled > BIAS_REFRESH_TOLERANCE;
     }
+    vector<Target*> refresh_targs;
     {
-      boost::unique_lock<boost::mutex> lock(*mutex);
-      // Do quick atomic swap
-      foreach(Target* targ, _targ_map) {
-        targ->lock();
+      boost::unique_lock<boost::mutex> lock(_bias_refresh_mut);
+      _bias_refresh_queue.swap(queued_targs);
+    }
+    if (full) {
+      if (!refreshed_all) {
+        _bias_refresh_fpbs.assign(_targ_map.size(), LOG_0);
+        refreshed_all = true;
       }
-      foreach(Target* targ, _targ_map) {
-        targ->swap_bias_parameters();
+      refresh_targs = targs;
+      pending_targs.clear();
+    } else {
+      // Targets that were refreshed by a full refresh after being queued are
+      // no longer dirty, and those that have not moved enough are held until
+      // they do.
+      pending_targs.insert(pending_targs.end(), queued_targs.begin(),
+                           queued_targs.end());
+      size_t num_pending = 0;
+      foreach (Target* targ, pending_targs) {
+        targ->lock();
+        bool dirty = targ->bias_dirty();
+        double fpb = targ->fpb();
         targ->unlock();
+        if (!dirty) {
+          continue;
+        }
+        double last_fpb = _bias_refresh_fpbs[targ->id()];
+        if (!islzero(fpb) &&
+            (islzero(last_fpb) ||
+             fpb - last_fpb > log(1 + BIAS_REFRESH_MASS_TOLERANCE))) {
+          refresh_targs.push_back(targ);
+        } else {
+          pending_targs[num_pending++] = targ;
+        }
+      }
+      pending_targs.resize(num_pending);
+    }
+    queued_targs.clear();
+    logger.info("Refreshing bias parameters of %d of %d targets.",
+                refresh_targs.size(), targs.size());
+
+    // Buffer results of long computations in parallel over shards of the
+    // targets. Each additional shard accumulates its own expectations, which
+    // are reduced with those of the first shard once all shards complete.
+    size_t num_shards = max(bias_threads, (size_t)1);
+    if (bg_table) {
+      if (!expectations) {
+        expectations.reset(new BiasBoss(bg_table->order(), 0));
+        expectations->clear_expectations();
+      } else if (full) {
+        expectations->clear_expectations();
+      }
+      while (shard_tables.size() < num_shards - 1) {
+        shard_tables.push_back(boost::shared_ptr<BiasBoss>(
+            new BiasBoss(bg_table->order(), 0)));
       }
+      foreach (boost::shared_ptr<BiasBoss>& shard_table, shard_tables) {
+        shard_table->clear_expectations();
+      }
+    }
+    // Targets that are first hit after the parameters are fixed are never
+    // refreshed again, so their bias at each position is stored now.
+    _bias_fixed = burned_out;
+    vector<boost::thread*> shard_threads;
+    for (size_t i = 1; i < num_shards; ++i) {
+      BiasBoss* shard_table = (bg_table) ? shard_tables[i-1].get() : NULL;
+      shard_threads.push_back(
+          new boost::thread(&TargetTable::update_bias_shard, this, i,
+                            num_shards, &refresh_targs, full, bias_table.get(),
+                            fld.get(), &fl_cdf, shard_table));
+    }
+    update_bias_shard(0, num_shards, &refresh_targs, full, bias_table.get(),
+                      fld.get(), &fl_cdf, expectations.get());
+    foreach (boost::thread* t, shard_threads) {
+      t->join();
+      delete t;
+    }
+    if (bg_table) {
+      for (size_t i = 0; i < num_shards - 1; ++i) {
+        expectations->add_expectations(*shard_tables[i]);
+      }
+      bg_table->add_expectations(*expectations);
+    }
+
+    {
+      // Publish the buffered parameters of all targets at once by advancing
+      // the epoch. Processing threads hold the mutex in shared mode for each
+      // batch, so no fragment sees a mix of old and new parameters.
+      boost::unique_lock<boost::shared_mutex> lock(*mutex);
+      _state->bias_epoch++;
+    }
+    foreach (Target* targ, refresh_targs) {
+      targ->release_bias_buffer();
+    }
+    run_stats.bias_refresh.add(pt::microsec_clock::universal_time() -
+                               cycle_start, refresh_targs.size());
+
+    // Cycles can be very short when few targets need refreshing, so wait
+    // before synchronizing again to avoid stalling the processing threads.
+    pt::time_duration min_cycle = pt::milliseconds(BIAS_UPDATE_MIN_CYCLE_MS);
+    while (running &&
+           pt::microsec_clock::universal_time() - cycle_start < min_cycle) {
+      boost::this_thread::sleep(pt::milliseconds(10));
     }
   }
 
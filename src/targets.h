@@ -9,11 +9,14 @@
 #ifndef TRANSCRIPTS_H
 #define TRANSCRIPTS_H
 
+#include <boost/cstdint.hpp>
 #include <boost/scoped_ptr.hpp>
+#include <boost/shared_array.hpp>
 #include "boost/shared_ptr.hpp"
 #include <boost/thread.hpp>
 #include <boost/unordered_map.hpp>
 #include <iostream>
+#include <limits>
 #include <fstream>
 #include <map>
 #include <string>
@@ -27,8 +30,14 @@ class FragHit;
 class BiasBoss;
 class MismatchTable;
 class Librarian;
+struct Library;
 class HaplotypeHandler;
+class TargetIndex;
 class TargetTable;
+class TaskScheduler;
+struct Result;
+struct BundleCounts;
+struct ResultsOutput;
 
 /**
  * The RoundParams struct stores the target parameters unique to a given round
@@ -62,11 +71,6 @@ struct RoundParams {
    * the assignments.
    */
   double var_sum;
-  /***
-   * A shared pointer to the target's HaplotypeHandler.  Null if target has no
-   * haplotype partner.
-   **/
-  boost::shared_ptr<HaplotypeHandler> haplotype;
   /**
    * RoundParams constructor sets initial values for parameters
    */
@@ -76,6 +80,195 @@ struct RoundParams {
 
 typedef size_t TargID;
 
+/**
+ * The number of mutexes that the Target locks are striped across. Must be a
+ * power of 2.
+ */
+const size_t NUM_TARGET_LOCKS = 4096;
+
+/**
+ * The relative increase in the mass per base of a Target since its bias
+ * parameters were last refreshed at which the bias updater refreshes them
+ * again.
+ */
+const double BIAS_REFRESH_MASS_TOLERANCE = 0.05;
+/**
+ * The mean absolute change in the (logged) fragment likelihoods of a sample of
+ * Targets that refreshing their bias parameters would cause, above which the
+ * bias updater refreshes all Targets.
+ */
+const double BIAS_REFRESH_TOLERANCE = 0.05;
+/**
+ * The number of Targets sampled to decide whether to refresh all Targets.
+ */
+const size_t BIAS_REFRESH_SAMPLE_SIZE = 100;
+/**
+ * The minimum duration in milliseconds of a bias updater cycle, to limit how
+ * often the auxiliary parameter tables are synchronized.
+ */
+const size_t BIAS_UPDATE_MIN_CYCLE_MS = 200;
+/**
+ * The number of consecutive synchronizations by the bias updater in which the
+ * auxiliary parameters must change by less than burn_out_tolerance for
+ * burn-out to be ended early.
+ */
+const size_t AUX_CONVERGENCE_SYNCS = 3;
+/**
+ * The number of fixed-point steps per unit of (logged) bias in the values
+ * stored for each position of a Target. Values are stored in 16 bits, so
+ * biases are clamped to about +/-32 and rounded to within 1/2048.
+ */
+const double BIAS_QUANTA = 1024;
+
+/**
+ * Helper function to encode a (logged) bias as a fixed-point value.
+ * @param bias the (logged) bias to encode.
+ * @return The nearest fixed-point value, clamped to the representable range.
+ */
+inline boost::int16_t quantize_bias(double bias) {
+  double q = floor(bias * BIAS_QUANTA + 0.5);
+  q = std::max(q, (double)std::numeric_limits<boost::int16_t>::min());
+  q = std::min(q, (double)std::numeric_limits<boost::int16_t>::max());
+  return (boost::int16_t)q;
+}
+
+/**
+ * Helper function to decode a fixed-point bias value.
+ * @param q the fixed-point value.
+ * @return The (logged) bias.
+ */
+inline double unquantize_bias(boost::int16_t q) {
+  return q / BIAS_QUANTA;
+}
+
+/**
+ * The BiasSummary struct stores the scalar bias parameters of a Target that are
+ * recomputed by the bias updater thread and read for every hit.
+ * @author    Adam Roberts
+ * @date      2012
+ * @copyright Artistic License 2.0
+ **/
+struct BiasSummary {
+  /**
+   * A public double storing the (logged) product of the average 3' and 5'
+   * biases for the target.
+   */
+  double avg_bias;
+  /**
+   * A public double storing the (logged) effective length as calculated by the
+   * bias updater thread.
+   */
+  double cached_eff_len;
+  BiasSummary() : avg_bias(0), cached_eff_len(LOG_0) {}
+};
+
+/**
+ * The BiasState struct stores the double-buffered BiasSummary of a Target. One
+ * summary is visible to readers while the other is used to buffer updates,
+ * allowing the bias updater thread to publish new parameters for all targets
+ * at once by advancing the bias epoch of the TargetState.
+ * @author    Adam Roberts
+ * @date      2012
+ * @copyright Artistic License 2.0
+ **/
+struct BiasState {
+  /**
+   * A public pair of BiasSummary structs, indexed by buffer slot.
+   */
+  BiasSummary summary[2];
+  /**
+   * A public size_t encoding the slot of the most recently buffered summary in
+   * its lowest bit and the epoch at which it is published in the remaining
+   * bits. The other slot is visible until then.
+   */
+  size_t buffer_state;
+  BiasState() : buffer_state(0) {}
+  /**
+   * An accessor for the slot that is published at the given epoch.
+   * @param epoch the current bias epoch.
+   * @return The index of the published slot.
+   */
+  size_t published_slot(size_t epoch) const {
+    return (buffer_state & 1) ^ ((buffer_state >> 1) > epoch);
+  }
+};
+
+/**
+ * The TargetState struct stores the per-target parameters that are read or
+ * updated for every hit in contiguous arrays indexed by TargID, so that the
+ * Target objects themselves (with their names, sequences and per-position
+ * bias) are only touched when needed. It is owned by the TargetTable and
+ * shared by all of its Targets, which are protected by their own locks.
+ * @author    Adam Roberts
+ * @date      2012
+ * @copyright Artistic License 2.0
+ **/
+struct TargetState {
+  /**
+   * A public vector storing the RoundParams for the current round.
+   */
+  std::vector<RoundParams> curr_params;
+  /**
+   * A public vector storing the RoundParams for the previous round.
+   */
+  std::vector<RoundParams> last_params;
+  /**
+   * A public pointer to the vector of RoundParams that should be used in any
+   * accessors. Points to curr_params until the first round_reset.
+   */
+  std::vector<RoundParams>* ret_params;
+  /**
+   * A public vector storing the (logged) pseudo-mass-per-base of each target.
+   */
+  std::vector<double> alpha;
+  /**
+   * A public vector storing the (logged) initial pseudo mass assigned to each
+   * target.
+   */
+  std::vector<double> init_pseudo_mass;
+  /**
+   * A public vector storing the double-buffered bias summaries.
+   */
+  std::vector<BiasState> bias;
+  /**
+   * A public vector storing whether a unique solution exists for each target.
+   * True iff a unique read is mapped to the target or all other targets in a
+   * mapping are solvable.
+   */
+  std::vector<char> solvable;
+  /**
+   * A public size_t storing the bias epoch, which is advanced (while holding
+   * the bias update mutex exclusively) to publish the bias summaries buffered
+   * by all targets at once.
+   */
+  size_t bias_epoch;
+  /**
+   * TargetState constructor allocates the arrays for the given number of
+   * targets.
+   * @param num_targs the number of targets.
+   */
+  TargetState(size_t num_targs)
+      : curr_params(num_targs),
+        last_params(num_targs),
+        ret_params(&curr_params),
+        alpha(num_targs, LOG_0),
+        init_pseudo_mass(num_targs, LOG_0),
+        bias(num_targs),
+        solvable(num_targs, false),
+        bias_epoch(0) {}
+  /**
+   * A member function that prepares the arrays for the next round of batch EM
+   * by moving the current RoundParams to the previous round and clearing the
+   * initial pseudo masses.
+   */
+  void round_reset() {
+    last_params.swap(curr_params);
+    curr_params.assign(last_params.size(), RoundParams());
+    ret_params = &last_params;
+    init_pseudo_mass.assign(init_pseudo_mass.size(), LOG_0);
+  }
+};
+
 /**
  * The Target class is used to store objects for the targets being mapped to.
  * Besides storing basic information about the object (id, length), it also
@@ -112,24 +305,15 @@ class Target {
    */
   SequenceRev _seq_r;
   /**
-   * A private double object that stores the pseudo-mass-per-base.
+   * A private pointer to the TargetState of the TargetTable, which stores the
+   * per-hit parameters of this target at index _id.
    */
-  double _alpha;
-  /**
-   * A private RoundParams struct that stores the parameters for the current
-   * round.
-   */
-  RoundParams _curr_params;
-  /**
-   * A private RoundParams struct that stores the parameters for the previous
-   * round.
-   */
-  RoundParams _last_params;
-  /**
-   * A private pointer to the RoundParams that should be used in any
-   * accessors.
-   */
-  RoundParams* _ret_params;
+  TargetState* _state;
+  /***
+   * A private shared pointer to the target's HaplotypeHandler. Null if target
+   * has no haplotype partner.
+   **/
+  boost::shared_ptr<HaplotypeHandler> _haplotype;
   /**
    * A private size_t that stores the number of fragments (non-logged)
    * uniquely mapping to this target.
@@ -141,70 +325,88 @@ class Target {
    * in the bundle.
    */
   size_t _tot_counts;
-  /**
-   * A private double storing the initial pseudo mass assigned to the target.
-   */
-  double _init_pseudo_mass;
   /**
    * A private pointer to the Bundle this Target is a member of.
    */
   Bundle* _bundle;
   /**
-   * A private mutex to provide thread-safety for variables with threaded
-   * update.
+   * A private static array of mutexes to provide thread-safety for variables
+   * with threaded update. Each Target is protected by the mutex at the index
+   * given by lock_index, which it may share with other Targets.
    */
-  mutable boost::mutex _mutex;
+  static boost::mutex _locks[NUM_TARGET_LOCKS];
   /**
-   * A scoped pointer to a private float vector storing the (logged) 5' bias
-   * at each position.
+   * A private pair of shared arrays storing the (logged) 5' bias at each
+   * position followed by the (logged) 3' bias at each position, encoded by
+   * quantize_bias, for each slot of the BiasState. NULL until the target has
+   * received a hit, with all positions unbiased. Both slots may share an array
+   * when the bias has not been recalculated.
    */
-  boost::scoped_ptr<std::vector<float> > _start_bias;
+  boost::shared_array<boost::int16_t> _pos_bias[2];
   /**
-   * Buffers the start bias to allow for atomic updating.
+   * A private accessor for the BiasState of the target.
+   * @return A reference to the BiasState.
    */
-  boost::scoped_ptr<std::vector<float> > _start_bias_buffer;
+  BiasState& bias_state() const { return _state->bias[_id]; }
   /**
-   * A scoped pointer to a private float vector storing the (logged) 3' bias
-   * at each position.
+   * A private accessor for the currently published bias slot.
+   * @return The index of the published slot.
    */
-  boost::scoped_ptr<std::vector<float> > _end_bias;
+  size_t bias_slot() const {
+    return bias_state().published_slot(_state->bias_epoch);
+  }
   /**
-   * Buffers the end bias to allow for atomic updating.
+   * A private accessor for the currently published BiasSummary.
+   * @return A reference to the published BiasSummary.
    */
-  boost::scoped_ptr<std::vector<float> > _end_bias_buffer;
+  const BiasSummary& bias_summary() const {
+    return bias_state().summary[bias_slot()];
+  }
   /**
-   * A private double storing the (logged) product of the average 3' and 5'
-   * biases for the target.
+   * A private accessor for the RoundParams that should be used in any
+   * accessors.
+   * @return A reference to the RoundParams.
    */
-  double _avg_bias;
+  const RoundParams& ret_params() const { return (*_state->ret_params)[_id]; }
   /**
-   * Buffers the average bias to allow for atomic updating.
+   * A private accessor for the RoundParams of the current round.
+   * @return A reference to the RoundParams.
    */
-  double _avg_bias_buffer;
+  RoundParams& curr_params() { return _state->curr_params[_id]; }
   /**
-   * A private double storing the most recently updated (logged) effective
-   * length as calculated by the bias updater thread.
+   * A private member function that recalculates the target bias and effective
+   * length into the given slot.
+   * @param slot the index of the slot to store the results in.
+   * @param bias_table a pointer to a BiasBoss to use as parameters. Bias not
+   *        updated if NULL.
+   * @param fld an optional pointer to a different LengthDistribution than the
+   *        global one, for thread-safety.
+   * @param store_bias a bool specifying whether to store the bias at each
+   *        position, or only the average bias.
    */
-  double _cached_eff_len;
+  void update_bias_parameters(size_t slot, const BiasBoss* bias_table,
+                              const LengthDistribution* fld, bool store_bias);
   /**
-   * Buffers the cached effective length to allow for atomic updating.
+   * A private bool that is true iff mass has been added to the target since its
+   * bias parameters were last refreshed, in which case it has been queued in
+   * the TargetTable for the bias updater.
    */
-  double _cached_eff_len_buffer;
+  bool _bias_dirty;
   /**
-   * A private boolean specifying whether a unique solution exists. True iff
-   * a unique read is mapped to the target or all other targets in a mapping
-   * are solvable.
+   * A private pointer to the row of the covariance matrix storing the
+   * covariances of this target with itself and the targets with larger TargIDs
+   * it shares fragments with. NULL until a covariance is first added.
    */
-  bool _solvable;
+  boost::scoped_ptr<CovarRow> _covar;
 
 public:
   /**
    * Target Constructor.
    * @param id a unique TargID identifier.
    * @param name a string that stores the target name.
-   * @param seq a string that stores the target sequence.
-   * @param prob_seq a bool that specifies if the sequence is to be treated
-   *        probablistically. For RDD detection.
+   * @param seq the encoded target sequence, which is copied. Sequences that
+   *        refer to an external packed array (such as a target index) are
+   *        shared, and the array must outlive the Target.
    * @param alpha a double that specifies the intial pseudo-counts
    *        (non-logged).
    * @param libs a pointer to the struct containing pointers to the global
@@ -213,19 +415,50 @@ public:
    *        if none given.
    * @param known_fld a pointer to a fragment length distribution provided as
    *        input, NULL if none given.
+   * @param state a pointer to the TargetState of the TargetTable, which must
+   *        have room for the id.
+   */
+  Target(TargID id, const std::string& name, const SequenceFwd& seq,
+         double alpha, const Librarian* libs,
+         const BiasBoss* known_bias_boss, const LengthDistribution* known_fld,
+         TargetState* state);
+  /**
+   * A static member function that returns the index of the mutex protecting
+   * the Target with the given id. Threads that must hold the locks of several
+   * Targets at once should acquire them in increasing index order (skipping
+   * repeats) with lock_by_index and unlock_by_index to avoid deadlock.
+   * @param id the TargID of the Target.
+   * @return The index of the mutex protecting the Target.
    */
-  Target(TargID id, const std::string& name, const std::string& seq,
-         bool prob_seq, double alpha, const Librarian* libs,
-         const BiasBoss* known_bias_boss, const LengthDistribution* known_fld);
+  static size_t lock_index(TargID id) { return id & (NUM_TARGET_LOCKS - 1); }
+  /**
+   * A static member function that locks the mutex at the given index.
+   * @param i the index of the mutex to lock.
+   */
+  static void lock_by_index(size_t i) { _locks[i].lock(); }
+  /**
+   * A static member function that tries to lock the mutex at the given index
+   * without blocking.
+   * @param i the index of the mutex to lock.
+   * @return True iff the mutex was locked.
+   */
+  static bool try_lock_by_index(size_t i) { return _locks[i].try_lock(); }
+  /**
+   * A static member function that unlocks the mutex at the given index.
+   * @param i the index of the mutex to unlock.
+   */
+  static void unlock_by_index(size_t i) { _locks[i].unlock(); }
   /**
    * A member function that locks the target mutex to provide thread safety.
    * The lock should be held by any thread that calls a method of the Target.
+   * The mutex may be shared with other Targets, so a thread must not lock
+   * another Target while holding this lock.
    */
-  void lock() const { _mutex.lock(); }
+  void lock() const { _locks[lock_index(_id)].lock(); }
   /**
    * A member function that unlocks the target mutex.
    */
-  void unlock() const { _mutex.unlock(); }
+  void unlock() const { _locks[lock_index(_id)].unlock(); }
   /**
    * An accessor for the target name.
    * @return string containing target name.
@@ -247,6 +480,12 @@ public:
     }
     return _seq_f;
   }
+  /**
+   * An accessor for the target's forward SequenceFwd, which allows direct
+   * access to its packed nucleotides.
+   * @return Const reference to the target's forward SequenceFwd object.
+   */
+  const SequenceFwd& seq_fwd() const { return _seq_f; }
   /**
    * An accessor for the the target's Sequence (non-const).
    * @param rev a bool specifying whether to return the reverse complement.
@@ -263,13 +502,13 @@ public:
    * @param hh a shared pointer to the HaplotypeHandler.
    **/
   void haplotype(boost::shared_ptr<HaplotypeHandler> hh) {
-    _curr_params.haplotype = hh;
+    _haplotype = hh;
   }
   /**
    * Mutator for the alpha (prior count) parameter of the target.
    * @param hh non-logged value to set alpha to.
    **/
-  void alpha(double alpha) { _alpha = log(alpha); }
+  void alpha(double alpha) { _state->alpha[_id] = log(alpha); }
   /**
    * An accessor for the length of the target sequence.
    * @return The target sequence length.
@@ -281,6 +520,14 @@ public:
    * @return The current estimated rho.
    */
   double rho() const;
+  /**
+   * An accessor for the current (logged) mass per effective base of the
+   * target, including pseudo-counts. Unlike rho, this is not normalized by the
+   * total mass of all targets and so only changes as mass is added to this
+   * target or its effective length is updated.
+   * @return The current mass per effective base (logged).
+   */
+  double fpb() const;
   /**
    * An accessor for the current (logged) probabilistically assigned fragment
    * mass.
@@ -299,19 +546,14 @@ public:
    * An accessor for the (logged) weighted sum of the variance on assignments.
    * @return The (logged) weighted sum of the variance on the assignments.
    */
-  double var_sum() const { return _ret_params->var_sum; }
+  double var_sum() const { return ret_params().var_sum; }
   /**
    * An accessor for the the (logged) total mass of ambiguous fragments mapping
    * to the target.
    * @return The (logged) total mass of ambiguous fragments mapping to the
    *         target.
    */
-  double tot_ambig_mass() const { return _ret_params->tot_ambig_mass; }
-  /**
-   * A member function that prepares the target object for the next round of
-   * batch EM.
-   */
-  void round_reset();
+  double tot_ambig_mass() const { return ret_params().tot_ambig_mass; }
   /**
    * An accessor for the current count of fragments mapped to this target
    * either uniquely or ambiguously.
@@ -344,6 +586,22 @@ public:
    *        mapped.
    */
   void add_hit(const FragHit& h, double v, double mass);
+  /**
+   * A member function that increases the expected fragment counts and
+   * variance for a number of identical fragments assigned with the given
+   * parameters. Has the same effect as add_hit without haplotype handling,
+   * applied count times.
+   * @param p a double for the (logged) posterior probability of the hit.
+   * @param v a double for the (logged) approximate variance (uncertainty) on
+   *        the probability p.
+   * @param mass a double specifying the (logged) mass of each fragment.
+   * @param log_count a double specifying the (logged) number of fragments.
+   * @param fpb_incr a pointer to a (logged) sum to add the increase in total
+   *        mass per base to in place of the TargetTable, or NULL. Used by
+   *        concurrent tasks to avoid contending for the TargetTable.
+   */
+  void add_mass(double p, double v, double mass, double log_count=LOG_1,
+                double* fpb_incr=NULL);
   /**
    * A member function that increases the count of fragments mapped to this
    * target.
@@ -353,7 +611,7 @@ public:
    */
   void incr_counts(bool uniq, size_t incr_amt = 1) {
     if (uniq) {
-      _solvable = true;
+      _state->solvable[_id] = true;
     }
     _tot_counts += incr_amt;
     _uniq_counts += incr_amt * uniq;
@@ -400,32 +658,90 @@ public:
   /**
    * A member function that causes the target bias to be re-calculated by the
    * _bias_table based on curent parameters. The results are buffered until
-   * swap_bias_parameters is called to allow for atomic updating.
+   * the bias epoch of the TargetTable is next advanced to allow for atomic
+   * updating. The target mutex should be held by the caller.
    * @param bias_table a pointer to a BiasBoss to use as parameters. Bias not
    *        updated if NULL.
    * @param fld an optional pointer to a different LengthDistribution than the
    *        global one, for thread-safety.
+   * @param store_bias a bool that is true iff the bias at each position should
+   *        be stored even if the target has no hits, as is needed once the
+   *        parameters are fixed and no longer refreshed.
    */
   void update_target_bias_buffer(const BiasBoss* bias_table = NULL,
-                                 const LengthDistribution* fld = NULL);
+                                 const LengthDistribution* fld = NULL,
+                                 bool store_bias = false);
+  /**
+   * A member function that frees the per-position bias of the unpublished
+   * slot once the buffered ones have been published, so that only
+   * a single copy is kept between refreshes. Must only be called by the bias
+   * updater thread.
+   */
+  void release_bias_buffer() {
+    assert((bias_state().buffer_state >> 1) <= _state->bias_epoch);
+    _pos_bias[(bias_state().buffer_state & 1) ^ 1].reset();
+  }
+  /**
+   * A member function that returns the change that refreshing the bias
+   * parameters of the target with the given tables would cause, as the mean
+   * absolute change in the (logged) bias of the ends of a fragment plus the
+   * absolute change in the (logged) effective length. The change in average
+   * bias is used instead for targets that have not stored per-position bias.
+   * @param bias_table a pointer to a BiasBoss to use as parameters, or NULL if
+   *        bias is not being corrected.
+   * @param fld a pointer to the LengthDistribution to use as parameters.
+   * @return The mean absolute change in (logged) fragment likelihoods.
+   */
+  double bias_parameters_change(const BiasBoss* bias_table,
+                                const LengthDistribution* fld) const;
+  /**
+   * An accessor for whether mass has been added to the target since its bias
+   * parameters were last refreshed. The target mutex should be held.
+   * @return True iff the target is queued for a bias refresh.
+   */
+  bool bias_dirty() const { return _bias_dirty; }
   /**
-   * Swaps in the buffered bias parameters for atomic updating. The target
-   * mutex should be held by the caller.
+   * A member function that marks the bias parameters of the target as
+   * refreshed, so that it is queued again once more mass is added. The target
+   * mutex should be held.
    */
-  void swap_bias_parameters();
+  void clear_bias_dirty() { _bias_dirty = false; }
   /**
-   * An accessor for the _solvable flag.
+   * A member function that increases the (logged) covariance between this
+   * target and one with an equal or larger TargID. The target mutex should be
+   * held.
+   * @param targ the TargID of the other target, which must not be smaller
+   *        than the TargID of this target.
+   * @param covar a double specifying the amount to increase the pair's
+   *        covariance by (logged, positive).
+   */
+  void add_covar(TargID targ, double covar) {
+    assert(targ >= _id);
+    if (!_covar) {
+      _covar.reset(new CovarRow());
+    }
+    _covar->increment(targ, covar);
+  }
+  /**
+   * An accessor for the row of the covariance matrix storing the covariances
+   * of this target with itself and the targets with larger TargIDs.
+   * @return A pointer to the covariance row, or NULL if no covariance has been
+   *         added.
+   */
+  const CovarRow* covar() const { return _covar.get(); }
+  /**
+   * An accessor for the solvable flag.
    * @return a boolean specifying whether or not the target has a unique
    *         solution for its abundance estimate.
    */
 
-  bool solvable() const { return _solvable; }
+  bool solvable() const { return _state->solvable[_id]; }
   /**
-   * A mutator that sets the _solvable flag.
+   * A mutator that sets the solvable flag.
    * @param a boolean specifying whether or not the target has a unique solution
    *        for its abundance estimate.
    */
-  void solvable(bool s) { _solvable = s; }
+  void solvable(bool s) { _state->solvable[_id] = s; }
 };
 
 /**
@@ -505,10 +821,40 @@ class HaplotypeHandler {
 
 typedef std::vector<Target*> TransMap;
 typedef boost::unordered_map<std::string, size_t> TransIndex;
-typedef boost::unordered_map<size_t, float> CovarMap;
 typedef boost::unordered_map<std::string, double> AlphaMap;
 typedef boost::unordered_set<std::vector<Target*> > HaplotypeSet;
 
+/**
+ * The TargetEntry struct stores what is needed to build a Target that is only
+ * instantiated once it is first aligned to.
+ * @author    Adam Roberts
+ * @date      2012
+ * @copyright Artistic License 2.0
+ **/
+struct TargetEntry {
+  /**
+   * A public string storing the target name. Empty if the target is not in the
+   * MultiFASTA file or binary index.
+   */
+  std::string name;
+  /**
+   * A public size_t storing the length of the target sequence.
+   */
+  size_t length;
+  /**
+   * A public size_t storing the offset of the first sequence line following
+   * the header in the MultiFASTA file, or the index of the target in the
+   * binary index.
+   */
+  size_t offset;
+  /**
+   * A public double storing the initial pseudo-counts per bp of the target
+   * (non-logged).
+   */
+  double alpha;
+  TargetEntry() : length(0), offset(0), alpha(0) {}
+};
+
 /**
  * The TargetTable class is used to keep track of the Target objects for a run.
  * The constructor parses a fasta file to generate the Target objects and stores
@@ -523,20 +869,69 @@ class TargetTable {
    * tables (bias_table, mismatch_table, fld).
    */
   const Librarian* _libs;
+  /**
+   * A private pointer to the binary target index the targets were loaded from,
+   * whose packed sequences they refer to. NULL if loaded from MultiFASTA.
+   */
+  boost::scoped_ptr<TargetIndex> _targ_index_file;
   /**
    * A private map to look up pointers to Target objects by their TargID id.
    */
   TransMap _targ_map;
   /**
-   * The private table to keep track of Bundle objects.
+   * A private pointer to the TargetState storing the per-hit parameters of the
+   * Targets, indexed by TargID.
    */
-  BundleTable _bundle_table;
+  boost::scoped_ptr<TargetState> _state;
+  /**
+   * A private bool that is true iff Targets are only instantiated once they
+   * are first requested with get_targ.
+   */
+  bool _lazy;
+  /**
+   * A private vector storing the TargetEntry of each target by TargID, used to
+   * instantiate them. Empty unless _lazy.
+   */
+  std::vector<TargetEntry> _entries;
+  /**
+   * A private stream for the MultiFASTA file that lazy Targets are read from.
+   * Not open if they are loaded from a binary index.
+   */
+  std::ifstream _lazy_fasta;
+  /**
+   * A private pointer to a copy of the initial fragment length distribution,
+   * used to compute the initial effective lengths of lazy Targets while the
+   * shared distribution may be updated. NULL unless _lazy.
+   */
+  boost::scoped_ptr<LengthDistribution> _lazy_fld;
+  /**
+   * Private pointers to copies of the fixed fragment length distribution and
+   * bias table, set by the bias updater once burn-out has passed. Lazy Targets
+   * instantiated afterwards are never refreshed, so they are given these
+   * parameters directly. NULL until then, or if bias is not corrected.
+   */
+  boost::scoped_ptr<LengthDistribution> _fixed_fld;
+  boost::scoped_ptr<BiasBoss> _fixed_bias;
+  /**
+   * A private bool that is true iff the sequences of lazy Targets are treated
+   * probabilistically.
+   */
+  bool _prob_seqs;
   /**
-   * A private table to look up the covariance for pairs of Targets by their
-   * combined hashed TargIDs. These values are stored logged and positive, even
-   * though they are negative.
+   * A private bool that is true iff the auxiliary parameters are provided and
+   * need not be learned.
    */
-  CovarTable _covar_table;
+  bool _known_aux_params;
+  /**
+   * A private mutex to make the instantiation of lazy Targets thread-safe. It
+   * is held while _targ_map or the Bundles are read by threads other than the
+   * parsers.
+   */
+  mutable boost::mutex _lazy_mut;
+  /**
+   * The private table to keep track of Bundle objects.
+   */
+  BundleTable _bundle_table;
   /**
    * A private set containing groups of Target pointers that are being 
    * considered alternative haplotypes.
@@ -551,13 +946,33 @@ class TargetTable {
    * A private mutex to make accesses to _total_fpb thread-safe.
    */
   mutable boost::mutex _fpb_mut;
+  /**
+   * A private vector of Targets that have had mass added since their bias
+   * parameters were last refreshed.
+   */
+  std::vector<Target*> _bias_refresh_queue;
+  /**
+   * A private mutex to make accesses to _bias_refresh_queue thread-safe.
+   */
+  boost::mutex _bias_refresh_mut;
+  /**
+   * A private vector storing, for each Target, the (logged) mass per base that
+   * its contribution to the expected bias counts was last computed with. Only
+   * accessed by the bias updater.
+   */
+  std::vector<double> _bias_refresh_fpbs;
+  /**
+   * A private bool that is true iff the bias parameters being refreshed are
+   * the fixed ones after burn-out, so that the bias at each position is
+   * stored for all targets. Only accessed by the bias updater and its shards.
+   */
+  bool _bias_fixed;
 
   /**
    * A private function that validates and adds a target pointer to the table.
    * @param name the name of the trancript.
-   * @param seq the sequence of the target.
-   * @param prob_seqs a bool that specifies if the sequence is to be treated
-   *        probablistically, for RDD detection.
+   * @param seq the encoded sequence of the target, which is treated
+   *        probabilistically (for RDD detection) if it was created as such.
    * @param known_aux_params a bool that is true iff the auxiliary parameters
    *        (fld, bias) are provided and need not be learned.
    * @param alpha a double that specifies the initial pseudo-counts for each bp
@@ -566,9 +981,168 @@ class TargetTable {
    * @param targ_lengths the target-to-length map from the alignment file, for
    *        validation.
    */
-  void add_targ(const std::string& name, const std::string& seq, bool prob_seqs,
+  void add_targ(const std::string& name, const SequenceFwd& seq,
                 bool known_aux_params, double alpha,
                 const TransIndex& targ_index, const TransIndex& targ_lengths);
+  /**
+   * A private function that looks up a target from the MultiFASTA file in the
+   * alignment file header and checks that their lengths agree.
+   * @param name the name of the target.
+   * @param length the length of the target sequence.
+   * @param targ_index the target-to-index map from the alignment file.
+   * @param targ_lengths the target-to-length map from the alignment file.
+   * @param id a reference to store the TargID of the target in, if found.
+   * @return True iff the target is in the alignment file.
+   */
+  bool find_targ(const std::string& name, size_t length,
+                 const TransIndex& targ_index, const TransIndex& targ_lengths,
+                 TargID& id) const;
+  /**
+   * A private function that validates and stores the entry of a target to be
+   * instantiated once it is first requested.
+   * @param name the name of the target.
+   * @param length the length of the target sequence.
+   * @param offset the offset of the sequence in the MultiFASTA file or the
+   *        index of the target in the binary index.
+   * @param alpha a double that specifies the initial pseudo-counts for each bp
+   *        of the target (non-logged).
+   * @param targ_index the target-to-index map from the alignment file.
+   * @param targ_lengths the target-to-length map from the alignment file, for
+   *        validation.
+   */
+  void add_entry(const std::string& name, size_t length, size_t offset,
+                 double alpha, const TransIndex& targ_index,
+                 const TransIndex& targ_lengths);
+  /**
+   * A private function that reads the sequence of a lazy target and builds its
+   * Target and Bundle. The caller must hold _lazy_mut.
+   * @param id the TargID of the target, which must have an entry.
+   * @return A pointer to the new Target.
+   */
+  Target* instantiate(TargID id);
+  /**
+   * A private function that returns the Targets that have been instantiated.
+   * @return A vector of pointers to the instantiated Targets, in TargID order.
+   */
+  TransMap instantiated_targets() const;
+  /**
+   * A private function that stores copies of the fixed auxiliary parameters
+   * for lazy Targets instantiated after burn-out, and returns the Targets that
+   * have already been instantiated and must be refreshed with them.
+   * @param bias_table a pointer to the fixed BiasBoss, or NULL if bias is not
+   *        corrected.
+   * @param fld a pointer to the fixed LengthDistribution.
+   * @return A vector of pointers to the instantiated Targets, in TargID order.
+   */
+  TransMap fix_lazy_parameters(const BiasBoss* bias_table,
+                               const LengthDistribution* fld);
+  /**
+   * A private function run by each shard of the bias updater that buffers the
+   * bias parameters of every num_shards-th Target in targs, starting with the
+   * given shard, and adds their expected bias counts to the given table.
+   * @param shard the index of the shard.
+   * @param num_shards the total number of shards.
+   * @param bias_table a pointer to the BiasBoss to calculate target bias with,
+   *        or NULL if bias is not being corrected.
+   * @param fld a pointer to the LengthDistribution to calculate effective
+   *        lengths with.
+   * @param fl_cdf a pointer to the cumulative mass function of fld.
+   * @param expectations a pointer to the BiasBoss to accumulate expected
+   *        counts in, or NULL if they are not being updated.
+   * @param targs a pointer to the vector of Targets to refresh.
+   * @param full a bool that is true iff the expected counts are being rebuilt
+   *        from scratch rather than incremented by the mass added to each
+   *        Target since its last refresh.
+   */
+  void update_bias_shard(size_t shard, size_t num_shards,
+                         const std::vector<Target*>* targs, bool full,
+                         const BiasBoss* bias_table,
+                         const LengthDistribution* fld,
+                         const std::vector<double>* fl_cdf,
+                         BiasBoss* expectations);
+  /**
+   * A private function that renormalizes the masses of the Targets in a
+   * Bundle to be counts, projecting when necessary.
+   * @param bundle a pointer to the Bundle to convert.
+   */
+  void bundle_masses_to_counts(Bundle* bundle);
+  /**
+   * A private function run as a TaskScheduler task by masses_to_counts that
+   * converts a range of the Bundles.
+   * @param bundles a pointer to the vector of Bundles to convert.
+   * @param begin the index of the first Bundle to convert.
+   * @param end the index after the last Bundle to convert.
+   * @param w the index of the worker running the task (unused).
+   */
+  void masses_to_counts_task(const std::vector<Bundle*>* bundles,
+                             size_t begin, size_t end, size_t w);
+  /**
+   * A private function that computes the counts of the Targets of a Bundle,
+   * projecting when necessary, and then the Results of the Targets and
+   * (optionally) their formatted rows of the variance-covariance matrix and
+   * their RDDs. Bundles with more than a single piece of targets have the
+   * Results of each piece computed by tasks spawned onto the worker.
+   * @param bundle a pointer to the Bundle to compute the Results of.
+   * @param bundle_id the id of the Bundle in the output.
+   * @param first_piece the index of the first output piece of the Bundle.
+   * @param num_pieces the number of output pieces of the Bundle.
+   * @param out a pointer to the state shared by the output tasks.
+   * @param w the index of the worker running the task.
+   */
+  void bundle_results(const Bundle* bundle, size_t bundle_id,
+                      size_t first_piece, size_t num_pieces,
+                      ResultsOutput* out, size_t w) const;
+  /**
+   * A private function run as a TaskScheduler task that computes the Results
+   * of a range of the Targets of a Bundle from its counts, and (optionally)
+   * formats their variance-covariance rows and RDDs into the buffers of an
+   * output piece.
+   * @param counts a shared pointer to the counts of the Bundle.
+   * @param begin the position in the Bundle of the first Target.
+   * @param end the position in the Bundle after the last Target.
+   * @param piece the index of the output piece to append text to.
+   * @param out a pointer to the state shared by the output tasks.
+   * @param w the index of the worker running the task (unused).
+   */
+  void target_results(boost::shared_ptr<const BundleCounts> counts,
+                      size_t begin, size_t end, size_t piece,
+                      ResultsOutput* out, size_t w) const;
+  /**
+   * A private function run as a TaskScheduler task by output_results that
+   * computes the Results of a range of the Bundles.
+   * @param bundles a pointer to the vector of Bundles in output order.
+   * @param first_piece a pointer to the index of the first output piece of
+   *        each Bundle, followed by the total number of pieces.
+   * @param begin the index of the first Bundle.
+   * @param end the index after the last Bundle.
+   * @param out a pointer to the state shared by the output tasks.
+   * @param w the index of the worker running the task.
+   */
+  void results_task(const std::vector<Bundle*>* bundles,
+                    const std::vector<size_t>* first_piece, size_t begin,
+                    size_t end, ResultsOutput* out, size_t w) const;
+  /**
+   * A private function that writes the results in binary columnar form. The
+   * file begins with a 24-byte header holding the uint32 magic number
+   * RESULTS_BIN_MAGIC, the uint32 format version, the uint64 number of rows,
+   * and the uint64 number of columns. Each column follows as an array of one
+   * 8-byte value per row, in the order of the 'results.xprs' columns without
+   * target_id. Integer columns (bundle_id, length, tot_counts, uniq_counts,
+   * solvable) are uint64 and the rest are doubles. The names follow as uint64
+   * offsets for each row plus the total length, and then the null-terminated
+   * names themselves. Values are stored in native byte order and every
+   * column is 8-byte aligned, so the file can be mapped directly.
+   * @param file_name the path to the file to write.
+   * @param targs the TargIDs of the rows in output order.
+   * @param bundle_ids the bundle id of each row.
+   * @param tpms the TPM of each row.
+   * @param res the vector of Results indexed by TargID.
+   */
+  void output_binary_results(const std::string& file_name,
+                             const std::vector<TargID>& targs,
+                             const std::vector<size_t>& bundle_ids,
+                             const std::vector<double>& tpms,
+                             const std::vector<Result>& res) const;
 
 public:
   /**
@@ -588,20 +1162,41 @@ public:
    *        proportional weights of pseudo-counts for each target.
    * @param libs a pointer to the struct containing pointers to the global
    *        parameter tables (bias_table, mismatch_table, fld).
+   * @param lazy a bool that is true iff only a TargetEntry should be stored for
+   *        each target until it is first requested with get_targ, so that
+   *        targets that are never aligned to are not built. Their expected
+   *        counts are then also left out of the initial bias background.
    */
   TargetTable(std::string targ_fasta_file, std::string haplotype_file,
               bool prob_seqs, bool known_aux_params, double alpha,
-              const AlphaMap* alpha_map, const Librarian* libs);
+              const AlphaMap* alpha_map, const Librarian* libs,
+              bool lazy=false);
   /**
    * TargetTable Destructor. Deletes all of the target objects in the table.
    */
   ~TargetTable();
   /**
-   * A member function that returns a pointer to the target with the given id.
+   * A member function that returns a pointer to the target with the given id,
+   * instantiating it first if it is lazy.
    * @param id of the target queried.
-   * @return A pointer to the target with the given id.
+   * @return A pointer to the target with the given id, or NULL if there is no
+   *         sequence for it.
    */
   Target* get_targ(TargID id);
+  /**
+   * An accessor for the name of the target with the given id, which does not
+   * instantiate it.
+   * @param id of the target queried.
+   * @return The name of the target.
+   */
+  const std::string& targ_name(TargID id) const;
+  /**
+   * An accessor for the length of the target with the given id, which does not
+   * instantiate it.
+   * @param id of the target queried.
+   * @return The length of the target sequence.
+   */
+  size_t targ_length(TargID id) const;
   /**
    * A member function that readies all Target objects in the table for the next
    * round of batch EM.
@@ -617,6 +1212,12 @@ public:
    * @return The (logged) total mass per base, including pseudo-counts.
    */
   double total_fpb() const;
+  /**
+   * A member function that queues a Target for the bias updater after mass is
+   * first added to it since its last refresh.
+   * @param targ a pointer to the Target to queue.
+   */
+  void queue_bias_refresh(Target* targ);
   /**
    * a member function that increments the (logged) total mass per base.
    * @param incr_amt the (logged) amount to increment by.
@@ -626,14 +1227,16 @@ public:
   /**
    * A member function that increases the (logged) covariance between two
    * targets by the specified amount. These values are stored positive even
-   * though they are negative.
+   * though they are negative. The covariance is stored by the target with the
+   * smaller TargID, whose mutex should be held.
    * @param targ1 one of the targets in the pair
    * @param targ2 the other target in the pair
    * @param covar a double specifying the amount to increase the pair's
    *        covariance by (logged)
    */
   void update_covar(TargID targ1, TargID targ2, double covar) {
-    _covar_table.increment(targ1, targ2, covar);
+    _targ_map[std::min(targ1, targ2)]->add_covar(std::max(targ1, targ2),
+                                                 covar);
   }
   /**
    * An accessor for the covariance between two targets. These returned value
@@ -642,14 +1245,15 @@ public:
    * @param targ2 the other target in the pair.
    * @return The negative of the pair's covariance (logged).
    */
-  double get_covar(TargID targ1, TargID targ2) {
-    return _covar_table.get(targ1, targ2);
+  double get_covar(TargID targ1, TargID targ2) const {
+    const CovarRow* row = _targ_map[std::min(targ1, targ2)]->covar();
+    return (row) ? row->get(std::max(targ1, targ2)) : LOG_0;
   }
   /**
    * An accessor for number of pairs of targets with non-zero covariance.
    * @return The number of target pairs with non-zero covariance.
    */
-  size_t covar_size() const { return _covar_table.size(); }
+  size_t covar_size() const;
   /**
    * A member function that merges the given Bundles.
    * @param b1 a pointer to the first Bundle to merge.
@@ -663,36 +1267,77 @@ public:
    */
   size_t num_bundles() const { return _bundle_table.size(); }
   /**
-   * Renormalized masses to be counts and projects when necessary.
+   * Renormalized masses to be counts and projects when necessary. Bundles are
+   * converted in parallel by output_threads workers with a TaskScheduler.
    */
   void masses_to_counts();
   /**
    * A member function that outputs the final expression data in a file called
    * 'results.xprs', (optionally) the variance-covariance matrix in
-   * 'varcov.xprs', and (optionally) the RDD p-values in the given output
-   * directory.
+   * 'varcov.xprs', (optionally) the RDD p-values in 'rdds.xprs', and
+   * (optionally) the expression data in binary form in 'results.bin' in the
+   * given output directory. Bundle results are computed and formatted in
+   * parallel by output_threads workers with a TaskScheduler, with the targets
+   * of large bundles split across tasks, and the files are written from large
+   * buffers.
    * @param output_dir the directory to output the expression file to.
    * @param tot_counts the total number of observed mapped fragments.
    * @param output_varcov boolean specifying whether to also output the
    *        variance-covariance matrix
    * @param output_rdds boolean specifying whether to also output the RDD
    *        p-values.
+   * @param output_binary boolean specifying whether to also output the
+   *        expression data in binary columnar form.
    */
   void output_results(std::string output_dir, size_t tot_counts,
-                      bool output_varcov=false, bool output_rdds=false);
+                      bool output_varcov=false, bool output_rdds=false,
+                      bool output_binary=false);
   /**
    * A member function to be run asynchronously that continuously updates the
    * background bias values, target bias values, and target effective lengths.
+   * Counts held in the per-thread auxiliary accumulators of the Library are
+   * added to the global tables each time they are synchronized. Targets are
+   * updated in parallel by bias_threads shards, and the buffered parameters
+   * are published together by advancing the bias epoch. Only Targets whose
+   * mass per base has increased by BIAS_REFRESH_MASS_TOLERANCE are refreshed
+   * in each cycle, unless the fragment length distribution or bias parameters
+   * have moved enough to change the likelihoods of a sample of Targets by more
+   * than BIAS_REFRESH_TOLERANCE, in which case all of them are refreshed.
+   * If burn_out_tolerance is positive, the burn-out of the Library is ended
+   * early once the fragment length distribution, error model, and bias weights
+   * change by less than it for AUX_CONVERGENCE_SYNCS consecutive
+   * synchronizations.
    * @param mutex a pointer to the mutex to be used to protect the global fld
-   *        and bias tables during updates.
+   *        and bias tables during updates. Processing threads hold it in shared
+   *        mode while this holds it exclusively.
+   * @param lib a pointer to the Library whose auxiliary parameter tables are
+   *        synchronized.
    */
-  void asynch_bias_update(boost::mutex* mutex);
+  void asynch_bias_update(boost::shared_mutex* mutex, Library* lib);
   void enable_bundle_threadsafety() { _bundle_table.threadsafe_mode(true); }
   void disable_bundle_threadsafety() { _bundle_table.threadsafe_mode(false); }
   /**
    * Collapses the merge trees in the BundleTable.
    */
   void collapse_bundles() { _bundle_table.collapse(); }
+  /**
+   * A member function that appends the online EM state of the table to a
+   * buffer, for checkpointing. This includes the current round parameters,
+   * counts, and covariances of each Target, the bundle partition, and the
+   * total mass per base. The bundles must be collapsed and no fragments may
+   * be processed concurrently.
+   * @param buff the buffer to append the state to.
+   */
+  void save_state(std::string& buff) const;
+  /**
+   * A member function that restores the online EM state saved by save_state
+   * into a newly constructed table for the same targets, exiting if the state
+   * does not match them.
+   * @param p a reference to the pointer to read the state from, which is
+   *        advanced past it.
+   * @param end a pointer to the end of the buffer holding the state.
+   */
+  void load_state(const char*& p, const char* end);
 };
 
 #endif
@@ -0,0 +1,97 @@
+//
+//  taskscheduler.cpp
+//  express
+//
+//  Created by Adam Roberts on 10/14/12.
+//  Copyright 2012 Adam Roberts. All rights reserved.
+//
+
+#include "taskscheduler.h"
+#include "main.h"
+
+using namespace std;
+
+/**
+ * The number of milliseconds an idle worker waits before looking for a task to
+ * steal again, in case it missed the notification of a spawn.
+ */
+const size_t TASK_IDLE_WAIT_MS = 1;
+
+TaskScheduler::TaskScheduler(size_t num_workers) : _pending(0) {
+  for (size_t w = 0; w < max(num_workers, (size_t)1); ++w) {
+    _workers.push_back(boost::shared_ptr<Worker>(new Worker()));
+  }
+}
+
+void TaskScheduler::spawn(const Task& task, size_t w) {
+  // The task is counted before it can be taken, so that _pending cannot reach
+  // 0 while it is queued.
+  {
+    boost::unique_lock<boost::mutex> lock(_mut);
+    _pending++;
+  }
+  {
+    Worker& worker = *_workers[w];
+    boost::unique_lock<boost::mutex> lock(worker.mut);
+    worker.tasks.push_back(task);
+  }
+  _cond.notify_one();
+}
+
+bool TaskScheduler::pop(size_t w, Task& task) {
+  Worker& worker = *_workers[w];
+  boost::unique_lock<boost::mutex> lock(worker.mut);
+  if (worker.tasks.empty()) {
+    return false;
+  }
+  task.swap(worker.tasks.back());
+  worker.tasks.pop_back();
+  return true;
+}
+
+bool TaskScheduler::steal(size_t w, Task& task) {
+  for (size_t i = 1; i < _workers.size(); ++i) {
+    Worker& victim = *_workers[(w + i) % _workers.size()];
+    boost::unique_lock<boost::mutex> lock(victim.mut);
+    if (!victim.tasks.empty()) {
+      task.swap(victim.tasks.front());
+      victim.tasks.pop_front();
+      return true;
+    }
+  }
+  return false;
+}
+
+void TaskScheduler::work(size_t w) {
+  Task task;
+  while (true) {
+    if (pop(w, task) || steal(w, task)) {
+      task(w);
+      task.clear();
+      boost::unique_lock<boost::mutex> lock(_mut);
+      if (--_pending == 0) {
+        _cond.notify_all();
+      }
+      continue;
+    }
+    boost::unique_lock<boost::mutex> lock(_mut);
+    if (_pending == 0) {
+      return;
+    }
+    // Tasks can only be queued by running tasks, so wait briefly for one to
+    // be spawned or for the last to complete.
+    _cond.timed_wait(lock, boost::posix_time::milliseconds(TASK_IDLE_WAIT_MS));
+  }
+}
+
+void TaskScheduler::run() {
+  vector<boost::thread*> threads;
+  for (size_t w = 1; w < _workers.size(); ++w) {
+    threads.push_back(new boost::thread(&TaskScheduler::work, this, w));
+  }
+  work(0);
+  foreach (boost::thread* thread, threads) {
+    thread->join();
+    delete thread;
+  }
+}
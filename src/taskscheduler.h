@@ -0,0 +1,120 @@
+/**
+ *  taskscheduler.h
+ *  express
+ *
+ *  Created by Adam Roberts on 10/14/12.
+ *  Copyright 2012 Adam Roberts. All rights reserved.
+ */
+
+#ifndef express_taskscheduler_h
+#define express_taskscheduler_h
+
+#include <boost/function.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread.hpp>
+#include <deque>
+#include <vector>
+
+/**
+ * The TaskScheduler class runs a set of tasks on a pool of worker threads with
+ * work stealing. Each worker has its own deque of tasks, taking the most
+ * recently added task from the back of it and, when it is empty, stealing the
+ * oldest from the front of another worker's. Tasks may spawn further tasks
+ * onto the deque of the worker running them, so that a large task can be split
+ * and the pieces taken by workers that would otherwise be idle.
+ *  @author    Adam Roberts
+ *  @date      2012
+ *  @copyright Artistic License 2.0
+ **/
+class TaskScheduler {
+ public:
+  /**
+   * A Task is called with the index of the worker running it, which can be
+   * passed to spawn.
+   */
+  typedef boost::function<void (size_t)> Task;
+
+ private:
+  /**
+   * The Worker struct stores the deque of tasks of a single worker.
+   */
+  struct Worker {
+    /**
+     * The tasks queued for the worker.
+     */
+    std::deque<Task> tasks;
+    /**
+     * A mutex protecting the deque, which is shared with thieves.
+     */
+    boost::mutex mut;
+  };
+  /**
+   * A private vector of pointers to the Workers.
+   */
+  std::vector<boost::shared_ptr<Worker> > _workers;
+  /**
+   * A private size_t counting the tasks that have been spawned but have not
+   * yet completed. Protected by _mut.
+   */
+  size_t _pending;
+  /**
+   * A private mutex protecting _pending.
+   */
+  boost::mutex _mut;
+  /**
+   * A private condition variable notified when a task is spawned or all tasks
+   * are complete.
+   */
+  boost::condition_variable _cond;
+  /**
+   * A private member function that takes the next task from the back of a
+   * worker's own deque.
+   * @param w the index of the worker.
+   * @param task a reference to the Task to store the task in.
+   * @return True iff a task was found.
+   */
+  bool pop(size_t w, Task& task);
+  /**
+   * A private member function that steals the oldest task of another worker,
+   * trying each in turn starting after the given worker.
+   * @param w the index of the stealing worker.
+   * @param task a reference to the Task to store the task in.
+   * @return True iff a task was found.
+   */
+  bool steal(size_t w, Task& task);
+  /**
+   * A private member function run by each worker that runs tasks until all
+   * spawned tasks have completed.
+   * @param w the index of the worker.
+   */
+  void work(size_t w);
+
+ public:
+  /**
+   * TaskScheduler constructor creates the (empty) deques of the workers.
+   * @param num_workers the number of workers to run the tasks on, including
+   *        the thread that calls run.
+   */
+  TaskScheduler(size_t num_workers);
+  /**
+   * An accessor for the number of workers.
+   * @return The number of workers.
+   */
+  size_t num_workers() const { return _workers.size(); }
+  /**
+   * A member function that adds a task to the back of a worker's deque. It can
+   * be called before run, to distribute the initial tasks, or by a running
+   * task with the index of its own worker.
+   * @param task the Task to add.
+   * @param w the index of the worker whose deque to add the task to.
+   */
+  void spawn(const Task& task, size_t w);
+  /**
+   * A member function that runs all spawned tasks, and any they spawn, and
+   * returns once they are all complete. The calling thread acts as worker 0
+   * and the other workers run in threads started for the call.
+   */
+  void run();
+};
+
+#endif
@@ -9,33 +9,54 @@
 #include "threadsafety.h"
 #include "fragments.h"
 
-ThreadSafeFragQueue::ThreadSafeFragQueue(size_t max_size)
-    : _max_size(max_size) {
+ThreadSafeFragQueue::ThreadSafeFragQueue(size_t max_size, QueueStats* stats)
+    : _max_size(max_size), _stats(stats) {
 }
 
-Fragment* ThreadSafeFragQueue::pop(bool block) {
+FragBatch* ThreadSafeFragQueue::pop(bool block) {
   boost::unique_lock<boost::mutex> lock(_mut);
-  while (_queue.empty()) {
+  if (_queue.empty()) {
     if (!block) {
-            return NULL;
+      return NULL;
+    }
+    // Only waits are timed, to keep the overhead of uncontended pops low.
+    Stopwatch wait;
+    while (_queue.empty()) {
+      _not_empty.wait(lock);
+    }
+    if (_stats) {
+      _stats->pop_wait.add(wait.elapsed());
     }
-        _cond.wait(lock);
   }
 
-  _cond.notify_all();
-  Fragment* res = _queue.front();
+  FragBatch* res = _queue.front();
   _queue.pop();
+  if (_queue.empty()) {
+    // Wake anyone waiting in is_empty as well as a blocked producer.
+    _not_full.notify_all();
+  } else {
+    _not_full.notify_one();
+  }
   return res;
 }
 
-void ThreadSafeFragQueue::push(Fragment* frag) {
+void ThreadSafeFragQueue::push(FragBatch* batch) {
   boost::unique_lock<boost::mutex> lock(_mut);
-  while (_queue.size() == _max_size) {
-    _cond.wait(lock);
+  if (_max_size && _queue.size() >= _max_size) {
+    Stopwatch wait;
+    while (_queue.size() >= _max_size) {
+      _not_full.wait(lock);
+    }
+    if (_stats) {
+      _stats->push_wait.add(wait.elapsed());
+    }
   }
 
-  _cond.notify_all();
-  return _queue.push(frag);
+  _queue.push(batch);
+  if (_stats && batch) {
+    _stats->occupancy.add(_queue.size());
+  }
+  _not_empty.notify_one();
 }
 
 bool ThreadSafeFragQueue::is_empty(bool block) {
@@ -44,7 +65,7 @@ bool ThreadSafeFragQueue::is_empty(bool block) {
     if (!block) {
       return false;
     }
-    _cond.wait(lock);
+    _not_full.wait(lock);
   }
   return true;
 }
@@ -9,62 +9,83 @@
 #ifndef express_thread_safety_h
 #define express_thread_safety_h
 
+#include "runstats.h"
 #include <boost/thread.hpp>
 #include <queue>
+#include <vector>
 
 class Fragment;
 
 /**
- * The ThreadSafeFragQueue is a threadsafe queue of Fragment pointers.
+ * A FragBatch is a block of Fragment pointers that is passed between the
+ * parsing, dispatching, and processing stages as a single unit so that the
+ * queue locks are taken once per batch instead of once per Fragment.
+ */
+typedef std::vector<Fragment*> FragBatch;
+
+/**
+ * The ThreadSafeFragQueue is a threadsafe queue of FragBatch pointers. A NULL
+ * batch is used by producers to signal that no more Fragments will follow.
  *  @author    Adam Roberts
  *  @date      2012
  *  @copyright Artistic License 2.0
  **/
 class ThreadSafeFragQueue {
   /**
-   * A private queue of Fragment objects.
+   * A private queue of FragBatch pointers.
    */
-  std::queue<Fragment*> _queue;
+  std::queue<FragBatch*> _queue;
   /**
-   * A private size_t representing the number of Fragments allowed in the queue
-   * before blocking on a push.
+   * A private size_t representing the number of FragBatches allowed in the
+   * queue before blocking on a push. The queue is unbounded if 0.
    */
   size_t _max_size;
   /**
    * A private mutex used to provide thread-safety and used in association with
-   * _cond to provide blocking behavior.
+   * _not_empty and _not_full to provide blocking behavior.
    */
   boost::mutex _mut;
   /**
-   * A private condition variable used with _mut for blocking when queue is
-   * empty on pop or full on push.
+   * A private condition variable used with _mut for blocking when the queue is
+   * empty on pop.
    */
-  boost::condition_variable _cond;
+  boost::condition_variable _not_empty;
+  /**
+   * A private condition variable used with _mut for blocking when the queue is
+   * full on push or not yet empty in is_empty.
+   */
+  boost::condition_variable _not_full;
+  /**
+   * A private pointer to the QueueStats to record blocking and occupancy in, or
+   * NULL if they are not recorded.
+   */
+  QueueStats* _stats;
 
  public:
   /**
    * ThreadSafeFragQueue Constructor.
-   * @param max_size a size_t representing the number of Fragments allowed in
-
-   *        the queue before blocking on a push.
+   * @param max_size a size_t representing the number of FragBatches allowed in
+   *        the queue before blocking on a push (unbounded if 0).
+   * @param stats a pointer to the QueueStats to record blocking and occupancy
+   *        in, or NULL if they should not be recorded.
    */
-  ThreadSafeFragQueue(size_t max_size);
+  ThreadSafeFragQueue(size_t max_size, QueueStats* stats=NULL);
   /**
-   * A member function that pops the next Fragment pointer off the queue. If
+   * A member function that pops the next FragBatch pointer off the queue. If
    * the queue is empty, returns NULL if block is false, otherwise blocks until
    * one is available.
    * @param block a bool specifying whether or not the function should block if
    *        the queue is empty.
-   * @return The next Fragment pointer on the queue or NULL if the queue is
+   * @return The next FragBatch pointer on the queue or NULL if the queue is
    *         empty and block is false.
    */
-  Fragment* pop(bool block=true);
+  FragBatch* pop(bool block=true);
   /**
-   * A member function that pushes the given Fragment pointer onto the queue.
+   * A member function that pushes the given FragBatch pointer onto the queue.
    * Blocks if the queue is full.
-   * @param frag the Fragment pointer to push onto the queue.
+   * @param batch the FragBatch pointer to push onto the queue.
    */
-  void push(Fragment* frag);
+  void push(FragBatch* batch);
   /**
    * A member function that returns true iff the queue is empty. If block is
    * true, the function blocks until the queue is empty and returns true.
@@ -84,26 +105,68 @@ class ThreadSafeFragQueue {
  **/
 struct ParseThreadSafety {
   /**
-   * A public ThreadSafeFragQueue of pointers to Fragments that have been parsed
-   * but not pre-processed.
+   * A public ThreadSafeFragQueue of batches of Fragments that have been parsed
+   * but not processed. The parser pushes a single NULL batch once the input
+   * is exhausted, which each processing thread pushes back for the others.
    */
   ThreadSafeFragQueue proc_in;
   /**
-   * A public ThreadSafeFragQueue of pointers to Fragments that have been
-   * pre-processed but not processed.
+   * A public ThreadSafeFragQueue of batches of Fragments that have been
+   * processed but not yet written out by the output thread of the parser. It
+   * has the same bound as proc_in, so that the number of batches in flight is
+   * limited if output falls behind. The parser pushes a single NULL batch once
+   * all of its batches have been returned, to stop the output thread.
    */
-  ThreadSafeFragQueue proc_on;
+  ThreadSafeFragQueue proc_out;
   /**
-   * A public ThreadSafeFragQueue of pointers to Fragments that have been
-   * processed but not post-processed.
+   * A public size_t for the maximum number of Fragments placed in each batch by
+   * the parser.
    */
-  ThreadSafeFragQueue proc_out;
+  size_t batch_size;
+  /**
+   * A public size_t counting the batches that have been processed by the
+   * processing threads. Protected by done_mut.
+   */
+  size_t num_done;
+  /**
+   * A public mutex protecting num_done.
+   */
+  boost::mutex done_mut;
+  /**
+   * A public condition variable notified when num_done is incremented.
+   */
+  boost::condition_variable done_cond;
+  /**
+   * PraseThreadSafety constructor intializes queues to the given size. The
+   * statistics of the queues are recorded in the global RunStats.
+   * @param q_size the maximum number of batches in each of the proc_in and
+   *        proc_out ThreadSafeFragQueues.
+   * @param b_size the maximum number of Fragments in each batch.
+   */
+  ParseThreadSafety(size_t q_size, size_t b_size)
+      : proc_in(q_size, &run_stats.parsed_queue),
+        proc_out(q_size, &run_stats.processed_queue),
+        batch_size(std::max(b_size, (size_t)1)), num_done(0) {
+  }
+  /**
+   * A member function called by the processing threads after each batch has
+   * been processed.
+   */
+  void batch_done() {
+    boost::unique_lock<boost::mutex> lock(done_mut);
+    num_done++;
+    done_cond.notify_all();
+  }
   /**
-   * PraseThreadSafety constructor intializes queues to the given size.
-   * @param q_size the maximum size for the ThreadSafeFragQueues.
+   * A member function that blocks until the given number of batches have been
+   * processed by the processing threads.
+   * @param num_batches the number of batches to wait for.
    */
-  ParseThreadSafety(size_t q_size)
-      : proc_in(q_size), proc_on(q_size), proc_out(q_size) {
+  void wait_done(size_t num_batches) {
+    boost::unique_lock<boost::mutex> lock(done_mut);
+    while (num_done < num_batches) {
+      done_cond.wait(lock);
+    }
   }
 };
 